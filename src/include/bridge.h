@@ -132,6 +132,19 @@ pgexporter_bridge_json(int fd);
 int
 pgexporter_bridge_json_init_cache(size_t* p_size, void** p_shmem);
 
+/**
+ * Run the bridge poller.
+ *
+ * The poller keeps a live bridge of all endpoints, fetches them every
+ * `bridge_poll_interval`, renders only the metrics that changed and
+ * publishes the result into the bridge and bridge JSON caches.
+ *
+ * Must be called in a forked process; it exits when pgexporter
+ * shuts down or the parent process goes away.
+ */
+void
+pgexporter_bridge_poller(void);
+
 #ifdef __cplusplus
 }
 #endif
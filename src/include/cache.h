@@ -34,6 +34,7 @@ extern "C" {
 #endif
 
 #include <pgexporter.h>
+#include <http_server.h>
 
 #include <stdlib.h>
 
@@ -79,7 +80,9 @@ bool
 pgexporter_cache_append(struct prometheus_cache* cache, char* data);
 
 /**
- * Finalize the cache by setting its expiry time.
+ * Finalize the cache by setting its expiry time, and stamp the
+ * payload with its entity tag and modification time.
+ * A payload that overflowed is not finalized.
  * Requires the caller to hold the lock on the cache.
  * @param cache The cache
  * @param max_age The maximum age of the cache
@@ -88,6 +91,26 @@ pgexporter_cache_append(struct prometheus_cache* cache, char* data);
 bool
 pgexporter_cache_finalize(struct prometheus_cache* cache, pgexporter_time_t max_age);
 
+/**
+ * Stamp the payload with its entity tag and modification time.
+ * The entity tag is a hash of the payload, so a payload that did
+ * not change keeps its entity tag and modification time across
+ * generations.
+ * Requires the caller to hold the lock on the cache.
+ * @param cache The cache
+ */
+void
+pgexporter_cache_stamp(struct prometheus_cache* cache);
+
+/**
+ * Get the validators of the payload for a conditional response.
+ * Requires the caller to hold the lock on the cache.
+ * @param cache The cache
+ * @param validators The validators
+ */
+void
+pgexporter_cache_validators(struct prometheus_cache* cache, struct http_validators* validators);
+
 #ifdef __cplusplus
 }
 #endif
@@ -49,6 +49,7 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_BRIDGE_ENDPOINTS           "bridge_endpoints"
 #define CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_AGE       "bridge_cache_max_age"
 #define CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_SIZE      "bridge_cache_max_size"
+#define CONFIGURATION_ARGUMENT_BRIDGE_POLL_INTERVAL       "bridge_poll_interval"
 #define CONFIGURATION_ARGUMENT_BRIDGE_JSON                "bridge_json"
 #define CONFIGURATION_ARGUMENT_BRIDGE_JSON_CACHE_MAX_SIZE "bridge_json_cache_max_size"
 #define CONFIGURATION_ARGUMENT_BRIDGE_HISTORY             "bridge_history"
@@ -60,8 +61,15 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_HISTORY                    "history"
 #define CONFIGURATION_ARGUMENT_HISTORY_INTERVAL           "history_interval"
 #define CONFIGURATION_ARGUMENT_HISTORY_RETENTION          "history_retention"
+#define CONFIGURATION_ARGUMENT_HISTORY_RAW_RETENTION      "history_raw_retention"
+#define CONFIGURATION_ARGUMENT_HISTORY_MINUTE_RETENTION   "history_minute_retention"
 #define CONFIGURATION_ARGUMENT_HISTORY_BACKEND            "history_backend"
 #define CONFIGURATION_ARGUMENT_HISTORY_PATH               "history_path"
+#define CONFIGURATION_ARGUMENT_HISTORY_QUEUE_SIZE         "history_queue_size"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_URL           "remote_write_url"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_SHARDS        "remote_write_shards"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_SPOOL         "remote_write_spool"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_SPOOL_SIZE    "remote_write_spool_size"
 #define CONFIGURATION_ARGUMENT_CACHE                      "cache"
 #define CONFIGURATION_ARGUMENT_MANAGEMENT                 "management"
 #define CONFIGURATION_ARGUMENT_LOG_TYPE                   "log_type"
@@ -71,6 +79,7 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_LOG_ROTATION_SIZE          "log_rotation_size"
 #define CONFIGURATION_ARGUMENT_LOG_LINE_PREFIX            "log_line_prefix"
 #define CONFIGURATION_ARGUMENT_LOG_MODE                   "log_mode"
+#define CONFIGURATION_ARGUMENT_LOG_ASYNC                  "log_async"
 #define CONFIGURATION_ARGUMENT_BLOCKING_TIMEOUT           "blocking_timeout"
 #define CONFIGURATION_ARGUMENT_TLS                        "tls"
 #define CONFIGURATION_ARGUMENT_TLS_CERT_FILE              "tls_cert_file"
@@ -80,6 +89,11 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_METRICS_KEY_FILE           "metrics_key_file"
 #define CONFIGURATION_ARGUMENT_METRICS_CA_FILE            "metrics_ca_file"
 #define CONFIGURATION_ARGUMENT_METRICS_QUERY_TIMEOUT      "metrics_query_timeout"
+#define CONFIGURATION_ARGUMENT_METRICS_SCRAPE_TIMEOUT     "metrics_scrape_timeout"
+#define CONFIGURATION_ARGUMENT_METRICS_WORKERS            "metrics_workers"
+#define CONFIGURATION_ARGUMENT_METRICS_KEEP_ALIVE_TIMEOUT "metrics_keep_alive_timeout"
+#define CONFIGURATION_ARGUMENT_METRICS_KEEP_ALIVE_REQUESTS "metrics_keep_alive_requests"
+#define CONFIGURATION_ARGUMENT_METRICS_EVENT_LOOP         "metrics_event_loop"
 #define CONFIGURATION_ARGUMENT_EV_BACKEND                 "ev_backend"
 #define CONFIGURATION_ARGUMENT_KEEP_ALIVE                 "keep_alive"
 #define CONFIGURATION_ARGUMENT_NODELAY                    "nodelay"
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_EXPOSITION_H
+#define PGEXPORTER_EXPOSITION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+/**
+ * Exposition formats of the /metrics endpoint
+ */
+#define EXPOSITION_FORMAT_TEXT        0
+#define EXPOSITION_FORMAT_OPENMETRICS 1
+#define EXPOSITION_FORMAT_PROTOBUF    2
+
+/**
+ * Select the exposition format from an Accept header, honoring the
+ * quality values. The first of equally preferred formats wins
+ * @param accept The Accept header, or NULL
+ * @return The format
+ */
+int
+pgexporter_exposition_negotiate(char* accept);
+
+/**
+ * Get the Content-Type of an exposition format
+ * @param format The format
+ * @return The Content-Type
+ */
+char*
+pgexporter_exposition_content_type(int format);
+
+/**
+ * Convert the text exposition to another format. Histograms are encoded
+ * with both classic and native buckets in the protobuf format
+ * @param text The text exposition
+ * @param format The format
+ * @param data The converted exposition
+ * @param size The size of the converted exposition
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_exposition_convert(char* text, int format, void** data, size_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_FRAGMENT_H
+#define PGEXPORTER_FRAGMENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The number of slots in the fragment table (power of two)
+ */
+#define FRAGMENT_SLOTS 32768
+
+/**
+ * The size of the fragment arena
+ */
+#define FRAGMENT_ARENA_SIZE (8 * 1024 * 1024)
+
+/**
+ * The maximum length of a fragment key
+ */
+#define FRAGMENT_MAX_KEY_LENGTH 1024
+
+/**
+ * The number of scrapes a fragment survives compaction without being used
+ */
+#define FRAGMENT_MAX_IDLE_SCRAPES 2
+
+/**
+ * @struct fragment_slot
+ * @brief A slot of the fragment table, pointing at an entry in the arena.
+ *
+ * An entry is stored as the key, the label set and the prefix, each
+ * followed by a NUL terminator.
+ */
+struct fragment_slot
+{
+   uint64_t hash;           /**< The hash of the key, 0 if the slot is free */
+   uint32_t offset;         /**< The offset of the entry in the arena */
+   uint32_t key_length;     /**< The length of the key */
+   uint32_t labels_length;  /**< The length of the label set */
+   uint32_t prefix_length;  /**< The length of the prefix */
+   uint64_t last_seen;      /**< The scrape that last used the entry */
+};
+
+/**
+ * @struct fragment_cache
+ * @brief Pre-rendered exposition fragments shared by all scrapes.
+ *
+ * A fragment is the text in front of the value of a series, i.e.
+ * "name{labels} ", or the HELP and TYPE header of a metric family.
+ * Fragments are keyed by the raw column values they were rendered
+ * from, so a scrape only has to splice in the new values.
+ */
+struct fragment_cache
+{
+   atomic_schar lock;                          /**< The lock */
+   atomic_ullong hits;                         /**< The number of lookups that found a fragment */
+   atomic_ullong misses;                       /**< The number of lookups that rendered a fragment */
+   uint64_t scrape;                            /**< The current scrape */
+   int number_of_entries;                      /**< The number of entries */
+   size_t size;                                /**< The size of the arena */
+   size_t used;                                /**< The number of bytes used in the arena */
+   struct fragment_slot slots[FRAGMENT_SLOTS]; /**< The slots */
+   char arena[];                               /**< The entries */
+} __attribute__((aligned(64)));
+
+/**
+ * @struct fragment_lookup
+ * @brief The lookup of the fragment of one series of a family.
+ */
+struct fragment_lookup
+{
+   char* key;         /**< The key */
+   size_t key_length; /**< The length of the key, 0 to skip the series */
+   size_t offset;     /**< The offset of the fragment in the buffer */
+   char* labels;      /**< The label set, or NULL if the fragment was not found */
+   char* prefix;      /**< The prefix, or NULL if the fragment was not found */
+};
+
+/**
+ * Initialize the fragment cache in shared memory
+ * @param p_size Pointer to store the total allocated size
+ * @param p_shmem Pointer to store the shared memory pointer
+ * @return 0 on success, otherwise 1
+ */
+int
+pgexporter_fragment_init(size_t* p_size, void** p_shmem);
+
+/**
+ * Start a scrape. Fragments not used for FRAGMENT_MAX_IDLE_SCRAPES
+ * scrapes are dropped at the next compaction.
+ */
+void
+pgexporter_fragment_begin(void);
+
+/**
+ * Drop all fragments, f.ex. when the configuration is reloaded
+ */
+void
+pgexporter_fragment_reset(void);
+
+/**
+ * Look up the fragments of the series of a family under one lock. The
+ * fragments found are copied into the buffer, which is grown as needed
+ * and can be reused for the next family
+ * @param lookups The lookups
+ * @param number_of_lookups The number of lookups
+ * @param buffer The buffer; the caller must free it
+ * @param capacity The capacity of the buffer
+ * @return The number of fragments found
+ */
+int
+pgexporter_fragment_lookup(struct fragment_lookup* lookups, int number_of_lookups, char** buffer, size_t* capacity);
+
+/**
+ * Store a fragment. Vanished series are compacted away when the
+ * cache is full; if there still is no room the fragment is not stored.
+ * @param key The key
+ * @param key_length The length of the key
+ * @param labels The label set, or NULL
+ * @param prefix The prefix
+ * @return true if the fragment was stored, otherwise false
+ */
+bool
+pgexporter_fragment_store(char* key, size_t key_length, char* labels, char* prefix);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
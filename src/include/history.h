@@ -34,12 +34,57 @@ extern "C" {
 #endif
 
 #include <pgexporter.h>
+#include <regex.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
 #include <openssl/ssl.h>
 
+/**
+ * The default size of the history queue (in bytes)
+ */
+#define HISTORY_DEFAULT_QUEUE_SIZE (4 * 1024 * 1024)
+
+/**
+ * Aggregations of a history query
+ */
+#define HISTORY_AGGREGATION_NONE 0
+#define HISTORY_AGGREGATION_AVG  1
+#define HISTORY_AGGREGATION_MIN  2
+#define HISTORY_AGGREGATION_MAX  3
+#define HISTORY_AGGREGATION_LAST 4
+#define HISTORY_AGGREGATION_RATE 5
+
+/**
+ * Label matcher operators
+ */
+#define HISTORY_MATCH_EQUAL     0
+#define HISTORY_MATCH_NOT_EQUAL 1
+#define HISTORY_MATCH_REGEX     2
+#define HISTORY_MATCH_NOT_REGEX 3
+
+/**
+ * The maximum number of label matchers of a history query
+ */
+#define HISTORY_MAX_MATCHERS 8
+
+/**
+ * @struct history_queue
+ * @brief Snapshots queued in shared memory by the metrics endpoint, and
+ * drained into the backend by the history worker.
+ */
+struct history_queue
+{
+   atomic_schar lock;     /**< The lock */
+   atomic_ulong dropped;  /**< The number of snapshots dropped because the queue was full */
+   unsigned long reported; /**< The number of dropped snapshots already reported by the worker */
+   atomic_int_least64_t last_snapshot_time; /**< The time of the most recent queued snapshot */
+   size_t size;           /**< The size of the data */
+   size_t used;           /**< The number of bytes used in the data */
+   char data[];           /**< The snapshots */
+} __attribute__((aligned(64)));
+
 /**
  * @struct history_record
  * @brief Stored metric sample for the history backend.
@@ -55,6 +100,42 @@ struct history_record
    double value;                   /**< Metric value */
 };
 
+/**
+ * Called for every record of a streamed query. The record, including its
+ * labels, is only valid during the call.
+ * @param data The data passed to the query
+ * @param record The record
+ * @return 0 to continue, 1 to stop the query with an error
+ */
+typedef int (*history_record_callback)(void* data, struct history_record* record);
+
+/**
+ * @struct history_matcher
+ * @brief A label matcher, such as database="postgres" or database=~"app.*".
+ */
+struct history_matcher
+{
+   char name[MISC_LENGTH];  /**< The label name */
+   char value[MISC_LENGTH]; /**< The value, or the regular expression */
+   int op;                  /**< The operator */
+   regex_t regex;           /**< The compiled (anchored) regular expression */
+};
+
+/**
+ * @struct history_query
+ * @brief A history query: a time window, an optional downsampling step with
+ * its aggregation, and label matchers.
+ */
+struct history_query
+{
+   time_t start;                                         /**< Start of the time window (inclusive) */
+   time_t end;                                           /**< End of the time window (inclusive) */
+   time_t step;                                          /**< The bucket size in seconds, 0 for raw samples */
+   int aggregation;                                      /**< The aggregation of a bucket */
+   int number_of_matchers;                               /**< The number of matchers */
+   struct history_matcher matchers[HISTORY_MAX_MATCHERS]; /**< The matchers, all must match */
+};
+
 /**
  * Free an array of history records returned by pgexporter_history_query_range,
  * including each record's heap-allocated labels string.
@@ -74,10 +155,11 @@ struct history_backend_ops
 {
    int (*init)(void);                                             /**< Initialize backend resources. */
    int (*write_batch)(struct history_record* records, int count); /**< Persist a batch of history records. */
-   int (*query_range)(const char* metric, time_t start, time_t end,
-                      struct history_record** out, int* count_out); /**< Query records for a metric and time range. */
-   int (*prune)(void);                                              /**< Remove records older than configured retention. */
-   int (*shutdown)(void);                                           /**< Release backend resources. */
+   int (*query_stream)(const char* metric, struct history_query* query,
+                       history_record_callback callback, void* data); /**< Stream the records of a metric and time range in time order. */
+   int (*rollup)(void);                                               /**< Aggregate raw records into rollups, may be NULL. */
+   int (*prune)(void);                                                /**< Remove records older than configured retention. */
+   int (*shutdown)(void);                                             /**< Release backend resources. */
 };
 
 /**
@@ -109,6 +191,84 @@ int
 pgexporter_history_query_range(const char* metric, time_t start, time_t end,
                                struct history_record** records_out, int* count_out);
 
+/**
+ * Stream the records of a given metric within a time window, in time order,
+ * without holding the whole result in memory.
+ * @param metric   Metric name to query
+ * @param start    Start of the time window
+ * @param end      End of the time window
+ * @param callback Called for every record
+ * @param data     Passed to the callback
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_query_stream(const char* metric, time_t start, time_t end,
+                                history_record_callback callback, void* data);
+
+/**
+ * Parse a label matcher, such as name="value", name!="value",
+ * name=~"regex" or name!~"regex". The quotes are optional.
+ * @param str The matcher
+ * @param matcher The resulting matcher
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_matcher_parse(char* str, struct history_matcher* matcher);
+
+/**
+ * Read the next label of a label set, such as
+ * server="primary", database="postgres"
+ * @param position The position in the label set, advanced past the label
+ * @param name The label name
+ * @param name_size The size of name
+ * @param value The unescaped label value
+ * @param value_size The size of value
+ * @return true if a label was read, false at the end of the label set
+ */
+bool
+pgexporter_history_label_next(const char** position, char* name, size_t name_size, char* value, size_t value_size);
+
+/**
+ * Does a series match all the matchers of a query. A missing label has the
+ * empty value, and the server label defaults to the server of the series.
+ * @param query The query
+ * @param server The server of the series
+ * @param labels The label set of the series
+ * @return true if the series matches
+ */
+bool
+pgexporter_history_matches(struct history_query* query, const char* server, const char* labels);
+
+/**
+ * Stream the result of a query. Records that do not match are skipped, and
+ * with a step every series is reduced to one record per bucket, with the
+ * timestamp of the start of the bucket. Only one record per series is kept
+ * in memory.
+ * @param metric   Metric name to query
+ * @param query    The query
+ * @param callback Called for every resulting record
+ * @param data     Passed to the callback
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_query(const char* metric, struct history_query* query,
+                         history_record_callback callback, void* data);
+
+/**
+ * Release the compiled matchers of a query
+ * @param query The query
+ */
+void
+pgexporter_history_query_destroy(struct history_query* query);
+
+/**
+ * Aggregate the raw records into the 1-minute and 1-hour rollups, picking
+ * up where the previous call stopped. A no-op for backends without rollups.
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_rollup(void);
+
 /**
  * Delete records older than the configured retention threshold.
  * @return 0 on success, 1 on failure
@@ -127,15 +287,44 @@ struct prometheus_metrics_container;
 
 /**
  * Persist a metrics container as one history snapshot.
- * The container's metrics are serialized to Prometheus exposition text and
- * written to the history backend, which must already be initialized via
- * pgexporter_history_init().
+ * The structured samples of the container are written to the history
+ * backend, which must already be initialized via pgexporter_history_init().
  *
  * @param container The metrics container to store
  */
 int
 pgexporter_history_store_metrics(struct prometheus_metrics_container* container);
 
+/**
+ * Allocate the history queue in shared memory.
+ *
+ * @param p_size Pointer to store the total allocated size
+ * @param p_shmem Pointer to store the shared memory pointer
+ * @return 0 on success, otherwise 1
+ */
+int
+pgexporter_history_init_queue(size_t* p_size, void** p_shmem);
+
+/**
+ * Queue the structured samples of a metrics container as one snapshot.
+ * The snapshot is dropped if the queue is full or busy, so the caller
+ * never waits for the history backend.
+ *
+ * @param container The metrics container
+ * @return 0 if the snapshot was queued, otherwise 1
+ */
+int
+pgexporter_history_enqueue(struct prometheus_metrics_container* container);
+
+/**
+ * Write the queued snapshots to the history backend, which must already be
+ * initialized via pgexporter_history_init().
+ *
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_drain(void);
+
 /**
  * Periodic callback: fork a history worker to snapshot current metrics.
  * Skipped if a previous worker is still running.
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_HISTORY_COLUMNAR_H
+#define PGEXPORTER_HISTORY_COLUMNAR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <history.h>
+#include <time.h>
+
+/**
+ * The time span of a partition (in seconds)
+ */
+#define HISTORY_COLUMNAR_PARTITION_SECONDS 3600
+
+/**
+ * How long after its end a partition is compacted (in seconds),
+ * so late snapshots from the history queue still end up in it
+ */
+#define HISTORY_COLUMNAR_COMPACT_DELAY_SECONDS 300
+
+/**
+ * Open (or create) the storage directory and load the series dictionary.
+ * The directory is taken from config->history_path.
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_columnar_init(void);
+
+/**
+ * Append a batch of records to their partitions.
+ * @param records Array of history_record structs
+ * @param count   Number of records
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_columnar_write_batch(struct history_record* records, int count);
+
+/**
+ * Stream the records of a metric within [query->start, query->end] in time order.
+ * @param metric   Metric name
+ * @param query    The query
+ * @param callback Called for every record
+ * @param data     Passed to the callback
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_columnar_query_stream(const char* metric, struct history_query* query,
+                                         history_record_callback callback, void* data);
+
+/**
+ * Compact the closed partitions, and remove the partitions that are
+ * completely older than config->history_retention.
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_columnar_prune(void);
+
+/**
+ * Release the series dictionary.
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_columnar_shutdown(void);
+
+extern const struct history_backend_ops pgexporter_history_columnar_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -54,20 +54,33 @@ int
 pgexporter_history_sqlite_write_batch(struct history_record* records, int count);
 
 /**
- * Query records for a metric within [start, end].
- * @param metric      Metric name
- * @param start       Start timestamp (inclusive)
- * @param end         End timestamp (inclusive)
- * @param records_out Pointer to a caller-freeable array of results; may be NULL
- * @param count_out   Number of returned records
+ * Stream the records of a metric within [query->start, query->end] in time
+ * order. Older parts of the window, and queries with a step of whole minutes
+ * or hours, are read from the rollups.
+ * @param metric   Metric name
+ * @param query    The query
+ * @param callback Called for every record
+ * @param data     Passed to the callback
  * @return 0 on success, 1 on failure
  */
 int
-pgexporter_history_sqlite_query_range(const char* metric, time_t start, time_t end,
-                                      struct history_record** records_out, int* count_out);
+pgexporter_history_sqlite_query_stream(const char* metric, struct history_query* query,
+                                       history_record_callback callback, void* data);
+
+/**
+ * Aggregate the complete minutes of the raw samples into samples_1m, and
+ * the complete hours of samples_1m into samples_1h. Only done when
+ * config->history_raw_retention is set.
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_history_sqlite_rollup(void);
 
 /**
  * Delete records whose timestamp is older than config->history_retention.
+ * With rollups, raw samples are kept for config->history_raw_retention and
+ * 1-minute rollups for config->history_minute_retention, but never before
+ * they have been rolled up.
  * @return 0 on success, 1 on failure
  */
 int
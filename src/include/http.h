@@ -75,6 +75,7 @@ struct http_request
    char* path;                                                   /**< Request path */
    size_t (*read_cb)(void* buffer, size_t size, void* userdata); /**< Read callback for streaming upload */
    void* read_userdata;                                          /**< User data for read callback */
+   bool keep_alive;                                              /**< Ask the server to keep the connection open */
 };
 
 /** @struct http_response
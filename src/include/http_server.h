@@ -34,23 +34,58 @@ extern "C" {
 #endif
 
 #include <openssl/ssl.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
 /** @struct http_server_request
  * Parsed inbound HTTP request. Populated by pgexporter_http_server_parse().
  */
 struct http_server_request
 {
-   char path[256]; /**< Request path extracted from the GET line (e.g. "/metrics") */
+   char path[256];  /**< Request path extracted from the request line (e.g. "/metrics") */
+   char* headers;   /**< The header lines following the request line, or NULL */
+   bool head;       /**< Is this a HEAD request, i.e. the response has no body */
+   bool keep_alive; /**< Does the connection stay open after the response */
+};
+
+/** @struct http_server_connection
+ * A client connection, which may carry several requests (HTTP/1.1 keep-alive).
+ * Bytes received beyond the current request are kept for the next one, so
+ * pipelined requests are answered in order.
+ */
+struct http_server_connection
+{
+   SSL* ssl;                 /**< The SSL connection, or NULL for plain HTTP */
+   int fd;                   /**< The client socket file descriptor */
+   int requests;             /**< The number of requests read so far */
+   int max_requests;         /**< The maximum number of requests, 1 closes after the first response */
+   int idle_timeout;         /**< Milliseconds to wait for a following request */
+   int* idle_fds;            /**< Descriptors that may end an idle connection when readable, or NULL */
+   int idle_fds_length;      /**< The number of descriptors in idle_fds */
+   bool (*idle_yield)(void); /**< Should an idle connection give way to a readable idle_fds, or NULL for always */
+   char* buffer;             /**< Bytes received but not parsed yet */
+   size_t length;            /**< The number of bytes in the buffer */
+};
+
+/** @struct http_validators
+ * Validators of a cached response, used for conditional requests.
+ */
+struct http_validators
+{
+   char etag[48];        /**< The entity tag including the quotes, or empty */
+   time_t last_modified; /**< When the response was generated, or 0 */
+   time_t expires;       /**< When the response expires, or 0 */
 };
 
 /**
  * Handler function type for HTTP route handlers.
  * @param ssl The SSL connection, or NULL for plain HTTP
  * @param fd  The client socket file descriptor
+ * @param req The parsed request
  * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
  */
-typedef int (*http_handler_fn)(SSL* ssl, int fd);
+typedef int (*http_handler_fn)(SSL* ssl, int fd, struct http_server_request* req);
 
 /** @struct http_route
  * Maps a URL path to a handler function.
@@ -78,12 +113,13 @@ int
 pgexporter_http_server_ssl_accept(SSL* ssl, int fd);
 
 /**
- * Read and parse an inbound HTTP request from the socket.
+ * Read and parse a single inbound HTTP request from the socket. The response
+ * closes the connection.
  *
- * Calls pgexporter_read_timeout_message() using the configured authentication
- * timeout, then extracts the request path into a newly allocated
- * http_server_request. On failure (read error or malformed request) the
- * function returns MESSAGE_STATUS_ERROR and @p *req is set to NULL.
+ * Waits up to the configured authentication timeout for the request head,
+ * then extracts the request path into a newly allocated http_server_request.
+ * On failure (read error or malformed request) the function returns
+ * MESSAGE_STATUS_ERROR and @p *req is set to NULL.
  *
  * The caller must free the returned struct with
  * pgexporter_http_server_request_destroy() when done.
@@ -96,6 +132,114 @@ pgexporter_http_server_ssl_accept(SSL* ssl, int fd);
 int
 pgexporter_http_server_parse(SSL* ssl, int fd, struct http_server_request** req);
 
+/**
+ * Initialize a connection for a single request, i.e. without keep-alive.
+ * @param connection The connection
+ * @param ssl        The SSL connection, or NULL for plain HTTP
+ * @param fd         The client socket file descriptor
+ */
+void
+pgexporter_http_server_connection_init(struct http_server_connection* connection, SSL* ssl, int fd);
+
+/**
+ * Read and parse the next request of a connection. The first request, and
+ * the rest of a request once it has started, get the authentication timeout.
+ * Between requests the connection waits for idle_timeout.
+ * @param connection The connection
+ * @param req        Output: pointer to the allocated request struct
+ * @return MESSAGE_STATUS_OK when there is a request, MESSAGE_STATUS_ZERO when the
+ *         connection ended between requests, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_http_server_next(struct http_server_connection* connection, struct http_server_request** req);
+
+/**
+ * Parse the next request from the bytes a connection has already received,
+ * without reading from the socket. Used by callers that read the socket
+ * themselves, such as an event loop.
+ * @param connection The connection
+ * @param req        Output: pointer to the allocated request struct
+ * @return MESSAGE_STATUS_OK when there is a request, MESSAGE_STATUS_ZERO when the
+ *         request is not complete yet, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_http_server_parse_buffered(struct http_server_connection* connection, struct http_server_request** req);
+
+/**
+ * Parse the next request from the bytes a connection has already received,
+ * but leave them in the buffer until pgexporter_http_server_consume() is
+ * called. Used by callers that may hand the request over unread.
+ * @param connection The connection
+ * @param req        Output: pointer to the allocated request struct
+ * @param length     Output: the length of the request
+ * @return MESSAGE_STATUS_OK when there is a request, MESSAGE_STATUS_ZERO when the
+ *         request is not complete yet, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_http_server_peek(struct http_server_connection* connection, struct http_server_request** req, size_t* length);
+
+/**
+ * Remove a request returned by pgexporter_http_server_peek() from the
+ * buffer of a connection
+ * @param connection The connection
+ * @param length     The length of the request
+ */
+void
+pgexporter_http_server_consume(struct http_server_connection* connection, size_t length);
+
+/**
+ * Add received bytes to a connection
+ * @param connection The connection
+ * @param data       The data
+ * @param length     The length of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_http_server_append(struct http_server_connection* connection, const void* data, size_t length);
+
+/**
+ * Serve the requests of a connection against a route table until the client
+ * or a handler closes it, the connection is idle for too long or has served
+ * max_requests. A malformed request is answered with a 400.
+ * @param connection The connection
+ * @param routes     Route table array
+ * @param n_routes   Number of entries in @p routes
+ * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_http_server_serve(struct http_server_connection* connection,
+                             struct http_route* routes, int n_routes);
+
+/**
+ * Free the buffer of a connection. The socket is left open.
+ * @param connection The connection
+ */
+void
+pgexporter_http_server_connection_destroy(struct http_server_connection* connection);
+
+/**
+ * Get the value of a request header. The name is matched case-insensitively
+ * and the value is returned without surrounding whitespace.
+ * @param req   The parsed request
+ * @param name  The header name (e.g. "Accept")
+ * @param value The value buffer
+ * @param size  The size of the value buffer
+ * @return true if the header is present, otherwise false
+ */
+bool
+pgexporter_http_server_get_header(struct http_server_request* req, const char* name, char* value, size_t size);
+
+/**
+ * Can the request be answered with 304 Not Modified? If-None-Match is
+ * matched against the entity tag using the weak comparison, and
+ * If-Modified-Since is only looked at when If-None-Match is absent.
+ * @param req        The parsed request
+ * @param validators The validators of the current response
+ * @return true if the client has the current response, otherwise false
+ */
+bool
+pgexporter_http_server_not_modified(struct http_server_request* req, struct http_validators* validators);
+
 /**
  * Free an http_server_request allocated by pgexporter_http_server_parse().
  * Safe to call with NULL.
@@ -123,18 +267,77 @@ pgexporter_http_server_dispatch(SSL* ssl, int fd, struct http_server_request* re
                                 struct http_route* routes, int n_routes);
 
 /**
- * Send an HTTP 200 OK response with a fixed-size body.
+ * Send an HTTP 200 OK response with a fixed-size body. The body is left
+ * out for a HEAD request.
  * @param ssl          The SSL connection, or NULL for plain HTTP
  * @param fd           The client socket file descriptor
+ * @param req          The request being answered, or NULL to close the connection
  * @param content_type The Content-Type header value
  * @param body         Response body data
  * @param len          Length of @p body in bytes
  * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
  */
 int
-pgexporter_http_respond_ok(SSL* ssl, int fd, const char* content_type,
+pgexporter_http_respond_ok(SSL* ssl, int fd, struct http_server_request* req, const char* content_type,
                            const void* body, size_t len);
 
+/**
+ * Send an HTTP 200 OK response with a fixed-size body and the
+ * ETag, Last-Modified and Expires headers of its validators. The body is
+ * left out for a HEAD request.
+ * @param ssl          The SSL connection, or NULL for plain HTTP
+ * @param fd           The client socket file descriptor
+ * @param req          The request being answered, or NULL to close the connection
+ * @param content_type The Content-Type header value
+ * @param body         Response body data
+ * @param len          Length of @p body in bytes
+ * @param validators   The validators, or NULL
+ * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_http_respond_ok_validated(SSL* ssl, int fd, struct http_server_request* req, const char* content_type,
+                                     const void* body, size_t len, struct http_validators* validators);
+
+/**
+ * Build an HTTP 200 OK response with a fixed-size body and the validator
+ * headers, for callers that write the response themselves. The body is
+ * left out for a HEAD request.
+ * @param req             The request being answered, or NULL to close the connection
+ * @param content_type    The Content-Type header value
+ * @param body            Response body data
+ * @param len             Length of @p body in bytes
+ * @param validators      The validators, or NULL
+ * @param response        Output: the response
+ * @param response_length Output: the length of the response
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_http_response_ok(struct http_server_request* req, const char* content_type, const void* body, size_t len,
+                            struct http_validators* validators, char** response, size_t* response_length);
+
+/**
+ * Build an HTTP 304 Not Modified response.
+ * @param req             The request being answered, or NULL to close the connection
+ * @param validators      The validators of the current response
+ * @param response        Output: the response
+ * @param response_length Output: the length of the response
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_http_response_not_modified(struct http_server_request* req, struct http_validators* validators,
+                                      char** response, size_t* response_length);
+
+/**
+ * Send an HTTP 304 Not Modified response.
+ * @param ssl        The SSL connection, or NULL for plain HTTP
+ * @param fd         The client socket file descriptor
+ * @param req        The request being answered, or NULL to close the connection
+ * @param validators The validators of the current response
+ * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_http_respond_not_modified(SSL* ssl, int fd, struct http_server_request* req, struct http_validators* validators);
+
 /**
  * Send an HTTP 400 Bad Request response.
  * @param ssl The SSL connection, or NULL for plain HTTP
@@ -148,10 +351,11 @@ pgexporter_http_respond_400(SSL* ssl, int fd);
  * Send an HTTP 404 Not Found response.
  * @param ssl The SSL connection, or NULL for plain HTTP
  * @param fd  The client socket file descriptor
+ * @param req The request being answered, or NULL to close the connection
  * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
  */
 int
-pgexporter_http_respond_404(SSL* ssl, int fd);
+pgexporter_http_respond_404(SSL* ssl, int fd, struct http_server_request* req);
 
 /**
  * Send an HTTP 500 Internal Server Error response.
@@ -166,23 +370,26 @@ pgexporter_http_respond_500(SSL* ssl, int fd);
  * Send an HTTP 301 Moved Permanently redirect.
  * @param ssl      The SSL connection, or NULL for plain HTTP
  * @param fd       The client socket file descriptor
+ * @param req      The request being answered, or NULL to close the connection
  * @param location The target URL for the Location header
  * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
  */
 int
-pgexporter_http_respond_redirect(SSL* ssl, int fd, const char* location);
+pgexporter_http_respond_redirect(SSL* ssl, int fd, struct http_server_request* req, const char* location);
 
 /**
  * Begin a chunked HTTP 200 OK response.
  * Must be followed by one or more pgexporter_http_respond_chunked_write() calls
- * and exactly one pgexporter_http_respond_chunked_end() call.
+ * and exactly one pgexporter_http_respond_chunked_end() call, except for a
+ * HEAD request which ends with the head.
  * @param ssl          The SSL connection, or NULL for plain HTTP
  * @param fd           The client socket file descriptor
+ * @param req          The request being answered, or NULL to close the connection
  * @param content_type The Content-Type header value
  * @return MESSAGE_STATUS_OK on success, otherwise MESSAGE_STATUS_ERROR
  */
 int
-pgexporter_http_respond_chunked_start(SSL* ssl, int fd, const char* content_type);
+pgexporter_http_respond_chunked_start(SSL* ssl, int fd, struct http_server_request* req, const char* content_type);
 
 /**
  * Write one chunk of data in a chunked response.
@@ -35,6 +35,7 @@ extern "C" {
 
 #include <pgexporter.h>
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -59,6 +60,9 @@ extern "C" {
 
 #define PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX "%Y-%m-%d %H:%M:%S"
 
+#define PGEXPORTER_LOGGING_RING_SLOTS              2048
+#define PGEXPORTER_LOGGING_RING_RECORD_SIZE        1024
+
 #define pgexporter_log_trace(...)                  pgexporter_log_line(PGEXPORTER_LOGGING_LEVEL_DEBUG5, __FILE__, __LINE__, __VA_ARGS__)
 #define pgexporter_log_debug(...)                  pgexporter_log_line(PGEXPORTER_LOGGING_LEVEL_DEBUG1, __FILE__, __LINE__, __VA_ARGS__)
 #define pgexporter_log_info(...)                   pgexporter_log_line(PGEXPORTER_LOGGING_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
@@ -66,6 +70,34 @@ extern "C" {
 #define pgexporter_log_error(...)                  pgexporter_log_line(PGEXPORTER_LOGGING_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
 #define pgexporter_log_fatal(...)                  pgexporter_log_line(PGEXPORTER_LOGGING_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
 
+/** @struct log_record
+ * A preformatted log line in the log ring
+ */
+struct log_record
+{
+   atomic_ulong sequence;                              /**< The sequence of the slot */
+   atomic_int pid;                                     /**< The process copying into the slot */
+   size_t length;                                      /**< The length of the data */
+   char data[PGEXPORTER_LOGGING_RING_RECORD_SIZE];     /**< The line, or a part of it */
+};
+
+/** @struct log_ring
+ * Bounded multi-producer, single-consumer ring of log lines. Every process
+ * formats its lines without a lock and queues them; the log writer process
+ * writes them out in batches. A long line spans consecutive records, and a
+ * slot that stays claimed but unpublished is skipped by the writer, unless
+ * a live process is still copying into it
+ */
+struct log_ring
+{
+   atomic_ulong head;                                          /**< The next slot to fill */
+   atomic_ulong tail;                                          /**< The next slot to write */
+   atomic_ulong dropped;                                       /**< The number of lines dropped because the ring was full */
+   atomic_uint generation;                                     /**< Bumped when the log file must be reopened */
+   atomic_bool stop;                                           /**< Should the writer stop */
+   struct log_record records[PGEXPORTER_LOGGING_RING_SLOTS];   /**< The records */
+};
+
 /**
  * Start the logging system
  * @return 0 upon success, otherwise 1
@@ -108,6 +140,34 @@ pgexporter_log_line(int level, char* file, int line, char* fmt, ...);
 void
 pgexporter_log_mem(void* data, size_t size);
 
+/**
+ * Create and initialize the log ring shared memory
+ * @param p_size The resulting size
+ * @param p_shmem The resulting shared memory
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_log_ring_init(size_t* p_size, void** p_shmem);
+
+/**
+ * Run the log writer, which writes the queued lines until it is stopped.
+ * Does not return
+ */
+void
+pgexporter_log_writer(void);
+
+/**
+ * Stop the log writer once the queued lines are written, and wait for it
+ */
+void
+pgexporter_log_writer_stop(void);
+
+/**
+ * Have the log writer reopen the log file, f.ex. after a reload
+ */
+void
+pgexporter_log_writer_reopen(void);
+
 /**
  * Print n bytes after ptr in binary format
  * @param ptr Pointer to the bytes
@@ -54,6 +54,22 @@ struct message
    void* data;       /**< The message data */
 } __attribute__((aligned(64)));
 
+/**
+ * Set the deadline for all client I/O in this process. Reads and writes
+ * that would wait past it give up, a read with MESSAGE_STATUS_ZERO and a
+ * write with MESSAGE_STATUS_ERROR
+ * @param timeout The number of milliseconds from now, or 0 to clear the deadline
+ */
+void
+pgexporter_set_deadline(int64_t timeout);
+
+/**
+ * Get the time left until the deadline
+ * @return The remaining milliseconds, 0 if the deadline has passed, or -1 if no deadline is set
+ */
+int64_t
+pgexporter_deadline_remaining(void);
+
 /**
  * Read a message in blocking mode
  * @param ssl The SSL struct
@@ -83,7 +99,7 @@ pgexporter_read_complete_message(SSL* ssl, int socket, struct message** msg);
  * Read a message with a timeout
  * @param ssl The SSL struct
  * @param socket The socket descriptor
- * @param timeout The timeout in seconds
+ * @param timeout The timeout in milliseconds
  * @param msg The resulting message
  * @return One of MESSAGE_STATUS_ZERO, MESSAGE_STATUS_OK or MESSAGE_STATUS_ERROR
  */
@@ -189,6 +205,16 @@ pgexporter_write_notice(SSL* ssl, int socket);
 int
 pgexporter_write_terminate(SSL* ssl, int socket);
 
+/**
+ * Write a CancelRequest message. It is written without regard to the deadline
+ * @param socket The socket descriptor of a new connection to the server
+ * @param pid The process id of the backend
+ * @param secret The secret key of the backend
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_write_cancel_request(int socket, int pid, int secret);
+
 /**
  * Write an empty message
  * @param ssl The SSL struct
@@ -77,6 +77,18 @@ pgexporter_remove_unix_socket(const char* directory, const char* file);
 int
 pgexporter_connect(const char* hostname, int port, int* fd);
 
+/**
+ * Connect to a host, giving up when the connection isn't established
+ * within a timeout
+ * @param hostname The host name
+ * @param port The port number
+ * @param timeout The timeout in milliseconds
+ * @param fd The resulting descriptor
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_connect_timeout(const char* hostname, int port, int timeout, int* fd);
+
 /**
  * Connect to a Unix Domain Socket
  * @param directory The directory
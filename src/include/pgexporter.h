@@ -54,6 +54,7 @@ extern "C" {
 #define TRANSFER_UDS                 ".s.pgexporter.tu"
 
 #define MAX_NUMBER_OF_COLUMNS        32
+#define MAX_METRICS_WORKERS          64
 
 #define MAX_PROCESS_TITLE_LENGTH     256
 
@@ -78,6 +79,7 @@ extern "C" {
 #define NUMBER_OF_ALERTS             64
 #define NUMBER_OF_DATABASES          64
 #define NUMBER_OF_METRIC_NAMES       1024
+#define NUMBER_OF_CONSOLE_CATEGORIES 256
 #define MAX_METRIC_COLUMNS           2048
 
 #define STATE_FREE                   0
@@ -108,6 +110,7 @@ extern "C" {
 #define HUGEPAGE_ON                  2
 
 #define HISTORY_BACKEND_SQLITE       0
+#define HISTORY_BACKEND_COLUMNAR     1
 
 #define VERSION_GREATER              1
 #define VERSION_EQUAL                0
@@ -271,6 +274,35 @@ extern void* bridge_cache_shmem;
  */
 extern void* bridge_json_cache_shmem;
 
+/**
+ * Shared memory used to contain the history
+ * snapshot queue.
+ */
+extern void* history_queue_shmem;
+
+/**
+ * Shared memory used to contain the pre-rendered
+ * exposition fragments.
+ */
+extern void* fragment_shmem;
+
+/**
+ * Shared memory used to contain the SCRAM-SHA-256
+ * SaltedPassword cache.
+ */
+extern void* scram_cache_shmem;
+
+/**
+ * Shared memory used to contain the client
+ * TLS sessions.
+ */
+extern void* tls_session_shmem;
+
+/**
+ * Shared memory used to contain the log ring.
+ */
+extern void* log_ring_shmem;
+
 /**
  * @struct version
  * Semantic version structure for extensions (major.minor.patch format)
@@ -322,6 +354,8 @@ struct server
    struct extension_info extensions[NUMBER_OF_EXTENSIONS]; /**< The extensions */
    char extensions_config[MAX_EXTENSIONS_CONFIG_LENGTH];   /**< Server-specific extensions configuration */
    int fips_enabled;                                       /**< FIPS mode status */
+   int backend_pid;                                        /**< The process id of the backend, for CancelRequest */
+   int backend_secret;                                     /**< The secret key of the backend, for CancelRequest */
 
 } __attribute__((aligned(64)));
 
@@ -347,13 +381,23 @@ struct user
  *
  * The `size` field stores the size of the allocated
  * `data` payload.
+ *
+ * The `etag` and `last_modified` fields identify the
+ * generation of the payload for conditional requests.
+ * The `hash` and `stamped` fields survive invalidation,
+ * so an unchanged payload keeps its modification time.
  */
 struct prometheus_cache
 {
-   time_t valid_until; /**< when the cache will become not valid */
-   atomic_schar lock;  /**< lock to protect the cache */
-   size_t size;        /**< size of the cache */
-   char data[];        /**< the payload */
+   time_t valid_until;   /**< when the cache will become not valid */
+   time_t last_modified; /**< when the payload was finalized */
+   char etag[24];        /**< the entity tag of the payload, including the quotes */
+   uint64_t hash;        /**< the hash of the last stamped payload */
+   time_t stamped;       /**< when the payload with that hash was first stamped */
+   bool overflow;        /**< the payload did not fit since the last invalidation */
+   atomic_schar lock;    /**< lock to protect the cache */
+   size_t size;          /**< size of the cache */
+   char data[];          /**< the payload */
 } __attribute__((aligned(64)));
 
 /** @struct column
@@ -432,14 +476,29 @@ struct configuration
    pgexporter_time_t metrics_cache_max_age; /**< Cache duration for Prometheus response */
    size_t metrics_cache_max_size;           /**< Number of bytes max to cache the Prometheus response */
    pgexporter_time_t metrics_query_timeout; /**< Timeout for metric queries */
+   pgexporter_time_t metrics_scrape_timeout; /**< Timeout for a whole scrape */
+   int metrics_workers;                     /**< Number of pre-forked metrics workers (0 = fork per request) */
+   atomic_uint metrics_workers_generation;  /**< Bumped when the metrics workers must be replaced */
+   atomic_bool metrics_workers_yield;       /**< Set while a worker gives up an idle connection for a new one */
+   pgexporter_time_t metrics_keep_alive_timeout; /**< Idle timeout of persistent metrics connections */
+   int metrics_keep_alive_requests;         /**< Maximum number of requests per metrics connection */
+   bool metrics_event_loop;                 /**< Answer cached metrics from the main event loop */
    int management;                          /**< The management port */
    int console;                             /**< The console port */
 
+   atomic_schar console_categories_lock;                                       /**< The lock for the console categories */
+   uint64_t console_categories_hash;                                           /**< Hash of the metric names the categories were selected for */
+   int number_of_console_categories;                                           /**< The number of console categories */
+   char console_categories[NUMBER_OF_CONSOLE_CATEGORIES][MISC_LENGTH];         /**< The console categories */
+
    int history;                                  /**< The history API port (-1 = disabled) */
    pgexporter_time_t history_interval;           /**< Interval between history snapshots */
    pgexporter_time_t history_retention;          /**< How long to retain history records */
+   pgexporter_time_t history_raw_retention;      /**< How long to retain raw samples before only keeping rollups */
+   pgexporter_time_t history_minute_retention;   /**< How long to retain the 1-minute rollups */
    int history_backend;                          /**< The history storage backend */
    char history_path[MAX_PATH];                  /**< Path for the history storage file */
+   size_t history_queue_size;                    /**< The size of the queue of snapshots for the history worker */
    char history_cert_file[MAX_PATH];             /**< History API TLS certificate path */
    char history_key_file[MAX_PATH];              /**< History API TLS key path */
    char history_ca_file[MAX_PATH];               /**< History API TLS CA certificate path */
@@ -448,10 +507,28 @@ struct configuration
    atomic_int history_worker_pid;                /**< PID of the forked history ticker worker (0 if none) */
    atomic_bool history_retention_worker_running; /**< State of the retention pruner */
    atomic_int history_retention_worker_pid;      /**< PID of the forked retention worker (0 if none) */
+   atomic_ulong history_prune_records;           /**< The number of history records removed by pruning */
+   atomic_ulong history_prune_batches;           /**< The number of pruning batches */
+   atomic_int_least64_t history_prune_duration;  /**< Duration of the last prune in milliseconds */
+   atomic_bool history_prune_pending;            /**< The last prune ran out of time with records left */
+
+   char remote_write_url[MAX_PATH];             /**< The Prometheus remote_write URL, empty to disable */
+   int remote_write_shards;                     /**< The number of parallel remote_write senders */
+   char remote_write_spool[MAX_PATH];           /**< The directory of the remote_write spool */
+   size_t remote_write_spool_size;              /**< The maximum size of the remote_write spool */
+   atomic_ulong remote_write_samples;           /**< The number of samples sent with remote_write */
+   atomic_ulong remote_write_failures;          /**< The number of remote_write requests that failed */
+   atomic_ulong remote_write_retries;           /**< The number of remote_write requests that were retried */
+   atomic_ulong remote_write_dropped;           /**< The number of samples dropped from the full spool */
+   atomic_int_least64_t remote_write_spool_used; /**< The number of bytes in the remote_write spool */
+   atomic_bool remote_write_running;            /**< State of the remote_write sender */
+   atomic_int remote_write_pid;                 /**< PID of the forked remote_write sender (0 if none) */
 
    int bridge;                                 /**< The bridge port */
    pgexporter_time_t bridge_cache_max_age;     /**< Cache duration for bridge response */
    size_t bridge_cache_max_size;               /**< Number of bytes max to cache the bridge response */
+   pgexporter_time_t bridge_poll_interval;     /**< Interval between background bridge polls */
+   atomic_int bridge_poller_pid;               /**< PID of the bridge poller (0 if none) */
    int bridge_json;                            /**< The bridge port */
    size_t bridge_json_cache_max_size;          /**< Number of bytes max to cache the bridge response */
    int bridge_history;                         /**< The bridge history API port (-1 = disabled) */
@@ -471,6 +548,8 @@ struct configuration
    pgexporter_time_t log_rotation_age; /**< Log rotation interval */
    char log_line_prefix[MISC_LENGTH];  /**< The logging prefix */
    atomic_schar log_lock;              /**< The logging lock */
+   bool log_async;                     /**< Queue log lines for the log writer */
+   atomic_int log_writer_pid;          /**< PID of the log writer (0 if none) */
 
    bool tls;                     /**< Is TLS enabled */
    char tls_cert_file[MAX_PATH]; /**< TLS certificate path */
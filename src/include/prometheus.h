@@ -36,8 +36,33 @@ extern "C" {
 
 #include <art.h>
 #include <ev.h>
+#include <http_server.h>
+#include <prometheus_client.h>
 #include <stdlib.h>
 
+/**
+ * A structured sample, emitted by the collectors next to the exposition text
+ */
+struct prometheus_sample
+{
+   int name;     /**< The id of the metric name */
+   int server;   /**< The id of the server name */
+   int labels;   /**< The id of the label set */
+   double value; /**< The value */
+};
+
+/**
+ * ART-based metric value with timestamp
+ */
+typedef struct prometheus_metric_value
+{
+   time_t timestamp; /**< The timestamp */
+   char* value;      /**< The exposition text of the family */
+   char* help;       /**< The HELP */
+   char* type;       /**< The TYPE */
+   int sort_type;    /**< The sort type */
+} prometheus_metric_value_t;
+
 /**
  * ART-based metrics container for each category
  */
@@ -55,6 +80,15 @@ typedef struct prometheus_metrics_container
    struct art* settings_metrics;
    struct art* custom_metrics;
    struct art* alert_metrics;
+
+   bool record_samples;                /**< Record the structured samples */
+   struct art* sample_ids;             /**< The ids of the sample strings */
+   char** sample_strings;              /**< The sample strings, indexed by id */
+   int number_of_sample_strings;       /**< The number of sample strings */
+   int sample_strings_capacity;        /**< The capacity of the sample strings */
+   struct prometheus_sample* samples;  /**< The samples */
+   int number_of_samples;              /**< The number of samples */
+   int samples_capacity;               /**< The capacity of the samples */
 } prometheus_metrics_container_t;
 
 /**
@@ -64,10 +98,44 @@ typedef struct prometheus_metrics_container
  * On failure no container is returned and the connections are closed first.
  *
  * @param container The pointer to store the allocated and populated container
+ * @param samples Record the structured samples next to the exposition text
  * @return 0 on success, 1 on failure
  */
 int
-pgexporter_prometheus_scrape(prometheus_metrics_container_t** container);
+pgexporter_prometheus_scrape(prometheus_metrics_container_t** container, bool samples);
+
+/**
+ * Render a metrics container in the Prometheus text format.
+ *
+ * @param container The container
+ * @return The text, or NULL if there are no metrics; the caller must free it
+ */
+char*
+pgexporter_prometheus_container_to_string(prometheus_metrics_container_t* container);
+
+/**
+ * Add the structured samples of a metrics container to a bridge, without
+ * going through the exposition text. A sample takes the HELP and TYPE of
+ * its family, so the _bucket, _sum and _count series of a histogram are
+ * kept like when the text is parsed.
+ *
+ * @param container The container, recording samples
+ * @param bridge The bridge
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_prometheus_container_to_bridge(prometheus_metrics_container_t* container, struct prometheus_bridge* bridge);
+
+/**
+ * Get the current metrics into a bridge without going through the metrics
+ * endpoint. The published response is used while the metrics cache is valid,
+ * otherwise the servers are scraped and the result is published to the cache.
+ *
+ * @param bridge The bridge
+ * @return 0 on success, 1 on failure
+ */
+int
+pgexporter_prometheus_metrics_bridge(struct prometheus_bridge* bridge);
 
 /**
  * Destroy a metrics container
@@ -120,6 +188,29 @@ pgexporter_prometheus_iterator_value(struct art_iterator* iter, char** value);
 void
 pgexporter_prometheus(SSL* client_ssl, int fd);
 
+/**
+ * Serve the requests of a connection on the metrics port, and close it.
+ * The connection is kept alive according to metrics_keep_alive_timeout and
+ * metrics_keep_alive_requests. Used by the metrics workers, which serve
+ * many connections
+ * @param connection The connection, initialized with pgexporter_http_server_connection_init
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_prometheus_serve(struct http_server_connection* connection);
+
+/**
+ * Answer a request on the metrics port out of the cache, without blocking.
+ * Only a valid cache in the text format, or a 304 Not Modified, is answered;
+ * everything else needs a process of its own. The cache lock is tried once
+ * @param req The parsed request
+ * @param response Output: the complete response
+ * @param response_length Output: the length of the response
+ * @return 0 if the request was answered, otherwise 1
+ */
+int
+pgexporter_prometheus_cached(struct http_server_request* req, char** response, size_t* response_length);
+
 /**
  * Reset the counters and histograms
  */
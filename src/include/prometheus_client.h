@@ -59,6 +59,7 @@ struct prometheus_metric
    char* help;                /**< The HELP of the metric */
    char* type;                /**< The TYPE of the metric */
    struct deque* definitions; /**< The attributes of the metric - ValueRef<prometheus_attributes> */
+   bool changed;              /**< Has the metric changed since it was last rendered */
 };
 
 /**
@@ -69,6 +70,7 @@ struct prometheus_attributes
 {
    struct deque* attributes; /**< Each attribute - ValueRef<prometheus_attribute> */
    struct deque* values;     /**< The values - ValueRef<prometheus_value> */
+   time_t last_seen;         /**< When the series was last reported */
 };
 
 /**
@@ -116,6 +118,42 @@ pgexporter_prometheus_client_destroy_bridge(struct prometheus_bridge* bridge);
 int
 pgexporter_prometheus_client_get(int endpoint, struct prometheus_bridge* bridge);
 
+/**
+ * Parse metrics in the Prometheus text format into the bridge.
+ * The series don't get an endpoint attribute.
+ * @param body The metrics, which will be modified
+ * @param bridge The ART containing all bridge metrics.
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_prometheus_client_parse(char* body, struct prometheus_bridge* bridge);
+
+/**
+ * Add a series to the bridge. The series doesn't get an endpoint attribute.
+ * @param bridge The ART containing all bridge metrics.
+ * @param name The name of the metric
+ * @param help The HELP of the metric, or NULL
+ * @param type The TYPE of the metric, or NULL
+ * @param labels The labels in the Prometheus text format without braces, or NULL
+ * @param value The value
+ * @param timestamp The timestamp
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_prometheus_client_add(struct prometheus_bridge* bridge, char* name, char* help, char* type,
+                                 char* labels, char* value, time_t timestamp);
+
+/**
+ * Remove the series which haven't been reported since a point in time,
+ * and the metrics that end up without any series.
+ * Metrics that lose a series are marked as changed.
+ * @param bridge The bridge
+ * @param since The oldest timestamp to keep
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_prometheus_client_expire(struct prometheus_bridge* bridge, time_t since);
+
 #ifdef __cplusplus
 }
 #endif
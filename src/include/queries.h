@@ -103,6 +103,21 @@ pgexporter_open_connections(void);
 void
 pgexporter_close_connections(void);
 
+/**
+ * Forget which servers the scrape deadline cut short, at the start of a
+ * scrape. The state belongs to the process that runs the scrape
+ */
+void
+pgexporter_scrape_incomplete_reset(void);
+
+/**
+ * Did the scrape deadline cut the scrape of a server in this process short
+ * @param server The server
+ * @return true if so, otherwise false
+ */
+bool
+pgexporter_is_scrape_incomplete(int server);
+
 /**
  * Execute query
  * @param server The server
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_REMOTE_WRITE_H
+#define PGEXPORTER_REMOTE_WRITE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+#include <history.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * The default size of the remote write spool (in bytes)
+ */
+#define REMOTE_WRITE_DEFAULT_SPOOL_SIZE (64 * 1024 * 1024)
+
+/**
+ * The maximum number of remote write shards
+ */
+#define REMOTE_WRITE_MAX_SHARDS 16
+
+/**
+ * The number of attempts for a segment before it is left for the next flush
+ */
+#define REMOTE_WRITE_ATTEMPTS 3
+
+/**
+ * The interval at which the spool is sent to the endpoint (in ms)
+ */
+#define REMOTE_WRITE_FLUSH_INTERVAL_MS (5 * 1000)
+
+/**
+ * Split a remote write URL, such as https://host:9090/api/v1/write
+ * @param url The URL
+ * @param host The host
+ * @param host_size The size of the host buffer
+ * @param port The port
+ * @param secure Is TLS used
+ * @param path The path
+ * @param path_size The size of the path buffer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_parse_url(char* url, char* host, size_t host_size, int* port, bool* secure, char* path, size_t path_size);
+
+/**
+ * Encode the records of a shard as a protobuf WriteRequest
+ * @param records The records
+ * @param count The number of records
+ * @param shard The shard
+ * @param shards The number of shards
+ * @param buffer The encoded request
+ * @param size The size of the encoded request
+ * @param number_of_samples The number of encoded samples
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_encode(struct history_record* records, int count, int shard, int shards,
+                               void** buffer, size_t* size, int* number_of_samples);
+
+/**
+ * Append the records to the spool as one compressed segment per shard.
+ * The oldest segments are dropped when the spool exceeds remote_write_spool_size
+ * @param records The records
+ * @param count The number of records
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_spool(struct history_record* records, int count);
+
+/**
+ * Send the spooled segments to the remote write endpoint, one process per
+ * shard. Segments that could not be delivered stay in the spool
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_flush(void);
+
+/**
+ * Periodic callback that forks a sender for the spool unless one
+ * is still running
+ */
+void
+pgexporter_remote_write_tick_cb(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
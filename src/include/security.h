@@ -36,14 +36,153 @@ extern "C" {
 #include <pgexporter.h>
 #include <deque.h>
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include <openssl/sha.h>
 #include <openssl/ssl.h>
 
 /* Largest SCRAM-SHA-256 iteration count we accept; caps the PBKDF2 work a peer
  * can force on us. Well above PostgreSQL's default of 4096. */
 #define SCRAM_MAX_ITERATIONS 100000
 
+/* Number of SaltedPassword entries kept in the SCRAM cache */
+#define SCRAM_CACHE_ENTRIES 256
+
+/* Largest salt we cache; PostgreSQL uses 16 bytes */
+#define SCRAM_CACHE_MAX_SALT_LENGTH 64
+
+/** @struct scram_cache_entry
+ * A SCRAM-SHA-256 SaltedPassword for a (server, user, salt, iterations) tuple
+ */
+struct scram_cache_entry
+{
+   bool in_use;                                            /**< Is the entry in use */
+   char server[MISC_LENGTH];                               /**< The server name */
+   char username[MAX_USERNAME_LENGTH];                     /**< The user name */
+   unsigned char salt[SCRAM_CACHE_MAX_SALT_LENGTH];        /**< The salt */
+   int salt_length;                                        /**< The length of the salt */
+   int iterations;                                         /**< The iteration count */
+   unsigned char verifier[SHA256_DIGEST_LENGTH];           /**< HMAC-SHA-256 of the password under a per-boot secret */
+   unsigned char salted_password[SHA256_DIGEST_LENGTH];    /**< The SaltedPassword */
+   unsigned long last_used;                                /**< The tick of the last use */
+} __attribute__ ((aligned (64)));
+
+/** @struct scram_cache
+ * Shared cache of SCRAM-SHA-256 SaltedPasswords, so the PBKDF2 is
+ * only run once per (server, user, salt, iterations) instead of once
+ * per connection
+ */
+struct scram_cache
+{
+   atomic_schar lock;                                      /**< The lock */
+   atomic_ulong hits;                                      /**< The number of cache hits */
+   atomic_ulong misses;                                    /**< The number of cache misses */
+   unsigned long tick;                                     /**< The use counter */
+   struct scram_cache_entry entries[SCRAM_CACHE_ENTRIES];  /**< The entries */
+};
+
+/**
+ * Create and initialize the SCRAM cache shared memory
+ * @param p_size The resulting size
+ * @param p_shmem The resulting shared memory
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_scram_cache_init(size_t* p_size, void** p_shmem);
+
+/**
+ * Drop all SCRAM cache entries, f.ex. when the configuration is reloaded
+ */
+void
+pgexporter_scram_cache_reset(void);
+
+/**
+ * Get the SaltedPassword for a server login. The PBKDF2 is only run when
+ * the (server, user, salt, iterations) tuple isn't in the SCRAM cache;
+ * the cache is skipped when it is busy.
+ *
+ * @param server The server
+ * @param username The user name
+ * @param password The normalized password
+ * @param salt The salt
+ * @param salt_length The length of the salt
+ * @param iterations The iteration count
+ * @param result The resulting SaltedPassword
+ * @param result_length The length of the result
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_scram_salted_password(int server, char* username, char* password, char* salt, int salt_length, int iterations,
+                                 unsigned char** result, int* result_length);
+
+/* Number of client TLS sessions kept for resumption */
+#define TLS_SESSION_ENTRIES 64
+
+/* Largest serialized TLS session we keep; includes the peer certificate */
+#define TLS_SESSION_MAX_LENGTH 8192
+
+/** @struct tls_session_entry
+ * A serialized client TLS session for a peer
+ */
+struct tls_session_entry
+{
+   bool in_use;                                    /**< Is the entry in use */
+   char peer[MISC_LENGTH];                         /**< The peer key */
+   time_t expires;                                 /**< When the session can no longer be resumed */
+   unsigned long last_used;                        /**< The tick of the last use */
+   int length;                                     /**< The length of the session */
+   unsigned char data[TLS_SESSION_MAX_LENGTH];     /**< The DER encoded session */
+} __attribute__ ((aligned (64)));
+
+/** @struct tls_session_cache
+ * Shared cache of client TLS sessions, so a child can resume a session
+ * established by a sibling instead of doing a full handshake
+ */
+struct tls_session_cache
+{
+   atomic_schar lock;                                   /**< The lock */
+   atomic_ulong hits;                                   /**< The number of resumed handshakes */
+   atomic_ulong misses;                                 /**< The number of full handshakes */
+   unsigned long tick;                                  /**< The use counter */
+   struct tls_session_entry entries[TLS_SESSION_ENTRIES]; /**< The entries */
+};
+
+/**
+ * Create and initialize the TLS session cache shared memory
+ * @param p_size The resulting size
+ * @param p_shmem The resulting shared memory
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_tls_session_init(size_t* p_size, void** p_shmem);
+
+/**
+ * Drop all TLS sessions, f.ex. when the configuration is reloaded
+ */
+void
+pgexporter_tls_session_reset(void);
+
+/**
+ * Prepare a client connection for resumption. The cached session of the
+ * peer is offered, and new sessions from the peer are stored under its key.
+ * Must be called before SSL_connect
+ * @param ssl The SSL structure
+ * @param peer The peer key, f.ex. the host and port
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_tls_session_prepare(SSL* ssl, char* peer);
+
+/**
+ * Account a completed client handshake as resumed or full
+ * @param ssl The SSL structure
+ */
+void
+pgexporter_tls_session_account(SSL* ssl);
+
 /**
  * Authenticate a user
  * @param server The server
@@ -118,6 +257,15 @@ pgexporter_close_ssl(SSL* ssl);
 int
 pgexporter_extract_server_parameters(struct deque** server_parameters);
 
+/**
+ * Extract the BackendKeyData received during the latest authentication
+ * @param pid The process id of the backend
+ * @param secret The secret key of the backend
+ * @return 0 on success, otherwise 1
+ */
+int
+pgexporter_extract_backend_key(int* pid, int* secret);
+
 /**
  * Create a SSL context
  * @param client True if client, false if server
@@ -140,6 +288,29 @@ pgexporter_create_ssl_ctx(bool client, SSL_CTX** ctx);
 int
 pgexporter_create_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root, int socket, SSL** ssl);
 
+/**
+ * Load the certificate, private key and CA of a SSL server into a context
+ * @param ctx The SSL context
+ * @param key The key file path
+ * @param cert The certificate file path
+ * @param root The root file path
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_configure_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root);
+
+/**
+ * Create a SSL server connection from a context that is used for many
+ * connections. The connection takes its own reference on the context,
+ * which pgexporter_close_ssl releases
+ * @param ctx The configured SSL context
+ * @param socket The socket
+ * @param ssl The SSL structure
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_new_ssl_server(SSL_CTX* ctx, int socket, SSL** ssl);
+
 #ifdef __cplusplus
 }
 #endif
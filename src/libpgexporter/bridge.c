@@ -43,19 +43,21 @@
 #include <shmem.h>
 #include <stddef.h>
 #include <utils.h>
+#include <value.h>
 
 /* system */
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 #define CHUNK_SIZE                       32768
 #define DEFAULT_BLOCKING_TIMEOUT_SECONDS 30
 
-static int home_page(SSL* ssl, int fd);
-static int metrics_page(SSL* ssl, int fd);
+static int home_page(SSL* ssl, int fd, struct http_server_request* req);
+static int metrics_page(SSL* ssl, int fd, struct http_server_request* req);
 
 static bool is_bridge_cache_configured(void);
 static bool is_bridge_cache_valid(void);
@@ -69,7 +71,24 @@ static bool bridge_json_cache_set(char* data);
 static size_t bridge_json_cache_size_to_alloc(void);
 
 static void bridge_metrics(SSL* ssl, int client_fd);
-static int bridge_json_metrics(SSL* ssl, int fd);
+static int bridge_json_metrics(SSL* ssl, int fd, struct http_server_request* req);
+static char* bridge_render_metric(struct prometheus_metric* metric);
+
+static int bridge_poll(struct prometheus_bridge* bridge, struct art* fragments);
+static int bridge_keep_latest(struct prometheus_metric* metric);
+static int bridge_publish(char* text, char* json);
+static void bridge_fragment_destroy_cb(uintptr_t data);
+
+/**
+ * @struct bridge_fragment
+ * The rendered output of a single metric, kept by the poller
+ * so unchanged metrics are not rendered again
+ */
+struct bridge_fragment
+{
+   char* text; /**< The Prometheus text exposition */
+   char* json; /**< The JSON member */
+};
 
 static struct http_route bridge_routes[] = {
    {"/", home_page},
@@ -138,17 +157,22 @@ pgexporter_bridge_json(int client_fd)
 }
 
 static int
-home_page(SSL* ssl, int fd)
+home_page(SSL* ssl, int fd, struct http_server_request* req)
 {
    char* data = NULL;
    int status;
 
-   status = pgexporter_http_respond_chunked_start(ssl, fd, "text/html; charset=utf-8");
+   status = pgexporter_http_respond_chunked_start(ssl, fd, req, "text/html; charset=utf-8");
    if (status != MESSAGE_STATUS_OK)
    {
       goto error;
    }
 
+   if (req->head)
+   {
+      return 0;
+   }
+
    data = pgexporter_vappend(data, 13,
                              "<html>\n", "<head>\n",
                              "  <title>pgexporter: Bridge</title>\n",
@@ -179,11 +203,12 @@ error:
 }
 
 static int
-metrics_page(SSL* ssl, int fd)
+metrics_page(SSL* ssl, int fd, struct http_server_request* req)
 {
    time_t start_time;
    int dt;
    int status;
+   struct http_validators validators;
    struct prometheus_cache* cache;
    signed char cache_is_free;
    struct configuration* config;
@@ -204,14 +229,23 @@ retry_cache_locking:
          pgexporter_log_debug("Serving bridge out of cache (%d/%d bytes valid until %lld)",
                               strlen(cache->data), cache->size, cache->valid_until);
 
-         status = pgexporter_http_respond_chunked_start(ssl, fd, "text/plain; charset=utf-8");
+         pgexporter_cache_validators(cache, &validators);
+
+         if (pgexporter_http_server_not_modified(req, &validators))
+         {
+            status = pgexporter_http_respond_not_modified(ssl, fd, req, &validators);
+         }
+         else
+         {
+            status = pgexporter_http_respond_ok_validated(ssl, fd, req, "text/plain; version=0.0.1; charset=utf-8",
+                                                          cache->data, strlen(cache->data), &validators);
+         }
+
          if (status != MESSAGE_STATUS_OK)
          {
+            atomic_store(&cache->lock, STATE_FREE);
             goto error;
          }
-
-         pgexporter_http_respond_chunked_write(ssl, fd, cache->data);
-         pgexporter_http_respond_chunked_end(ssl, fd);
       }
       else
       {
@@ -219,15 +253,19 @@ retry_cache_locking:
 
          bridge_cache_invalidate();
 
-         status = pgexporter_http_respond_chunked_start(ssl, fd,
+         status = pgexporter_http_respond_chunked_start(ssl, fd, req,
                                                         "text/plain; version=0.0.1; charset=utf-8");
          if (status != MESSAGE_STATUS_OK)
          {
             goto error;
          }
 
-         bridge_metrics(ssl, fd);
-         pgexporter_http_respond_chunked_end(ssl, fd);
+         /* The endpoints are only scraped for a body */
+         if (!req->head)
+         {
+            bridge_metrics(ssl, fd);
+            pgexporter_http_respond_chunked_end(ssl, fd);
+         }
       }
 
       atomic_store(&cache->lock, STATE_FREE);
@@ -543,9 +581,12 @@ bridge_json_cache_set(char* data)
    if (strlen(data) < cache->size)
    {
       memcpy(cache->data, data, strlen(data));
+      pgexporter_cache_stamp(cache);
    }
    else
    {
+      cache->etag[0] = '\0';
+      cache->last_modified = 0;
       pgexporter_log_warn("Bridge/JSON: The data won't fit - %lld > %lld", strlen(data), cache->size);
    }
 
@@ -635,66 +676,13 @@ retry_cache_json_locking:
    while (pgexporter_art_iterator_next(metrics_iterator))
    {
       struct prometheus_metric* metric_data = (struct prometheus_metric*)metrics_iterator->value->data;
-      struct deque_iterator* definition_iterator = NULL;
 
-      data = pgexporter_append(data, "#HELP ");
-      data = pgexporter_append(data, metric_data->name);
-      data = pgexporter_append_char(data, ' ');
-      data = pgexporter_append(data, metric_data->help);
-      data = pgexporter_append_char(data, '\n');
-
-      data = pgexporter_append(data, "#TYPE ");
-      data = pgexporter_append(data, metric_data->name);
-      data = pgexporter_append_char(data, ' ');
-      data = pgexporter_append(data, metric_data->type);
-      data = pgexporter_append_char(data, '\n');
-
-      if (pgexporter_deque_iterator_create(metric_data->definitions, &definition_iterator))
+      data = bridge_render_metric(metric_data);
+      if (data == NULL)
       {
          goto error;
       }
 
-      while (pgexporter_deque_iterator_next(definition_iterator))
-      {
-         struct deque_iterator* attributes_iterator = NULL;
-         struct prometheus_attributes* attrs_data = (struct prometheus_attributes*)definition_iterator->value->data;
-         struct prometheus_value* value_data = NULL;
-
-         if (pgexporter_deque_iterator_create(attrs_data->attributes, &attributes_iterator))
-         {
-            goto error;
-         }
-
-         value_data = (struct prometheus_value*)pgexporter_deque_peek_last(attrs_data->values, NULL);
-
-         data = pgexporter_append(data, metric_data->name);
-         data = pgexporter_append_char(data, '{');
-
-         while (pgexporter_deque_iterator_next(attributes_iterator))
-         {
-            struct prometheus_attribute* attr_data = (struct prometheus_attribute*)attributes_iterator->value->data;
-
-            data = pgexporter_append(data, attr_data->key);
-            data = pgexporter_append(data, "=\"");
-            data = pgexporter_append(data, attr_data->value);
-            data = pgexporter_append_char(data, '\"');
-
-            if (pgexporter_deque_iterator_has_next(attributes_iterator))
-            {
-               data = pgexporter_append(data, ", ");
-            }
-         }
-
-         data = pgexporter_append(data, "} ");
-         data = pgexporter_append(data, value_data->value);
-
-         data = pgexporter_append_char(data, '\n');
-
-         pgexporter_deque_iterator_destroy(attributes_iterator);
-      }
-
-      data = pgexporter_append_char(data, '\n');
-
       if (is_bridge_cache_configured())
       {
          bridge_cache_append(data);
@@ -702,8 +690,6 @@ retry_cache_json_locking:
 
       pgexporter_http_respond_chunked_write(ssl, client_fd, data);
 
-      pgexporter_deque_iterator_destroy(definition_iterator);
-
       free(data);
       data = NULL;
    }
@@ -740,12 +726,100 @@ error:
    pgexporter_prometheus_client_destroy_bridge(bridge);
 }
 
+/**
+ * Render a metric in the Prometheus text format, using the
+ * latest value of each of its series.
+ *
+ * @param metric The metric
+ * @return The text, or NULL on error
+ */
+static char*
+bridge_render_metric(struct prometheus_metric* metric)
+{
+   char* data = NULL;
+   struct deque_iterator* definition_iterator = NULL;
+   struct deque_iterator* attributes_iterator = NULL;
+
+   data = pgexporter_append(data, "#HELP ");
+   data = pgexporter_append(data, metric->name);
+   data = pgexporter_append_char(data, ' ');
+   data = pgexporter_append(data, metric->help);
+   data = pgexporter_append_char(data, '\n');
+
+   data = pgexporter_append(data, "#TYPE ");
+   data = pgexporter_append(data, metric->name);
+   data = pgexporter_append_char(data, ' ');
+   data = pgexporter_append(data, metric->type);
+   data = pgexporter_append_char(data, '\n');
+
+   if (pgexporter_deque_iterator_create(metric->definitions, &definition_iterator))
+   {
+      goto error;
+   }
+
+   while (pgexporter_deque_iterator_next(definition_iterator))
+   {
+      struct prometheus_attributes* attrs_data = (struct prometheus_attributes*)definition_iterator->value->data;
+      struct prometheus_value* value_data = NULL;
+
+      if (pgexporter_deque_iterator_create(attrs_data->attributes, &attributes_iterator))
+      {
+         goto error;
+      }
+
+      value_data = (struct prometheus_value*)pgexporter_deque_peek_last(attrs_data->values, NULL);
+
+      data = pgexporter_append(data, metric->name);
+      data = pgexporter_append_char(data, '{');
+
+      while (pgexporter_deque_iterator_next(attributes_iterator))
+      {
+         struct prometheus_attribute* attr_data = (struct prometheus_attribute*)attributes_iterator->value->data;
+
+         data = pgexporter_append(data, attr_data->key);
+         data = pgexporter_append(data, "=\"");
+         data = pgexporter_append(data, attr_data->value);
+         data = pgexporter_append_char(data, '\"');
+
+         if (pgexporter_deque_iterator_has_next(attributes_iterator))
+         {
+            data = pgexporter_append(data, ", ");
+         }
+      }
+
+      data = pgexporter_append(data, "} ");
+      data = pgexporter_append(data, value_data->value);
+
+      data = pgexporter_append_char(data, '\n');
+
+      pgexporter_deque_iterator_destroy(attributes_iterator);
+      attributes_iterator = NULL;
+   }
+
+   data = pgexporter_append_char(data, '\n');
+
+   pgexporter_deque_iterator_destroy(definition_iterator);
+
+   return data;
+
+error:
+
+   pgexporter_deque_iterator_destroy(attributes_iterator);
+   pgexporter_deque_iterator_destroy(definition_iterator);
+
+   free(data);
+
+   return NULL;
+}
+
 static int
-bridge_json_metrics(SSL* ssl, int fd)
+bridge_json_metrics(SSL* ssl, int fd, struct http_server_request* req)
 {
    time_t start_time;
    int dt;
    int status;
+   char* json = NULL;
+   struct http_validators validators;
    struct prometheus_cache* cache;
    signed char cache_is_free;
    struct configuration* config = NULL;
@@ -771,24 +845,26 @@ retry_cache_locking:
          SLEEP_AND_GOTO(10000000L, retry_cache_locking);
       }
 
-      status = pgexporter_http_respond_chunked_start(ssl, fd, "text/plain; charset=utf-8");
-      if (status != MESSAGE_STATUS_OK)
-      {
-         goto error;
-      }
+      json = strlen(cache->data) > 0 ? cache->data : "{\n}\n";
+
+      pgexporter_cache_validators(cache, &validators);
 
-      if (strlen(cache->data) > 0)
+      if (pgexporter_http_server_not_modified(req, &validators))
       {
-         pgexporter_http_respond_chunked_write(ssl, fd, cache->data);
+         status = pgexporter_http_respond_not_modified(ssl, fd, req, &validators);
       }
       else
       {
-         pgexporter_http_respond_chunked_write(ssl, fd, "{\n}\n");
+         status = pgexporter_http_respond_ok_validated(ssl, fd, req, "text/plain; charset=utf-8",
+                                                       json, strlen(json), &validators);
       }
 
-      pgexporter_http_respond_chunked_end(ssl, fd);
-
       atomic_store(&cache->lock, STATE_FREE);
+
+      if (status != MESSAGE_STATUS_OK)
+      {
+         goto error;
+      }
    }
    else
    {
@@ -802,3 +878,428 @@ error:
    pgexporter_log_error("bridge_json_metrics: failed to serve response");
    return MESSAGE_STATUS_ERROR;
 }
+
+void
+pgexporter_bridge_poller(void)
+{
+   pid_t parent;
+   int64_t interval_ms;
+   struct timespec start;
+   struct timespec now;
+   struct prometheus_bridge* bridge = NULL;
+   struct art* fragments = NULL;
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+
+   parent = getppid();
+
+   if (pgexporter_prometheus_client_create_bridge(&bridge))
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_create(&fragments))
+   {
+      goto error;
+   }
+
+   pgexporter_log_debug("Bridge: poller started (pid %d)", getpid());
+
+   while (config->keep_running && getppid() == parent)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      if (bridge_poll(bridge, fragments))
+      {
+         pgexporter_log_warn("Bridge: poll failed");
+      }
+
+      interval_ms = pgexporter_time_convert(config->bridge_poll_interval, FORMAT_TIME_MS);
+      if (interval_ms <= 0)
+      {
+         break;
+      }
+
+      /* Sleep until the next poll in small steps, so we notice a shutdown */
+      while (config->keep_running && getppid() == parent)
+      {
+         int64_t elapsed_ms;
+
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         elapsed_ms = (int64_t)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+
+         if (elapsed_ms >= interval_ms)
+         {
+            break;
+         }
+
+         /* Sleep for 100ms */
+         SLEEP(100000000L);
+      }
+   }
+
+   pgexporter_log_debug("Bridge: poller stopped (pid %d)", getpid());
+
+   pgexporter_art_destroy(fragments);
+   pgexporter_prometheus_client_destroy_bridge(bridge);
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(0);
+
+error:
+
+   pgexporter_log_error("Bridge: poller could not be initialized");
+
+   pgexporter_art_destroy(fragments);
+   pgexporter_prometheus_client_destroy_bridge(bridge);
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(1);
+}
+
+/**
+ * Fetch all endpoints into the live bridge, render the metrics
+ * that changed and publish the result into the caches.
+ *
+ * @param bridge The live bridge
+ * @param fragments The rendered metrics
+ * @return 0 on success, otherwise 1
+ */
+static int
+bridge_poll(struct prometheus_bridge* bridge, struct art* fragments)
+{
+   time_t start_time;
+   int rendered = 0;
+   int total = 0;
+   char* text = NULL;
+   char* json = NULL;
+   struct art_iterator* metrics_iterator = NULL;
+   struct art_iterator* fragments_iterator = NULL;
+   struct deque* stale = NULL;
+   struct deque_iterator* stale_iterator = NULL;
+   struct value_config vc = {.destroy_data = &bridge_fragment_destroy_cb,
+                             .to_string = NULL};
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   start_time = time(NULL);
+
+   for (int i = 0; i < config->number_of_endpoints; i++)
+   {
+      if (pgexporter_prometheus_client_get(i, bridge))
+      {
+         pgexporter_log_debug("Bridge: no data from %s:%d",
+                              config->endpoints[i].host,
+                              config->endpoints[i].port);
+      }
+   }
+
+   /* A failed parse drops the whole tree */
+   if (bridge->metrics == NULL)
+   {
+      if (pgexporter_art_create(&bridge->metrics))
+      {
+         goto error;
+      }
+   }
+
+   /* Series that weren't reported in this round are gone */
+   if (pgexporter_prometheus_client_expire(bridge, start_time))
+   {
+      goto error;
+   }
+
+   /* Forget the fragments of metrics that are gone */
+   if (pgexporter_deque_create(false, &stale))
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_iterator_create(fragments, &fragments_iterator))
+   {
+      goto error;
+   }
+
+   while (pgexporter_art_iterator_next(fragments_iterator))
+   {
+      if (!pgexporter_art_contains_key(bridge->metrics, fragments_iterator->key))
+      {
+         pgexporter_deque_add(stale, NULL, (uintptr_t)fragments_iterator->key, ValueString);
+      }
+   }
+
+   pgexporter_art_iterator_destroy(fragments_iterator);
+   fragments_iterator = NULL;
+
+   if (pgexporter_deque_iterator_create(stale, &stale_iterator))
+   {
+      goto error;
+   }
+
+   while (pgexporter_deque_iterator_next(stale_iterator))
+   {
+      pgexporter_art_delete(fragments, (char*)stale_iterator->value->data);
+   }
+
+   pgexporter_deque_iterator_destroy(stale_iterator);
+   stale_iterator = NULL;
+
+   /* Render the changed metrics, and splice everything together */
+   if (pgexporter_art_iterator_create(bridge->metrics, &metrics_iterator))
+   {
+      goto error;
+   }
+
+   json = pgexporter_append(json, "{\n");
+
+   while (pgexporter_art_iterator_next(metrics_iterator))
+   {
+      struct prometheus_metric* metric = (struct prometheus_metric*)metrics_iterator->value->data;
+      struct bridge_fragment* fragment = NULL;
+
+      fragment = (struct bridge_fragment*)pgexporter_art_search(fragments, metrics_iterator->key);
+
+      if (fragment == NULL || metric->changed)
+      {
+         char* tag = NULL;
+         char* key = NULL;
+
+         /* Only the latest value is served, so don't let the live bridge grow */
+         if (bridge_keep_latest(metric))
+         {
+            goto error;
+         }
+
+         fragment = (struct bridge_fragment*)malloc(sizeof(struct bridge_fragment));
+         if (fragment == NULL)
+         {
+            goto error;
+         }
+
+         fragment->text = bridge_render_metric(metric);
+
+         key = pgexporter_escape_string(metrics_iterator->key);
+         tag = pgexporter_append_char(tag, '"');
+         tag = pgexporter_append(tag, key);
+         tag = pgexporter_append(tag, "\": ");
+         fragment->json = pgexporter_value_to_string(metrics_iterator->value, FORMAT_JSON, tag, INDENT_PER_LEVEL);
+         free(tag);
+         free(key);
+
+         if (fragment->text == NULL || fragment->json == NULL)
+         {
+            bridge_fragment_destroy_cb((uintptr_t)fragment);
+            goto error;
+         }
+
+         if (pgexporter_art_insert_with_config(fragments, metrics_iterator->key, (uintptr_t)fragment, &vc))
+         {
+            bridge_fragment_destroy_cb((uintptr_t)fragment);
+            goto error;
+         }
+
+         metric->changed = false;
+         rendered++;
+      }
+
+      if (total > 0)
+      {
+         json = pgexporter_append(json, ",\n");
+      }
+
+      text = pgexporter_append(text, fragment->text);
+      json = pgexporter_append(json, fragment->json);
+
+      total++;
+   }
+
+   if (total > 0)
+   {
+      json = pgexporter_append(json, "\n}");
+   }
+   else
+   {
+      free(json);
+      json = pgexporter_append(NULL, "{}");
+   }
+
+   pgexporter_log_trace("Bridge: rendered %d of %d metrics", rendered, total);
+
+   if (bridge_publish(text != NULL ? text : "", json))
+   {
+      goto error;
+   }
+
+   pgexporter_art_iterator_destroy(metrics_iterator);
+   pgexporter_deque_destroy(stale);
+
+   free(text);
+   free(json);
+
+   return 0;
+
+error:
+
+   pgexporter_art_iterator_destroy(metrics_iterator);
+   pgexporter_art_iterator_destroy(fragments_iterator);
+   pgexporter_deque_iterator_destroy(stale_iterator);
+   pgexporter_deque_destroy(stale);
+
+   free(text);
+   free(json);
+
+   return 1;
+}
+
+/**
+ * Drop all but the latest value of each series of a metric.
+ *
+ * @param metric The metric
+ * @return 0 on success, otherwise 1
+ */
+static int
+bridge_keep_latest(struct prometheus_metric* metric)
+{
+   struct deque_iterator* definition_iterator = NULL;
+
+   if (pgexporter_deque_iterator_create(metric->definitions, &definition_iterator))
+   {
+      return 1;
+   }
+
+   while (pgexporter_deque_iterator_next(definition_iterator))
+   {
+      struct prometheus_attributes* attrs = (struct prometheus_attributes*)definition_iterator->value->data;
+
+      while (pgexporter_deque_size(attrs->values) > 1)
+      {
+         struct prometheus_value* v = (struct prometheus_value*)pgexporter_deque_poll(attrs->values, NULL);
+
+         free(v->value);
+         free(v);
+      }
+   }
+
+   pgexporter_deque_iterator_destroy(definition_iterator);
+
+   return 0;
+}
+
+/**
+ * Replace the content of the bridge caches.
+ *
+ * The text cache is kept valid for at least two poll intervals,
+ * so a slow round doesn't make requests fall back to a fresh fetch.
+ *
+ * @param text The Prometheus text exposition
+ * @param json The JSON representation
+ * @return 0 on success, otherwise 1
+ */
+static int
+bridge_publish(char* text, char* json)
+{
+   time_t start_time;
+   int dt;
+   int timeout;
+   signed char cache_is_free;
+   pgexporter_time_t max_age;
+   struct prometheus_cache* cache;
+   struct prometheus_cache* cache_json;
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+   cache = (struct prometheus_cache*)bridge_cache_shmem;
+   cache_json = (struct prometheus_cache*)bridge_json_cache_shmem;
+
+   timeout = pgexporter_time_convert(config->blocking_timeout, FORMAT_TIME_S) > 0 ? pgexporter_time_convert(config->blocking_timeout, FORMAT_TIME_S) : DEFAULT_BLOCKING_TIMEOUT_SECONDS;
+
+   start_time = time(NULL);
+
+   if (is_bridge_cache_configured())
+   {
+retry_cache_locking:
+      cache_is_free = STATE_FREE;
+      if (!atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+      {
+         dt = (int)difftime(time(NULL), start_time);
+         if (dt >= timeout)
+         {
+            goto error;
+         }
+
+         /* Sleep for 10ms */
+         SLEEP_AND_GOTO(10000000L, retry_cache_locking);
+      }
+
+      max_age = config->bridge_cache_max_age;
+      if (max_age.ms < 2 * config->bridge_poll_interval.ms)
+      {
+         max_age = PGEXPORTER_TIME_MS(2 * config->bridge_poll_interval.ms);
+      }
+
+      bridge_cache_invalidate();
+
+      if (bridge_cache_append(text))
+      {
+         pgexporter_cache_finalize(cache, max_age);
+      }
+      else
+      {
+         pgexporter_log_warn("Bridge: the metrics won't fit in the cache (%zu bytes)", strlen(text));
+      }
+
+      atomic_store(&cache->lock, STATE_FREE);
+   }
+
+   if (is_bridge_json_cache_configured() && cache_json != NULL)
+   {
+retry_cache_json_locking:
+      cache_is_free = STATE_FREE;
+      if (!atomic_compare_exchange_strong(&cache_json->lock, &cache_is_free, STATE_IN_USE))
+      {
+         dt = (int)difftime(time(NULL), start_time);
+         if (dt >= timeout)
+         {
+            goto error;
+         }
+
+         /* Sleep for 10ms */
+         SLEEP_AND_GOTO(10000000L, retry_cache_json_locking);
+      }
+
+      bridge_json_cache_set(json);
+
+      atomic_store(&cache_json->lock, STATE_FREE);
+   }
+
+   return 0;
+
+error:
+
+   pgexporter_log_warn("Bridge: could not lock the cache to publish the metrics");
+
+   return 1;
+}
+
+static void
+bridge_fragment_destroy_cb(uintptr_t data)
+{
+   struct bridge_fragment* fragment = NULL;
+
+   fragment = (struct bridge_fragment*)data;
+
+   if (fragment != NULL)
+   {
+      free(fragment->text);
+      free(fragment->json);
+   }
+
+   free(fragment);
+}
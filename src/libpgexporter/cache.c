@@ -36,6 +36,7 @@
 /* system */
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -96,6 +97,9 @@ pgexporter_cache_invalidate(struct prometheus_cache* cache)
 
    memset(cache->data, 0, cache->size);
    cache->valid_until = 0;
+   cache->last_modified = 0;
+   cache->etag[0] = '\0';
+   cache->overflow = false;
 }
 
 bool
@@ -104,7 +108,7 @@ pgexporter_cache_append(struct prometheus_cache* cache, char* data)
    size_t origin_length = 0;
    size_t append_length = 0;
 
-   if (cache == NULL || data == NULL)
+   if (cache == NULL || data == NULL || cache->overflow)
    {
       return false;
    }
@@ -119,6 +123,7 @@ pgexporter_cache_append(struct prometheus_cache* cache, char* data)
                            cache->size,
                            origin_length);
       pgexporter_cache_invalidate(cache);
+      cache->overflow = true;
       return false;
    }
 
@@ -133,7 +138,7 @@ pgexporter_cache_finalize(struct prometheus_cache* cache, pgexporter_time_t max_
 {
    time_t now;
 
-   if (cache == NULL)
+   if (cache == NULL || cache->overflow)
    {
       return false;
    }
@@ -141,5 +146,51 @@ pgexporter_cache_finalize(struct prometheus_cache* cache, pgexporter_time_t max_
    now = time(NULL);
    cache->valid_until = now + pgexporter_time_convert(max_age, FORMAT_TIME_S);
 
+   pgexporter_cache_stamp(cache);
+
    return cache->valid_until > now;
 }
+
+void
+pgexporter_cache_stamp(struct prometheus_cache* cache)
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   /* FNV-1a */
+   for (char* p = cache->data; *p != '\0'; p++)
+   {
+      hash ^= (unsigned char)*p;
+      hash *= 1099511628211ULL;
+   }
+
+   pgexporter_snprintf(cache->etag, sizeof(cache->etag), "\"%016llx\"", (unsigned long long)hash);
+
+   /* A payload that did not change was not modified either */
+   if (cache->stamped == 0 || cache->hash != hash)
+   {
+      cache->hash = hash;
+      cache->stamped = time(NULL);
+   }
+
+   cache->last_modified = cache->stamped;
+}
+
+void
+pgexporter_cache_validators(struct prometheus_cache* cache, struct http_validators* validators)
+{
+   memset(validators, 0, sizeof(struct http_validators));
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   pgexporter_snprintf(validators->etag, sizeof(validators->etag), "%s", cache->etag);
+   validators->last_modified = cache->last_modified;
+   validators->expires = cache->valid_until;
+}
@@ -33,12 +33,14 @@
 #include <configuration.h>
 #include <json.h>
 #include <ext_query_alts.h>
+#include <history.h>
 #include <logging.h>
 #include <management.h>
 #include <memory.h>
 #include <network.h>
 #include <pg_query_alts.h>
 #include <prometheus.h>
+#include <remote_write.h>
 #include <security.h>
 #include <shmem.h>
 #include <utils.h>
@@ -133,6 +135,11 @@ pgexporter_init_configuration(void* shm)
 
    config->metrics = -1;
    config->metrics_query_timeout = PGEXPORTER_TIME_DISABLED;
+   config->metrics_scrape_timeout = PGEXPORTER_TIME_DISABLED;
+   config->metrics_workers = 0;
+   config->metrics_keep_alive_timeout = PGEXPORTER_TIME_SEC(60);
+   config->metrics_keep_alive_requests = 100;
+   config->metrics_event_loop = false;
    config->cache = true;
    config->alerts_enabled = false;
    config->number_of_metric_names = 0;
@@ -143,8 +150,15 @@ pgexporter_init_configuration(void* shm)
    config->history = -1;
    config->history_interval = PGEXPORTER_TIME_DISABLED;
    config->history_retention = PGEXPORTER_TIME_DISABLED;
+   config->history_raw_retention = PGEXPORTER_TIME_DISABLED;
+   config->history_minute_retention = PGEXPORTER_TIME_DISABLED;
    config->history_backend = HISTORY_BACKEND_SQLITE;
    memset(config->history_path, 0, MAX_PATH);
+   config->history_queue_size = HISTORY_DEFAULT_QUEUE_SIZE;
+   memset(config->remote_write_url, 0, MAX_PATH);
+   config->remote_write_shards = 1;
+   memset(config->remote_write_spool, 0, MAX_PATH);
+   config->remote_write_spool_size = REMOTE_WRITE_DEFAULT_SPOOL_SIZE;
    memset(config->history_cert_file, 0, MAX_PATH);
    memset(config->history_key_file, 0, MAX_PATH);
    memset(config->history_ca_file, 0, MAX_PATH);
@@ -152,6 +166,7 @@ pgexporter_init_configuration(void* shm)
    config->bridge = -1;
    config->bridge_cache_max_age = PGEXPORTER_TIME_SEC(300);
    config->bridge_cache_max_size = PROMETHEUS_DEFAULT_BRIDGE_CACHE_SIZE;
+   config->bridge_poll_interval = PGEXPORTER_TIME_DISABLED;
    config->bridge_json = -1;
    config->bridge_json_cache_max_size = PROMETHEUS_DEFAULT_BRIDGE_JSON_CACHE_SIZE;
    config->bridge_history = -1;
@@ -183,6 +198,7 @@ pgexporter_init_configuration(void* shm)
    config->log_type = PGEXPORTER_LOGGING_TYPE_CONSOLE;
    config->log_level = PGEXPORTER_LOGGING_LEVEL_INFO;
    config->log_mode = PGEXPORTER_LOGGING_MODE_APPEND;
+   config->log_async = false;
    atomic_init(&config->log_lock, STATE_FREE);
 
    atomic_init(&config->logging_info, 0);
@@ -479,6 +495,76 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "metrics_scrape_timeout"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_milliseconds(value, &config->metrics_scrape_timeout, PGEXPORTER_TIME_DISABLED))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_workers"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->metrics_workers))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_keep_alive_timeout"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_milliseconds(value, &config->metrics_keep_alive_timeout, PGEXPORTER_TIME_SEC(60)))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_keep_alive_requests"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->metrics_keep_alive_requests))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_event_loop"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->metrics_event_loop))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "bridge"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -544,6 +630,20 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "bridge_poll_interval"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_milliseconds(value, &config->bridge_poll_interval, PGEXPORTER_TIME_DISABLED))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "bridge_json"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -651,6 +751,34 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "history_raw_retention"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_milliseconds(value, &config->history_raw_retention, PGEXPORTER_TIME_DISABLED))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "history_minute_retention"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_milliseconds(value, &config->history_minute_retention, PGEXPORTER_TIME_DISABLED))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "history_backend"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -682,6 +810,88 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "history_queue_size"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     long l = 0;
+
+                     if (as_bytes(value, &l, HISTORY_DEFAULT_QUEUE_SIZE))
+                     {
+                        unknown = true;
+                     }
+
+                     config->history_queue_size = (size_t)l;
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_url"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     max = strlen(value);
+                     if (max > MAX_PATH - 1)
+                     {
+                        max = MAX_PATH - 1;
+                     }
+                     memcpy(config->remote_write_url, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_shards"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->remote_write_shards))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_spool"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     max = strlen(value);
+                     if (max > MAX_PATH - 1)
+                     {
+                        max = MAX_PATH - 1;
+                     }
+                     memcpy(config->remote_write_spool, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_spool_size"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     long l = 0;
+
+                     if (as_bytes(value, &l, REMOTE_WRITE_DEFAULT_SPOOL_SIZE))
+                     {
+                        unknown = true;
+                     }
+
+                     config->remote_write_spool_size = (size_t)l;
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "history_cert_file"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -1171,6 +1381,20 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "log_async"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->log_async))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "unix_socket_dir"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -1527,6 +1751,21 @@ pgexporter_validate_configuration(void* shm)
       config->backlog = 16;
    }
 
+   if (config->metrics_workers < 0)
+   {
+      config->metrics_workers = 0;
+   }
+   else if (config->metrics_workers > MAX_METRICS_WORKERS)
+   {
+      pgexporter_log_warn("metrics_workers capped at %d", MAX_METRICS_WORKERS);
+      config->metrics_workers = MAX_METRICS_WORKERS;
+   }
+
+   if (config->metrics_keep_alive_requests < 1)
+   {
+      config->metrics_keep_alive_requests = 1;
+   }
+
    /* log_level is set to -1 by as_logging_level for invalid values */
    if (config->log_level < 0)
    {
@@ -1569,6 +1808,31 @@ pgexporter_validate_configuration(void* shm)
       return 1;
    }
 
+   if (strlen(config->remote_write_url) > 0)
+   {
+      char host[MISC_LENGTH];
+      char path[MAX_PATH];
+      int port;
+      bool secure;
+
+      if (pgexporter_remote_write_parse_url(config->remote_write_url, host, sizeof(host), &port, &secure, path, sizeof(path)))
+      {
+         pgexporter_log_fatal("pgexporter: Invalid remote_write_url %s", config->remote_write_url);
+         return 1;
+      }
+
+      if (config->remote_write_shards < 1 || config->remote_write_shards > REMOTE_WRITE_MAX_SHARDS)
+      {
+         pgexporter_log_fatal("pgexporter: remote_write_shards must be between 1 and %d", REMOTE_WRITE_MAX_SHARDS);
+         return 1;
+      }
+
+      if (config->history <= 0)
+      {
+         pgexporter_log_warn("pgexporter: remote_write_url requires history, no samples will be sent");
+      }
+   }
+
    if (strlen(config->metrics_cert_file) > 0)
    {
       if (!pgexporter_exists(config->metrics_cert_file))
@@ -1687,6 +1951,12 @@ pgexporter_validate_configuration(void* shm)
       config->metrics_query_timeout = PGEXPORTER_TIME_MS(50);
    }
 
+   if (pgexporter_time_is_valid(config->metrics_scrape_timeout) && pgexporter_time_convert(config->metrics_scrape_timeout, FORMAT_TIME_MS) < 100)
+   {
+      pgexporter_log_warn("metrics_scrape_timeout=%" PRId64 "ms is too low, using 100ms minimum", pgexporter_time_convert(config->metrics_scrape_timeout, FORMAT_TIME_MS));
+      config->metrics_scrape_timeout = PGEXPORTER_TIME_MS(100);
+   }
+
    validate_event_backend(config);
 
    return 0;
@@ -2369,6 +2639,16 @@ get_config_value_str(char* buf, size_t size, struct configuration* cfg, char* ke
       pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->metrics_cache_max_age, FORMAT_TIME_S));
    else if (!strcmp(key, "metrics_query_timeout"))
       pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->metrics_query_timeout, FORMAT_TIME_MS));
+   else if (!strcmp(key, "metrics_scrape_timeout"))
+      pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->metrics_scrape_timeout, FORMAT_TIME_MS));
+   else if (!strcmp(key, "metrics_workers"))
+      pgexporter_snprintf(buf, size, "%d", cfg->metrics_workers);
+   else if (!strcmp(key, "metrics_keep_alive_timeout"))
+      pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->metrics_keep_alive_timeout, FORMAT_TIME_S));
+   else if (!strcmp(key, "metrics_keep_alive_requests"))
+      pgexporter_snprintf(buf, size, "%d", cfg->metrics_keep_alive_requests);
+   else if (!strcmp(key, "metrics_event_loop"))
+      pgexporter_snprintf(buf, size, "%s", cfg->metrics_event_loop ? "true" : "false");
    else if (!strcmp(key, "metrics_path"))
       pgexporter_snprintf(buf, size, "%s", cfg->metrics_path);
    else if (!strcmp(key, "console"))
@@ -2389,6 +2669,8 @@ get_config_value_str(char* buf, size_t size, struct configuration* cfg, char* ke
       pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->log_rotation_age, FORMAT_TIME_S));
    else if (!strcmp(key, "log_mode"))
       to_log_mode(buf, cfg->log_mode);
+   else if (!strcmp(key, "log_async"))
+      pgexporter_snprintf(buf, size, "%s", cfg->log_async ? "true" : "false");
    else if (!strcmp(key, "cache"))
       pgexporter_snprintf(buf, size, "%s", cfg->cache ? "true" : "false");
    else if (!strcmp(key, "alerts_enabled"))
@@ -2401,10 +2683,24 @@ get_config_value_str(char* buf, size_t size, struct configuration* cfg, char* ke
       pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->history_interval, FORMAT_TIME_S));
    else if (!strcmp(key, "history_retention"))
       pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->history_retention, FORMAT_TIME_S));
+   else if (!strcmp(key, "history_raw_retention"))
+      pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->history_raw_retention, FORMAT_TIME_S));
+   else if (!strcmp(key, "history_minute_retention"))
+      pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->history_minute_retention, FORMAT_TIME_S));
    else if (!strcmp(key, "history_backend"))
       to_history_backend(buf, cfg->history_backend);
    else if (!strcmp(key, "history_path"))
       pgexporter_snprintf(buf, size, "%s", cfg->history_path);
+   else if (!strcmp(key, "history_queue_size"))
+      pgexporter_snprintf(buf, size, "%zu", cfg->history_queue_size);
+   else if (!strcmp(key, "remote_write_url"))
+      pgexporter_snprintf(buf, size, "%s", cfg->remote_write_url);
+   else if (!strcmp(key, "remote_write_shards"))
+      pgexporter_snprintf(buf, size, "%d", cfg->remote_write_shards);
+   else if (!strcmp(key, "remote_write_spool"))
+      pgexporter_snprintf(buf, size, "%s", cfg->remote_write_spool);
+   else if (!strcmp(key, "remote_write_spool_size"))
+      pgexporter_snprintf(buf, size, "%zu", cfg->remote_write_spool_size);
    else if (!strcmp(key, "bridge"))
       pgexporter_snprintf(buf, size, "%d", cfg->bridge);
    else if (!strcmp(key, "bridge_endpoints"))
@@ -2413,6 +2709,8 @@ get_config_value_str(char* buf, size_t size, struct configuration* cfg, char* ke
       pgexporter_snprintf(buf, size, "%zu", cfg->bridge_cache_max_size);
    else if (!strcmp(key, "bridge_cache_max_age"))
       pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->bridge_cache_max_age, FORMAT_TIME_S));
+   else if (!strcmp(key, "bridge_poll_interval"))
+      pgexporter_snprintf(buf, size, "%lld", (long long)pgexporter_time_convert(cfg->bridge_poll_interval, FORMAT_TIME_MS));
    else if (!strcmp(key, "bridge_json"))
       pgexporter_snprintf(buf, size, "%d", cfg->bridge_json);
    else if (!strcmp(key, "bridge_json_cache_max_size"))
@@ -2517,18 +2815,31 @@ copy_configuration_values(struct configuration* dst, struct configuration* src)
    dst->metrics_cache_max_age = src->metrics_cache_max_age;
    dst->metrics_cache_max_size = src->metrics_cache_max_size;
    dst->metrics_query_timeout = src->metrics_query_timeout;
+   dst->metrics_scrape_timeout = src->metrics_scrape_timeout;
+   dst->metrics_workers = src->metrics_workers;
+   dst->metrics_keep_alive_timeout = src->metrics_keep_alive_timeout;
+   dst->metrics_keep_alive_requests = src->metrics_keep_alive_requests;
+   dst->metrics_event_loop = src->metrics_event_loop;
    dst->management = src->management;
    dst->console = src->console;
 
    dst->history = src->history;
    dst->history_interval = src->history_interval;
    dst->history_retention = src->history_retention;
+   dst->history_raw_retention = src->history_raw_retention;
+   dst->history_minute_retention = src->history_minute_retention;
    dst->history_backend = src->history_backend;
    memcpy(dst->history_path, src->history_path, MAX_PATH);
+   dst->history_queue_size = src->history_queue_size;
+   memcpy(dst->remote_write_url, src->remote_write_url, MAX_PATH);
+   dst->remote_write_shards = src->remote_write_shards;
+   memcpy(dst->remote_write_spool, src->remote_write_spool, MAX_PATH);
+   dst->remote_write_spool_size = src->remote_write_spool_size;
 
    dst->bridge = src->bridge;
    dst->bridge_cache_max_age = src->bridge_cache_max_age;
    dst->bridge_cache_max_size = src->bridge_cache_max_size;
+   dst->bridge_poll_interval = src->bridge_poll_interval;
    dst->bridge_json = src->bridge_json;
    dst->bridge_json_cache_max_size = src->bridge_json_cache_max_size;
    dst->bridge_history = src->bridge_history;
@@ -2544,6 +2855,7 @@ copy_configuration_values(struct configuration* dst, struct configuration* src)
    dst->log_level = src->log_level;
    memcpy(dst->log_path, src->log_path, MISC_LENGTH);
    dst->log_mode = src->log_mode;
+   dst->log_async = src->log_async;
    dst->log_rotation_size = src->log_rotation_size;
    dst->log_rotation_age = src->log_rotation_age;
    memcpy(dst->log_line_prefix, src->log_line_prefix, MISC_LENGTH);
@@ -2887,6 +3199,46 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          }
          pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->metrics_query_timeout, FORMAT_TIME_MS), ValueInt64);
       }
+      else if (!strcmp(key, "metrics_scrape_timeout"))
+      {
+         if (as_milliseconds(config_value, &config->metrics_scrape_timeout, PGEXPORTER_TIME_DISABLED))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->metrics_scrape_timeout, FORMAT_TIME_MS), ValueInt64);
+      }
+      else if (!strcmp(key, "metrics_workers"))
+      {
+         if (as_int(config_value, &config->metrics_workers))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_workers, ValueInt32);
+      }
+      else if (!strcmp(key, "metrics_keep_alive_timeout"))
+      {
+         if (as_milliseconds(config_value, &config->metrics_keep_alive_timeout, PGEXPORTER_TIME_SEC(60)))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->metrics_keep_alive_timeout, FORMAT_TIME_S), ValueInt64);
+      }
+      else if (!strcmp(key, "metrics_keep_alive_requests"))
+      {
+         if (as_int(config_value, &config->metrics_keep_alive_requests))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_keep_alive_requests, ValueInt32);
+      }
+      else if (!strcmp(key, "metrics_event_loop"))
+      {
+         if (as_bool(config_value, &config->metrics_event_loop))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_event_loop, ValueBool);
+      }
       else if (!strcmp(key, "metrics_path"))
       {
          max = strlen(config_value);
@@ -2944,6 +3296,14 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          }
          pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->bridge_cache_max_age, FORMAT_TIME_S), ValueInt64);
       }
+      else if (!strcmp(key, "bridge_poll_interval"))
+      {
+         if (as_milliseconds(config_value, &config->bridge_poll_interval, PGEXPORTER_TIME_DISABLED))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->bridge_poll_interval, FORMAT_TIME_MS), ValueInt64);
+      }
       else if (!strcmp(key, "bridge_json"))
       {
          if (as_int(config_value, &config->bridge_json))
@@ -2992,6 +3352,22 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          }
          pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->history_retention, FORMAT_TIME_S), ValueInt64);
       }
+      else if (!strcmp(key, "history_raw_retention"))
+      {
+         if (as_milliseconds(config_value, &config->history_raw_retention, PGEXPORTER_TIME_DISABLED))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->history_raw_retention, FORMAT_TIME_S), ValueInt64);
+      }
+      else if (!strcmp(key, "history_minute_retention"))
+      {
+         if (as_milliseconds(config_value, &config->history_minute_retention, PGEXPORTER_TIME_DISABLED))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)pgexporter_time_convert(config->history_minute_retention, FORMAT_TIME_S), ValueInt64);
+      }
       else if (!strcmp(key, "history_backend"))
       {
          {
@@ -3018,6 +3394,62 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          config->history_path[max] = '\0';
          pgexporter_json_put(response, key, (uintptr_t)config->history_path, ValueString);
       }
+      else if (!strcmp(key, "history_queue_size"))
+      {
+         long l = 0;
+
+         if (as_bytes(config_value, &l, 0))
+         {
+            invalid_value = true;
+         }
+
+         config->history_queue_size = (size_t)l;
+
+         pgexporter_json_put(response, key, (uintptr_t)config->history_queue_size, ValueInt64);
+      }
+      else if (!strcmp(key, "remote_write_url"))
+      {
+         max = strlen(config_value);
+         if (max > MAX_PATH - 1)
+         {
+            max = MAX_PATH - 1;
+         }
+         memcpy(config->remote_write_url, config_value, max);
+         config->remote_write_url[max] = '\0';
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_url, ValueString);
+      }
+      else if (!strcmp(key, "remote_write_shards"))
+      {
+         if (as_int(config_value, &config->remote_write_shards))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_shards, ValueInt64);
+      }
+      else if (!strcmp(key, "remote_write_spool"))
+      {
+         max = strlen(config_value);
+         if (max > MAX_PATH - 1)
+         {
+            max = MAX_PATH - 1;
+         }
+         memcpy(config->remote_write_spool, config_value, max);
+         config->remote_write_spool[max] = '\0';
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_spool, ValueString);
+      }
+      else if (!strcmp(key, "remote_write_spool_size"))
+      {
+         long l = 0;
+
+         if (as_bytes(config_value, &l, 0))
+         {
+            invalid_value = true;
+         }
+
+         config->remote_write_spool_size = (size_t)l;
+
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_spool_size, ValueInt64);
+      }
       else if (!strcmp(key, "bridge_history"))
       {
          if (as_int(config_value, &config->bridge_history))
@@ -3344,6 +3776,14 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
             pgexporter_json_put(response, key, (uintptr_t)config->log_mode, ValueInt32);
          }
       }
+      else if (!strcmp(key, "log_async"))
+      {
+         if (as_bool(config_value, &config->log_async))
+         {
+            invalid_value = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->log_async, ValueBool);
+      }
       else if (!strcmp(key, "unix_socket_dir"))
       {
          max = strlen(config_value);
@@ -3599,6 +4039,11 @@ add_configuration_response(struct json* res)
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_AGE, config->metrics_cache_max_age, FORMAT_TIME_S);
    pgexporter_json_put_size_value(res, CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_SIZE, config->metrics_cache_max_size);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_METRICS_QUERY_TIMEOUT, config->metrics_query_timeout, FORMAT_TIME_MS);
+   pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_METRICS_SCRAPE_TIMEOUT, config->metrics_scrape_timeout, FORMAT_TIME_MS);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_WORKERS, (uintptr_t)config->metrics_workers, ValueInt32);
+   pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_METRICS_KEEP_ALIVE_TIMEOUT, config->metrics_keep_alive_timeout, FORMAT_TIME_S);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_KEEP_ALIVE_REQUESTS, (uintptr_t)config->metrics_keep_alive_requests, ValueInt32);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_EVENT_LOOP, (uintptr_t)config->metrics_event_loop, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE, (uintptr_t)config->bridge, ValueInt64);
 
    if (config->number_of_endpoints > 0)
@@ -3623,13 +4068,21 @@ add_configuration_response(struct json* res)
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_ENDPOINTS, (uintptr_t)data, ValueString);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_AGE, config->bridge_cache_max_age, FORMAT_TIME_S);
    pgexporter_json_put_size_value(res, CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_SIZE, config->bridge_cache_max_size);
+   pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_BRIDGE_POLL_INTERVAL, config->bridge_poll_interval, FORMAT_TIME_MS);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_JSON, (uintptr_t)config->bridge_json, ValueInt64);
    pgexporter_json_put_size_value(res, CONFIGURATION_ARGUMENT_BRIDGE_JSON_CACHE_MAX_SIZE, config->bridge_json_cache_max_size);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_HISTORY, (uintptr_t)config->history, ValueInt64);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_HISTORY_INTERVAL, config->history_interval, FORMAT_TIME_S);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_HISTORY_RETENTION, config->history_retention, FORMAT_TIME_S);
+   pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_HISTORY_RAW_RETENTION, config->history_raw_retention, FORMAT_TIME_S);
+   pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_HISTORY_MINUTE_RETENTION, config->history_minute_retention, FORMAT_TIME_S);
    pgexporter_json_put_enum_value(res, CONFIGURATION_ARGUMENT_HISTORY_BACKEND, config->history_backend, to_history_backend);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_HISTORY_PATH, (uintptr_t)config->history_path, ValueString);
+   pgexporter_json_put_size_value(res, CONFIGURATION_ARGUMENT_HISTORY_QUEUE_SIZE, config->history_queue_size);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_URL, (uintptr_t)config->remote_write_url, ValueString);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_SHARDS, (uintptr_t)config->remote_write_shards, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_SPOOL, (uintptr_t)config->remote_write_spool, ValueString);
+   pgexporter_json_put_size_value(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_SPOOL_SIZE, config->remote_write_spool_size);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_HISTORY, (uintptr_t)config->bridge_history, ValueInt64);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_BRIDGE_HISTORY_INTERVAL, config->bridge_history_interval, FORMAT_TIME_S);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_BRIDGE_HISTORY_RETENTION, config->bridge_history_retention, FORMAT_TIME_S);
@@ -3645,6 +4098,7 @@ add_configuration_response(struct json* res)
    pgexporter_json_put_size_value(res, CONFIGURATION_ARGUMENT_LOG_ROTATION_SIZE, config->log_rotation_size);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_LINE_PREFIX, (uintptr_t)config->log_line_prefix, ValueString);
    pgexporter_json_put_enum_value(res, CONFIGURATION_ARGUMENT_LOG_MODE, config->log_mode, to_log_mode);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_ASYNC, (uintptr_t)config->log_async, ValueBool);
    pgexporter_json_put_time_value(res, CONFIGURATION_ARGUMENT_BLOCKING_TIMEOUT, config->blocking_timeout, FORMAT_TIME_S);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_TLS, (uintptr_t)config->tls, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_TLS_CERT_FILE, (uintptr_t)config->tls_cert_file, ValueString);
@@ -4187,6 +4641,10 @@ as_history_backend(char* str)
    {
       return HISTORY_BACKEND_SQLITE;
    }
+   else if (!strcasecmp(str, "columnar"))
+   {
+      return HISTORY_BACKEND_COLUMNAR;
+   }
 
    return HISTORY_BACKEND_SQLITE;
 }
@@ -4783,6 +5241,10 @@ check_restart_required(struct configuration* config, struct configuration* reloa
    {
       restart = true;
    }
+   if (restart_int("history_queue_size", config->history_queue_size, reload->history_queue_size))
+   {
+      restart = true;
+   }
    if (restart_int("bridge", config->bridge, reload->bridge))
    {
       restart = true;
@@ -4801,6 +5263,10 @@ check_restart_required(struct configuration* config, struct configuration* reloa
    {
       restart = true;
    }
+   if (restart_int("log_async", config->log_async, reload->log_async))
+   {
+      restart = true;
+   }
 
    /* System configuration */
    if (restart_string("unix_socket_dir", config->unix_socket_dir, reload->unix_socket_dir))
@@ -4821,6 +5287,10 @@ check_restart_required(struct configuration* config, struct configuration* reloa
    }
 
    /* Cache infrastructure */
+   if (restart_int("metrics_workers", config->metrics_workers, reload->metrics_workers))
+   {
+      restart = true;
+   }
    if (restart_int("metrics_cache_max_size", config->metrics_cache_max_size, reload->metrics_cache_max_size))
    {
       restart = true;
@@ -4881,6 +5351,10 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->metrics_cache_max_age = reload->metrics_cache_max_age;
    config->metrics_cache_max_size = reload->metrics_cache_max_size;
    config->metrics_query_timeout = reload->metrics_query_timeout;
+   config->metrics_scrape_timeout = reload->metrics_scrape_timeout;
+   config->metrics_keep_alive_timeout = reload->metrics_keep_alive_timeout;
+   config->metrics_keep_alive_requests = reload->metrics_keep_alive_requests;
+   config->metrics_event_loop = reload->metrics_event_loop;
    config->console = reload->console;
    config->management = reload->management;
 
@@ -4927,6 +5401,7 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
 
    config->bridge_cache_max_age = reload->bridge_cache_max_age;
    config->bridge_cache_max_size = reload->bridge_cache_max_size;
+   config->bridge_poll_interval = reload->bridge_poll_interval;
    config->bridge_json = reload->bridge_json;
    config->bridge_json_cache_max_size = reload->bridge_json_cache_max_size;
 
@@ -4934,8 +5409,15 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->history = reload->history;
    config->history_interval = reload->history_interval;
    config->history_retention = reload->history_retention;
+   config->history_raw_retention = reload->history_raw_retention;
+   config->history_minute_retention = reload->history_minute_retention;
    config->history_backend = reload->history_backend;
    memcpy(config->history_path, reload->history_path, MAX_PATH);
+   config->history_queue_size = reload->history_queue_size;
+   memcpy(config->remote_write_url, reload->remote_write_url, MAX_PATH);
+   config->remote_write_shards = reload->remote_write_shards;
+   memcpy(config->remote_write_spool, reload->remote_write_spool, MAX_PATH);
+   config->remote_write_spool_size = reload->remote_write_spool_size;
 
    /* Bridge history */
    config->bridge_history = reload->bridge_history;
@@ -4966,6 +5448,7 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
       memcpy(config->log_line_prefix, reload->log_line_prefix, MISC_LENGTH);
       memcpy(config->log_path, reload->log_path, MISC_LENGTH);
       pgexporter_start_logging();
+      pgexporter_log_writer_reopen();
    }
 
    /* TLS - changes apply to new connections immediately */
@@ -5433,6 +5916,9 @@ to_history_backend(char* where, int value)
       case HISTORY_BACKEND_SQLITE:
          pgexporter_snprintf(where, MISC_LENGTH, "%s", "sqlite");
          break;
+      case HISTORY_BACKEND_COLUMNAR:
+         pgexporter_snprintf(where, MISC_LENGTH, "%s", "columnar");
+         break;
       default:
          return 1;
    }
@@ -37,6 +37,7 @@
 #include <prometheus_client.h>
 #include <management.h>
 #include <message.h>
+#include <prometheus.h>
 #include <security.h>
 #include <utils.h>
 
@@ -140,6 +141,10 @@ struct category_candidate
 #define CATEGORY_CANDIDATE_INITIAL_CAP 16
 #define CATEGORY_SELECT_INITIAL_CAP    16
 
+/* FNV-1a */
+#define CATEGORIES_HASH_SEED  14695981039346656037ULL
+#define CATEGORIES_HASH_PRIME 1099511628211ULL
+
 static int build_categories_from_bridge(struct prometheus_bridge* bridge, struct console_page* console);
 static int record_prefix_counts(const char* metric_name, struct prefix_count** counts, int* size, int* capacity);
 static int add_or_increment_prefix(struct prefix_count** counts, int* size, int* capacity, const char* prefix);
@@ -148,6 +153,9 @@ static int build_category_candidates(struct prefix_count* counts, int size, stru
 static int compare_candidates_by_score(const void* a, const void* b);
 static char** select_global_categories(struct category_candidate* candidates, int candidate_count, int* selected_count);
 static char* find_best_category(const char* metric_name, char** categories, int category_count);
+static uint64_t categories_hash_name(uint64_t hash, const char* name);
+static char** categories_cache_get(uint64_t hash, int* count);
+static void categories_cache_set(uint64_t hash, char** categories, int count);
 static char* extract_category_prefix(char* metric_name);
 static char* fallback_category_from_last_underscore(char* metric_name);
 static struct console_category* find_or_create_category(struct console_page* console, char* category_name);
@@ -158,8 +166,8 @@ static int collect_simple_label_columns(struct console_category* category, char*
 static const char* find_metric_label_value(struct console_metric* metric, const char* key);
 static char* generate_metrics_table(struct console_category* category);
 static char* generate_category_tabs(struct console_page* console);
-static int home_page(SSL* client_ssl, int client_fd);
-static int api_page(SSL* client_ssl, int client_fd);
+static int home_page(SSL* client_ssl, int client_fd, struct http_server_request* req);
+static int api_page(SSL* client_ssl, int client_fd, struct http_server_request* req);
 static int console_init(int endpoint, const char* brand_name, const char* metric_prefix, struct console_page** result);
 static int console_refresh_metrics(int endpoint, struct console_page* console);
 static int console_refresh_status(struct console_page* console);
@@ -233,7 +241,7 @@ error:
 }
 
 static int
-home_page(SSL* client_ssl, int client_fd)
+home_page(SSL* client_ssl, int client_fd, struct http_server_request* req)
 {
    struct console_page* console = NULL;
    char* html = NULL;
@@ -254,7 +262,7 @@ home_page(SSL* client_ssl, int client_fd)
       goto done;
    }
 
-   status = pgexporter_http_respond_ok(client_ssl, client_fd, "text/html; charset=utf-8", html, html_size);
+   status = pgexporter_http_respond_ok(client_ssl, client_fd, req, "text/html; charset=utf-8", html, html_size);
 
 done:
    if (status != MESSAGE_STATUS_OK)
@@ -271,7 +279,7 @@ done:
 }
 
 static int
-api_page(SSL* client_ssl, int client_fd)
+api_page(SSL* client_ssl, int client_fd, struct http_server_request* req)
 {
    struct console_page* console = NULL;
    char* json = NULL;
@@ -292,7 +300,7 @@ api_page(SSL* client_ssl, int client_fd)
       goto done;
    }
 
-   status = pgexporter_http_respond_ok(client_ssl, client_fd, "application/json; charset=utf-8", json, json_size);
+   status = pgexporter_http_respond_ok(client_ssl, client_fd, req, "application/json; charset=utf-8", json, json_size);
 
 done:
    if (status != MESSAGE_STATUS_OK)
@@ -313,7 +321,6 @@ console_refresh_metrics(int endpoint, struct console_page* console)
 {
    struct prometheus_bridge* bridge = NULL;
    struct configuration* config = NULL;
-   int effective_endpoint = endpoint;
 
    if (console == NULL)
    {
@@ -322,27 +329,6 @@ console_refresh_metrics(int endpoint, struct console_page* console)
    }
 
    config = (struct configuration*)shmem;
-   if (config != NULL)
-   {
-      if (config->number_of_endpoints <= 0 || effective_endpoint >= config->number_of_endpoints || config->endpoints[effective_endpoint].port == 0)
-      {
-         if (config->metrics > 0)
-         {
-            effective_endpoint = 0;
-            config->number_of_endpoints = 1;
-            /* Use loopback if host is wildcard/empty */
-            const char* h = (strlen(config->host) == 0 || strcmp(config->host, "*") == 0 || strcmp(config->host, "0.0.0.0") == 0) ? "127.0.0.1" : config->host;
-            strncpy(config->endpoints[0].host, h, MISC_LENGTH - 1);
-            config->endpoints[0].host[MISC_LENGTH - 1] = '\0';
-            config->endpoints[0].port = config->metrics;
-         }
-         else
-         {
-            pgexporter_log_error("No Prometheus endpoint configured and metrics listener disabled");
-            goto error;
-         }
-      }
-   }
 
    if (pgexporter_prometheus_client_create_bridge(&bridge))
    {
@@ -350,9 +336,26 @@ console_refresh_metrics(int endpoint, struct console_page* console)
       goto error;
    }
 
-   if (pgexporter_prometheus_client_get(effective_endpoint, bridge))
+   if (config->metrics > 0)
+   {
+      /* Read the local metrics directly instead of going through our own port */
+      if (pgexporter_prometheus_metrics_bridge(bridge))
+      {
+         pgexporter_log_error("Failed to get the local metrics");
+         goto error;
+      }
+   }
+   else if (endpoint >= 0 && endpoint < config->number_of_endpoints && config->endpoints[endpoint].port != 0)
    {
-      pgexporter_log_error("Failed to fetch metrics from endpoint %d", effective_endpoint);
+      if (pgexporter_prometheus_client_get(endpoint, bridge))
+      {
+         pgexporter_log_error("Failed to fetch metrics from endpoint %d", endpoint);
+         goto error;
+      }
+   }
+   else
+   {
+      pgexporter_log_error("No Prometheus endpoint configured and metrics listener disabled");
       goto error;
    }
 
@@ -899,6 +902,7 @@ build_categories_from_bridge(struct prometheus_bridge* bridge, struct console_pa
    int candidate_count = 0;
    char** selected_categories = NULL;
    int selected_count = 0;
+   uint64_t names_hash = CATEGORIES_HASH_SEED;
 
    int status = 0;
 
@@ -951,29 +955,49 @@ build_categories_from_bridge(struct prometheus_bridge* bridge, struct console_pa
 
       metrics[metric_count++] = prom_metric;
 
-      if (record_prefix_counts(base_name, &prefix_counts, &prefix_count_size, &prefix_count_capacity))
-      {
-         pgexporter_log_error("Failed to record prefix counts");
-         status = 1;
-         goto error;
-      }
+      names_hash = categories_hash_name(names_hash, base_name);
    }
 
    pgexporter_art_iterator_destroy(iter);
    iter = NULL;
 
-   /* Build and rank category candidates globally */
-   if (build_category_candidates(prefix_counts, prefix_count_size, &candidates, &candidate_count))
-   {
-      pgexporter_log_error("Failed to build category candidates");
-      status = 1;
-      goto error;
-   }
+   /* The categories only depend on the metric names, so reuse the last selection */
+   selected_categories = categories_cache_get(names_hash, &selected_count);
 
-   selected_categories = select_global_categories(candidates, candidate_count, &selected_count);
    if (selected_categories == NULL)
    {
-      pgexporter_log_warn("No categories selected, using fallback");
+      for (int i = 0; i < metric_count; i++)
+      {
+         const char* base_name = metrics[i]->name;
+
+         if (strncmp(base_name, "pgexporter_", strlen("pgexporter_")) == 0)
+         {
+            base_name = base_name + strlen("pgexporter_");
+         }
+
+         if (record_prefix_counts(base_name, &prefix_counts, &prefix_count_size, &prefix_count_capacity))
+         {
+            pgexporter_log_error("Failed to record prefix counts");
+            status = 1;
+            goto error;
+         }
+      }
+
+      /* Build and rank category candidates globally */
+      if (build_category_candidates(prefix_counts, prefix_count_size, &candidates, &candidate_count))
+      {
+         pgexporter_log_error("Failed to build category candidates");
+         status = 1;
+         goto error;
+      }
+
+      selected_categories = select_global_categories(candidates, candidate_count, &selected_count);
+      if (selected_categories == NULL)
+      {
+         pgexporter_log_warn("No categories selected, using fallback");
+      }
+
+      categories_cache_set(names_hash, selected_categories, selected_count);
    }
 
    /* assign metrics to selected categories */
@@ -1665,6 +1689,103 @@ find_best_category(const char* metric_name, char** categories, int category_coun
    return best != NULL ? strdup(best) : NULL;
 }
 
+/**
+ * Helper: Add a metric name to the hash of the metric names
+ */
+static uint64_t
+categories_hash_name(uint64_t hash, const char* name)
+{
+   for (const unsigned char* p = (const unsigned char*)name; *p != '\0'; p++)
+   {
+      hash ^= *p;
+      hash *= CATEGORIES_HASH_PRIME;
+   }
+
+   /* Separator, so "a_b" + "c" differs from "a" + "b_c" */
+   hash ^= 0xff;
+   hash *= CATEGORIES_HASH_PRIME;
+
+   return hash;
+}
+
+/**
+ * Helper: Get the categories selected the last time for the same metric names
+ */
+static char**
+categories_cache_get(uint64_t hash, int* count)
+{
+   char** categories = NULL;
+   signed char cache_is_free = STATE_FREE;
+   struct configuration* config = (struct configuration*)shmem;
+
+   *count = 0;
+
+   /* Don't wait for the lock, just select the categories again */
+   if (!atomic_compare_exchange_strong(&config->console_categories_lock, &cache_is_free, STATE_IN_USE))
+   {
+      return NULL;
+   }
+
+   if (config->console_categories_hash == hash && config->number_of_console_categories > 0)
+   {
+      categories = (char**)malloc(config->number_of_console_categories * sizeof(char*));
+
+      if (categories != NULL)
+      {
+         for (int i = 0; i < config->number_of_console_categories; i++)
+         {
+            categories[i] = strdup(config->console_categories[i]);
+         }
+
+         *count = config->number_of_console_categories;
+      }
+   }
+
+   atomic_store(&config->console_categories_lock, STATE_FREE);
+
+   return categories;
+}
+
+/**
+ * Helper: Remember the categories selected for the metric names
+ */
+static void
+categories_cache_set(uint64_t hash, char** categories, int count)
+{
+   signed char cache_is_free = STATE_FREE;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (categories == NULL || count <= 0 || count > NUMBER_OF_CONSOLE_CATEGORIES)
+   {
+      return;
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      if (strlen(categories[i]) >= MISC_LENGTH)
+      {
+         return;
+      }
+   }
+
+   if (!atomic_compare_exchange_strong(&config->console_categories_lock, &cache_is_free, STATE_IN_USE))
+   {
+      return;
+   }
+
+   memset(config->console_categories, 0, sizeof(config->console_categories));
+
+   for (int i = 0; i < count; i++)
+   {
+      memcpy(config->console_categories[i], categories[i], strlen(categories[i]));
+   }
+
+   config->number_of_console_categories = count;
+   config->console_categories_hash = hash;
+
+   atomic_store(&config->console_categories_lock, STATE_FREE);
+}
+
 /**
  * Helper: Generate HTML table for metrics in a category
  */
@@ -53,6 +53,10 @@
 #if HAVE_LINUX
 #if HAVE_IO_URING
 #include <liburing.h>
+
+/* The user data of an I/O request carries the generation of its watcher above the pointer */
+#define IO_URING_DATA_GENERATION_SHIFT 48
+#define IO_URING_DATA_POINTER_MASK     ((1ULL << IO_URING_DATA_GENERATION_SHIFT) - 1)
 #endif
 #include <netdb.h>
 #include <sys/epoll.h>
@@ -86,6 +90,8 @@ static int ev_io_uring_destroy(void);
 static int ev_io_uring_loop(void);
 static int ev_io_uring_fork(void);
 static int ev_io_uring_handler(struct io_uring_cqe*);
+static bool is_registered(event_watcher_t* watcher);
+static uint64_t watcher_data(event_watcher_t* watcher);
 #if EXPERIMENTAL_FEATURE_RECV_MULTISHOT_ENABLED
 static int ev_io_uring_setup_buffers(void);
 #endif /* EXPERIMENTAL_FEATURE_RECV_MULTISHOT_ENABLED */
@@ -813,8 +819,8 @@ ev_io_uring_rearm_receive(struct event_loop* loop, struct io_watcher* watcher)
       pgexporter_log_error("io_uring: no SQE available for rearm");
       return;
    }
-   io_uring_sqe_set_data(sqe, watcher);
    io_uring_prep_recv_multishot(sqe, watcher->fds.worker.rcv_fd, NULL, 0, 0);
+   io_uring_sqe_set_data64(sqe, watcher_data((event_watcher_t*)watcher));
 }
 
 static int
@@ -899,7 +905,6 @@ ev_io_uring_io_start(struct io_watcher* watcher)
       return PGEXPORTER_EVENT_RC_ERROR;
    }
 
-   io_uring_sqe_set_data(sqe, watcher);
    switch (watcher->event_watcher.type)
    {
       case PGEXPORTER_EVENT_TYPE_MAIN:
@@ -921,6 +926,7 @@ ev_io_uring_io_start(struct io_watcher* watcher)
          pgexporter_log_fatal("unknown event type: %d", watcher->event_watcher.type);
          exit(1);
    }
+   io_uring_sqe_set_data64(sqe, watcher_data((event_watcher_t*)watcher));
    return PGEXPORTER_EVENT_RC_OK;
 }
 
@@ -951,10 +957,14 @@ ev_io_uring_io_stop(struct io_watcher* target)
       return PGEXPORTER_EVENT_RC_ERROR;
    }
 
-   io_uring_prep_cancel(sqe, (void*)target, 0);
+   io_uring_prep_cancel64(sqe, watcher_data((event_watcher_t*)target), 0);
 
    io_uring_submit_and_wait_timeout(&loop->ring_rcv, &cqe, 0, &ts, NULL);
 
+   /* A completion that is already queued belongs to the old connection of
+    * the watcher, which may be reused before the completion is seen */
+   target->generation++;
+
    return rc;
 }
 
@@ -1021,7 +1031,7 @@ retry:
 
    for (int i = 0; i < loop->events_nr; i++)
    {
-      io_uring_prep_cancel(sqe, (void*)(loop->events[i]), 0);
+      io_uring_prep_cancel64(sqe, watcher_data(loop->events[i]), 0);
       /* XXX: if used, delete event */
       to_wait++;
    }
@@ -1113,6 +1123,45 @@ ev_io_uring_fork(void)
    return 0;
 }
 
+/**
+ * Is a watcher still in the loop. A callback may stop and release its own
+ * watcher, in which case the watcher must not be rearmed
+ * @param watcher The watcher
+ * @return true if the watcher is registered, otherwise false
+ */
+static bool
+is_registered(event_watcher_t* watcher)
+{
+   for (int i = 0; i < loop->events_nr; i++)
+   {
+      if (loop->events[i] == watcher)
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * The user data of the requests of a watcher. An I/O watcher adds its
+ * generation, so completions from before it was stopped are told apart
+ * @param watcher The watcher
+ * @return The user data
+ */
+static uint64_t
+watcher_data(event_watcher_t* watcher)
+{
+   uint64_t data = (uint64_t)(uintptr_t)watcher;
+
+   if (watcher->type == PGEXPORTER_EVENT_TYPE_MAIN || watcher->type == PGEXPORTER_EVENT_TYPE_WORKER)
+   {
+      data |= (uint64_t)(((struct io_watcher*)watcher)->generation & 0xFFFF) << IO_URING_DATA_GENERATION_SHIFT;
+   }
+
+   return data;
+}
+
 static int
 ev_io_uring_handler(struct io_uring_cqe* cqe)
 {
@@ -1127,7 +1176,7 @@ ev_io_uring_handler(struct io_uring_cqe* cqe)
       return PGEXPORTER_EVENT_RC_OK;
    }
 
-   watcher = io_uring_cqe_get_data(cqe);
+   watcher = (event_watcher_t*)(uintptr_t)(io_uring_cqe_get_data64(cqe) & IO_URING_DATA_POINTER_MASK);
 
 #if EXPERIMENTAL_FEATURE_RECV_MULTISHOT_ENABLED
    loop->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
@@ -1154,6 +1203,12 @@ ev_io_uring_handler(struct io_uring_cqe* cqe)
       return PGEXPORTER_EVENT_RC_OK;
    }
 
+   if (io_uring_cqe_get_data64(cqe) != watcher_data(watcher))
+   {
+      pgexporter_log_trace("io_uring: dropping a completion of a stopped watcher, res=%d", cqe->res);
+      return PGEXPORTER_EVENT_RC_OK;
+   }
+
    /* This type of thing is not ideal, ideally I should have
     * only event_watcher_t pointers returning in cqe->user_data */
    switch (watcher->type)
@@ -1212,9 +1267,9 @@ ev_io_uring_handler(struct io_uring_cqe* cqe)
                                     io->fds.worker.rcv_fd, strerror(-cqe->res));
             }
             msg->length = 0;
-            rc = PGEXPORTER_EVENT_RC_CONN_CLOSED;
+            /* The callback closes the connection, which does not end the loop.
+             * Do NOT rearm after connection close or error */
             io->cb(io);
-            /* Do NOT rearm after connection close or error */
          }
          else
          {
@@ -1222,8 +1277,8 @@ ev_io_uring_handler(struct io_uring_cqe* cqe)
             rc = PGEXPORTER_EVENT_RC_OK;
             io->cb(io);
 
-            /* Only rearm if loop is still running and connection is good */
-            if (pgexporter_event_loop_is_running())
+            /* Only rearm if loop is still running, and the callback kept the connection */
+            if (pgexporter_event_loop_is_running() && is_registered(watcher))
             {
                ev_io_uring_io_start(io);
             }
@@ -1896,12 +1951,9 @@ ev_kqueue_io_handler(struct kevent* kev)
          if (kev->flags & EV_EOF)
          {
             pgexporter_log_debug("Connection closed on fd %d", watcher->fds.worker.rcv_fd);
-            rc = PGEXPORTER_EVENT_RC_CONN_CLOSED;
-         }
-         else
-         {
-            watcher->cb(watcher);
          }
+         /* The callback reads what is left, and closes the connection */
+         watcher->cb(watcher);
          break;
       default:
          pgexporter_log_fatal("unknown event type: %d", type);
@@ -0,0 +1,1456 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <exposition.h>
+#include <logging.h>
+#include <utils.h>
+
+/* system */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* The metric types, numbered as the MetricType enum of the protobuf format */
+#define EXPOSITION_TYPE_COUNTER   0
+#define EXPOSITION_TYPE_GAUGE     1
+#define EXPOSITION_TYPE_SUMMARY   2
+#define EXPOSITION_TYPE_UNTYPED   3
+#define EXPOSITION_TYPE_HISTOGRAM 4
+
+#define EXPOSITION_MIN_SCHEMA -4
+#define EXPOSITION_MAX_SCHEMA 8
+
+#define CONTENT_TYPE_TEXT        "text/plain; version=0.0.1; charset=utf-8"
+#define CONTENT_TYPE_OPENMETRICS "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define CONTENT_TYPE_PROTOBUF    "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited"
+
+struct exposition_label
+{
+   char* name;
+   char* value;
+};
+
+struct exposition_sample
+{
+   char* name;
+   char* value;
+   struct exposition_label* labels;
+   int number_of_labels;
+};
+
+struct exposition_family
+{
+   char* name;
+   char* help;
+   int type;
+   struct exposition_sample* samples;
+   int number_of_samples;
+   int samples_capacity;
+};
+
+struct exposition
+{
+   struct exposition_family* families;
+   int number_of_families;
+   int families_capacity;
+};
+
+struct exposition_buffer
+{
+   unsigned char* data;
+   size_t size;
+   size_t capacity;
+};
+
+/* A native histogram bucket: index and number of observations */
+struct exposition_bucket
+{
+   int index;
+   uint64_t count;
+};
+
+static int parse(char* text, struct exposition* exposition);
+static int parse_comment(char* line, struct exposition* exposition);
+static int parse_sample(char* line, struct exposition* exposition);
+static int parse_labels(char** position, struct exposition_sample* sample);
+static struct exposition_family* add_family(struct exposition* exposition, char* name, int length);
+static bool belongs(struct exposition_family* family, char* name);
+static void destroy(struct exposition* exposition);
+
+static int render_openmetrics(struct exposition* exposition, struct exposition_buffer* out);
+static int render_protobuf(struct exposition* exposition, struct exposition_buffer* out);
+static int render_labels(struct exposition_sample* sample, struct exposition_buffer* metric, bool skip_le);
+static int render_metric(struct exposition_family* family, struct exposition_sample* sample, struct exposition_buffer* out);
+static int render_histogram(struct exposition_family* family, int first, bool* done, struct exposition_buffer* out);
+static int render_native(double* bounds, uint64_t* counts, int n, uint64_t count, struct exposition_buffer* out);
+static bool native_schema(double* bounds, int n, int* schema);
+
+static char* label_value(struct exposition_sample* sample, char* name);
+static bool same_series(struct exposition_sample* a, struct exposition_sample* b);
+
+static int buffer_append(struct exposition_buffer* buffer, const void* data, size_t size);
+static int buffer_string(struct exposition_buffer* buffer, const char* s);
+static int buffer_escaped(struct exposition_buffer* buffer, const char* s);
+static int buffer_varint(struct exposition_buffer* buffer, uint64_t value);
+static int buffer_tag(struct exposition_buffer* buffer, int field, int wire);
+static int buffer_double(struct exposition_buffer* buffer, int field, double value);
+static int buffer_bytes(struct exposition_buffer* buffer, int field, struct exposition_buffer* message);
+static uint64_t zigzag(int64_t value);
+
+int
+pgexporter_exposition_negotiate(char* accept)
+{
+   char* copy = NULL;
+   char* entry = NULL;
+   char* saveptr = NULL;
+   int format = EXPOSITION_FORMAT_TEXT;
+   double best = -1.0;
+
+   if (accept == NULL || strlen(accept) == 0)
+   {
+      return EXPOSITION_FORMAT_TEXT;
+   }
+
+   copy = strdup(accept);
+   if (copy == NULL)
+   {
+      return EXPOSITION_FORMAT_TEXT;
+   }
+
+   for (entry = strtok_r(copy, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr))
+   {
+      char* parameter = NULL;
+      char* parameters = NULL;
+      char* type = entry;
+      char* proto = NULL;
+      char* encoding = NULL;
+      double q = 1.0;
+      int candidate = -1;
+
+      parameters = strchr(entry, ';');
+      if (parameters != NULL)
+      {
+         *parameters++ = '\0';
+      }
+
+      while (parameters != NULL)
+      {
+         parameter = parameters;
+         parameters = strchr(parameters, ';');
+         if (parameters != NULL)
+         {
+            *parameters++ = '\0';
+         }
+
+         while (*parameter == ' ' || *parameter == '\t')
+         {
+            parameter++;
+         }
+
+         if (!strncasecmp(parameter, "q=", 2))
+         {
+            q = strtod(parameter + 2, NULL);
+         }
+         else if (!strncasecmp(parameter, "proto=", 6))
+         {
+            proto = parameter + 6;
+         }
+         else if (!strncasecmp(parameter, "encoding=", 9))
+         {
+            encoding = parameter + 9;
+         }
+      }
+
+      while (*type == ' ' || *type == '\t')
+      {
+         type++;
+      }
+      for (char* end = type + strlen(type); end > type && (*(end - 1) == ' ' || *(end - 1) == '\t'); end--)
+      {
+         *(end - 1) = '\0';
+      }
+
+      if (!strcasecmp(type, "application/vnd.google.protobuf"))
+      {
+         if ((proto == NULL || !strncmp(proto, "io.prometheus.client.MetricFamily", 33)) &&
+             encoding != NULL && !strncmp(encoding, "delimited", 9))
+         {
+            candidate = EXPOSITION_FORMAT_PROTOBUF;
+         }
+      }
+      else if (!strcasecmp(type, "application/openmetrics-text"))
+      {
+         candidate = EXPOSITION_FORMAT_OPENMETRICS;
+      }
+      else if (!strcasecmp(type, "text/plain") || !strcasecmp(type, "text/*") || !strcmp(type, "*/*"))
+      {
+         candidate = EXPOSITION_FORMAT_TEXT;
+      }
+
+      if (candidate >= 0 && q > 0.0 && q > best)
+      {
+         format = candidate;
+         best = q;
+      }
+   }
+
+   free(copy);
+
+   return format;
+}
+
+char*
+pgexporter_exposition_content_type(int format)
+{
+   switch (format)
+   {
+      case EXPOSITION_FORMAT_OPENMETRICS:
+         return CONTENT_TYPE_OPENMETRICS;
+      case EXPOSITION_FORMAT_PROTOBUF:
+         return CONTENT_TYPE_PROTOBUF;
+      default:
+         return CONTENT_TYPE_TEXT;
+   }
+}
+
+int
+pgexporter_exposition_convert(char* text, int format, void** data, size_t* size)
+{
+   struct exposition exposition = {0};
+   struct exposition_buffer out = {0};
+
+   *data = NULL;
+   *size = 0;
+
+   if (text == NULL)
+   {
+      goto error;
+   }
+
+   if (format == EXPOSITION_FORMAT_TEXT)
+   {
+      *data = strdup(text);
+      *size = strlen(text);
+      return *data != NULL ? 0 : 1;
+   }
+
+   if (parse(text, &exposition))
+   {
+      goto error;
+   }
+
+   if (format == EXPOSITION_FORMAT_OPENMETRICS)
+   {
+      if (render_openmetrics(&exposition, &out))
+      {
+         goto error;
+      }
+   }
+   else if (render_protobuf(&exposition, &out))
+   {
+      goto error;
+   }
+
+   destroy(&exposition);
+
+   *data = out.data;
+   *size = out.size;
+
+   return 0;
+
+error:
+
+   destroy(&exposition);
+   free(out.data);
+
+   return 1;
+}
+
+static int
+parse(char* text, struct exposition* exposition)
+{
+   char* copy = NULL;
+   char* line = NULL;
+   char* saveptr = NULL;
+
+   copy = strdup(text);
+   if (copy == NULL)
+   {
+      return 1;
+   }
+
+   for (line = strtok_r(copy, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+   {
+      size_t length = strlen(line);
+
+      if (length > 0 && line[length - 1] == '\r')
+      {
+         line[length - 1] = '\0';
+      }
+
+      if (line[0] == '#')
+      {
+         if (parse_comment(line, exposition))
+         {
+            goto error;
+         }
+      }
+      else if (line[0] != '\0')
+      {
+         if (parse_sample(line, exposition))
+         {
+            goto error;
+         }
+      }
+   }
+
+   free(copy);
+
+   return 0;
+
+error:
+
+   free(copy);
+
+   return 1;
+}
+
+/**
+ * Handle #HELP and #TYPE, with or without a space after the hash
+ */
+static int
+parse_comment(char* line, struct exposition* exposition)
+{
+   struct exposition_family* family = NULL;
+   char* p = line + 1;
+   char* name = NULL;
+   int length;
+   bool help;
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (!strncmp(p, "HELP ", 5))
+   {
+      help = true;
+   }
+   else if (!strncmp(p, "TYPE ", 5))
+   {
+      help = false;
+   }
+   else
+   {
+      return 0;
+   }
+
+   p += 5;
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   name = p;
+   while (*p != '\0' && *p != ' ')
+   {
+      p++;
+   }
+   length = (int)(p - name);
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (length == 0)
+   {
+      return 0;
+   }
+
+   /* HELP and TYPE of a family precede its samples */
+   if (exposition->number_of_families > 0)
+   {
+      family = &exposition->families[exposition->number_of_families - 1];
+
+      if (family->number_of_samples > 0 || strlen(family->name) != (size_t)length ||
+          strncmp(family->name, name, length) || (help && family->help != NULL))
+      {
+         family = NULL;
+      }
+   }
+
+   if (family == NULL)
+   {
+      family = add_family(exposition, name, length);
+      if (family == NULL)
+      {
+         return 1;
+      }
+   }
+
+   if (help)
+   {
+      family->help = strdup(p);
+      if (family->help == NULL)
+      {
+         return 1;
+      }
+   }
+   else if (!strcmp(p, "counter"))
+   {
+      family->type = EXPOSITION_TYPE_COUNTER;
+   }
+   else if (!strcmp(p, "gauge"))
+   {
+      family->type = EXPOSITION_TYPE_GAUGE;
+   }
+   else if (!strcmp(p, "histogram"))
+   {
+      family->type = EXPOSITION_TYPE_HISTOGRAM;
+   }
+   else if (!strcmp(p, "summary"))
+   {
+      family->type = EXPOSITION_TYPE_SUMMARY;
+   }
+   else
+   {
+      family->type = EXPOSITION_TYPE_UNTYPED;
+   }
+
+   return 0;
+}
+
+static int
+parse_sample(char* line, struct exposition* exposition)
+{
+   struct exposition_family* family = NULL;
+   struct exposition_sample* sample = NULL;
+   char* p = line;
+   char* name = NULL;
+   char* value = NULL;
+   int length;
+
+   name = p;
+   while (*p != '\0' && *p != '{' && *p != ' ')
+   {
+      p++;
+   }
+   length = (int)(p - name);
+
+   if (length == 0)
+   {
+      return 0;
+   }
+
+   if (exposition->number_of_families > 0)
+   {
+      char c = name[length];
+
+      family = &exposition->families[exposition->number_of_families - 1];
+
+      name[length] = '\0';
+      if (!belongs(family, name))
+      {
+         family = NULL;
+      }
+      name[length] = c;
+   }
+
+   if (family == NULL)
+   {
+      family = add_family(exposition, name, length);
+      if (family == NULL)
+      {
+         return 1;
+      }
+   }
+
+   if (family->number_of_samples == family->samples_capacity)
+   {
+      int capacity = family->samples_capacity > 0 ? family->samples_capacity * 2 : 16;
+      struct exposition_sample* samples = realloc(family->samples, capacity * sizeof(struct exposition_sample));
+
+      if (samples == NULL)
+      {
+         return 1;
+      }
+
+      family->samples = samples;
+      family->samples_capacity = capacity;
+   }
+
+   sample = &family->samples[family->number_of_samples];
+   memset(sample, 0, sizeof(struct exposition_sample));
+   family->number_of_samples++;
+
+   sample->name = strndup(name, length);
+   if (sample->name == NULL)
+   {
+      return 1;
+   }
+
+   if (*p == '{' && parse_labels(&p, sample))
+   {
+      pgexporter_log_debug("exposition: malformed labels in %s", line);
+      return 1;
+   }
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   value = p;
+   while (*p != '\0' && *p != ' ')
+   {
+      p++;
+   }
+
+   sample->value = strndup(value, p - value);
+   if (sample->value == NULL)
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+parse_labels(char** position, struct exposition_sample* sample)
+{
+   char* p = *position + 1;
+
+   while (true)
+   {
+      struct exposition_label* labels = NULL;
+      struct exposition_label* label = NULL;
+      char* name = NULL;
+      char* value = NULL;
+      size_t length = 0;
+
+      while (*p == ' ' || *p == ',')
+      {
+         p++;
+      }
+
+      if (*p == '}')
+      {
+         p++;
+         break;
+      }
+
+      name = p;
+      while (*p != '\0' && *p != '=' && *p != ' ')
+      {
+         p++;
+      }
+
+      if (p == name)
+      {
+         return 1;
+      }
+
+      labels = realloc(sample->labels, (sample->number_of_labels + 1) * sizeof(struct exposition_label));
+      if (labels == NULL)
+      {
+         return 1;
+      }
+      sample->labels = labels;
+
+      label = &sample->labels[sample->number_of_labels++];
+      label->name = strndup(name, p - name);
+      label->value = NULL;
+
+      while (*p == ' ')
+      {
+         p++;
+      }
+
+      if (label->name == NULL || *p != '=' || *(p + 1) != '"')
+      {
+         return 1;
+      }
+      p += 2;
+
+      value = malloc(strlen(p) + 1);
+      if (value == NULL)
+      {
+         return 1;
+      }
+      label->value = value;
+
+      while (*p != '\0' && *p != '"')
+      {
+         if (*p == '\\' && *(p + 1) != '\0')
+         {
+            p++;
+            value[length++] = *p == 'n' ? '\n' : *p;
+         }
+         else
+         {
+            value[length++] = *p;
+         }
+         p++;
+      }
+      value[length] = '\0';
+
+      if (*p != '"')
+      {
+         return 1;
+      }
+      p++;
+   }
+
+   *position = p;
+
+   return 0;
+}
+
+static struct exposition_family*
+add_family(struct exposition* exposition, char* name, int length)
+{
+   struct exposition_family* family = NULL;
+
+   if (exposition->number_of_families == exposition->families_capacity)
+   {
+      int capacity = exposition->families_capacity > 0 ? exposition->families_capacity * 2 : 64;
+      struct exposition_family* families = realloc(exposition->families, capacity * sizeof(struct exposition_family));
+
+      if (families == NULL)
+      {
+         return NULL;
+      }
+
+      exposition->families = families;
+      exposition->families_capacity = capacity;
+   }
+
+   family = &exposition->families[exposition->number_of_families];
+   memset(family, 0, sizeof(struct exposition_family));
+
+   family->name = strndup(name, length);
+   family->type = EXPOSITION_TYPE_UNTYPED;
+
+   if (family->name == NULL)
+   {
+      return NULL;
+   }
+
+   exposition->number_of_families++;
+
+   return family;
+}
+
+static bool
+belongs(struct exposition_family* family, char* name)
+{
+   size_t length = strlen(family->name);
+
+   if (!strcmp(family->name, name))
+   {
+      return true;
+   }
+
+   if (family->type != EXPOSITION_TYPE_HISTOGRAM && family->type != EXPOSITION_TYPE_SUMMARY)
+   {
+      return false;
+   }
+
+   if (strncmp(family->name, name, length))
+   {
+      return false;
+   }
+
+   name += length;
+
+   return !strcmp(name, "_sum") || !strcmp(name, "_count") ||
+          (family->type == EXPOSITION_TYPE_HISTOGRAM && !strcmp(name, "_bucket"));
+}
+
+static void
+destroy(struct exposition* exposition)
+{
+   for (int i = 0; i < exposition->number_of_families; i++)
+   {
+      struct exposition_family* family = &exposition->families[i];
+
+      for (int j = 0; j < family->number_of_samples; j++)
+      {
+         struct exposition_sample* sample = &family->samples[j];
+
+         for (int k = 0; k < sample->number_of_labels; k++)
+         {
+            free(sample->labels[k].name);
+            free(sample->labels[k].value);
+         }
+
+         free(sample->labels);
+         free(sample->name);
+         free(sample->value);
+      }
+
+      free(family->samples);
+      free(family->name);
+      free(family->help);
+   }
+
+   free(exposition->families);
+
+   memset(exposition, 0, sizeof(struct exposition));
+}
+
+/**
+ * OpenMetrics requires counter samples to end in _total, with the family
+ * named without it. Counters that do not follow the convention are
+ * exposed as unknown so that their names stay the same in every format
+ */
+static int
+render_openmetrics(struct exposition* exposition, struct exposition_buffer* out)
+{
+   for (int i = 0; i < exposition->number_of_families; i++)
+   {
+      struct exposition_family* family = &exposition->families[i];
+      size_t length = strlen(family->name);
+      char* type = "unknown";
+      int name_length = (int)length;
+
+      switch (family->type)
+      {
+         case EXPOSITION_TYPE_COUNTER:
+            if (length > 6 && !strcmp(family->name + length - 6, "_total"))
+            {
+               type = "counter";
+               name_length -= 6;
+            }
+            break;
+         case EXPOSITION_TYPE_GAUGE:
+            type = "gauge";
+            break;
+         case EXPOSITION_TYPE_HISTOGRAM:
+            type = "histogram";
+            break;
+         case EXPOSITION_TYPE_SUMMARY:
+            type = "summary";
+            break;
+         default:
+            break;
+      }
+
+      if (family->help != NULL)
+      {
+         if (buffer_string(out, "# HELP ") || buffer_append(out, family->name, name_length) ||
+             buffer_string(out, " ") || buffer_escaped(out, family->help) || buffer_string(out, "\n"))
+         {
+            return 1;
+         }
+      }
+
+      if (buffer_string(out, "# TYPE ") || buffer_append(out, family->name, name_length) ||
+          buffer_string(out, " ") || buffer_string(out, type) || buffer_string(out, "\n"))
+      {
+         return 1;
+      }
+
+      for (int j = 0; j < family->number_of_samples; j++)
+      {
+         struct exposition_sample* sample = &family->samples[j];
+
+         if (buffer_string(out, sample->name))
+         {
+            return 1;
+         }
+
+         for (int k = 0; k < sample->number_of_labels; k++)
+         {
+            if (buffer_string(out, k == 0 ? "{" : ",") || buffer_string(out, sample->labels[k].name) ||
+                buffer_string(out, "=\"") || buffer_escaped(out, sample->labels[k].value) ||
+                buffer_string(out, "\""))
+            {
+               return 1;
+            }
+         }
+
+         if ((sample->number_of_labels > 0 && buffer_string(out, "}")) ||
+             buffer_string(out, " ") || buffer_string(out, sample->value) || buffer_string(out, "\n"))
+         {
+            return 1;
+         }
+      }
+   }
+
+   return buffer_string(out, "# EOF\n");
+}
+
+/**
+ * Every MetricFamily message is preceded by its length as a varint
+ */
+static int
+render_protobuf(struct exposition* exposition, struct exposition_buffer* out)
+{
+   struct exposition_buffer family_buffer = {0};
+   bool* done = NULL;
+
+   for (int i = 0; i < exposition->number_of_families; i++)
+   {
+      struct exposition_family* family = &exposition->families[i];
+      int type = family->type;
+
+      /* Summaries are not produced by pgexporter, keep their samples as they are */
+      if (type == EXPOSITION_TYPE_SUMMARY)
+      {
+         type = EXPOSITION_TYPE_UNTYPED;
+      }
+
+      family_buffer.size = 0;
+
+      if (buffer_tag(&family_buffer, 1, 2) || buffer_varint(&family_buffer, strlen(family->name)) ||
+          buffer_string(&family_buffer, family->name))
+      {
+         goto error;
+      }
+
+      if (family->help != NULL)
+      {
+         if (buffer_tag(&family_buffer, 2, 2) || buffer_varint(&family_buffer, strlen(family->help)) ||
+             buffer_string(&family_buffer, family->help))
+         {
+            goto error;
+         }
+      }
+
+      if (buffer_tag(&family_buffer, 3, 0) || buffer_varint(&family_buffer, (uint64_t)type))
+      {
+         goto error;
+      }
+
+      if (type == EXPOSITION_TYPE_HISTOGRAM)
+      {
+         free(done);
+         done = calloc(family->number_of_samples > 0 ? family->number_of_samples : 1, sizeof(bool));
+         if (done == NULL)
+         {
+            goto error;
+         }
+
+         for (int j = 0; j < family->number_of_samples; j++)
+         {
+            if (!done[j] && render_histogram(family, j, done, &family_buffer))
+            {
+               goto error;
+            }
+         }
+      }
+      else
+      {
+         for (int j = 0; j < family->number_of_samples; j++)
+         {
+            if (render_metric(family, &family->samples[j], &family_buffer))
+            {
+               goto error;
+            }
+         }
+      }
+
+      if (buffer_varint(out, family_buffer.size) || buffer_append(out, family_buffer.data, family_buffer.size))
+      {
+         goto error;
+      }
+   }
+
+   free(family_buffer.data);
+   free(done);
+
+   return 0;
+
+error:
+
+   free(family_buffer.data);
+   free(done);
+
+   return 1;
+}
+
+static int
+render_labels(struct exposition_sample* sample, struct exposition_buffer* metric, bool skip_le)
+{
+   struct exposition_buffer label = {0};
+
+   for (int k = 0; k < sample->number_of_labels; k++)
+   {
+      if (skip_le && !strcmp(sample->labels[k].name, "le"))
+      {
+         continue;
+      }
+
+      label.size = 0;
+
+      if (buffer_tag(&label, 1, 2) || buffer_varint(&label, strlen(sample->labels[k].name)) ||
+          buffer_string(&label, sample->labels[k].name) ||
+          buffer_tag(&label, 2, 2) || buffer_varint(&label, strlen(sample->labels[k].value)) ||
+          buffer_string(&label, sample->labels[k].value) ||
+          buffer_bytes(metric, 1, &label))
+      {
+         free(label.data);
+         return 1;
+      }
+   }
+
+   free(label.data);
+
+   return 0;
+}
+
+/**
+ * A counter, gauge or untyped Metric
+ */
+static int
+render_metric(struct exposition_family* family, struct exposition_sample* sample, struct exposition_buffer* out)
+{
+   struct exposition_buffer metric = {0};
+   struct exposition_buffer value = {0};
+   int field;
+
+   switch (family->type)
+   {
+      case EXPOSITION_TYPE_COUNTER:
+         field = 3;
+         break;
+      case EXPOSITION_TYPE_GAUGE:
+         field = 2;
+         break;
+      default:
+         field = 5;
+         break;
+   }
+
+   if (render_labels(sample, &metric, false) ||
+       buffer_double(&value, 1, strtod(sample->value, NULL)) ||
+       buffer_bytes(&metric, field, &value) ||
+       buffer_bytes(out, 4, &metric))
+   {
+      goto error;
+   }
+
+   free(metric.data);
+   free(value.data);
+
+   return 0;
+
+error:
+
+   free(metric.data);
+   free(value.data);
+
+   return 1;
+}
+
+/**
+ * Collect the _bucket, _sum and _count samples of one series, starting at
+ * the sample first, into a single Histogram Metric
+ */
+static int
+render_histogram(struct exposition_family* family, int first, bool* done, struct exposition_buffer* out)
+{
+   struct exposition_buffer metric = {0};
+   struct exposition_buffer histogram = {0};
+   struct exposition_buffer bucket = {0};
+   struct exposition_sample* series = &family->samples[first];
+   size_t length = strlen(family->name);
+   double* bounds = NULL;
+   uint64_t* counts = NULL;
+   int number_of_buckets = 0;
+   uint64_t count = 0;
+   double sum = 0.0;
+
+   bounds = malloc(family->number_of_samples * sizeof(double));
+   counts = malloc(family->number_of_samples * sizeof(uint64_t));
+   if (bounds == NULL || counts == NULL)
+   {
+      goto error;
+   }
+
+   for (int j = first; j < family->number_of_samples; j++)
+   {
+      struct exposition_sample* sample = &family->samples[j];
+      char* suffix = sample->name + length;
+
+      if (done[j] || !same_series(series, sample))
+      {
+         continue;
+      }
+
+      done[j] = true;
+
+      if (!strcmp(suffix, "_sum"))
+      {
+         sum = strtod(sample->value, NULL);
+      }
+      else if (!strcmp(suffix, "_count"))
+      {
+         count = (uint64_t)strtod(sample->value, NULL);
+      }
+      else if (!strcmp(suffix, "_bucket") && label_value(sample, "le") != NULL)
+      {
+         double bound = strtod(label_value(sample, "le"), NULL);
+
+         /* The +Inf bucket is the count */
+         if (isinf(bound))
+         {
+            continue;
+         }
+
+         bounds[number_of_buckets] = bound;
+         counts[number_of_buckets] = (uint64_t)strtod(sample->value, NULL);
+         number_of_buckets++;
+      }
+   }
+
+   /* Sort the buckets by bound, they are few */
+   for (int i = 1; i < number_of_buckets; i++)
+   {
+      for (int j = i; j > 0 && bounds[j - 1] > bounds[j]; j--)
+      {
+         double b = bounds[j];
+         uint64_t c = counts[j];
+
+         bounds[j] = bounds[j - 1];
+         counts[j] = counts[j - 1];
+         bounds[j - 1] = b;
+         counts[j - 1] = c;
+      }
+   }
+
+   if (buffer_tag(&histogram, 1, 0) || buffer_varint(&histogram, count) ||
+       buffer_double(&histogram, 2, sum))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_buckets; i++)
+   {
+      bucket.size = 0;
+
+      if (buffer_tag(&bucket, 1, 0) || buffer_varint(&bucket, counts[i]) ||
+          buffer_double(&bucket, 2, bounds[i]) ||
+          buffer_bytes(&histogram, 3, &bucket))
+      {
+         goto error;
+      }
+   }
+
+   if (render_native(bounds, counts, number_of_buckets, count, &histogram))
+   {
+      goto error;
+   }
+
+   if (render_labels(series, &metric, true) ||
+       buffer_bytes(&metric, 7, &histogram) ||
+       buffer_bytes(out, 4, &metric))
+   {
+      goto error;
+   }
+
+   free(bounds);
+   free(counts);
+   free(metric.data);
+   free(histogram.data);
+   free(bucket.data);
+
+   return 0;
+
+error:
+
+   free(bounds);
+   free(counts);
+   free(metric.data);
+   free(histogram.data);
+   free(bucket.data);
+
+   return 1;
+}
+
+/**
+ * Add the native histogram fields. They are only added when the classic
+ * bounds are consecutive boundaries of a schema, so every classic bucket
+ * maps to exactly one native bucket. The lowest positive bound is the zero
+ * threshold, so the zero bucket holds the observations up to it, and the
+ * observations above the last bound go to the bucket right after it.
+ * Other histograms only carry the classic buckets
+ */
+static int
+render_native(double* bounds, uint64_t* counts, int n, uint64_t count, struct exposition_buffer* out)
+{
+   struct exposition_bucket* buckets = NULL;
+   struct exposition_buffer span = {0};
+   uint64_t zero_count = 0;
+   double zero_threshold = 0.0;
+   uint64_t previous = 0;
+   int number_of_buckets = 0;
+   int schema = 0;
+   int start = 0;
+   int64_t last = 0;
+
+   for (int i = 0; i < n; i++)
+   {
+      /* The zero bucket can not represent negative bounds */
+      if (bounds[i] < 0.0)
+      {
+         return 0;
+      }
+   }
+
+   if (!native_schema(bounds, n, &schema))
+   {
+      return 0;
+   }
+
+   buckets = calloc(n + 1, sizeof(struct exposition_bucket));
+   if (buckets == NULL)
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      uint64_t c = counts[i] > previous ? counts[i] - previous : 0;
+      int index;
+
+      previous = MAX(previous, counts[i]);
+
+      if (zero_threshold == 0.0)
+      {
+         zero_count += c;
+         zero_threshold = bounds[i];
+         continue;
+      }
+
+      if (c == 0)
+      {
+         continue;
+      }
+
+      index = (int)round(log2(bounds[i]) * ldexp(1.0, schema));
+
+      if (number_of_buckets > 0 && buckets[number_of_buckets - 1].index == index)
+      {
+         buckets[number_of_buckets - 1].count += c;
+      }
+      else
+      {
+         buckets[number_of_buckets].index = index;
+         buckets[number_of_buckets].count = c;
+         number_of_buckets++;
+      }
+   }
+
+   if (count > previous)
+   {
+      int index = (int)round(log2(bounds[n - 1]) * ldexp(1.0, schema)) + 1;
+
+      if (number_of_buckets > 0 && buckets[number_of_buckets - 1].index >= index)
+      {
+         buckets[number_of_buckets - 1].count += count - previous;
+      }
+      else
+      {
+         buckets[number_of_buckets].index = index;
+         buckets[number_of_buckets].count = count - previous;
+         number_of_buckets++;
+      }
+   }
+
+   if (buffer_tag(out, 5, 0) || buffer_varint(out, zigzag(schema)) ||
+       buffer_double(out, 6, zero_threshold) ||
+       buffer_tag(out, 7, 0) || buffer_varint(out, zero_count))
+   {
+      goto error;
+   }
+
+   /* One span for every run of consecutive indexes */
+   for (int i = 0; i < number_of_buckets; i++)
+   {
+      if (i + 1 < number_of_buckets && buckets[i + 1].index == buckets[i].index + 1)
+      {
+         continue;
+      }
+
+      span.size = 0;
+
+      if (buffer_tag(&span, 1, 0) ||
+          buffer_varint(&span, zigzag(start == 0 ? buckets[start].index : buckets[start].index - buckets[start - 1].index - 1)) ||
+          buffer_tag(&span, 2, 0) || buffer_varint(&span, (uint64_t)(i - start + 1)) ||
+          buffer_bytes(out, 12, &span))
+      {
+         goto error;
+      }
+
+      start = i + 1;
+   }
+
+   for (int i = 0; i < number_of_buckets; i++)
+   {
+      if (buffer_tag(out, 13, 0) || buffer_varint(out, zigzag((int64_t)buckets[i].count - last)))
+      {
+         goto error;
+      }
+
+      last = (int64_t)buckets[i].count;
+   }
+
+   free(buckets);
+   free(span.data);
+
+   return 0;
+
+error:
+
+   free(buckets);
+   free(span.data);
+
+   return 1;
+}
+
+/**
+ * Find the schema whose consecutive bucket boundaries are the positive
+ * bounds, which needs at least two of them
+ */
+static bool
+native_schema(double* bounds, int n, int* schema)
+{
+   for (int candidate = EXPOSITION_MIN_SCHEMA; candidate <= EXPOSITION_MAX_SCHEMA; candidate++)
+   {
+      bool exact = true;
+      int positive = 0;
+      double previous = 0.0;
+
+      for (int i = 0; exact && i < n; i++)
+      {
+         double index;
+
+         if (bounds[i] <= 0.0)
+         {
+            continue;
+         }
+
+         index = log2(bounds[i]) * ldexp(1.0, candidate);
+         exact = fabs(index - round(index)) < 1e-9 && (positive == 0 || round(index) == previous + 1.0);
+
+         previous = round(index);
+         positive++;
+      }
+
+      if (exact && positive >= 2)
+      {
+         *schema = candidate;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static char*
+label_value(struct exposition_sample* sample, char* name)
+{
+   for (int k = 0; k < sample->number_of_labels; k++)
+   {
+      if (!strcmp(sample->labels[k].name, name))
+      {
+         return sample->labels[k].value;
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * Do two samples have the same labels, apart from le
+ */
+static bool
+same_series(struct exposition_sample* a, struct exposition_sample* b)
+{
+   int n = 0;
+
+   for (int k = 0; k < a->number_of_labels; k++)
+   {
+      char* value;
+
+      if (!strcmp(a->labels[k].name, "le"))
+      {
+         continue;
+      }
+
+      value = label_value(b, a->labels[k].name);
+      if (value == NULL || strcmp(value, a->labels[k].value))
+      {
+         return false;
+      }
+
+      n++;
+   }
+
+   for (int k = 0; k < b->number_of_labels; k++)
+   {
+      if (strcmp(b->labels[k].name, "le"))
+      {
+         n--;
+      }
+   }
+
+   return n == 0;
+}
+
+static int
+buffer_append(struct exposition_buffer* buffer, const void* data, size_t size)
+{
+   if (buffer->size + size > buffer->capacity)
+   {
+      size_t capacity = MAX(MAX(buffer->capacity * 2, buffer->size + size), (size_t)8192);
+      unsigned char* d = realloc(buffer->data, capacity);
+
+      if (d == NULL)
+      {
+         return 1;
+      }
+
+      buffer->data = d;
+      buffer->capacity = capacity;
+   }
+
+   if (size > 0)
+   {
+      memcpy(buffer->data + buffer->size, data, size);
+      buffer->size += size;
+   }
+
+   return 0;
+}
+
+static int
+buffer_string(struct exposition_buffer* buffer, const char* s)
+{
+   return buffer_append(buffer, s, strlen(s));
+}
+
+static int
+buffer_escaped(struct exposition_buffer* buffer, const char* s)
+{
+   for (const char* p = s; *p != '\0'; p++)
+   {
+      int status;
+
+      if (*p == '\\')
+      {
+         status = buffer_string(buffer, "\\\\");
+      }
+      else if (*p == '\n')
+      {
+         status = buffer_string(buffer, "\\n");
+      }
+      else if (*p == '"')
+      {
+         status = buffer_string(buffer, "\\\"");
+      }
+      else
+      {
+         status = buffer_append(buffer, p, 1);
+      }
+
+      if (status)
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+buffer_varint(struct exposition_buffer* buffer, uint64_t value)
+{
+   unsigned char bytes[10];
+   size_t n = 0;
+
+   while (value >= 0x80)
+   {
+      bytes[n++] = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+   bytes[n++] = (unsigned char)value;
+
+   return buffer_append(buffer, bytes, n);
+}
+
+static int
+buffer_tag(struct exposition_buffer* buffer, int field, int wire)
+{
+   return buffer_varint(buffer, ((uint64_t)field << 3) | (uint64_t)wire);
+}
+
+static int
+buffer_double(struct exposition_buffer* buffer, int field, double value)
+{
+   unsigned char bytes[8];
+   uint64_t bits;
+
+   memcpy(&bits, &value, sizeof(bits));
+   for (int i = 0; i < 8; i++)
+   {
+      bytes[i] = (unsigned char)(bits >> (8 * i));
+   }
+
+   if (buffer_tag(buffer, field, 1))
+   {
+      return 1;
+   }
+
+   return buffer_append(buffer, bytes, sizeof(bytes));
+}
+
+static int
+buffer_bytes(struct exposition_buffer* buffer, int field, struct exposition_buffer* message)
+{
+   if (buffer_tag(buffer, field, 2) || buffer_varint(buffer, message->size))
+   {
+      return 1;
+   }
+
+   return buffer_append(buffer, message->data, message->size);
+}
+
+static uint64_t
+zigzag(int64_t value)
+{
+   return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <fragment.h>
+#include <logging.h>
+#include <shmem.h>
+
+/* system */
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAGMENT_LOCK_ATTEMPTS 1000
+
+static bool fragment_lock(struct fragment_cache* cache);
+static void fragment_unlock(struct fragment_cache* cache);
+static uint64_t fragment_hash(char* key, size_t key_length);
+static int fragment_find(struct fragment_cache* cache, uint64_t hash, char* key, size_t key_length);
+static void fragment_clear(struct fragment_cache* cache);
+static void fragment_compact(struct fragment_cache* cache);
+
+int
+pgexporter_fragment_init(size_t* p_size, void** p_shmem)
+{
+   struct fragment_cache* cache = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   size_t size = sizeof(struct fragment_cache) + FRAGMENT_ARENA_SIZE;
+
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   if (pgexporter_create_shared_memory(size, config->hugepage, (void*)&cache))
+   {
+      pgexporter_log_error("Cannot allocate shared memory for the exposition fragments");
+      return 1;
+   }
+
+   memset(cache, 0, size);
+   atomic_init(&cache->lock, STATE_FREE);
+   atomic_init(&cache->hits, 0);
+   atomic_init(&cache->misses, 0);
+   cache->size = FRAGMENT_ARENA_SIZE;
+
+   *p_size = size;
+   *p_shmem = cache;
+
+   return 0;
+}
+
+void
+pgexporter_fragment_begin(void)
+{
+   struct fragment_cache* cache = (struct fragment_cache*)fragment_shmem;
+
+   if (cache == NULL || !fragment_lock(cache))
+   {
+      return;
+   }
+
+   cache->scrape++;
+
+   fragment_unlock(cache);
+}
+
+void
+pgexporter_fragment_reset(void)
+{
+   struct fragment_cache* cache = (struct fragment_cache*)fragment_shmem;
+
+   if (cache == NULL || !fragment_lock(cache))
+   {
+      return;
+   }
+
+   fragment_clear(cache);
+
+   fragment_unlock(cache);
+}
+
+int
+pgexporter_fragment_lookup(struct fragment_lookup* lookups, int number_of_lookups, char** buffer, size_t* capacity)
+{
+   int slot;
+   int found = 0;
+   int missed = 0;
+   size_t used = 0;
+   size_t length;
+   struct fragment_slot* s = NULL;
+   struct fragment_cache* cache = (struct fragment_cache*)fragment_shmem;
+
+   for (int i = 0; i < number_of_lookups; i++)
+   {
+      lookups[i].labels = NULL;
+      lookups[i].prefix = NULL;
+   }
+
+   if (cache == NULL || number_of_lookups <= 0 || !fragment_lock(cache))
+   {
+      return 0;
+   }
+
+   for (int i = 0; i < number_of_lookups; i++)
+   {
+      struct fragment_lookup* lookup = &lookups[i];
+
+      if (lookup->key_length == 0)
+      {
+         continue;
+      }
+
+      slot = fragment_find(cache, fragment_hash(lookup->key, lookup->key_length), lookup->key, lookup->key_length);
+
+      if (slot == -1 || cache->slots[slot].hash == 0)
+      {
+         missed++;
+         continue;
+      }
+
+      s = &cache->slots[slot];
+      length = s->labels_length + 1 + s->prefix_length + 1;
+
+      if (used + length > *capacity)
+      {
+         size_t c = MAX(MAX(*capacity * 2, used + length), (size_t)4096);
+         char* b = realloc(*buffer, c);
+
+         if (b == NULL)
+         {
+            break;
+         }
+
+         *buffer = b;
+         *capacity = c;
+      }
+
+      /* The label set and the prefix are copied out as they are laid out in the arena */
+      memcpy(*buffer + used, &cache->arena[s->offset + s->key_length + 1], length);
+      s->last_seen = cache->scrape;
+
+      lookup->offset = used;
+      lookup->labels = *buffer;
+
+      used += length;
+      found++;
+   }
+
+   fragment_unlock(cache);
+
+   /* The buffer may have moved while it grew */
+   for (int i = 0; i < number_of_lookups; i++)
+   {
+      if (lookups[i].labels != NULL)
+      {
+         lookups[i].labels = *buffer + lookups[i].offset;
+         lookups[i].prefix = lookups[i].labels + strlen(lookups[i].labels) + 1;
+      }
+   }
+
+   atomic_fetch_add(&cache->hits, found);
+   atomic_fetch_add(&cache->misses, missed);
+
+   return found;
+}
+
+bool
+pgexporter_fragment_store(char* key, size_t key_length, char* labels, char* prefix)
+{
+   int slot;
+   uint64_t hash;
+   size_t labels_length;
+   size_t prefix_length;
+   size_t needed;
+   char* entry = NULL;
+   struct fragment_slot* s = NULL;
+   struct fragment_cache* cache = (struct fragment_cache*)fragment_shmem;
+
+   if (cache == NULL || key_length > FRAGMENT_MAX_KEY_LENGTH)
+   {
+      return false;
+   }
+
+   labels_length = labels != NULL ? strlen(labels) : 0;
+   prefix_length = strlen(prefix);
+   needed = key_length + 1 + labels_length + 1 + prefix_length + 1;
+
+   if (needed > UINT32_MAX || !fragment_lock(cache))
+   {
+      return false;
+   }
+
+   if (cache->number_of_entries >= FRAGMENT_SLOTS / 4 * 3 || cache->used + needed > cache->size)
+   {
+      fragment_compact(cache);
+
+      if (cache->number_of_entries >= FRAGMENT_SLOTS / 4 * 3 || cache->used + needed > cache->size)
+      {
+         fragment_unlock(cache);
+         return false;
+      }
+   }
+
+   hash = fragment_hash(key, key_length);
+   slot = fragment_find(cache, hash, key, key_length);
+
+   if (slot == -1 || cache->slots[slot].hash != 0)
+   {
+      /* Stored by a concurrent scrape */
+      fragment_unlock(cache);
+      return slot != -1;
+   }
+
+   entry = &cache->arena[cache->used];
+   memcpy(entry, key, key_length);
+   entry[key_length] = '\0';
+   entry += key_length + 1;
+   memcpy(entry, labels != NULL ? labels : "", labels_length + 1);
+   entry += labels_length + 1;
+   memcpy(entry, prefix, prefix_length + 1);
+
+   s = &cache->slots[slot];
+   s->hash = hash;
+   s->offset = (uint32_t)cache->used;
+   s->key_length = (uint32_t)key_length;
+   s->labels_length = (uint32_t)labels_length;
+   s->prefix_length = (uint32_t)prefix_length;
+   s->last_seen = cache->scrape;
+
+   cache->used += needed;
+   cache->number_of_entries++;
+
+   fragment_unlock(cache);
+
+   return true;
+}
+
+/**
+ * Take the lock of the fragment cache. Fragments are only an
+ * optimization, so a busy cache is skipped rather than waited for.
+ *
+ * @param cache The cache
+ * @return true if the lock was taken, otherwise false
+ */
+static bool
+fragment_lock(struct fragment_cache* cache)
+{
+   signed char cache_is_free;
+
+   for (int i = 0; i < FRAGMENT_LOCK_ATTEMPTS; i++)
+   {
+      cache_is_free = STATE_FREE;
+      if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+      {
+         return true;
+      }
+
+      sched_yield();
+   }
+
+   return false;
+}
+
+static void
+fragment_unlock(struct fragment_cache* cache)
+{
+   atomic_store(&cache->lock, STATE_FREE);
+}
+
+/**
+ * FNV-1a hash of a key; 0 marks a free slot so it is never returned
+ *
+ * @param key The key
+ * @param key_length The length of the key
+ * @return The hash
+ */
+static uint64_t
+fragment_hash(char* key, size_t key_length)
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   for (size_t i = 0; i < key_length; i++)
+   {
+      hash ^= (unsigned char)key[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash != 0 ? hash : 1;
+}
+
+/**
+ * Find the slot of a key, or the free slot where it belongs.
+ * Requires the caller to hold the lock.
+ *
+ * @param cache The cache
+ * @param hash The hash of the key
+ * @param key The key
+ * @param key_length The length of the key
+ * @return The slot, or -1 if the table is full
+ */
+static int
+fragment_find(struct fragment_cache* cache, uint64_t hash, char* key, size_t key_length)
+{
+   int slot = (int)(hash & (FRAGMENT_SLOTS - 1));
+
+   for (int i = 0; i < FRAGMENT_SLOTS; i++)
+   {
+      struct fragment_slot* s = &cache->slots[slot];
+
+      if (s->hash == 0)
+      {
+         return slot;
+      }
+
+      if (s->hash == hash && s->key_length == key_length &&
+          !memcmp(&cache->arena[s->offset], key, key_length))
+      {
+         return slot;
+      }
+
+      slot = (slot + 1) & (FRAGMENT_SLOTS - 1);
+   }
+
+   return -1;
+}
+
+/**
+ * Drop all entries. Requires the caller to hold the lock.
+ *
+ * @param cache The cache
+ */
+static void
+fragment_clear(struct fragment_cache* cache)
+{
+   memset(cache->slots, 0, sizeof(cache->slots));
+   cache->number_of_entries = 0;
+   cache->used = 0;
+}
+
+/**
+ * Drop the entries of series that have not been seen for
+ * FRAGMENT_MAX_IDLE_SCRAPES scrapes, and pack the remaining ones.
+ * Requires the caller to hold the lock.
+ *
+ * @param cache The cache
+ */
+static void
+fragment_compact(struct fragment_cache* cache)
+{
+   int kept = 0;
+   size_t used = 0;
+   char* arena = NULL;
+   struct fragment_slot* slots = NULL;
+
+   slots = malloc(sizeof(cache->slots));
+   arena = malloc(cache->used > 0 ? cache->used : 1);
+
+   if (slots == NULL || arena == NULL)
+   {
+      /* Start over rather than fail every store */
+      fragment_clear(cache);
+      goto cleanup;
+   }
+
+   memcpy(slots, cache->slots, sizeof(cache->slots));
+   memcpy(arena, cache->arena, cache->used);
+
+   fragment_clear(cache);
+
+   for (int i = 0; i < FRAGMENT_SLOTS; i++)
+   {
+      struct fragment_slot* s = &slots[i];
+      size_t length;
+      int slot;
+
+      if (s->hash == 0 || s->last_seen + FRAGMENT_MAX_IDLE_SCRAPES <= cache->scrape)
+      {
+         continue;
+      }
+
+      length = s->key_length + 1 + s->labels_length + 1 + s->prefix_length + 1;
+      slot = fragment_find(cache, s->hash, &arena[s->offset], s->key_length);
+
+      memcpy(&cache->arena[used], &arena[s->offset], length);
+      cache->slots[slot] = *s;
+      cache->slots[slot].offset = (uint32_t)used;
+
+      used += length;
+      kept++;
+   }
+
+   cache->used = used;
+   cache->number_of_entries = kept;
+
+   pgexporter_log_debug("Exposition fragments compacted: %d kept, %zu bytes", kept, used);
+
+cleanup:
+   free(slots);
+   free(arena);
+}
@@ -28,17 +28,20 @@
 
 /* pgexporter */
 #include <pgexporter.h>
+#include <art.h>
 #include <history.h>
+#include <history_columnar.h>
 #include <history_sqlite.h>
 #include <http.h>
 #include <http_server.h>
-#include <json.h>
 #include <logging.h>
 #include <memory.h>
 #include <message.h>
 #include <network.h>
 #include <prometheus.h>
+#include <remote_write.h>
 #include <security.h>
+#include <shmem.h>
 #include <utils.h>
 #include <value.h>
 
@@ -59,6 +62,7 @@ static const struct
    const struct history_backend_ops* ops;
 } backend_registry[] = {
    {HISTORY_BACKEND_SQLITE, &pgexporter_history_sqlite_ops},
+   {HISTORY_BACKEND_COLUMNAR, &pgexporter_history_columnar_ops},
 };
 
 #define BACKEND_REGISTRY_SIZE (sizeof(backend_registry) / sizeof(backend_registry[0]))
@@ -92,252 +96,972 @@ pgexporter_history_write_batch(struct history_record* records, int count)
    return ops->write_batch(records, count);
 }
 
+/**
+ * The records collected by pgexporter_history_query_range
+ */
+struct history_records
+{
+   struct history_record* records; /**< The records, NULL to only count */
+   int count;                      /**< The number of records */
+   int capacity;                   /**< The capacity */
+   bool collect;                   /**< Keep the records */
+};
+
+static int
+history_collect_record(void* data, struct history_record* record)
+{
+   struct history_records* result = (struct history_records*)data;
+
+   if (result->collect)
+   {
+      if (result->count == result->capacity)
+      {
+         int capacity = result->capacity > 0 ? result->capacity * 2 : 100;
+         struct history_record* records = realloc(result->records, capacity * sizeof(struct history_record));
+
+         if (records == NULL)
+         {
+            return 1;
+         }
+
+         result->records = records;
+         result->capacity = capacity;
+      }
+
+      result->records[result->count] = *record;
+      result->records[result->count].labels = pgexporter_append(NULL, record->labels != NULL ? record->labels : "");
+   }
+
+   result->count++;
+
+   return 0;
+}
+
 int
 pgexporter_history_query_range(const char* metric, time_t start, time_t end,
                                struct history_record** records_out, int* count_out)
 {
+   struct history_records result;
+   struct history_query query;
+
+   memset(&result, 0, sizeof(struct history_records));
+   result.collect = records_out != NULL;
+
+   if (count_out)
+   {
+      *count_out = 0;
+   }
+
    if (ops == NULL)
    {
-      return 1;
+      return 1;
+   }
+
+   memset(&query, 0, sizeof(struct history_query));
+   query.start = start;
+   query.end = end;
+
+   if (ops->query_stream(metric, &query, history_collect_record, &result))
+   {
+      pgexporter_history_records_free(result.records, result.collect ? result.count : 0);
+      return 1;
+   }
+
+   if (records_out)
+   {
+      *records_out = result.records;
+   }
+
+   if (count_out)
+   {
+      *count_out = result.count;
+   }
+
+   return 0;
+}
+
+int
+pgexporter_history_query_stream(const char* metric, time_t start, time_t end,
+                                history_record_callback callback, void* data)
+{
+   struct history_query query;
+
+   if (ops == NULL)
+   {
+      return 1;
+   }
+
+   memset(&query, 0, sizeof(struct history_query));
+   query.start = start;
+   query.end = end;
+
+   return ops->query_stream(metric, &query, callback, data);
+}
+
+bool
+pgexporter_history_label_next(const char** position, char* name, size_t name_size, char* value, size_t value_size)
+{
+   const char* p = *position;
+   const char* key;
+   size_t key_length;
+   size_t length = 0;
+
+   if (p == NULL)
+   {
+      return false;
+   }
+
+   while (*p == ',' || *p == ' ')
+   {
+      p++;
+   }
+
+   key = p;
+   while (*p != '\0' && *p != '=')
+   {
+      p++;
+   }
+
+   if (*p != '=' || *(p + 1) != '"')
+   {
+      return false;
+   }
+
+   key_length = (size_t)(p - key);
+   pgexporter_snprintf(name, name_size, "%.*s", (int)key_length, key);
+   p += 2;
+
+   while (*p != '\0' && *p != '"')
+   {
+      if (*p == '\\' && *(p + 1) != '\0')
+      {
+         p++;
+      }
+
+      if (length + 1 < value_size)
+      {
+         value[length++] = *p;
+      }
+
+      p++;
+   }
+   value[length] = '\0';
+
+   if (*p == '"')
+   {
+      p++;
+   }
+
+   *position = p;
+
+   return true;
+}
+
+/**
+ * Find the value of a label in a label set, such as
+ * server="primary", database="postgres"
+ */
+static bool
+history_label_value(const char* labels, const char* name, char* out, size_t out_size)
+{
+   const char* p = labels;
+   char key[MISC_LENGTH];
+
+   while (pgexporter_history_label_next(&p, key, sizeof(key), out, out_size))
+   {
+      if (!strcmp(key, name))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+bool
+pgexporter_history_matches(struct history_query* query, const char* server, const char* labels)
+{
+   char value[MISC_LENGTH];
+
+   for (int i = 0; i < query->number_of_matchers; i++)
+   {
+      struct history_matcher* matcher = &query->matchers[i];
+      bool match;
+
+      /* A missing label has the empty value */
+      if (!history_label_value(labels, matcher->name, value, sizeof(value)))
+      {
+         pgexporter_snprintf(value, sizeof(value), "%s", strcmp(matcher->name, "server") ? "" : server);
+      }
+
+      switch (matcher->op)
+      {
+         case HISTORY_MATCH_EQUAL:
+            match = !strcmp(value, matcher->value);
+            break;
+         case HISTORY_MATCH_NOT_EQUAL:
+            match = strcmp(value, matcher->value) != 0;
+            break;
+         case HISTORY_MATCH_REGEX:
+            match = regexec(&matcher->regex, value, 0, NULL, 0) == 0;
+            break;
+         case HISTORY_MATCH_NOT_REGEX:
+            match = regexec(&matcher->regex, value, 0, NULL, 0) != 0;
+            break;
+         default:
+            match = false;
+            break;
+      }
+
+      if (!match)
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/**
+ * The state of a series in a downsampled query
+ */
+struct history_series_state
+{
+   struct history_record record; /**< The series (labels are owned) */
+   bool active;                  /**< Has samples in the current bucket */
+   int count;                    /**< The number of samples in the bucket */
+   double sum;                   /**< The sum of the bucket */
+   double min;                   /**< The minimum of the bucket */
+   double max;                   /**< The maximum of the bucket */
+   double last;                  /**< The last value of the bucket */
+   double increase;              /**< The counter increase within the bucket */
+   time_t elapsed;               /**< The time covered by the increase */
+   bool has_previous;            /**< A previous sample exists */
+   time_t previous_ts;           /**< The time of the previous sample */
+   double previous_value;        /**< The value of the previous sample */
+};
+
+/**
+ * Reduces the time ordered stream of a query to one record per
+ * series and bucket
+ */
+struct history_reducer
+{
+   struct history_query* query;          /**< The query */
+   history_record_callback callback;     /**< The callback of the query */
+   void* data;                           /**< The data of the callback */
+   bool started;                         /**< A bucket is open */
+   time_t bucket;                        /**< The start of the current bucket */
+   struct art* index;                    /**< Series key to position */
+   struct history_series_state* series;  /**< The series */
+   int number_of_series;                 /**< The number of series */
+   int capacity;                         /**< The capacity of the series */
+   char* key;                            /**< The key buffer */
+   size_t key_capacity;                  /**< The capacity of the key buffer */
+};
+
+static int
+history_reducer_flush(struct history_reducer* reducer)
+{
+   for (int i = 0; i < reducer->number_of_series; i++)
+   {
+      struct history_series_state* state = &reducer->series[i];
+      bool emit = state->active;
+      struct history_record record;
+
+      if (!state->active)
+      {
+         continue;
+      }
+
+      record = state->record;
+      record.ts = reducer->bucket;
+
+      switch (reducer->query->aggregation)
+      {
+         case HISTORY_AGGREGATION_MIN:
+            record.value = state->min;
+            break;
+         case HISTORY_AGGREGATION_MAX:
+            record.value = state->max;
+            break;
+         case HISTORY_AGGREGATION_LAST:
+            record.value = state->last;
+            break;
+         case HISTORY_AGGREGATION_RATE:
+            /* The first sample of a series has no rate */
+            emit = state->elapsed > 0;
+            record.value = emit ? state->increase / (double)state->elapsed : 0.0;
+            break;
+         case HISTORY_AGGREGATION_AVG:
+         default:
+            record.value = state->sum / state->count;
+            break;
+      }
+
+      state->active = false;
+      state->count = 0;
+      state->increase = 0.0;
+      state->elapsed = 0;
+
+      if (emit && reducer->callback(reducer->data, &record))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+history_reducer_record(void* data, struct history_record* record)
+{
+   struct history_reducer* reducer = (struct history_reducer*)data;
+   struct history_query* query = reducer->query;
+   struct history_series_state* state = NULL;
+   const char* labels = record->labels != NULL ? record->labels : "";
+   size_t length;
+   time_t bucket;
+   int position;
+
+   if (!pgexporter_history_matches(query, record->server, record->labels))
+   {
+      return 0;
+   }
+
+   if (query->step <= 0)
+   {
+      return reducer->callback(reducer->data, record);
+   }
+
+   /* Buckets start at the start of the window, so a window of one step is one bucket */
+   bucket = record->ts - ((record->ts - query->start) % query->step + query->step) % query->step;
+
+   if (reducer->started && bucket != reducer->bucket)
+   {
+      if (history_reducer_flush(reducer))
+      {
+         return 1;
+      }
+   }
+
+   reducer->started = true;
+   reducer->bucket = bucket;
+
+   /* The unit separator cannot be part of a name or a label set */
+   length = strlen(record->server) + strlen(record->metric) + strlen(labels) + 3;
+   if (length > reducer->key_capacity)
+   {
+      char* key = realloc(reducer->key, length);
+
+      if (key == NULL)
+      {
+         return 1;
+      }
+
+      reducer->key = key;
+      reducer->key_capacity = length;
+   }
+   pgexporter_snprintf(reducer->key, reducer->key_capacity, "%s\x1f%s\x1f%s", record->server, record->metric, labels);
+
+   if (pgexporter_art_contains_key(reducer->index, reducer->key))
+   {
+      position = (int)pgexporter_art_search(reducer->index, reducer->key);
+   }
+   else
+   {
+      if (reducer->number_of_series == reducer->capacity)
+      {
+         int capacity = reducer->capacity > 0 ? reducer->capacity * 2 : 64;
+         struct history_series_state* series = realloc(reducer->series, capacity * sizeof(struct history_series_state));
+
+         if (series == NULL)
+         {
+            return 1;
+         }
+
+         reducer->series = series;
+         reducer->capacity = capacity;
+      }
+
+      position = reducer->number_of_series;
+      state = &reducer->series[position];
+
+      memset(state, 0, sizeof(struct history_series_state));
+      state->record = *record;
+      state->record.labels = pgexporter_append(NULL, (char*)labels);
+
+      if (state->record.labels == NULL ||
+          pgexporter_art_insert(reducer->index, reducer->key, (uintptr_t)position, ValueInt32))
+      {
+         free(state->record.labels);
+         return 1;
+      }
+
+      reducer->number_of_series++;
+   }
+
+   state = &reducer->series[position];
+
+   if (state->count == 0)
+   {
+      state->min = record->value;
+      state->max = record->value;
+      state->sum = 0.0;
+   }
+
+   state->active = true;
+   state->count++;
+   state->sum += record->value;
+   state->min = record->value < state->min ? record->value : state->min;
+   state->max = record->value > state->max ? record->value : state->max;
+   state->last = record->value;
+
+   if (state->has_previous && record->ts > state->previous_ts)
+   {
+      double delta = record->value - state->previous_value;
+
+      /* A counter reset restarts from zero */
+      state->increase += delta >= 0.0 ? delta : record->value;
+      state->elapsed += record->ts - state->previous_ts;
+   }
+
+   state->has_previous = true;
+   state->previous_ts = record->ts;
+   state->previous_value = record->value;
+
+   return 0;
+}
+
+int
+pgexporter_history_matcher_parse(char* str, struct history_matcher* matcher)
+{
+   char* p = str;
+   char* value = NULL;
+   size_t name_length;
+   size_t value_length;
+   char pattern[MISC_LENGTH + 4];
+
+   memset(matcher, 0, sizeof(struct history_matcher));
+
+   if (str == NULL)
+   {
+      goto error;
+   }
+
+   while (*p != '\0' && (isalnum((unsigned char)*p) || *p == '_'))
+   {
+      p++;
+   }
+
+   name_length = (size_t)(p - str);
+   if (name_length == 0 || name_length >= sizeof(matcher->name))
+   {
+      goto error;
+   }
+
+   if (!strncmp(p, "!=", 2))
+   {
+      matcher->op = HISTORY_MATCH_NOT_EQUAL;
+      value = p + 2;
+   }
+   else if (!strncmp(p, "=~", 2))
+   {
+      matcher->op = HISTORY_MATCH_REGEX;
+      value = p + 2;
+   }
+   else if (!strncmp(p, "!~", 2))
+   {
+      matcher->op = HISTORY_MATCH_NOT_REGEX;
+      value = p + 2;
+   }
+   else if (*p == '=')
+   {
+      matcher->op = HISTORY_MATCH_EQUAL;
+      value = p + 1;
+   }
+   else
+   {
+      goto error;
+   }
+
+   value_length = strlen(value);
+   if (value_length >= 2 && value[0] == '"' && value[value_length - 1] == '"')
+   {
+      value++;
+      value_length -= 2;
+   }
+
+   if (value_length >= sizeof(matcher->value))
+   {
+      goto error;
+   }
+
+   memcpy(matcher->name, str, name_length);
+   memcpy(matcher->value, value, value_length);
+
+   if (matcher->op == HISTORY_MATCH_REGEX || matcher->op == HISTORY_MATCH_NOT_REGEX)
+   {
+      /* Anchored, as in Prometheus */
+      pgexporter_snprintf(pattern, sizeof(pattern), "^(%s)$", matcher->value);
+
+      if (regcomp(&matcher->regex, pattern, REG_EXTENDED | REG_NOSUB))
+      {
+         goto error;
+      }
+   }
+
+   return 0;
+
+error:
+
+   memset(matcher, 0, sizeof(struct history_matcher));
+
+   return 1;
+}
+
+int
+pgexporter_history_query(const char* metric, struct history_query* query,
+                         history_record_callback callback, void* data)
+{
+   struct history_reducer reducer;
+   int status = 1;
+
+   memset(&reducer, 0, sizeof(struct history_reducer));
+   reducer.query = query;
+   reducer.callback = callback;
+   reducer.data = data;
+
+   if (query == NULL || callback == NULL)
+   {
+      return 1;
+   }
+
+   if (query->step > 0 && pgexporter_art_create(&reducer.index))
+   {
+      return 1;
+   }
+
+   if (ops == NULL || ops->query_stream(metric, query, history_reducer_record, &reducer))
+   {
+      goto done;
+   }
+
+   if (reducer.started && history_reducer_flush(&reducer))
+   {
+      goto done;
+   }
+
+   status = 0;
+
+done:
+   for (int i = 0; i < reducer.number_of_series; i++)
+   {
+      free(reducer.series[i].record.labels);
+   }
+   free(reducer.series);
+   free(reducer.key);
+   pgexporter_art_destroy(reducer.index);
+
+   return status;
+}
+
+void
+pgexporter_history_query_destroy(struct history_query* query)
+{
+   if (query == NULL)
+   {
+      return;
+   }
+
+   for (int i = 0; i < query->number_of_matchers; i++)
+   {
+      if (query->matchers[i].op == HISTORY_MATCH_REGEX || query->matchers[i].op == HISTORY_MATCH_NOT_REGEX)
+      {
+         regfree(&query->matchers[i].regex);
+      }
+   }
+
+   query->number_of_matchers = 0;
+}
+
+int
+pgexporter_history_rollup(void)
+{
+   if (ops == NULL)
+   {
+      return 1;
+   }
+   if (ops->rollup == NULL)
+   {
+      return 0;
+   }
+   return ops->rollup();
+}
+
+int
+pgexporter_history_prune(void)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct timespec start;
+   struct timespec end;
+   int ret;
+
+   if (ops == NULL)
+   {
+      return 1;
+   }
+
+   /* Set again by the backend when it runs out of time */
+   atomic_store(&config->history_prune_pending, false);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ret = ops->prune();
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   atomic_store(&config->history_prune_duration,
+                (int64_t)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+
+   return ret;
+}
+
+int
+pgexporter_history_shutdown(void)
+{
+   int ret;
+
+   if (ops == NULL)
+   {
+      return 1;
+   }
+   ret = ops->shutdown();
+   ops = NULL;
+   return ret;
+}
+
+/**
+ * A queued snapshot, followed by its samples and its strings
+ */
+struct history_queue_entry
+{
+   time_t ts;             /**< The time of the snapshot */
+   int number_of_strings; /**< The number of strings */
+   int number_of_samples; /**< The number of samples */
+   size_t size;           /**< The size of the entry, including the header */
+};
+
+#define HISTORY_QUEUE_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+/**
+ * Write structured samples to the backend as one snapshot.
+ *
+ * @param ts The time of the snapshot
+ * @param samples The samples
+ * @param number_of_samples The number of samples
+ * @param strings The sample strings, indexed by id
+ * @return 0 on success, 1 on failure
+ */
+static int
+history_store_samples(time_t ts, struct prometheus_sample* samples, int number_of_samples, char** strings)
+{
+   struct history_record* records = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   int status = 1;
+
+   if (number_of_samples <= 0)
+   {
+      return 0;
+   }
+
+   records = calloc(number_of_samples, sizeof(struct history_record));
+   if (records == NULL)
+   {
+      pgexporter_log_error("history: records malloc failed");
+      return 1;
+   }
+
+   for (int i = 0; i < number_of_samples; i++)
+   {
+      char* labels = strings[samples[i].labels];
+
+      records[i].ts = ts;
+      records[i].value = samples[i].value;
+      pgexporter_snprintf(records[i].metric, PROMETHEUS_LENGTH, "%s", strings[samples[i].name]);
+      pgexporter_snprintf(records[i].server, MISC_LENGTH, "%s", strings[samples[i].server]);
+      /* Borrowed from the strings, so the records are released with free() */
+      records[i].labels = strlen(labels) > 0 ? labels : NULL;
+   }
+
+   status = pgexporter_history_write_batch(records, number_of_samples);
+   if (status == 0 && (int64_t)ts > atomic_load(&config->history_last_store_time))
+   {
+      atomic_store(&config->history_last_store_time, (int64_t)ts);
+   }
+
+   if (status == 0 && config->remote_write_url[0] != '\0')
+   {
+      pgexporter_remote_write_spool(records, number_of_samples);
+   }
+
+   free(records);
+
+   return status;
+}
+
+int
+pgexporter_history_store_metrics(struct prometheus_metrics_container* container)
+{
+   if (container == NULL)
+   {
+      return 1;
+   }
+
+   return history_store_samples(time(NULL), container->samples, container->number_of_samples,
+                                container->sample_strings);
+}
+
+/**
+ * Are there snapshots waiting in the queue
+ *
+ * @return true if the queue is not empty
+ */
+static bool
+history_queue_pending(void)
+{
+   struct history_queue* queue = (struct history_queue*)history_queue_shmem;
+   signed char queue_is_free = STATE_FREE;
+   bool pending = false;
+
+   if (queue == NULL)
+   {
+      return false;
+   }
+
+   if (!atomic_compare_exchange_strong(&queue->lock, &queue_is_free, STATE_IN_USE))
+   {
+      /* Being written, so there will be something to drain */
+      return true;
    }
-   return ops->query_range(metric, start, end, records_out, count_out);
+
+   pending = queue->used > 0;
+
+   atomic_store(&queue->lock, STATE_FREE);
+
+   return pending;
 }
 
-int
-pgexporter_history_prune(void)
+/**
+ * Is an automatic snapshot due? A snapshot stored or queued by a scrape
+ * within history_interval is recent enough, so the metrics are not
+ * collected a second time.
+ */
+static bool
+history_snapshot_due(void)
 {
-   if (ops == NULL)
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_queue* queue = (struct history_queue*)history_queue_shmem;
+   int64_t last = atomic_load(&config->history_last_store_time);
+   int tick_time = pgexporter_time_convert(config->history_interval, FORMAT_TIME_S);
+
+   if (tick_time <= 0)
    {
-      return 1;
+      return false;
+   }
+
+   if (queue != NULL && atomic_load(&queue->last_snapshot_time) > last)
+   {
+      last = atomic_load(&queue->last_snapshot_time);
    }
-   return ops->prune();
+
+   return (int64_t)time(NULL) >= last + tick_time;
 }
 
 int
-pgexporter_history_shutdown(void)
+pgexporter_history_init_queue(size_t* p_size, void** p_shmem)
 {
-   int ret;
+   struct history_queue* queue = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   size_t queue_size = config->history_queue_size > 0 ? config->history_queue_size : HISTORY_DEFAULT_QUEUE_SIZE;
+   size_t size = sizeof(struct history_queue) + queue_size;
 
-   if (ops == NULL)
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   if (pgexporter_create_shared_memory(size, config->hugepage, (void*)&queue))
    {
+      pgexporter_log_error("history: cannot allocate shared memory for the queue");
       return 1;
    }
-   ret = ops->shutdown();
-   ops = NULL;
-   return ret;
+
+   memset(queue, 0, size);
+   atomic_init(&queue->lock, STATE_FREE);
+   atomic_init(&queue->dropped, 0);
+   queue->size = queue_size;
+
+   *p_size = size;
+   *p_shmem = queue;
+
+   return 0;
 }
 
-/**
- * Parse a raw Prometheus container directly into an array
- * of history_record structs and store them in the database.
- *
- * @param container The metrics container
- * @return 0 on success, 1 on failure
- */
 int
-pgexporter_history_store_metrics(struct prometheus_metrics_container* container)
+pgexporter_history_enqueue(struct prometheus_metrics_container* container)
 {
-   int capacity = 100;
-   int count = 0;
-   struct history_record* records = NULL;
-   time_t now = time(NULL);
-   int status = 1;
-
-   if (container == NULL)
+   struct history_queue* queue = (struct history_queue*)history_queue_shmem;
+   struct history_queue_entry* entry = NULL;
+   signed char queue_is_free = STATE_FREE;
+   size_t strings_size = 0;
+   size_t size = 0;
+   char* p = NULL;
+
+   if (queue == NULL || container == NULL || container->number_of_samples == 0)
    {
       return 1;
    }
 
-   records = malloc(sizeof(struct history_record) * capacity);
-   if (records == NULL)
+   for (int i = 0; i < container->number_of_sample_strings; i++)
    {
-      return 1;
+      strings_size += strlen(container->sample_strings[i]) + 1;
    }
 
-   struct art* trees[] = {
-      container->general_metrics,
-      container->server_metrics,
-      container->version_metrics,
-      container->uptime_metrics,
-      container->primary_metrics,
-      container->fips_metrics,
-      container->core_metrics,
-      container->extension_metrics,
-      container->extension_list_metrics,
-      container->settings_metrics,
-      container->custom_metrics,
-      container->alert_metrics};
+   size = HISTORY_QUEUE_ALIGN(sizeof(struct history_queue_entry) +
+                              container->number_of_samples * sizeof(struct prometheus_sample) +
+                              strings_size);
 
-   for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++)
+   /* Never wait for the worker, the snapshot is simply dropped */
+   if (!atomic_compare_exchange_strong(&queue->lock, &queue_is_free, STATE_IN_USE))
    {
-      struct art_iterator* iter = NULL;
-      if (trees[i] == NULL)
-      {
-         continue;
-      }
+      goto dropped;
+   }
+
+   if (queue->used + size > queue->size)
+   {
+      atomic_store(&queue->lock, STATE_FREE);
 
-      if (pgexporter_art_iterator_create(trees[i], &iter) == 0)
+      if (size > queue->size)
       {
-         while (pgexporter_art_iterator_next(iter))
-         {
-            char* val = NULL;
-            if (pgexporter_prometheus_iterator_value(iter, &val) && val != NULL)
-            {
-               const char* line = val;
-               /* Iterate over each line in the multiline Prometheus exposition block */
-               while (*line != '\0')
-               {
-                  const char* next_line = strchr(line, '\n');
-                  size_t line_len;
-                  if (next_line)
-                  {
-                     line_len = next_line - line;
-                  }
-                  else
-                  {
-                     line_len = strlen(line);
-                  }
-
-                  if (line_len > 0 && line[line_len - 1] == '\r')
-                  {
-                     line_len--;
-                  }
-
-                  if (line_len == 0 || line[0] == '#')
-                  {
-                     if (!next_line)
-                        break;
-                     line = next_line + 1;
-                     continue;
-                  }
-
-                  char metric_name[PROMETHEUS_LENGTH] = {0};
-                  char* labels = NULL;
-                  char server[MISC_LENGTH] = {0};
-                  double value = 0.0;
-
-                  const char* p = line;
-                  const char* end_of_line = line + line_len;
-                  const char* name_start = p;
-
-                  /* Extract the metric name, stopping at the first brace or whitespace */
-                  while (p < end_of_line && *p != '{' && !isspace((unsigned char)*p))
-                  {
-                     p++;
-                  }
-
-                  size_t name_len = p - name_start;
-                  pgexporter_snprintf(metric_name, sizeof(metric_name), "%.*s", (int)name_len, name_start);
-
-                  /* If labels are present, extract the full label string and look for the 'server' label */
-                  if (p < end_of_line && *p == '{')
-                  {
-                     p++;
-                     const char* labels_start = p;
-                     bool escaped = false;
-                     bool in_quotes = false;
-                     while (p < end_of_line)
-                     {
-                        if (!escaped && *p == '"')
-                           in_quotes = !in_quotes;
-                        else if (!in_quotes && *p == '}')
-                           break;
-                        escaped = (*p == '\\' && !escaped);
-                        p++;
-                     }
-
-                     if (p < end_of_line && *p == '}')
-                     {
-                        size_t labels_len = p - labels_start;
-                        labels = malloc(labels_len + 1);
-                        if (labels == NULL)
-                        {
-                           pgexporter_log_error("history: labels malloc failed");
-                           goto cleanup;
-                        }
-                        memcpy(labels, labels_start, labels_len);
-                        labels[labels_len] = '\0';
-
-                        char* server_pos = strstr(labels, "server=\"");
-                        if (server_pos)
-                        {
-                           server_pos += 8;
-                           char* end_quote = strchr(server_pos, '"');
-                           if (end_quote)
-                           {
-                              size_t server_len = end_quote - server_pos;
-                              pgexporter_snprintf(server, sizeof(server), "%.*s", (int)server_len, server_pos);
-                           }
-                        }
-                        p++;
-                     }
-                  }
-
-                  /* Skip any trailing whitespace before the value */
-                  while (p < end_of_line && isspace((unsigned char)*p))
-                  {
-                     p++;
-                  }
-
-                  if (p < end_of_line)
-                  {
-                     /* we must strtod from a null-terminated string, so let's copy the rest of the line */
-                     char val_buf[64] = {0};
-                     size_t val_len = end_of_line - p;
-                     pgexporter_snprintf(val_buf, sizeof(val_buf), "%.*s", (int)val_len, p);
-                     value = strtod(val_buf, NULL);
-                  }
-
-                  if (count >= capacity)
-                  {
-                     struct history_record* new_records = NULL;
-                     capacity *= 2;
-                     new_records = realloc(records, sizeof(struct history_record) * capacity);
-                     if (new_records == NULL)
-                     {
-                        pgexporter_log_error("history: realloc failed");
-                        free(labels);
-                        goto cleanup;
-                     }
-                     records = new_records;
-                  }
-
-                  memset(&records[count], 0, sizeof(struct history_record));
-                  records[count].ts = now;
-                  records[count].value = value;
-                  pgexporter_snprintf(records[count].metric, PROMETHEUS_LENGTH, "%s", metric_name);
-                  pgexporter_snprintf(records[count].server, MISC_LENGTH, "%s", server);
-                  records[count].labels = labels; /* transfer ownership; may be NULL */
-                  labels = NULL;
-
-                  count++;
-
-                  if (!next_line)
-                     break;
-                  line = next_line + 1;
-               }
-            }
-         }
-         pgexporter_art_iterator_destroy(iter);
+         pgexporter_log_debug("history: snapshot of %zu bytes is larger than the queue", size);
       }
+
+      goto dropped;
+   }
+
+   entry = (struct history_queue_entry*)(queue->data + queue->used);
+   entry->ts = time(NULL);
+   entry->number_of_strings = container->number_of_sample_strings;
+   entry->number_of_samples = container->number_of_samples;
+   entry->size = size;
+
+   p = (char*)(entry + 1);
+   memcpy(p, container->samples, container->number_of_samples * sizeof(struct prometheus_sample));
+   p += container->number_of_samples * sizeof(struct prometheus_sample);
+
+   for (int i = 0; i < container->number_of_sample_strings; i++)
+   {
+      size_t length = strlen(container->sample_strings[i]) + 1;
+
+      memcpy(p, container->sample_strings[i], length);
+      p += length;
+   }
+
+   queue->used += size;
+   atomic_store(&queue->last_snapshot_time, (int64_t)entry->ts);
+
+   atomic_store(&queue->lock, STATE_FREE);
+
+   return 0;
+
+dropped:
+   atomic_fetch_add(&queue->dropped, 1);
+   pgexporter_log_debug("history: queue full, snapshot dropped");
+
+   return 1;
+}
+
+int
+pgexporter_history_drain(void)
+{
+   struct history_queue* queue = (struct history_queue*)history_queue_shmem;
+   signed char queue_is_free;
+   char* data = NULL;
+   size_t used = 0;
+   size_t offset = 0;
+   unsigned long dropped = 0;
+   int status = 0;
+
+   if (queue == NULL)
+   {
+      return 0;
+   }
+
+retry:
+   queue_is_free = STATE_FREE;
+   if (!atomic_compare_exchange_strong(&queue->lock, &queue_is_free, STATE_IN_USE))
+   {
+      SLEEP_AND_GOTO(1000000L, retry);
    }
 
-   if (count > 0 && records != NULL)
+   /* Only hold the lock for the copy, the producers must not wait for the backend */
+   used = queue->used;
+   if (used > 0)
    {
-      struct configuration* config = (struct configuration*)shmem;
-      status = pgexporter_history_write_batch(records, count);
-      if (status == 0)
+      data = malloc(used);
+      if (data != NULL)
       {
-         atomic_store(&config->history_last_store_time, (int64_t)time(NULL));
+         memcpy(data, queue->data, used);
       }
+      queue->used = 0;
    }
-   else
+
+   atomic_store(&queue->lock, STATE_FREE);
+
+   /* The counter itself is exposed as a metric, only report what is new */
+   dropped = atomic_load(&queue->dropped);
+   if (dropped > queue->reported)
    {
-      status = 0;
+      pgexporter_log_warn("history: %lu snapshots dropped because the queue was full, consider raising history_queue_size (%zu)",
+                          dropped - queue->reported, queue->size);
+      queue->reported = dropped;
+   }
+
+   if (used > 0 && data == NULL)
+   {
+      pgexporter_log_error("history: queue malloc failed");
+      return 1;
+   }
+
+   while (offset < used)
+   {
+      struct history_queue_entry* entry = (struct history_queue_entry*)(data + offset);
+      struct prometheus_sample* samples = (struct prometheus_sample*)(entry + 1);
+      char** strings = NULL;
+      char* p = (char*)(samples + entry->number_of_samples);
+
+      strings = malloc(entry->number_of_strings * sizeof(char*));
+      if (strings == NULL)
+      {
+         pgexporter_log_error("history: strings malloc failed");
+         status = 1;
+         break;
+      }
+
+      for (int i = 0; i < entry->number_of_strings; i++)
+      {
+         strings[i] = p;
+         p += strlen(p) + 1;
+      }
+
+      if (history_store_samples(entry->ts, samples, entry->number_of_samples, strings))
+      {
+         status = 1;
+      }
+
+      free(strings);
+
+      offset += entry->size;
    }
 
-cleanup:
-   pgexporter_history_records_free(records, count);
+   free(data);
 
    return status;
 }
@@ -359,11 +1083,15 @@ pgexporter_history_records_free(struct history_record* records, int count)
 }
 
 /**
- * Child-process worker that fetches the current metrics directly
- * and persists them as one history snapshot. Called after fork(); exit(0)s.
+ * Child-process worker that stores the snapshots queued by the metrics
+ * endpoint, then, if requested and no scrape was queued in the meantime,
+ * fetches the current metrics directly and persists them as one history
+ * snapshot. Called after fork(); exit(0)s.
+ *
+ * @param scrape Take a snapshot of the current metrics
  */
 static void
-history_tick_worker(void)
+history_tick_worker(bool scrape)
 {
    struct configuration* config = (struct configuration*)shmem;
    prometheus_metrics_container_t* container = NULL;
@@ -374,7 +1102,17 @@ history_tick_worker(void)
       goto child_done;
    }
 
-   if (pgexporter_prometheus_scrape(&container) != 0)
+   if (pgexporter_history_drain() != 0)
+   {
+      pgexporter_log_warn("history: failed to store queued snapshots");
+   }
+
+   if (!scrape || !history_snapshot_due())
+   {
+      goto child_done;
+   }
+
+   if (pgexporter_prometheus_scrape(&container, true) != 0)
    {
       pgexporter_log_error("history: failed to scrape metrics");
       goto child_done;
@@ -399,8 +1137,7 @@ pgexporter_history_tick_cb(void)
 {
    struct configuration* config = (struct configuration*)shmem;
    pid_t pid;
-   time_t now = time(NULL);
-   int tick_time = 0;
+   bool scrape = false;
    bool expected = false;
 
    if (config == NULL || config->history == 0)
@@ -408,13 +1145,9 @@ pgexporter_history_tick_cb(void)
       return;
    }
 
-   tick_time = pgexporter_time_convert(config->history_interval, FORMAT_TIME_S);
-   if (tick_time <= 0)
-   {
-      return;
-   }
+   scrape = history_snapshot_due();
 
-   if (now < (time_t)atomic_load(&config->history_last_store_time) + tick_time)
+   if (!scrape && !history_queue_pending())
    {
       return;
    }
@@ -440,12 +1173,13 @@ pgexporter_history_tick_cb(void)
       return;
    }
 
-   history_tick_worker();
+   history_tick_worker(scrape);
 }
 
 /**
- * Child-process worker that opens its own database connection and prunes
- * records older than the configured retention. Called after fork(); exit(0)s.
+ * Child-process worker that opens its own database connection, rolls up
+ * the new records and prunes records older than the configured retention.
+ * Called after fork(); exit(0)s.
  */
 static void
 history_retention_worker(void)
@@ -458,6 +1192,12 @@ history_retention_worker(void)
       goto child_done;
    }
 
+   /* Rollups first, as prune never removes what is not rolled up yet */
+   if (pgexporter_history_rollup() != 0)
+   {
+      pgexporter_log_error("history: rollup failed");
+   }
+
    if (pgexporter_history_prune() != 0)
    {
       pgexporter_log_error("history: prune failed");
@@ -506,8 +1246,85 @@ pgexporter_history_retention_tick_cb(void)
    history_retention_worker();
 }
 
+/* Size at which a /history response is sent as a chunk */
+#define HISTORY_STREAM_FLUSH_SIZE (64 * 1024)
+
+/**
+ * A /history response written as the records are read from the backend
+ */
+struct history_stream
+{
+   SSL* ssl;                        /**< The SSL connection */
+   int fd;                          /**< The socket */
+   struct http_server_request* req; /**< The request */
+   char* buffer;                    /**< The pending output */
+   size_t length;                   /**< The length of the pending output */
+   size_t capacity;                 /**< The capacity of the buffer */
+   bool started;                    /**< The response header has been sent */
+   int count;                       /**< The number of records written */
+};
+
+static int
+history_aggregation(const char* str)
+{
+   if (!strcmp(str, "avg"))
+   {
+      return HISTORY_AGGREGATION_AVG;
+   }
+   else if (!strcmp(str, "min"))
+   {
+      return HISTORY_AGGREGATION_MIN;
+   }
+   else if (!strcmp(str, "max"))
+   {
+      return HISTORY_AGGREGATION_MAX;
+   }
+   else if (!strcmp(str, "last"))
+   {
+      return HISTORY_AGGREGATION_LAST;
+   }
+   else if (!strcmp(str, "rate"))
+   {
+      return HISTORY_AGGREGATION_RATE;
+   }
+
+   return HISTORY_AGGREGATION_NONE;
+}
+
+/**
+ * Decode a percent-encoded query parameter in place
+ */
+static void
+history_url_decode(char* str)
+{
+   char* in = str;
+   char* out = str;
+
+   while (*in != '\0')
+   {
+      if (*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2]))
+      {
+         char hex[3] = {in[1], in[2], '\0'};
+
+         *out++ = (char)strtol(hex, NULL, 16);
+         in += 3;
+      }
+      else if (*in == '+')
+      {
+         *out++ = ' ';
+         in++;
+      }
+      else
+      {
+         *out++ = *in++;
+      }
+   }
+
+   *out = '\0';
+}
+
 static bool
-history_query_param(const char* query, const char* name, char* out, size_t out_size)
+history_query_param(const char* query, const char* name, int occurrence, char* out, size_t out_size)
 {
    size_t name_len = strlen(name);
    const char* p = query;
@@ -535,7 +1352,7 @@ history_query_param(const char* query, const char* name, char* out, size_t out_s
 
       key_len = (size_t)(eq - p);
 
-      if (key_len == name_len && strncmp(p, name, name_len) == 0)
+      if (key_len == name_len && strncmp(p, name, name_len) == 0 && occurrence-- == 0)
       {
          const char* val_start = eq + 1;
          size_t val_len = amp != NULL ? (size_t)(amp - val_start) : strlen(val_start);
@@ -547,6 +1364,7 @@ history_query_param(const char* query, const char* name, char* out, size_t out_s
 
          memcpy(out, val_start, val_len);
          out[val_len] = '\0';
+         history_url_decode(out);
          return true;
       }
 
@@ -561,6 +1379,155 @@ history_query_param(const char* query, const char* name, char* out, size_t out_s
    return false;
 }
 
+static int
+history_stream_append(struct history_stream* stream, const char* str, size_t length)
+{
+   if (stream->length + length + 1 > stream->capacity)
+   {
+      size_t capacity = stream->capacity > 0 ? stream->capacity : HISTORY_STREAM_FLUSH_SIZE;
+      char* buffer = NULL;
+
+      while (stream->length + length + 1 > capacity)
+      {
+         capacity *= 2;
+      }
+
+      buffer = realloc(stream->buffer, capacity);
+      if (buffer == NULL)
+      {
+         return 1;
+      }
+
+      stream->buffer = buffer;
+      stream->capacity = capacity;
+   }
+
+   memcpy(stream->buffer + stream->length, str, length);
+   stream->length += length;
+   stream->buffer[stream->length] = '\0';
+
+   return 0;
+}
+
+static int
+history_stream_append_string(struct history_stream* stream, const char* str)
+{
+   const char* start = str;
+
+   if (history_stream_append(stream, "\"", 1))
+   {
+      return 1;
+   }
+
+   for (const char* p = str; *p != '\0'; p++)
+   {
+      char control[7];
+      const char* escaped = NULL;
+      size_t length = 2;
+
+      switch (*p)
+      {
+         case '\\':
+            escaped = "\\\\";
+            break;
+         case '\"':
+            escaped = "\\\"";
+            break;
+         case '\n':
+            escaped = "\\n";
+            break;
+         case '\t':
+            escaped = "\\t";
+            break;
+         case '\r':
+            escaped = "\\r";
+            break;
+         default:
+            if ((unsigned char)*p >= 0x20)
+            {
+               continue;
+            }
+
+            /* Any other control character is not allowed raw in a JSON string */
+            pgexporter_snprintf(control, sizeof(control), "\\u%04x", (unsigned int)(unsigned char)*p);
+            escaped = control;
+            length = 6;
+            break;
+      }
+
+      if (history_stream_append(stream, start, p - start) || history_stream_append(stream, escaped, length))
+      {
+         return 1;
+      }
+
+      start = p + 1;
+   }
+
+   return history_stream_append(stream, start, strlen(start)) || history_stream_append(stream, "\"", 1);
+}
+
+/**
+ * Send what has been buffered, starting the chunked response first
+ */
+static int
+history_stream_flush(struct history_stream* stream)
+{
+   if (!stream->started)
+   {
+      if (pgexporter_http_respond_chunked_start(stream->ssl, stream->fd, stream->req, "application/json; charset=utf-8") != MESSAGE_STATUS_OK)
+      {
+         return 1;
+      }
+      stream->started = true;
+   }
+
+   if (stream->length > 0)
+   {
+      if (pgexporter_http_respond_chunked_write(stream->ssl, stream->fd, stream->buffer) != MESSAGE_STATUS_OK)
+      {
+         return 1;
+      }
+      stream->length = 0;
+   }
+
+   return 0;
+}
+
+static int
+history_stream_record(void* data, struct history_record* record)
+{
+   struct history_stream* stream = (struct history_stream*)data;
+   char numbers[MISC_LENGTH * 2];
+
+   if ((stream->count > 0 && history_stream_append(stream, ",", 1)) ||
+       history_stream_append(stream, "{\"labels\":", 10) ||
+       history_stream_append_string(stream, record->labels != NULL ? record->labels : "") ||
+       history_stream_append(stream, ",\"metric\":", 10) ||
+       history_stream_append_string(stream, record->metric) ||
+       history_stream_append(stream, ",\"server\":", 10) ||
+       history_stream_append_string(stream, record->server))
+   {
+      return 1;
+   }
+
+   pgexporter_snprintf(numbers, sizeof(numbers), ",\"timestamp\":%lld,\"value\":%f}",
+                       (long long)record->ts, record->value);
+
+   if (history_stream_append(stream, numbers, strlen(numbers)))
+   {
+      return 1;
+   }
+
+   stream->count++;
+
+   if (stream->length >= HISTORY_STREAM_FLUSH_SIZE)
+   {
+      return history_stream_flush(stream);
+   }
+
+   return 0;
+}
+
 void
 pgexporter_history_http(SSL* ssl, int fd)
 {
@@ -572,18 +1539,20 @@ pgexporter_history_http(SSL* ssl, int fd)
    char value_buf[64];
    time_t ts;
    long long duration;
-   time_t start;
-   time_t end;
-   struct history_record* records = NULL;
-   int count = 0;
-   struct json* root = NULL;
-   char* json_str = NULL;
+   char match_buf[MISC_LENGTH * 2];
+   struct history_query history_query;
+   struct history_stream stream;
 
    pgexporter_start_logging();
    pgexporter_memory_init();
 
    config = (struct configuration*)shmem;
 
+   memset(&history_query, 0, sizeof(struct history_query));
+   memset(&stream, 0, sizeof(struct history_stream));
+   stream.ssl = ssl;
+   stream.fd = fd;
+
    if (pgexporter_history_init())
    {
       pgexporter_log_error("History: failed to initialize backend");
@@ -611,7 +1580,7 @@ pgexporter_history_http(SSL* ssl, int fd)
          char* redirect_path = "/";
          char* base_url = NULL;
 
-         if (pgexporter_read_timeout_message(NULL, fd, (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S), &redirect_msg) != MESSAGE_STATUS_OK)
+         if (pgexporter_read_timeout_message(NULL, fd, (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS), &redirect_msg) != MESSAGE_STATUS_OK)
          {
             pgexporter_log_error("History: failed to read redirect message");
             goto error;
@@ -631,7 +1600,7 @@ pgexporter_history_http(SSL* ssl, int fd)
 
          base_url = pgexporter_format_and_append(base_url, "https://localhost:%d%s", config->history, redirect_path);
 
-         if (pgexporter_http_respond_redirect(NULL, fd, base_url) != MESSAGE_STATUS_OK)
+         if (pgexporter_http_respond_redirect(NULL, fd, NULL, base_url) != MESSAGE_STATUS_OK)
          {
             pgexporter_log_error("History: failed to redirect to: %s", base_url);
             free(base_url);
@@ -653,6 +1622,8 @@ pgexporter_history_http(SSL* ssl, int fd)
       goto error;
    }
 
+   stream.req = req;
+
    path = req->path;
    query = strchr(path, '?');
    if (query != NULL)
@@ -663,7 +1634,7 @@ pgexporter_history_http(SSL* ssl, int fd)
 
    if (strncmp(path, "/history/", strlen("/history/")) != 0 || strlen(path) <= strlen("/history/"))
    {
-      pgexporter_http_respond_404(ssl, fd);
+      pgexporter_http_respond_404(ssl, fd, req);
       goto done;
    }
 
@@ -684,7 +1655,7 @@ pgexporter_history_http(SSL* ssl, int fd)
    ts = time(NULL);
    duration = -3600;
 
-   if (history_query_param(query, "timestamp", value_buf, sizeof(value_buf)))
+   if (history_query_param(query, "timestamp", 0, value_buf, sizeof(value_buf)))
    {
       char* endptr = NULL;
       long long parsed = strtoll(value_buf, &endptr, 10);
@@ -698,7 +1669,7 @@ pgexporter_history_http(SSL* ssl, int fd)
       ts = (time_t)parsed;
    }
 
-   if (history_query_param(query, "duration", value_buf, sizeof(value_buf)))
+   if (history_query_param(query, "duration", 0, value_buf, sizeof(value_buf)))
    {
       char* endptr = NULL;
 
@@ -711,58 +1682,85 @@ pgexporter_history_http(SSL* ssl, int fd)
       }
    }
 
-   start = ts + (duration < 0 ? (time_t)duration : 0);
-   end = ts + (duration > 0 ? (time_t)duration : 0);
+   history_query.start = ts + (duration < 0 ? (time_t)duration : 0);
+   history_query.end = ts + (duration > 0 ? (time_t)duration : 0);
 
-   if (pgexporter_history_query_range(metric, start, end, &records, &count))
+   if (history_query_param(query, "step", 0, value_buf, sizeof(value_buf)))
    {
-      pgexporter_http_respond_500(ssl, fd);
-      goto done;
-   }
+      char* endptr = NULL;
+      long long step = strtoll(value_buf, &endptr, 10);
 
-   if (pgexporter_json_create(&root))
-   {
-      pgexporter_http_respond_500(ssl, fd);
-      goto done;
+      if (endptr == value_buf || *endptr != '\0' || step <= 0)
+      {
+         pgexporter_http_respond_400(ssl, fd);
+         goto done;
+      }
+
+      history_query.step = (time_t)step;
+      history_query.aggregation = HISTORY_AGGREGATION_AVG;
    }
 
-   for (int i = 0; i < count; i++)
+   if (history_query_param(query, "agg", 0, value_buf, sizeof(value_buf)))
    {
-      struct json* item = NULL;
+      history_query.aggregation = history_aggregation(value_buf);
 
-      if (pgexporter_json_create(&item))
+      if (history_query.aggregation == HISTORY_AGGREGATION_NONE)
       {
-         continue;
+         pgexporter_http_respond_400(ssl, fd);
+         goto done;
       }
 
-      pgexporter_json_put(item, "timestamp", (uintptr_t)records[i].ts, ValueInt64);
-      pgexporter_json_put(item, "server", (uintptr_t)records[i].server, ValueString);
-      pgexporter_json_put(item, "metric", (uintptr_t)records[i].metric, ValueString);
+      /* Without a step the whole window is one bucket */
+      if (history_query.step == 0)
+      {
+         history_query.step = history_query.end - history_query.start + 1;
+      }
+   }
 
-      if (records[i].labels != NULL)
+   while (history_query_param(query, "match", history_query.number_of_matchers, match_buf, sizeof(match_buf)))
+   {
+      if (history_query.number_of_matchers >= HISTORY_MAX_MATCHERS ||
+          pgexporter_history_matcher_parse(match_buf, &history_query.matchers[history_query.number_of_matchers]))
       {
-         pgexporter_json_put(item, "labels", (uintptr_t)records[i].labels, ValueString);
+         pgexporter_http_respond_400(ssl, fd);
+         goto done;
       }
 
-      pgexporter_json_put(item, "value", pgexporter_value_from_double(records[i].value), ValueDouble);
+      history_query.number_of_matchers++;
+   }
 
-      pgexporter_json_append(root, (uintptr_t)item, ValueJSON);
+   /* The head of the response doesn't depend on the samples */
+   if (req->head)
+   {
+      pgexporter_http_respond_chunked_start(ssl, fd, req, "application/json; charset=utf-8");
+      goto done;
    }
 
-   json_str = pgexporter_json_to_string(root, FORMAT_JSON, NULL, 0);
+   if (history_stream_append(&stream, "[", 1) ||
+       pgexporter_history_query(metric, &history_query, history_stream_record, &stream))
+   {
+      if (!stream.started)
+      {
+         pgexporter_http_respond_500(ssl, fd);
+      }
+      else
+      {
+         /* The header is gone, so the client only sees a truncated response */
+         pgexporter_log_error("History: query for %s failed after %d records", metric, stream.count);
+      }
+      goto done;
+   }
 
-   if (json_str == NULL)
+   if (history_stream_append(&stream, "]", 1) || history_stream_flush(&stream))
    {
-      pgexporter_http_respond_500(ssl, fd);
       goto done;
    }
 
-   pgexporter_http_respond_ok(ssl, fd, "application/json; charset=utf-8", json_str, strlen(json_str));
+   pgexporter_http_respond_chunked_end(ssl, fd);
 
 done:
-   free(json_str);
-   pgexporter_json_destroy(root);
-   pgexporter_history_records_free(records, count);
+   free(stream.buffer);
+   pgexporter_history_query_destroy(&history_query);
    pgexporter_http_server_request_destroy(req);
    pgexporter_close_ssl(ssl);
    pgexporter_disconnect(fd);
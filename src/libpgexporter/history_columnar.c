@@ -0,0 +1,1656 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <history_columnar.h>
+#include <art.h>
+#include <logging.h>
+#include <pgexporter.h>
+#include <shmem.h>
+#include <utils.h>
+#include <value.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Columnar Backend for pgexporter History
+ *
+ * This module implements the `HISTORY_BACKEND_COLUMNAR` backend, storing
+ * metrics history in the directory pointed to by `history_path`:
+ *
+ * - `series` is an append-only dictionary of (id, server, metric, labels),
+ *   so the strings are stored once per series instead of once per sample.
+ * - Every partition covers HISTORY_COLUMNAR_PARTITION_SECONDS. Samples are
+ *   appended to `<start>.raw` as fixed size (ts, series id, value) rows.
+ * - Once a partition is closed it is compacted into `<start>.col`: an index
+ *   sorted by series id, followed by one chunk per series with the
+ *   timestamps stored as delta-of-delta and the values XOR'ed with the
+ *   previous value (Gorilla-style).
+ * - Queries memory-map the partition files and only decode the chunks of
+ *   the series of the metric that match the label matchers.
+ * - Retention removes whole partition files.
+ * - Compaction and retention take an exclusive flock on the directory, as
+ *   both the history worker and the retention worker compact.
+ */
+
+#define COLUMNAR_MAGIC        "PGEXCOL1"
+#define COLUMNAR_MAGIC_LENGTH 8
+#define COLUMNAR_SERIES_FILE  "series"
+#define COLUMNAR_RAW_SUFFIX   ".raw"
+#define COLUMNAR_COL_SUFFIX   ".col"
+
+/**
+ * A row of an open partition
+ */
+struct columnar_raw
+{
+   int64_t ts;        /**< The timestamp */
+   uint32_t series;   /**< The series id */
+   uint32_t reserved; /**< Padding */
+   double value;      /**< The value */
+};
+
+/**
+ * The header of a compacted partition
+ */
+struct columnar_header
+{
+   char magic[COLUMNAR_MAGIC_LENGTH]; /**< COLUMNAR_MAGIC */
+   int64_t start;                     /**< The start of the partition */
+   uint32_t number_of_series;         /**< The number of index entries */
+   uint32_t reserved;                 /**< Padding */
+};
+
+/**
+ * An index entry of a compacted partition
+ */
+struct columnar_index
+{
+   uint32_t series;   /**< The series id */
+   uint32_t count;    /**< The number of samples */
+   int64_t first_ts;  /**< The first timestamp */
+   int64_t last_ts;   /**< The last timestamp */
+   uint64_t offset;   /**< The offset of the chunk in the file */
+   uint64_t length;   /**< The length of the chunk */
+};
+
+/**
+ * A record of the series dictionary, followed by the strings
+ */
+struct columnar_series_record
+{
+   uint32_t id;            /**< The series id */
+   uint32_t server_length; /**< The length of the server name */
+   uint32_t metric_length; /**< The length of the metric name */
+   uint32_t labels_length; /**< The length of the label set */
+};
+
+/**
+ * A series of the dictionary
+ */
+struct columnar_series
+{
+   char server[MISC_LENGTH];       /**< The server name */
+   char metric[PROMETHEUS_LENGTH]; /**< The metric name */
+   char* labels;                   /**< The label set */
+};
+
+struct bit_writer
+{
+   uint8_t* data;   /**< The data */
+   size_t size;     /**< The number of bytes used */
+   size_t capacity; /**< The capacity */
+   int free_bits;   /**< The number of free bits in the last byte */
+};
+
+struct bit_reader
+{
+   const uint8_t* data; /**< The data */
+   size_t length;       /**< The length in bytes */
+   size_t position;     /**< The position in bits */
+};
+
+static char directory[MAX_PATH];
+static struct art* series_ids = NULL;
+static struct columnar_series* series = NULL;
+static int number_of_series = 0;
+static int series_capacity = 0;
+static int series_fd = -1;
+
+static int bit_write(struct bit_writer* w, uint64_t value, int n);
+static void bit_align(struct bit_writer* w);
+static int bit_read(struct bit_reader* r, int n, uint64_t* value);
+static int64_t sign_extend(uint64_t value, int bits);
+static int encode_samples(struct bit_writer* w, struct columnar_raw* samples, int count);
+static int decode_samples(const uint8_t* data, size_t length, struct columnar_index* index,
+                          time_t start, time_t end, struct columnar_raw** out, int* n, int* capacity);
+
+static char* series_key(const char* server, const char* metric, const char* labels);
+static int series_add(const char* server, const char* metric, const char* labels);
+static int series_load(char* path);
+static int series_id(const char* server, const char* metric, const char* labels);
+
+static int64_t partition_start(int64_t ts);
+static void partition_path(int64_t start, const char* suffix, char* path);
+static int partitions(int64_t** starts, int* n);
+static int partition_read(int64_t start, uint32_t* ids, int number_of_ids, time_t from, time_t to,
+                          struct columnar_raw** out, int* n, int* capacity);
+static int partition_append(int64_t start, struct columnar_raw* rows, int count);
+static int partition_compact(int64_t start);
+static uint64_t partition_records(int64_t start);
+static int compact_closed(void);
+static int directory_lock(bool wait);
+static void directory_unlock(int fd);
+
+static int raw_append(struct columnar_raw** out, int* n, int* capacity, struct columnar_raw* row);
+static bool ids_contains(uint32_t* ids, int number_of_ids, uint32_t id);
+static int compare_series_ts(const void* a, const void* b);
+static int compare_ts(const void* a, const void* b);
+
+int
+pgexporter_history_columnar_init(void)
+{
+   struct configuration* config;
+   char path[MAX_PATH];
+
+   if (series_ids != NULL)
+   {
+      return 0;
+   }
+
+   config = (struct configuration*)shmem;
+
+   if (!config || !config->history_path[0])
+   {
+      pgexporter_log_error("history_columnar: no history path configured");
+      goto error;
+   }
+
+   pgexporter_snprintf(directory, sizeof(directory), "%s", config->history_path);
+
+   if (pgexporter_mkdir(directory))
+   {
+      pgexporter_log_error("history_columnar: failed to create %s", directory);
+      goto error;
+   }
+
+   if (pgexporter_art_create(&series_ids))
+   {
+      goto error;
+   }
+
+   pgexporter_snprintf(path, sizeof(path), "%s/%s", directory, COLUMNAR_SERIES_FILE);
+
+   if (series_load(path))
+   {
+      goto error;
+   }
+
+   series_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+   if (series_fd == -1)
+   {
+      pgexporter_log_error("history_columnar: failed to open %s: %s", path, strerror(errno));
+      goto error;
+   }
+
+   pgexporter_log_debug("history_columnar: initialized at %s with %d series", directory, number_of_series);
+   return 0;
+
+error:
+
+   pgexporter_history_columnar_shutdown();
+
+   return 1;
+}
+
+int
+pgexporter_history_columnar_write_batch(struct history_record* records, int count)
+{
+   struct columnar_raw* rows = NULL;
+   int n = 0;
+   int lock = -1;
+   int64_t current = 0;
+
+   if (series_ids == NULL)
+   {
+      goto error;
+   }
+
+   if (count <= 0)
+   {
+      return 0;
+   }
+
+   rows = malloc(count * sizeof(struct columnar_raw));
+   if (rows == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      int id = series_id(records[i].server, records[i].metric, records[i].labels != NULL ? records[i].labels : "");
+      int64_t start = partition_start((int64_t)records[i].ts);
+
+      if (id < 0)
+      {
+         goto error;
+      }
+
+      /* A batch is usually one snapshot, so one partition */
+      if (n > 0 && start != current)
+      {
+         if (partition_append(current, rows, n))
+         {
+            goto error;
+         }
+         n = 0;
+      }
+
+      current = start;
+
+      memset(&rows[n], 0, sizeof(struct columnar_raw));
+      rows[n].ts = (int64_t)records[i].ts;
+      rows[n].series = (uint32_t)id;
+      rows[n].value = records[i].value;
+      n++;
+   }
+
+   if (n > 0 && partition_append(current, rows, n))
+   {
+      goto error;
+   }
+
+   free(rows);
+
+   /* Leave the compaction to the retention worker if it is busy */
+   lock = directory_lock(false);
+   if (lock != -1)
+   {
+      if (compact_closed())
+      {
+         pgexporter_log_warn("history_columnar: compaction failed");
+      }
+
+      directory_unlock(lock);
+   }
+
+   return 0;
+
+error:
+
+   free(rows);
+
+   return 1;
+}
+
+int
+pgexporter_history_columnar_query_stream(const char* metric, struct history_query* query,
+                                         history_record_callback callback, void* data)
+{
+   uint32_t* ids = NULL;
+   int number_of_ids = 0;
+   int64_t* starts = NULL;
+   int number_of_partitions = 0;
+   struct columnar_raw* rows = NULL;
+   int n = 0;
+   int capacity = 0;
+   struct history_record record;
+   time_t start;
+   time_t end;
+
+   if (series_ids == NULL || metric == NULL || query == NULL || callback == NULL)
+   {
+      goto error;
+   }
+
+   start = query->start;
+   end = query->end;
+
+   for (int i = 0; i < number_of_series; i++)
+   {
+      /* The dictionary is in memory, so the matchers select the series
+       * before any partition is read */
+      if (!strcmp(series[i].metric, metric) &&
+          pgexporter_history_matches(query, series[i].server, series[i].labels))
+      {
+         uint32_t* new_ids = realloc(ids, (number_of_ids + 1) * sizeof(uint32_t));
+         if (new_ids == NULL)
+         {
+            goto error;
+         }
+         ids = new_ids;
+         ids[number_of_ids++] = (uint32_t)i;
+      }
+   }
+
+   if (number_of_ids > 0)
+   {
+      if (partitions(&starts, &number_of_partitions))
+      {
+         goto error;
+      }
+
+      /* Only one partition is held in memory at a time */
+      for (int i = 0; i < number_of_partitions; i++)
+      {
+         if (starts[i] + HISTORY_COLUMNAR_PARTITION_SECONDS <= (int64_t)start || starts[i] > (int64_t)end)
+         {
+            continue;
+         }
+
+         n = 0;
+
+         if (partition_read(starts[i], ids, number_of_ids, start, end, &rows, &n, &capacity))
+         {
+            goto error;
+         }
+
+         /* The partitions are in time order, so only sort within the partition */
+         qsort(rows, n, sizeof(struct columnar_raw), compare_ts);
+
+         for (int j = 0; j < n; j++)
+         {
+            struct columnar_series* s = &series[rows[j].series];
+
+            memset(&record, 0, sizeof(struct history_record));
+            record.ts = (time_t)rows[j].ts;
+            record.value = rows[j].value;
+            pgexporter_snprintf(record.server, MISC_LENGTH, "%s", s->server);
+            pgexporter_snprintf(record.metric, PROMETHEUS_LENGTH, "%s", s->metric);
+            record.labels = s->labels;
+
+            if (callback(data, &record))
+            {
+               goto error;
+            }
+         }
+      }
+   }
+
+   free(rows);
+   free(starts);
+   free(ids);
+
+   return 0;
+
+error:
+
+   free(rows);
+   free(starts);
+   free(ids);
+
+   return 1;
+}
+
+int
+pgexporter_history_columnar_prune(void)
+{
+   struct configuration* config;
+   int64_t* starts = NULL;
+   int number_of_partitions = 0;
+   int64_t retention_s;
+   int64_t cutoff;
+   uint64_t records;
+   int lock = -1;
+   char path[MAX_PATH];
+
+   config = (struct configuration*)shmem;
+
+   if (series_ids == NULL || !config)
+   {
+      return 0;
+   }
+
+   /* A partition must not be removed while it is being compacted */
+   lock = directory_lock(true);
+   if (lock == -1)
+   {
+      goto error;
+   }
+
+   if (compact_closed())
+   {
+      pgexporter_log_warn("history_columnar: compaction failed");
+   }
+
+   if (!pgexporter_time_is_valid(config->history_retention))
+   {
+      directory_unlock(lock);
+      return 0;
+   }
+
+   retention_s = pgexporter_time_convert(config->history_retention, FORMAT_TIME_S);
+   if (retention_s <= 0)
+   {
+      directory_unlock(lock);
+      return 0;
+   }
+
+   cutoff = (int64_t)time(NULL) - retention_s;
+
+   if (partitions(&starts, &number_of_partitions))
+   {
+      goto error;
+   }
+
+   /* Only whole partitions are removed */
+   for (int i = 0; i < number_of_partitions; i++)
+   {
+      if (starts[i] + HISTORY_COLUMNAR_PARTITION_SECONDS > cutoff)
+      {
+         continue;
+      }
+
+      records = partition_records(starts[i]);
+
+      partition_path(starts[i], COLUMNAR_COL_SUFFIX, path);
+      if (pgexporter_exists(path))
+      {
+         pgexporter_delete_file(path);
+      }
+
+      partition_path(starts[i], COLUMNAR_RAW_SUFFIX, path);
+      if (pgexporter_exists(path))
+      {
+         pgexporter_delete_file(path);
+      }
+
+      /* A partition is a batch, and removing it never blocks the writer */
+      atomic_fetch_add(&config->history_prune_records, (unsigned long)records);
+      atomic_fetch_add(&config->history_prune_batches, 1);
+
+      pgexporter_log_debug("history_columnar: removed partition %" PRId64 " (%" PRIu64 " records)", starts[i], records);
+   }
+
+   directory_unlock(lock);
+   free(starts);
+
+   return 0;
+
+error:
+
+   directory_unlock(lock);
+   free(starts);
+
+   return 1;
+}
+
+int
+pgexporter_history_columnar_shutdown(void)
+{
+   if (series_fd != -1)
+   {
+      close(series_fd);
+      series_fd = -1;
+   }
+
+   for (int i = 0; i < number_of_series; i++)
+   {
+      free(series[i].labels);
+   }
+   free(series);
+   series = NULL;
+   number_of_series = 0;
+   series_capacity = 0;
+
+   pgexporter_art_destroy(series_ids);
+   series_ids = NULL;
+
+   memset(directory, 0, sizeof(directory));
+
+   return 0;
+}
+
+const struct history_backend_ops pgexporter_history_columnar_ops = {
+   .init = pgexporter_history_columnar_init,
+   .write_batch = pgexporter_history_columnar_write_batch,
+   .query_stream = pgexporter_history_columnar_query_stream,
+   .rollup = NULL,
+   .prune = pgexporter_history_columnar_prune,
+   .shutdown = pgexporter_history_columnar_shutdown,
+};
+
+static int
+bit_write(struct bit_writer* w, uint64_t value, int n)
+{
+   while (n > 0)
+   {
+      int bits;
+      uint8_t chunk;
+
+      if (w->free_bits == 0)
+      {
+         if (w->size == w->capacity)
+         {
+            size_t capacity = w->capacity > 0 ? w->capacity * 2 : 4096;
+            uint8_t* data = realloc(w->data, capacity);
+
+            if (data == NULL)
+            {
+               return 1;
+            }
+
+            w->data = data;
+            w->capacity = capacity;
+         }
+
+         w->data[w->size++] = 0;
+         w->free_bits = 8;
+      }
+
+      bits = n < w->free_bits ? n : w->free_bits;
+      chunk = (uint8_t)((value >> (n - bits)) & ((1u << bits) - 1));
+
+      w->data[w->size - 1] |= (uint8_t)(chunk << (w->free_bits - bits));
+      w->free_bits -= bits;
+      n -= bits;
+   }
+
+   return 0;
+}
+
+static void
+bit_align(struct bit_writer* w)
+{
+   w->free_bits = 0;
+}
+
+static int
+bit_read(struct bit_reader* r, int n, uint64_t* value)
+{
+   uint64_t v = 0;
+
+   if (r->position + n > r->length * 8)
+   {
+      return 1;
+   }
+
+   while (n > 0)
+   {
+      int offset = r->position % 8;
+      int available = 8 - offset;
+      int bits = n < available ? n : available;
+      uint8_t chunk = (uint8_t)((r->data[r->position / 8] >> (available - bits)) & ((1u << bits) - 1));
+
+      v = (v << bits) | chunk;
+      r->position += bits;
+      n -= bits;
+   }
+
+   *value = v;
+
+   return 0;
+}
+
+static int64_t
+sign_extend(uint64_t value, int bits)
+{
+   uint64_t m = 1ULL << (bits - 1);
+
+   return (int64_t)((value ^ m) - m);
+}
+
+/**
+ * Encode the samples of one series, sorted by timestamp
+ */
+static int
+encode_samples(struct bit_writer* w, struct columnar_raw* samples, int count)
+{
+   int64_t prev_ts = 0;
+   int64_t prev_delta = 0;
+   uint64_t prev_value = 0;
+   int prev_leading = -1;
+   int prev_trailing = 0;
+
+   for (int i = 0; i < count; i++)
+   {
+      uint64_t value;
+
+      memcpy(&value, &samples[i].value, sizeof(uint64_t));
+
+      if (i == 0)
+      {
+         if (bit_write(w, (uint64_t)samples[i].ts, 64) || bit_write(w, value, 64))
+         {
+            return 1;
+         }
+      }
+      else
+      {
+         int64_t delta = samples[i].ts - prev_ts;
+         int64_t dod = delta - prev_delta;
+         uint64_t xor = value ^ prev_value;
+         int ret;
+
+         if (dod == 0)
+         {
+            ret = bit_write(w, 0, 1);
+         }
+         else if (dod >= -64 && dod <= 63)
+         {
+            ret = bit_write(w, 0x2, 2) || bit_write(w, (uint64_t)dod & 0x7f, 7);
+         }
+         else if (dod >= -256 && dod <= 255)
+         {
+            ret = bit_write(w, 0x6, 3) || bit_write(w, (uint64_t)dod & 0x1ff, 9);
+         }
+         else if (dod >= -2048 && dod <= 2047)
+         {
+            ret = bit_write(w, 0xe, 4) || bit_write(w, (uint64_t)dod & 0xfff, 12);
+         }
+         else
+         {
+            ret = bit_write(w, 0xf, 4) || bit_write(w, (uint64_t)dod, 64);
+         }
+
+         if (ret)
+         {
+            return 1;
+         }
+
+         if (xor == 0)
+         {
+            ret = bit_write(w, 0, 1);
+         }
+         else
+         {
+            int leading = __builtin_clzll(xor);
+            int trailing = __builtin_ctzll(xor);
+
+            if (leading > 31)
+            {
+               leading = 31;
+            }
+
+            if (prev_leading != -1 && leading >= prev_leading && trailing >= prev_trailing)
+            {
+               /* Same window as the previous value */
+               ret = bit_write(w, 0x2, 2) ||
+                     bit_write(w, xor >> prev_trailing, 64 - prev_leading - prev_trailing);
+            }
+            else
+            {
+               int meaningful = 64 - leading - trailing;
+
+               ret = bit_write(w, 0x3, 2) ||
+                     bit_write(w, (uint64_t)leading, 5) ||
+                     bit_write(w, (uint64_t)(meaningful == 64 ? 0 : meaningful), 6) ||
+                     bit_write(w, xor >> trailing, meaningful);
+
+               prev_leading = leading;
+               prev_trailing = trailing;
+            }
+         }
+
+         if (ret)
+         {
+            return 1;
+         }
+
+         prev_delta = delta;
+      }
+
+      prev_ts = samples[i].ts;
+      prev_value = value;
+   }
+
+   bit_align(w);
+
+   return 0;
+}
+
+/**
+ * Decode the chunk of one series, keeping the samples within [start, end]
+ */
+static int
+decode_samples(const uint8_t* data, size_t length, struct columnar_index* index,
+               time_t start, time_t end, struct columnar_raw** out, int* n, int* capacity)
+{
+   struct bit_reader r = {.data = data, .length = length, .position = 0};
+   struct columnar_raw row;
+   int64_t delta = 0;
+   uint64_t value = 0;
+   int leading = 0;
+   int trailing = 0;
+   uint64_t bits;
+
+   memset(&row, 0, sizeof(struct columnar_raw));
+   row.series = index->series;
+
+   for (uint32_t i = 0; i < index->count; i++)
+   {
+      if (i == 0)
+      {
+         if (bit_read(&r, 64, &bits) || bit_read(&r, 64, &value))
+         {
+            return 1;
+         }
+         row.ts = (int64_t)bits;
+      }
+      else
+      {
+         int64_t dod = 0;
+         int prefix = 0;
+
+         /* Up to four 1 bits select the size of the delta-of-delta */
+         while (prefix < 4)
+         {
+            if (bit_read(&r, 1, &bits))
+            {
+               return 1;
+            }
+            if (bits == 0)
+            {
+               break;
+            }
+            prefix++;
+         }
+
+         if (prefix > 0)
+         {
+            int size = prefix == 1 ? 7 : prefix == 2 ? 9 : prefix == 3 ? 12 : 64;
+
+            if (bit_read(&r, size, &bits))
+            {
+               return 1;
+            }
+            dod = size == 64 ? (int64_t)bits : sign_extend(bits, size);
+         }
+
+         delta += dod;
+         row.ts += delta;
+
+         if (bit_read(&r, 1, &bits))
+         {
+            return 1;
+         }
+
+         if (bits == 1)
+         {
+            uint64_t xor;
+
+            if (bit_read(&r, 1, &bits))
+            {
+               return 1;
+            }
+
+            if (bits == 1)
+            {
+               uint64_t l;
+               uint64_t m;
+
+               if (bit_read(&r, 5, &l) || bit_read(&r, 6, &m))
+               {
+                  return 1;
+               }
+
+               leading = (int)l;
+               trailing = 64 - leading - (m == 0 ? 64 : (int)m);
+            }
+
+            if (bit_read(&r, 64 - leading - trailing, &xor))
+            {
+               return 1;
+            }
+
+            value ^= xor << trailing;
+         }
+      }
+
+      if (row.ts >= (int64_t)start && row.ts <= (int64_t)end)
+      {
+         memcpy(&row.value, &value, sizeof(double));
+
+         if (raw_append(out, n, capacity, &row))
+         {
+            return 1;
+         }
+      }
+   }
+
+   return 0;
+}
+
+static char*
+series_key(const char* server, const char* metric, const char* labels)
+{
+   /* The unit separator cannot be part of a name or a label set */
+   return pgexporter_vappend(NULL, 5, (char*)server, "\x1f", (char*)metric, "\x1f", (char*)labels);
+}
+
+static int
+series_add(const char* server, const char* metric, const char* labels)
+{
+   char* key = NULL;
+   int id = number_of_series;
+
+   if (number_of_series == series_capacity)
+   {
+      int capacity = series_capacity > 0 ? series_capacity * 2 : 1024;
+      struct columnar_series* s = realloc(series, capacity * sizeof(struct columnar_series));
+
+      if (s == NULL)
+      {
+         return -1;
+      }
+
+      series = s;
+      series_capacity = capacity;
+   }
+
+   memset(&series[id], 0, sizeof(struct columnar_series));
+   pgexporter_snprintf(series[id].server, MISC_LENGTH, "%s", server);
+   pgexporter_snprintf(series[id].metric, PROMETHEUS_LENGTH, "%s", metric);
+   series[id].labels = pgexporter_append(NULL, (char*)labels);
+
+   key = series_key(server, metric, labels);
+   if (key == NULL || series[id].labels == NULL ||
+       pgexporter_art_insert(series_ids, key, (uintptr_t)id, ValueInt32))
+   {
+      free(series[id].labels);
+      free(key);
+      return -1;
+   }
+
+   free(key);
+
+   number_of_series++;
+
+   return id;
+}
+
+static int
+series_load(char* path)
+{
+   int fd = -1;
+   struct stat st;
+   char* data = NULL;
+   size_t offset = 0;
+   ssize_t r;
+
+   fd = open(path, O_RDONLY);
+   if (fd == -1)
+   {
+      /* New dictionary */
+      return errno == ENOENT ? 0 : 1;
+   }
+
+   if (fstat(fd, &st) || st.st_size == 0)
+   {
+      close(fd);
+      return 0;
+   }
+
+   data = malloc(st.st_size);
+   if (data == NULL)
+   {
+      close(fd);
+      return 1;
+   }
+
+   while (offset < (size_t)st.st_size)
+   {
+      r = read(fd, data + offset, st.st_size - offset);
+      if (r <= 0)
+      {
+         break;
+      }
+      offset += r;
+   }
+
+   close(fd);
+
+   for (size_t p = 0; p + sizeof(struct columnar_series_record) <= offset;)
+   {
+      struct columnar_series_record rec;
+      char server[MISC_LENGTH];
+      char metric[PROMETHEUS_LENGTH];
+      char* labels = NULL;
+
+      memcpy(&rec, data + p, sizeof(struct columnar_series_record));
+
+      /* A record that is still being written */
+      if (p + sizeof(struct columnar_series_record) + rec.server_length + rec.metric_length + rec.labels_length > offset)
+      {
+         break;
+      }
+
+      if (rec.id != (uint32_t)number_of_series || rec.server_length >= MISC_LENGTH || rec.metric_length >= PROMETHEUS_LENGTH)
+      {
+         pgexporter_log_warn("history_columnar: invalid series %u in %s", rec.id, path);
+         break;
+      }
+
+      p += sizeof(struct columnar_series_record);
+
+      memset(server, 0, sizeof(server));
+      memcpy(server, data + p, rec.server_length);
+      p += rec.server_length;
+
+      memset(metric, 0, sizeof(metric));
+      memcpy(metric, data + p, rec.metric_length);
+      p += rec.metric_length;
+
+      labels = calloc(1, rec.labels_length + 1);
+      if (labels == NULL)
+      {
+         free(data);
+         return 1;
+      }
+      memcpy(labels, data + p, rec.labels_length);
+      p += rec.labels_length;
+
+      if (series_add(server, metric, labels) < 0)
+      {
+         free(labels);
+         free(data);
+         return 1;
+      }
+
+      free(labels);
+   }
+
+   free(data);
+
+   return 0;
+}
+
+static int
+series_id(const char* server, const char* metric, const char* labels)
+{
+   struct columnar_series_record rec;
+   char* key = NULL;
+   char* record = NULL;
+   size_t size;
+   int id;
+
+   key = series_key(server, metric, labels);
+   if (key == NULL)
+   {
+      return -1;
+   }
+
+   if (pgexporter_art_contains_key(series_ids, key))
+   {
+      id = (int)pgexporter_art_search(series_ids, key);
+      free(key);
+      return id;
+   }
+
+   free(key);
+
+   id = series_add(server, metric, labels);
+   if (id < 0)
+   {
+      return -1;
+   }
+
+   memset(&rec, 0, sizeof(struct columnar_series_record));
+   rec.id = (uint32_t)id;
+   rec.server_length = (uint32_t)strlen(series[id].server);
+   rec.metric_length = (uint32_t)strlen(series[id].metric);
+   rec.labels_length = (uint32_t)strlen(series[id].labels);
+
+   size = sizeof(struct columnar_series_record) + rec.server_length + rec.metric_length + rec.labels_length;
+   record = malloc(size);
+   if (record == NULL)
+   {
+      return -1;
+   }
+
+   memcpy(record, &rec, sizeof(struct columnar_series_record));
+   memcpy(record + sizeof(struct columnar_series_record), series[id].server, rec.server_length);
+   memcpy(record + sizeof(struct columnar_series_record) + rec.server_length, series[id].metric, rec.metric_length);
+   memcpy(record + sizeof(struct columnar_series_record) + rec.server_length + rec.metric_length,
+          series[id].labels, rec.labels_length);
+
+   /* One write, so readers never see a partial record in the middle */
+   if (write(series_fd, record, size) != (ssize_t)size)
+   {
+      pgexporter_log_error("history_columnar: failed to write series: %s", strerror(errno));
+      free(record);
+      return -1;
+   }
+
+   free(record);
+
+   return id;
+}
+
+static int64_t
+partition_start(int64_t ts)
+{
+   int64_t r = ts % HISTORY_COLUMNAR_PARTITION_SECONDS;
+
+   return ts - (r < 0 ? r + HISTORY_COLUMNAR_PARTITION_SECONDS : r);
+}
+
+static void
+partition_path(int64_t start, const char* suffix, char* path)
+{
+   /* Zero padded, so the files sort by time */
+   pgexporter_snprintf(path, MAX_PATH, "%s/%012" PRId64 "%s", directory, start, suffix);
+}
+
+static int
+partitions(int64_t** starts, int* n)
+{
+   int number_of_files = 0;
+   char** files = NULL;
+   int64_t* result = NULL;
+   int count = 0;
+
+   *starts = NULL;
+   *n = 0;
+
+   if (pgexporter_get_files(directory, &number_of_files, &files))
+   {
+      return 1;
+   }
+
+   result = malloc((number_of_files > 0 ? number_of_files : 1) * sizeof(int64_t));
+   if (result == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      char* end = NULL;
+      int64_t start;
+
+      if (!pgexporter_ends_with(files[i], COLUMNAR_RAW_SUFFIX) && !pgexporter_ends_with(files[i], COLUMNAR_COL_SUFFIX))
+      {
+         continue;
+      }
+
+      start = (int64_t)strtoll(files[i], &end, 10);
+      if (end == files[i] || (strcmp(end, COLUMNAR_RAW_SUFFIX) && strcmp(end, COLUMNAR_COL_SUFFIX)))
+      {
+         continue;
+      }
+
+      /* The .col and .raw files of a partition are next to each other */
+      if (count > 0 && result[count - 1] == start)
+      {
+         continue;
+      }
+
+      result[count++] = start;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   *starts = result;
+   *n = count;
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   return 1;
+}
+
+/**
+ * Read the samples of a partition for the given series (all if ids is NULL)
+ */
+static int
+partition_read(int64_t start, uint32_t* ids, int number_of_ids, time_t from, time_t to,
+               struct columnar_raw** out, int* n, int* capacity)
+{
+   char path[MAX_PATH];
+   int fd = -1;
+   struct stat st;
+   uint8_t* map = NULL;
+   size_t map_size = 0;
+
+   /* Compacted part */
+   partition_path(start, COLUMNAR_COL_SUFFIX, path);
+
+   fd = open(path, O_RDONLY);
+   if (fd != -1)
+   {
+      struct columnar_header* header = NULL;
+      struct columnar_index* index = NULL;
+
+      if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct columnar_header))
+      {
+         goto error;
+      }
+
+      map_size = st.st_size;
+      map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+      {
+         map = NULL;
+         goto error;
+      }
+
+      close(fd);
+      fd = -1;
+
+      header = (struct columnar_header*)map;
+      index = (struct columnar_index*)(map + sizeof(struct columnar_header));
+
+      if (memcmp(header->magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LENGTH) ||
+          sizeof(struct columnar_header) + header->number_of_series * sizeof(struct columnar_index) > map_size)
+      {
+         pgexporter_log_error("history_columnar: invalid partition %s", path);
+         goto error;
+      }
+
+      for (uint32_t i = 0; i < header->number_of_series; i++)
+      {
+         if (ids != NULL && !ids_contains(ids, number_of_ids, index[i].series))
+         {
+            continue;
+         }
+
+         if (index[i].last_ts < (int64_t)from || index[i].first_ts > (int64_t)to)
+         {
+            continue;
+         }
+
+         if (index[i].offset + index[i].length > map_size)
+         {
+            pgexporter_log_error("history_columnar: invalid chunk in %s", path);
+            goto error;
+         }
+
+         if (decode_samples(map + index[i].offset, index[i].length, &index[i], from, to, out, n, capacity))
+         {
+            pgexporter_log_error("history_columnar: failed to decode series %u in %s", index[i].series, path);
+            goto error;
+         }
+      }
+
+      munmap(map, map_size);
+      map = NULL;
+   }
+
+   /* Open part */
+   partition_path(start, COLUMNAR_RAW_SUFFIX, path);
+
+   fd = open(path, O_RDONLY);
+   if (fd != -1)
+   {
+      struct columnar_raw* rows = NULL;
+      size_t count;
+
+      if (fstat(fd, &st))
+      {
+         goto error;
+      }
+
+      count = st.st_size / sizeof(struct columnar_raw);
+
+      if (count > 0)
+      {
+         map_size = count * sizeof(struct columnar_raw);
+         map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (map == MAP_FAILED)
+         {
+            map = NULL;
+            goto error;
+         }
+
+         rows = (struct columnar_raw*)map;
+
+         for (size_t i = 0; i < count; i++)
+         {
+            if (rows[i].ts < (int64_t)from || rows[i].ts > (int64_t)to)
+            {
+               continue;
+            }
+
+            if (ids != NULL && !ids_contains(ids, number_of_ids, rows[i].series))
+            {
+               continue;
+            }
+
+            if (raw_append(out, n, capacity, &rows[i]))
+            {
+               goto error;
+            }
+         }
+
+         munmap(map, map_size);
+         map = NULL;
+      }
+
+      close(fd);
+      fd = -1;
+   }
+
+   return 0;
+
+error:
+
+   if (map != NULL)
+   {
+      munmap(map, map_size);
+   }
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return 1;
+}
+
+static int
+partition_append(int64_t start, struct columnar_raw* rows, int count)
+{
+   char path[MAX_PATH];
+   size_t size = count * sizeof(struct columnar_raw);
+   int fd;
+
+   partition_path(start, COLUMNAR_RAW_SUFFIX, path);
+
+   fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+   if (fd == -1)
+   {
+      pgexporter_log_error("history_columnar: failed to open %s: %s", path, strerror(errno));
+      return 1;
+   }
+
+   if (write(fd, rows, size) != (ssize_t)size)
+   {
+      pgexporter_log_error("history_columnar: failed to write %s: %s", path, strerror(errno));
+      close(fd);
+      return 1;
+   }
+
+   close(fd);
+
+   return 0;
+}
+
+/**
+ * Rewrite a partition as one compacted file, merging a compacted
+ * part written earlier with the rows appended since
+ */
+static int
+partition_compact(int64_t start)
+{
+   char raw_path[MAX_PATH];
+   char col_path[MAX_PATH];
+   char tmp_path[MAX_PATH];
+   struct columnar_raw* rows = NULL;
+   int n = 0;
+   int capacity = 0;
+   struct columnar_index* index = NULL;
+   int number_of_index = 0;
+   struct bit_writer w;
+   struct columnar_header header;
+   size_t data_offset;
+   FILE* file = NULL;
+
+   memset(&w, 0, sizeof(struct bit_writer));
+
+   if (partition_read(start, NULL, 0, (time_t)INT64_MIN, (time_t)INT64_MAX, &rows, &n, &capacity))
+   {
+      goto error;
+   }
+
+   qsort(rows, n, sizeof(struct columnar_raw), compare_series_ts);
+
+   index = calloc(n > 0 ? n : 1, sizeof(struct columnar_index));
+   if (index == NULL)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < n;)
+   {
+      int j = i;
+      size_t offset = w.size;
+
+      while (j < n && rows[j].series == rows[i].series)
+      {
+         j++;
+      }
+
+      if (encode_samples(&w, &rows[i], j - i))
+      {
+         goto error;
+      }
+
+      index[number_of_index].series = rows[i].series;
+      index[number_of_index].count = (uint32_t)(j - i);
+      index[number_of_index].first_ts = rows[i].ts;
+      index[number_of_index].last_ts = rows[j - 1].ts;
+      index[number_of_index].offset = offset;
+      index[number_of_index].length = w.size - offset;
+      number_of_index++;
+
+      i = j;
+   }
+
+   data_offset = sizeof(struct columnar_header) + number_of_index * sizeof(struct columnar_index);
+   for (int i = 0; i < number_of_index; i++)
+   {
+      index[i].offset += data_offset;
+   }
+
+   memset(&header, 0, sizeof(struct columnar_header));
+   memcpy(header.magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LENGTH);
+   header.start = start;
+   header.number_of_series = (uint32_t)number_of_index;
+
+   partition_path(start, COLUMNAR_RAW_SUFFIX, raw_path);
+   partition_path(start, COLUMNAR_COL_SUFFIX, col_path);
+   pgexporter_snprintf(tmp_path, sizeof(tmp_path), "%s.%d", col_path, (int)getpid());
+
+   file = fopen(tmp_path, "w");
+   if (file == NULL)
+   {
+      pgexporter_log_error("history_columnar: failed to open %s: %s", tmp_path, strerror(errno));
+      goto error;
+   }
+
+   if (fwrite(&header, sizeof(struct columnar_header), 1, file) != 1 ||
+       (number_of_index > 0 && fwrite(index, sizeof(struct columnar_index), number_of_index, file) != (size_t)number_of_index) ||
+       (w.size > 0 && fwrite(w.data, 1, w.size, file) != w.size) ||
+       fflush(file) || fsync(fileno(file)))
+   {
+      pgexporter_log_error("history_columnar: failed to write %s", tmp_path);
+      goto error;
+   }
+
+   fclose(file);
+   file = NULL;
+
+   /* Readers either see the old files or the new one */
+   if (rename(tmp_path, col_path))
+   {
+      pgexporter_log_error("history_columnar: failed to rename %s: %s", tmp_path, strerror(errno));
+      goto error;
+   }
+
+   if (pgexporter_exists(raw_path))
+   {
+      pgexporter_delete_file(raw_path);
+   }
+
+   pgexporter_log_debug("history_columnar: compacted partition %" PRId64 " (%d samples, %d series, %zu bytes)",
+                        start, n, number_of_index, w.size);
+
+   free(w.data);
+   free(index);
+   free(rows);
+
+   return 0;
+
+error:
+
+   if (file != NULL)
+   {
+      fclose(file);
+      unlink(tmp_path);
+   }
+
+   free(w.data);
+   free(index);
+   free(rows);
+
+   return 1;
+}
+
+/**
+ * Count the records of a partition, from the size of the open file and the
+ * index of the compacted one
+ */
+static uint64_t
+partition_records(int64_t start)
+{
+   char path[MAX_PATH];
+   struct stat st;
+   struct columnar_header header;
+   struct columnar_index index;
+   uint64_t records = 0;
+   FILE* file = NULL;
+
+   partition_path(start, COLUMNAR_RAW_SUFFIX, path);
+   if (stat(path, &st) == 0)
+   {
+      records += (uint64_t)st.st_size / sizeof(struct columnar_raw);
+   }
+
+   partition_path(start, COLUMNAR_COL_SUFFIX, path);
+   file = fopen(path, "r");
+   if (file == NULL)
+   {
+      return records;
+   }
+
+   if (fread(&header, sizeof(struct columnar_header), 1, file) == 1 &&
+       !memcmp(header.magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LENGTH))
+   {
+      for (uint32_t i = 0; i < header.number_of_series; i++)
+      {
+         if (fread(&index, sizeof(struct columnar_index), 1, file) != 1)
+         {
+            break;
+         }
+         records += index.count;
+      }
+   }
+
+   fclose(file);
+
+   return records;
+}
+
+static int
+compact_closed(void)
+{
+   int64_t* starts = NULL;
+   int number_of_partitions = 0;
+   int64_t now = (int64_t)time(NULL);
+   char path[MAX_PATH];
+   int status = 0;
+
+   if (partitions(&starts, &number_of_partitions))
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < number_of_partitions; i++)
+   {
+      if (starts[i] + HISTORY_COLUMNAR_PARTITION_SECONDS + HISTORY_COLUMNAR_COMPACT_DELAY_SECONDS > now)
+      {
+         continue;
+      }
+
+      partition_path(starts[i], COLUMNAR_RAW_SUFFIX, path);
+      if (!pgexporter_exists(path))
+      {
+         continue;
+      }
+
+      if (partition_compact(starts[i]))
+      {
+         status = 1;
+      }
+   }
+
+   free(starts);
+
+   return status;
+}
+
+/**
+ * Take the exclusive lock on the history directory
+ *
+ * @param wait Wait for the lock, otherwise fail if it is held
+ * @return The descriptor holding the lock, or -1
+ */
+static int
+directory_lock(bool wait)
+{
+   int fd = -1;
+
+   fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (fd == -1)
+   {
+      pgexporter_log_error("history_columnar: failed to open %s: %s", directory, strerror(errno));
+      return -1;
+   }
+
+   while (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) == -1)
+   {
+      if (errno == EINTR)
+      {
+         continue;
+      }
+
+      if (errno != EWOULDBLOCK)
+      {
+         pgexporter_log_error("history_columnar: failed to lock %s: %s", directory, strerror(errno));
+      }
+
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+/**
+ * Release the lock on the history directory
+ *
+ * @param fd The descriptor holding the lock, or -1
+ */
+static void
+directory_unlock(int fd)
+{
+   if (fd != -1)
+   {
+      flock(fd, LOCK_UN);
+      close(fd);
+   }
+}
+
+static int
+raw_append(struct columnar_raw** out, int* n, int* capacity, struct columnar_raw* row)
+{
+   if (*n == *capacity)
+   {
+      int c = *capacity > 0 ? *capacity * 2 : 1024;
+      struct columnar_raw* rows = realloc(*out, c * sizeof(struct columnar_raw));
+
+      if (rows == NULL)
+      {
+         return 1;
+      }
+
+      *out = rows;
+      *capacity = c;
+   }
+
+   (*out)[(*n)++] = *row;
+
+   return 0;
+}
+
+static bool
+ids_contains(uint32_t* ids, int number_of_ids, uint32_t id)
+{
+   int low = 0;
+   int high = number_of_ids - 1;
+
+   while (low <= high)
+   {
+      int mid = low + (high - low) / 2;
+
+      if (ids[mid] == id)
+      {
+         return true;
+      }
+      else if (ids[mid] < id)
+      {
+         low = mid + 1;
+      }
+      else
+      {
+         high = mid - 1;
+      }
+   }
+
+   return false;
+}
+
+static int
+compare_series_ts(const void* a, const void* b)
+{
+   const struct columnar_raw* x = (const struct columnar_raw*)a;
+   const struct columnar_raw* y = (const struct columnar_raw*)b;
+
+   if (x->series != y->series)
+   {
+      return x->series < y->series ? -1 : 1;
+   }
+
+   return x->ts < y->ts ? -1 : x->ts > y->ts ? 1 : 0;
+}
+
+static int
+compare_ts(const void* a, const void* b)
+{
+   const struct columnar_raw* x = (const struct columnar_raw*)a;
+   const struct columnar_raw* y = (const struct columnar_raw*)b;
+
+   if (x->ts != y->ts)
+   {
+      return x->ts < y->ts ? -1 : 1;
+   }
+
+   return x->series < y->series ? -1 : x->series > y->series ? 1 : 0;
+}
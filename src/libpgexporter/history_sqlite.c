@@ -27,13 +27,16 @@
  */
 
 #include <history_sqlite.h>
+#include <art.h>
 #include <logging.h>
 #include <pgexporter.h>
 #include <shmem.h>
 #include <utils.h>
+#include <value.h>
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sqlite3.h>
 
 /**
@@ -43,9 +46,23 @@
  * history in a local SQLite database file. It provides:
  *
  * - Database initialization (creating tables and indexes).
- * - Batch insertion of history records using a single transaction.
- * - Range queries based on metric name and time window.
- * - Pruning of old records according to the configured retention policy.
+ * - A `series` dictionary so every (server, metric, labels) is stored once,
+ *   with the ids cached in-process; samples are stored as
+ *   (series_id, ts, seq, value) in a WITHOUT ROWID table.
+ * - An inverted index `series_labels` from every (label, value) pair to the
+ *   series that have it, so equality matchers only read the matching series.
+ * - Batch insertion of history records using a single transaction and
+ *   prepared statements that are reused across batches.
+ * - Range queries based on metric name and time window, streamed from the
+ *   cursor.
+ * - Optional rollups: the samples are aggregated incrementally into
+ *   samples_1m and samples_1h (count, sum, min, max, last), so the raw
+ *   samples and the 1-minute rollups can be kept for a shorter time than
+ *   the 1-hour rollups. Queries read each part of the window from the
+ *   finest table that still covers it.
+ * - Pruning of old records according to the configured retention policy,
+ *   in small transactions and within a time budget, so that the write lock
+ *   is never held for long and a large backlog is removed over several runs.
  *
  * The implementation relies on standard SQLite C API functions and handles
  * resource cleanup/rollback on error.
@@ -53,9 +70,51 @@
 
 static sqlite3* db = NULL;
 
+/* Prepared statements, kept for the lifetime of the connection */
+static sqlite3_stmt* insert_sample_stmt = NULL;
+static sqlite3_stmt* insert_next_sample_stmt = NULL;
+static sqlite3_stmt* insert_series_stmt = NULL;
+static sqlite3_stmt* select_series_stmt = NULL;
+static sqlite3_stmt* insert_label_stmt = NULL;
+
+/* (server, metric, labels) -> series id */
+static struct art* series_cache = NULL;
+
 /* Maximum free pages reclaimed per prune via PRAGMA incremental_vacuum */
 #define HISTORY_SQLITE_VACUUM_PAGES 1000
 
+/* Rollup resolutions in seconds */
+#define HISTORY_SQLITE_MINUTE 60
+#define HISTORY_SQLITE_HOUR   3600
+
+/* Seconds before a minute is considered complete and is rolled up */
+#define HISTORY_SQLITE_ROLLUP_DELAY 300
+
+/* Rows removed per pruning transaction */
+#define HISTORY_SQLITE_PRUNE_BATCH 10000
+
+/* Milliseconds a prune may run, the rest is left for the next one */
+#define HISTORY_SQLITE_PRUNE_BUDGET 30000
+
+/* Pause between two pruning transactions, so writers get the lock (nanoseconds) */
+#define HISTORY_SQLITE_PRUNE_PAUSE 10000000L
+
+static int migrate_history_table(void);
+static int prepare_statements(void);
+static int insert_sample(sqlite3_int64 id, struct history_record* record);
+static void finalize_statements(void);
+static int series_id(struct history_record* record, sqlite3_int64* id);
+static int index_labels(sqlite3_int64 id, const char* server, const char* labels);
+static int index_series(void);
+static bool rollups_enabled(void);
+static int64_t retention_seconds(pgexporter_time_t retention);
+static int rollup_done(int resolution, time_t* done);
+static int rollup(int resolution, const char* source, const char* sql, time_t until, time_t chunk);
+static int tier_boundaries(time_t now, time_t* raw_start, time_t* minute_start);
+static int delete_before(const char* table, const char* key, time_t cutoff, struct timespec* start, bool* complete);
+static int query_table(const char* table, const char* value, const char* metric, struct history_query* query,
+                       time_t start, time_t end, history_record_callback callback, void* data);
+
 int
 pgexporter_history_sqlite_init(void)
 {
@@ -64,17 +123,62 @@ pgexporter_history_sqlite_init(void)
    const char* sql = "PRAGMA auto_vacuum=INCREMENTAL;"
                      "PRAGMA journal_mode=WAL;"
                      "PRAGMA busy_timeout=5000;"
-                     "CREATE TABLE IF NOT EXISTS history ("
-                     "ts INTEGER, "
-                     "server TEXT, "
-                     "metric TEXT, "
-                     "labels TEXT, "
-                     "value REAL"
+                     "CREATE TABLE IF NOT EXISTS series ("
+                     "id INTEGER PRIMARY KEY, "
+                     "server TEXT NOT NULL, "
+                     "metric TEXT NOT NULL, "
+                     "labels TEXT NOT NULL, "
+                     "UNIQUE(server, metric, labels)"
                      ");"
-                     /* Index covers both query_range (metric + ts range) and
-                      * prune (ts range), avoiding a full table scan. */
-                     "CREATE INDEX IF NOT EXISTS idx_history_metric_ts ON history(metric, ts);"
-                     "CREATE INDEX IF NOT EXISTS idx_history_ts ON history(ts);";
+                     "CREATE INDEX IF NOT EXISTS idx_series_metric ON series(metric);"
+                     /* (label, value) -> series, the server is a label too */
+                     "CREATE TABLE IF NOT EXISTS series_labels ("
+                     "name TEXT NOT NULL, "
+                     "value TEXT NOT NULL, "
+                     "series_id INTEGER NOT NULL, "
+                     "PRIMARY KEY(name, value, series_id)"
+                     ") WITHOUT ROWID;"
+                     /* The primary key clusters the samples of a series by
+                      * time, which is what query_range reads. seq tells apart
+                      * two snapshots taken within the same second; it is 0
+                      * otherwise, which SQLite stores without any payload */
+                     "CREATE TABLE IF NOT EXISTS samples ("
+                     "series_id INTEGER NOT NULL, "
+                     "ts INTEGER NOT NULL, "
+                     "seq INTEGER NOT NULL DEFAULT 0, "
+                     "value REAL, "
+                     "PRIMARY KEY(series_id, ts, seq)"
+                     ") WITHOUT ROWID;"
+                     /* prune (ts range) */
+                     "CREATE INDEX IF NOT EXISTS idx_samples_ts ON samples(ts);"
+                     /* Rollups, one row per series and minute or hour */
+                     "CREATE TABLE IF NOT EXISTS samples_1m ("
+                     "series_id INTEGER NOT NULL, "
+                     "ts INTEGER NOT NULL, "
+                     "count INTEGER NOT NULL, "
+                     "sum REAL, "
+                     "min REAL, "
+                     "max REAL, "
+                     "last REAL, "
+                     "PRIMARY KEY(series_id, ts)"
+                     ") WITHOUT ROWID;"
+                     "CREATE INDEX IF NOT EXISTS idx_samples_1m_ts ON samples_1m(ts);"
+                     "CREATE TABLE IF NOT EXISTS samples_1h ("
+                     "series_id INTEGER NOT NULL, "
+                     "ts INTEGER NOT NULL, "
+                     "count INTEGER NOT NULL, "
+                     "sum REAL, "
+                     "min REAL, "
+                     "max REAL, "
+                     "last REAL, "
+                     "PRIMARY KEY(series_id, ts)"
+                     ") WITHOUT ROWID;"
+                     "CREATE INDEX IF NOT EXISTS idx_samples_1h_ts ON samples_1h(ts);"
+                     /* Everything before done has been rolled up */
+                     "CREATE TABLE IF NOT EXISTS rollup_state ("
+                     "resolution INTEGER PRIMARY KEY, "
+                     "done INTEGER NOT NULL"
+                     ");";
 
    if (db != NULL)
    {
@@ -92,11 +196,6 @@ pgexporter_history_sqlite_init(void)
    if (sqlite3_open_v2(config->history_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
    {
       pgexporter_log_error("history_sqlite: failed to open db %s: %s", config->history_path, db ? sqlite3_errmsg(db) : "out of memory");
-      if (db)
-      {
-         sqlite3_close(db);
-         db = NULL;
-      }
       goto error;
    }
 
@@ -110,19 +209,39 @@ pgexporter_history_sqlite_init(void)
       goto error;
    }
 
+   if (migrate_history_table())
+   {
+      goto error;
+   }
+
+   if (prepare_statements())
+   {
+      goto error;
+   }
+
+   if (index_series())
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_create(&series_cache))
+   {
+      goto error;
+   }
+
    pgexporter_log_debug("history_sqlite: initialized at %s", config->history_path);
    return 0;
 
 error:
 
+   pgexporter_history_sqlite_shutdown();
+
    return 1;
 }
 
 int
 pgexporter_history_sqlite_write_batch(struct history_record* records, int count)
 {
-   sqlite3_stmt* stmt = NULL;
-   const char* sql = "INSERT INTO history(ts, server, metric, labels, value) VALUES(?, ?, ?, ?, ?);";
    bool in_txn = false;
    int i;
 
@@ -137,30 +256,20 @@ pgexporter_history_sqlite_write_batch(struct history_record* records, int count)
    }
    in_txn = true;
 
-   if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
-   {
-      pgexporter_log_error("history_sqlite: prepare failed: %s", sqlite3_errmsg(db));
-      goto error;
-   }
-
    for (i = 0; i < count; i++)
    {
-      sqlite3_bind_int64(stmt, 1, (sqlite3_int64)records[i].ts);
-      sqlite3_bind_text(stmt, 2, records[i].server, -1, SQLITE_TRANSIENT);
-      sqlite3_bind_text(stmt, 3, records[i].metric, -1, SQLITE_TRANSIENT);
-      sqlite3_bind_text(stmt, 4, records[i].labels ? records[i].labels : "", -1, SQLITE_TRANSIENT);
-      sqlite3_bind_double(stmt, 5, records[i].value);
+      sqlite3_int64 id;
 
-      if (sqlite3_step(stmt) != SQLITE_DONE)
+      if (series_id(&records[i], &id))
       {
-         pgexporter_log_error("history_sqlite: insert failed: %s", sqlite3_errmsg(db));
          goto error;
       }
-      sqlite3_reset(stmt);
-   }
 
-   sqlite3_finalize(stmt);
-   stmt = NULL;
+      if (insert_sample(id, &records[i]))
+      {
+         goto error;
+      }
+   }
 
    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
    {
@@ -171,11 +280,6 @@ pgexporter_history_sqlite_write_batch(struct history_record* records, int count)
 
 error:
 
-   if (stmt)
-   {
-      sqlite3_finalize(stmt);
-   }
-
    /* Only roll back if a transaction was actually started */
    if (db && in_txn)
    {
@@ -183,117 +287,147 @@ error:
       {
          pgexporter_log_error("history_sqlite: rollback failed: %s", sqlite3_errmsg(db));
       }
+
+      /* Series added in this transaction are gone, so are their cached ids */
+      pgexporter_art_destroy(series_cache);
+      series_cache = NULL;
+      pgexporter_art_create(&series_cache);
    }
 
    return 1;
 }
 
 int
-pgexporter_history_sqlite_query_range(const char* metric, time_t start, time_t end,
-                                      struct history_record** records_out, int* count_out)
+pgexporter_history_sqlite_query_stream(const char* metric, struct history_query* query,
+                                       history_record_callback callback, void* data)
 {
-   sqlite3_stmt* stmt = NULL;
-   const char* sql = "SELECT ts, server, metric, labels, value FROM history WHERE metric = ? AND ts >= ? AND ts <= ? ORDER BY ts ASC;";
-   int count = 0;
-   int capacity = 100;
-   struct history_record* results = NULL;
-
-   if (count_out)
-   {
-      *count_out = 0;
-   }
-
-   if (!db)
-   {
-      goto error;
-   }
+   const char* value;
+   time_t minute_start = 0;
+   time_t raw_start = 0;
+   time_t done = 0;
 
-   if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+   if (!db || query == NULL || callback == NULL)
    {
-      pgexporter_log_error("history_sqlite: query prepare failed: %s", sqlite3_errmsg(db));
       goto error;
    }
 
-   sqlite3_bind_text(stmt, 1, metric, -1, SQLITE_TRANSIENT);
-   sqlite3_bind_int64(stmt, 2, (sqlite3_int64)start);
-   sqlite3_bind_int64(stmt, 3, (sqlite3_int64)end);
-
-   if (records_out)
+   if (rollups_enabled())
    {
-      results = malloc(capacity * sizeof(struct history_record));
-      if (!results)
+      if (tier_boundaries(time(NULL), &raw_start, &minute_start))
       {
          goto error;
       }
-      memset(results, 0, capacity * sizeof(struct history_record));
-   }
 
-   while (sqlite3_step(stmt) == SQLITE_ROW)
-   {
-      if (records_out)
+      /* A step of whole minutes or hours does not need anything finer */
+      if (query->step > 0 && query->step % HISTORY_SQLITE_MINUTE == 0)
       {
-         if (count >= capacity)
+         if (rollup_done(HISTORY_SQLITE_MINUTE, &done))
+         {
+            goto error;
+         }
+         raw_start = done;
+
+         if (query->step % HISTORY_SQLITE_HOUR == 0)
          {
-            struct history_record* new_results;
-            capacity *= 2;
-            new_results = realloc(results, capacity * sizeof(struct history_record));
-            if (!new_results)
+            if (rollup_done(HISTORY_SQLITE_HOUR, &done))
             {
                goto error;
             }
-            results = new_results;
-            memset(results + (capacity / 2), 0, (capacity / 2) * sizeof(struct history_record));
+            minute_start = done;
          }
+      }
 
-         results[count].ts = (time_t)sqlite3_column_int64(stmt, 0);
+      raw_start = MAX(raw_start, minute_start);
+   }
 
-         const unsigned char* srv = sqlite3_column_text(stmt, 1);
-         if (srv)
-            pgexporter_snprintf(results[count].server, MISC_LENGTH, "%s", (const char*)srv);
+   switch (query->aggregation)
+   {
+      case HISTORY_AGGREGATION_AVG:
+         value = "t.sum / t.count";
+         break;
+      case HISTORY_AGGREGATION_MIN:
+         value = "t.min";
+         break;
+      case HISTORY_AGGREGATION_MAX:
+         value = "t.max";
+         break;
+      default:
+         /* Also for rates, which only depend on the last sample */
+         value = "t.last";
+         break;
+   }
 
-         const unsigned char* met = sqlite3_column_text(stmt, 2);
-         if (met)
-            pgexporter_snprintf(results[count].metric, PROMETHEUS_LENGTH, "%s", (const char*)met);
+   /* The tables cover consecutive parts of the window, in time order */
+   if (query_table("samples_1h", value, metric, query, query->start, MIN(query->end + 1, minute_start), callback, data) ||
+       query_table("samples_1m", value, metric, query, MAX(query->start, minute_start), MIN(query->end + 1, raw_start), callback, data) ||
+       query_table("samples", NULL, metric, query, MAX(query->start, raw_start), query->end + 1, callback, data))
+   {
+      goto error;
+   }
 
-         const unsigned char* lab = sqlite3_column_text(stmt, 3);
-         results[count].labels = pgexporter_append(NULL, lab ? (char*)lab : (char*)"");
+   return 0;
 
-         results[count].value = sqlite3_column_double(stmt, 4);
-      }
-      count++;
-   }
+error:
 
-   sqlite3_finalize(stmt);
-   stmt = NULL;
+   return 1;
+}
 
-   if (count_out)
+int
+pgexporter_history_sqlite_rollup(void)
+{
+   time_t now;
+   time_t done = 0;
+   const char* minute_sql = "INSERT OR REPLACE INTO samples_1m(series_id, ts, count, sum, min, max, last) "
+                            "SELECT s.series_id, s.ts / 60 * 60 AS bucket, COUNT(*), SUM(s.value), MIN(s.value), MAX(s.value), "
+                            "(SELECT l.value FROM samples l WHERE l.series_id = s.series_id "
+                            "AND l.ts >= s.ts / 60 * 60 AND l.ts < s.ts / 60 * 60 + 60 "
+                            "ORDER BY l.ts DESC, l.seq DESC LIMIT 1) "
+                            "FROM samples s WHERE s.ts >= ?1 AND s.ts < ?2 "
+                            "GROUP BY s.series_id, bucket;";
+   const char* hour_sql = "INSERT OR REPLACE INTO samples_1h(series_id, ts, count, sum, min, max, last) "
+                          "SELECT m.series_id, m.ts / 3600 * 3600 AS bucket, SUM(m.count), SUM(m.sum), MIN(m.min), MAX(m.max), "
+                          "(SELECT l.last FROM samples_1m l WHERE l.series_id = m.series_id "
+                          "AND l.ts >= m.ts / 3600 * 3600 AND l.ts < m.ts / 3600 * 3600 + 3600 "
+                          "ORDER BY l.ts DESC LIMIT 1) "
+                          "FROM samples_1m m WHERE m.ts >= ?1 AND m.ts < ?2 "
+                          "GROUP BY m.series_id, bucket;";
+
+   if (!db)
    {
-      *count_out = count;
+      goto error;
    }
 
-   if (records_out)
+   if (!rollups_enabled())
    {
-      *records_out = results;
+      return 0;
    }
 
-   return 0;
+   now = time(NULL);
 
-error:
+   /* Minutes are rolled up an hour per transaction, hours a day at a time */
+   if (rollup(HISTORY_SQLITE_MINUTE, "samples", minute_sql,
+              (now - HISTORY_SQLITE_ROLLUP_DELAY) / HISTORY_SQLITE_MINUTE * HISTORY_SQLITE_MINUTE,
+              HISTORY_SQLITE_HOUR))
+   {
+      goto error;
+   }
 
-   if (stmt)
+   if (rollup_done(HISTORY_SQLITE_MINUTE, &done))
    {
-      sqlite3_finalize(stmt);
+      goto error;
    }
 
-   if (results)
+   if (rollup(HISTORY_SQLITE_HOUR, "samples_1m", hour_sql,
+              done / HISTORY_SQLITE_HOUR * HISTORY_SQLITE_HOUR,
+              24 * HISTORY_SQLITE_HOUR))
    {
-      for (int i = 0; i < count; i++)
-      {
-         free(results[i].labels);
-      }
-      free(results);
+      goto error;
    }
 
+   return 0;
+
+error:
+
    return 1;
 }
 
@@ -301,43 +435,59 @@ int
 pgexporter_history_sqlite_prune(void)
 {
    struct configuration* config;
-   sqlite3_stmt* stmt = NULL;
-   const char* sql = "DELETE FROM history WHERE ts < ?;";
    char vacuum_sql[48];
-   time_t cutoff;
+   struct timespec start;
+   bool complete = true;
+   time_t now;
+   time_t raw_start;
+   time_t minute_start;
    int64_t retention_s;
 
    config = (struct configuration*)shmem;
 
-   if (!db || !config || !pgexporter_time_is_valid(config->history_retention))
+   if (!db || !config)
    {
       return 0;
    }
 
-   retention_s = pgexporter_time_convert(config->history_retention, FORMAT_TIME_S);
-   if (retention_s <= 0)
-   {
-      return 0;
-   }
+   now = time(NULL);
+   retention_s = retention_seconds(config->history_retention);
+   clock_gettime(CLOCK_MONOTONIC, &start);
 
-   cutoff = time(NULL) - (time_t)retention_s;
-   if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+   /* The series dictionary is kept, as its ids are cached by the writer */
+   if (rollups_enabled())
    {
-      pgexporter_log_error("history_sqlite: prune prepare failed: %s", sqlite3_errmsg(db));
-      goto error;
+      if (tier_boundaries(now, &raw_start, &minute_start))
+      {
+         goto error;
+      }
+
+      if (delete_before("samples", "series_id, ts, seq", raw_start, &start, &complete) ||
+          delete_before("samples_1m", "series_id, ts", minute_start, &start, &complete) ||
+          (retention_s > 0 && delete_before("samples_1h", "series_id, ts", now - (time_t)retention_s, &start, &complete)))
+      {
+         goto error;
+      }
    }
+   else
+   {
+      if (retention_s <= 0)
+      {
+         return 0;
+      }
 
-   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)cutoff);
+      if (delete_before("samples", "series_id, ts, seq", now - (time_t)retention_s, &start, &complete))
+      {
+         goto error;
+      }
+   }
 
-   if (sqlite3_step(stmt) != SQLITE_DONE)
+   if (!complete)
    {
-      pgexporter_log_error("history_sqlite: prune failed: %s", sqlite3_errmsg(db));
-      goto error;
+      pgexporter_log_info("history_sqlite: prune stopped after %d ms, continuing on the next run", HISTORY_SQLITE_PRUNE_BUDGET);
+      atomic_store(&config->history_prune_pending, true);
    }
 
-   sqlite3_finalize(stmt);
-   stmt = NULL;
-
    /* Hand reclaimed pages back to the OS. Bounded so the write lock is held
     * only briefly; a no-op when auto_vacuum freed nothing. */
    pgexporter_snprintf(vacuum_sql, sizeof(vacuum_sql), "PRAGMA incremental_vacuum(%d);", HISTORY_SQLITE_VACUUM_PAGES);
@@ -350,17 +500,17 @@ pgexporter_history_sqlite_prune(void)
 
 error:
 
-   if (stmt)
-   {
-      sqlite3_finalize(stmt);
-   }
-
    return 1;
 }
 
 int
 pgexporter_history_sqlite_shutdown(void)
 {
+   finalize_statements();
+
+   pgexporter_art_destroy(series_cache);
+   series_cache = NULL;
+
    if (db)
    {
       sqlite3_close_v2(db);
@@ -372,7 +522,746 @@ pgexporter_history_sqlite_shutdown(void)
 const struct history_backend_ops pgexporter_history_sqlite_ops = {
    .init = pgexporter_history_sqlite_init,
    .write_batch = pgexporter_history_sqlite_write_batch,
-   .query_range = pgexporter_history_sqlite_query_range,
+   .query_stream = pgexporter_history_sqlite_query_stream,
+   .rollup = pgexporter_history_sqlite_rollup,
    .prune = pgexporter_history_sqlite_prune,
    .shutdown = pgexporter_history_sqlite_shutdown,
 };
+
+/**
+ * Move the rows of the flat history table used by earlier versions
+ * into series and samples
+ */
+static int
+migrate_history_table(void)
+{
+   sqlite3_stmt* stmt = NULL;
+   char* err_msg = NULL;
+   bool exists = false;
+   const char* sql = "BEGIN TRANSACTION;"
+                     "INSERT OR IGNORE INTO series(server, metric, labels) "
+                     "SELECT DISTINCT IFNULL(server, ''), IFNULL(metric, ''), IFNULL(labels, '') FROM history;"
+                     "INSERT INTO samples(series_id, ts, seq, value) "
+                     "SELECT series.id, history.ts, "
+                     "ROW_NUMBER() OVER (PARTITION BY series.id, history.ts ORDER BY history.rowid) - 1, "
+                     "history.value FROM history JOIN series "
+                     "ON series.server = IFNULL(history.server, '') "
+                     "AND series.metric = IFNULL(history.metric, '') "
+                     "AND series.labels = IFNULL(history.labels, '') "
+                     "WHERE history.ts IS NOT NULL;"
+                     "DROP TABLE history;"
+                     "COMMIT;";
+
+   if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'history';", -1, &stmt, NULL) != SQLITE_OK)
+   {
+      goto error;
+   }
+
+   exists = sqlite3_step(stmt) == SQLITE_ROW;
+
+   sqlite3_finalize(stmt);
+   stmt = NULL;
+
+   if (!exists)
+   {
+      return 0;
+   }
+
+   pgexporter_log_info("history_sqlite: migrating history table");
+
+   if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK)
+   {
+      pgexporter_log_error("history_sqlite: migration failed: %s", err_msg);
+      if (err_msg)
+      {
+         sqlite3_free(err_msg);
+      }
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+prepare_statements(void)
+{
+   const char* insert_sample = "INSERT INTO samples(series_id, ts, seq, value) VALUES(?1, ?2, 0, ?3);";
+   const char* insert_next_sample = "INSERT INTO samples(series_id, ts, seq, value) "
+                                    "SELECT ?1, ?2, MAX(seq) + 1, ?3 FROM samples WHERE series_id = ?1 AND ts = ?2;";
+   const char* insert_series = "INSERT OR IGNORE INTO series(server, metric, labels) VALUES(?, ?, ?);";
+   const char* select_series = "SELECT id FROM series WHERE server = ? AND metric = ? AND labels = ?;";
+   const char* insert_label = "INSERT OR IGNORE INTO series_labels(name, value, series_id) VALUES(?, ?, ?);";
+
+   if (sqlite3_prepare_v3(db, insert_sample, -1, SQLITE_PREPARE_PERSISTENT, &insert_sample_stmt, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v3(db, insert_next_sample, -1, SQLITE_PREPARE_PERSISTENT, &insert_next_sample_stmt, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v3(db, insert_series, -1, SQLITE_PREPARE_PERSISTENT, &insert_series_stmt, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v3(db, select_series, -1, SQLITE_PREPARE_PERSISTENT, &select_series_stmt, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v3(db, insert_label, -1, SQLITE_PREPARE_PERSISTENT, &insert_label_stmt, NULL) != SQLITE_OK)
+   {
+      pgexporter_log_error("history_sqlite: prepare failed: %s", sqlite3_errmsg(db));
+      return 1;
+   }
+
+   return 0;
+}
+
+static void
+finalize_statements(void)
+{
+   sqlite3_finalize(insert_sample_stmt);
+   insert_sample_stmt = NULL;
+
+   sqlite3_finalize(insert_next_sample_stmt);
+   insert_next_sample_stmt = NULL;
+
+   sqlite3_finalize(insert_series_stmt);
+   insert_series_stmt = NULL;
+
+   sqlite3_finalize(select_series_stmt);
+   select_series_stmt = NULL;
+
+   sqlite3_finalize(insert_label_stmt);
+   insert_label_stmt = NULL;
+}
+
+/**
+ * Insert a sample. The first sample of a series at a timestamp gets seq 0
+ * without looking at the table; only a second sample in the same second
+ * looks up the next seq
+ */
+static int
+insert_sample(sqlite3_int64 id, struct history_record* record)
+{
+   int rc;
+   sqlite3_stmt* stmts[2] = {insert_sample_stmt, insert_next_sample_stmt};
+
+   for (int i = 0; i < 2; i++)
+   {
+      sqlite3_bind_int64(stmts[i], 1, id);
+      sqlite3_bind_int64(stmts[i], 2, (sqlite3_int64)record->ts);
+      sqlite3_bind_double(stmts[i], 3, record->value);
+
+      rc = sqlite3_step(stmts[i]);
+      sqlite3_reset(stmts[i]);
+
+      if (rc == SQLITE_DONE)
+      {
+         return 0;
+      }
+
+      if ((rc & 0xff) != SQLITE_CONSTRAINT)
+      {
+         break;
+      }
+   }
+
+   pgexporter_log_error("history_sqlite: insert failed: %s", sqlite3_errmsg(db));
+
+   return 1;
+}
+
+/**
+ * Look up the series id of a record, adding the series when it is new
+ */
+static int
+series_id(struct history_record* record, sqlite3_int64* id)
+{
+   char* labels = record->labels ? record->labels : "";
+   char* key = NULL;
+   bool added;
+
+   /* The unit separator cannot be part of a name or a label set */
+   key = pgexporter_vappend(NULL, 5, record->server, "\x1f", record->metric, "\x1f", labels);
+   if (key == NULL)
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_contains_key(series_cache, key))
+   {
+      *id = (sqlite3_int64)pgexporter_art_search(series_cache, key);
+      free(key);
+      return 0;
+   }
+
+   sqlite3_bind_text(insert_series_stmt, 1, record->server, -1, SQLITE_STATIC);
+   sqlite3_bind_text(insert_series_stmt, 2, record->metric, -1, SQLITE_STATIC);
+   sqlite3_bind_text(insert_series_stmt, 3, labels, -1, SQLITE_STATIC);
+
+   if (sqlite3_step(insert_series_stmt) != SQLITE_DONE)
+   {
+      pgexporter_log_error("history_sqlite: series insert failed: %s", sqlite3_errmsg(db));
+      sqlite3_reset(insert_series_stmt);
+      goto error;
+   }
+   sqlite3_reset(insert_series_stmt);
+   added = sqlite3_changes(db) > 0;
+
+   /* The series may have been added by another process */
+   sqlite3_bind_text(select_series_stmt, 1, record->server, -1, SQLITE_STATIC);
+   sqlite3_bind_text(select_series_stmt, 2, record->metric, -1, SQLITE_STATIC);
+   sqlite3_bind_text(select_series_stmt, 3, labels, -1, SQLITE_STATIC);
+
+   if (sqlite3_step(select_series_stmt) != SQLITE_ROW)
+   {
+      pgexporter_log_error("history_sqlite: series lookup failed: %s", sqlite3_errmsg(db));
+      sqlite3_reset(select_series_stmt);
+      goto error;
+   }
+
+   *id = sqlite3_column_int64(select_series_stmt, 0);
+   sqlite3_reset(select_series_stmt);
+
+   /* Indexed in the same transaction as the series */
+   if (added && index_labels(*id, record->server, labels))
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_insert(series_cache, key, (uintptr_t)*id, ValueInt64))
+   {
+      goto error;
+   }
+
+   free(key);
+
+   return 0;
+
+error:
+
+   free(key);
+
+   return 1;
+}
+
+/**
+ * Add the labels of a new series to the label index. The server is indexed
+ * as the server label, unless the label set has its own.
+ */
+static int
+index_labels(sqlite3_int64 id, const char* server, const char* labels)
+{
+   const char* p = labels;
+   char name[MISC_LENGTH];
+   char value[MISC_LENGTH];
+   bool has_server = false;
+
+   for (;;)
+   {
+      bool more = pgexporter_history_label_next(&p, name, sizeof(name), value, sizeof(value));
+
+      if (!more)
+      {
+         if (has_server)
+         {
+            break;
+         }
+
+         pgexporter_snprintf(name, sizeof(name), "server");
+         pgexporter_snprintf(value, sizeof(value), "%s", server);
+         has_server = true;
+      }
+      else if (!strcmp(name, "server"))
+      {
+         has_server = true;
+      }
+
+      sqlite3_bind_text(insert_label_stmt, 1, name, -1, SQLITE_STATIC);
+      sqlite3_bind_text(insert_label_stmt, 2, value, -1, SQLITE_STATIC);
+      sqlite3_bind_int64(insert_label_stmt, 3, id);
+
+      if (sqlite3_step(insert_label_stmt) != SQLITE_DONE)
+      {
+         pgexporter_log_error("history_sqlite: label index insert failed: %s", sqlite3_errmsg(db));
+         sqlite3_reset(insert_label_stmt);
+         return 1;
+      }
+      sqlite3_reset(insert_label_stmt);
+
+      if (!more)
+      {
+         break;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * Index the series that are not in the label index yet, such as the series
+ * of a database written by an earlier version
+ */
+static int
+index_series(void)
+{
+   sqlite3_stmt* stmt = NULL;
+   bool in_txn = false;
+   int rc;
+
+   if (sqlite3_prepare_v2(db, "SELECT id, server, labels FROM series "
+                              "WHERE id NOT IN (SELECT series_id FROM series_labels WHERE name = 'server');",
+                          -1, &stmt, NULL) != SQLITE_OK)
+   {
+      goto error;
+   }
+
+   if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+   {
+      goto error;
+   }
+   in_txn = true;
+
+   while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+   {
+      const unsigned char* server = sqlite3_column_text(stmt, 1);
+      const unsigned char* labels = sqlite3_column_text(stmt, 2);
+
+      if (index_labels(sqlite3_column_int64(stmt, 0), server ? (const char*)server : "", labels ? (const char*)labels : ""))
+      {
+         goto error;
+      }
+   }
+
+   if (rc != SQLITE_DONE)
+   {
+      goto error;
+   }
+
+   sqlite3_finalize(stmt);
+   stmt = NULL;
+
+   if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   pgexporter_log_error("history_sqlite: label index failed: %s", sqlite3_errmsg(db));
+
+   if (stmt)
+   {
+      sqlite3_finalize(stmt);
+   }
+
+   if (in_txn)
+   {
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+   }
+
+   return 1;
+}
+
+static bool
+rollups_enabled(void)
+{
+   struct configuration* config = (struct configuration*)shmem;
+
+   return config != NULL && retention_seconds(config->history_raw_retention) > 0;
+}
+
+static int64_t
+retention_seconds(pgexporter_time_t retention)
+{
+   if (!pgexporter_time_is_valid(retention))
+   {
+      return 0;
+   }
+
+   return pgexporter_time_convert(retention, FORMAT_TIME_S);
+}
+
+/**
+ * Get the end of what has been rolled up at a resolution, 0 if nothing
+ */
+static int
+rollup_done(int resolution, time_t* done)
+{
+   sqlite3_stmt* stmt = NULL;
+   int rc;
+
+   *done = 0;
+
+   if (sqlite3_prepare_v2(db, "SELECT done FROM rollup_state WHERE resolution = ?;", -1, &stmt, NULL) != SQLITE_OK)
+   {
+      pgexporter_log_error("history_sqlite: rollup state prepare failed: %s", sqlite3_errmsg(db));
+      goto error;
+   }
+
+   sqlite3_bind_int(stmt, 1, resolution);
+
+   rc = sqlite3_step(stmt);
+   if (rc == SQLITE_ROW)
+   {
+      *done = (time_t)sqlite3_column_int64(stmt, 0);
+   }
+   else if (rc != SQLITE_DONE)
+   {
+      pgexporter_log_error("history_sqlite: rollup state failed: %s", sqlite3_errmsg(db));
+      goto error;
+   }
+
+   sqlite3_finalize(stmt);
+
+   return 0;
+
+error:
+
+   if (stmt)
+   {
+      sqlite3_finalize(stmt);
+   }
+
+   return 1;
+}
+
+/**
+ * Roll up the source table at a resolution up to until, continuing from
+ * where the previous rollup stopped. Every chunk is committed together with
+ * the new state, so an interrupted rollup resumes at the chunk it was in.
+ */
+static int
+rollup(int resolution, const char* source, const char* sql, time_t until, time_t chunk)
+{
+   sqlite3_stmt* stmt = NULL;
+   char first_sql[64];
+   bool in_txn = false;
+   time_t from = 0;
+   time_t to;
+
+   if (rollup_done(resolution, &from))
+   {
+      goto error;
+   }
+
+   if (from == 0)
+   {
+      pgexporter_snprintf(first_sql, sizeof(first_sql), "SELECT MIN(ts) FROM %s;", source);
+
+      if (sqlite3_prepare_v2(db, first_sql, -1, &stmt, NULL) != SQLITE_OK)
+      {
+         goto error;
+      }
+
+      if (sqlite3_step(stmt) != SQLITE_ROW)
+      {
+         goto error;
+      }
+
+      if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+      {
+         /* Nothing to roll up yet */
+         sqlite3_finalize(stmt);
+         return 0;
+      }
+
+      from = (time_t)sqlite3_column_int64(stmt, 0) / resolution * resolution;
+
+      sqlite3_finalize(stmt);
+      stmt = NULL;
+   }
+
+   while (from < until)
+   {
+      to = MIN(from + chunk, until);
+
+      if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+      {
+         goto error;
+      }
+      in_txn = true;
+
+      if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+      {
+         goto error;
+      }
+
+      sqlite3_bind_int64(stmt, 1, (sqlite3_int64)from);
+      sqlite3_bind_int64(stmt, 2, (sqlite3_int64)to);
+
+      if (sqlite3_step(stmt) != SQLITE_DONE)
+      {
+         goto error;
+      }
+
+      sqlite3_finalize(stmt);
+      stmt = NULL;
+
+      if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO rollup_state(resolution, done) VALUES(?, ?);", -1, &stmt, NULL) != SQLITE_OK)
+      {
+         goto error;
+      }
+
+      sqlite3_bind_int(stmt, 1, resolution);
+      sqlite3_bind_int64(stmt, 2, (sqlite3_int64)to);
+
+      if (sqlite3_step(stmt) != SQLITE_DONE)
+      {
+         goto error;
+      }
+
+      sqlite3_finalize(stmt);
+      stmt = NULL;
+
+      if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+      {
+         goto error;
+      }
+      in_txn = false;
+
+      from = to;
+   }
+
+   return 0;
+
+error:
+
+   pgexporter_log_error("history_sqlite: rollup of %s failed: %s", source, sqlite3_errmsg(db));
+
+   if (stmt)
+   {
+      sqlite3_finalize(stmt);
+   }
+
+   if (in_txn)
+   {
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+   }
+
+   return 1;
+}
+
+/**
+ * Get where the raw samples and the 1-minute rollups start. Records are
+ * kept for their retention, but never removed before they have been rolled
+ * up, so everything before raw_start is in samples_1m and everything before
+ * minute_start is in samples_1h.
+ */
+static int
+tier_boundaries(time_t now, time_t* raw_start, time_t* minute_start)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   time_t minute_done = 0;
+   time_t hour_done = 0;
+   int64_t retention_s;
+
+   if (rollup_done(HISTORY_SQLITE_MINUTE, &minute_done) ||
+       rollup_done(HISTORY_SQLITE_HOUR, &hour_done))
+   {
+      return 1;
+   }
+
+   *raw_start = MIN(now - (time_t)retention_seconds(config->history_raw_retention), minute_done);
+   *raw_start = *raw_start / HISTORY_SQLITE_MINUTE * HISTORY_SQLITE_MINUTE;
+
+   /* Without their own retention the 1-minute rollups are kept as long as
+    * the 1-hour rollups */
+   retention_s = retention_seconds(config->history_minute_retention);
+   if (retention_s <= 0)
+   {
+      retention_s = retention_seconds(config->history_retention);
+   }
+
+   *minute_start = retention_s > 0 ? MIN(now - (time_t)retention_s, hour_done) : 0;
+   *minute_start = *minute_start / HISTORY_SQLITE_HOUR * HISTORY_SQLITE_HOUR;
+
+   return 0;
+}
+
+/**
+ * Delete the rows of a table before cutoff, a batch per transaction, until
+ * the prune has used up its time budget. key is the primary key of the
+ * table, and complete is cleared when rows may be left.
+ */
+static int
+delete_before(const char* table, const char* key, time_t cutoff, struct timespec* start, bool* complete)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   sqlite3_stmt* stmt = NULL;
+   struct timespec now;
+   int64_t elapsed_ms;
+   char sql[256];
+   int changes;
+
+   if (!*complete)
+   {
+      return 0;
+   }
+
+   /* The subquery walks idx_*_ts, so a batch never scans the kept rows */
+   pgexporter_snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE (%s) IN (SELECT %s FROM %s WHERE ts < ?1 LIMIT ?2);",
+                       table, key, key, table);
+
+   if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+   {
+      pgexporter_log_error("history_sqlite: prune prepare failed: %s", sqlite3_errmsg(db));
+      goto error;
+   }
+
+   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)cutoff);
+   sqlite3_bind_int(stmt, 2, HISTORY_SQLITE_PRUNE_BATCH);
+
+   for (;;)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed_ms = (int64_t)(now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+
+      if (elapsed_ms >= HISTORY_SQLITE_PRUNE_BUDGET)
+      {
+         *complete = false;
+         break;
+      }
+
+      /* Every batch is its own transaction */
+      if (sqlite3_step(stmt) != SQLITE_DONE)
+      {
+         pgexporter_log_error("history_sqlite: prune of %s failed: %s", table, sqlite3_errmsg(db));
+         goto error;
+      }
+      sqlite3_reset(stmt);
+
+      changes = sqlite3_changes(db);
+      if (changes > 0)
+      {
+         atomic_fetch_add(&config->history_prune_records, (unsigned long)changes);
+         atomic_fetch_add(&config->history_prune_batches, 1);
+      }
+
+      if (changes < HISTORY_SQLITE_PRUNE_BATCH)
+      {
+         break;
+      }
+
+      SLEEP(HISTORY_SQLITE_PRUNE_PAUSE);
+   }
+
+   sqlite3_finalize(stmt);
+
+   return 0;
+
+error:
+
+   if (stmt)
+   {
+      sqlite3_finalize(stmt);
+   }
+
+   return 1;
+}
+
+/**
+ * Stream the records of a metric within [start, end) from one table. value
+ * is the rollup column to read, NULL for the raw samples.
+ */
+static int
+query_table(const char* table, const char* value, const char* metric, struct history_query* query,
+            time_t start, time_t end, history_record_callback callback, void* data)
+{
+   sqlite3_stmt* stmt = NULL;
+   char* sql = NULL;
+   char clause[MISC_LENGTH];
+   struct history_record record;
+   int parameter = 4;
+   int rc;
+
+   if (start >= end)
+   {
+      return 0;
+   }
+
+   pgexporter_snprintf(clause, sizeof(clause), "SELECT t.ts, series.server, series.metric, series.labels, %s ",
+                       value != NULL ? value : "t.value");
+   sql = pgexporter_vappend(sql, 4, clause, "FROM series JOIN ", table,
+                            " t ON t.series_id = series.id WHERE series.metric = ? AND t.ts >= ? AND t.ts < ?");
+
+   /* A non-empty equality matcher is looked up in the label index. The
+    * other matchers are left to the caller */
+   for (int i = 0; i < query->number_of_matchers; i++)
+   {
+      if (query->matchers[i].op == HISTORY_MATCH_EQUAL && query->matchers[i].value[0] != '\0')
+      {
+         sql = pgexporter_append(sql, " AND series.id IN (SELECT series_id FROM series_labels WHERE name = ? AND value = ?)");
+      }
+   }
+
+   sql = pgexporter_vappend(sql, 2, " ORDER BY t.ts ASC, series.id ASC", value != NULL ? ";" : ", t.seq ASC;");
+   if (sql == NULL)
+   {
+      goto error;
+   }
+
+   if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+   {
+      pgexporter_log_error("history_sqlite: query prepare failed: %s", sqlite3_errmsg(db));
+      goto error;
+   }
+
+   sqlite3_bind_text(stmt, 1, metric, -1, SQLITE_TRANSIENT);
+   sqlite3_bind_int64(stmt, 2, (sqlite3_int64)start);
+   sqlite3_bind_int64(stmt, 3, (sqlite3_int64)end);
+
+   for (int i = 0; i < query->number_of_matchers; i++)
+   {
+      if (query->matchers[i].op == HISTORY_MATCH_EQUAL && query->matchers[i].value[0] != '\0')
+      {
+         sqlite3_bind_text(stmt, parameter++, query->matchers[i].name, -1, SQLITE_STATIC);
+         sqlite3_bind_text(stmt, parameter++, query->matchers[i].value, -1, SQLITE_STATIC);
+      }
+   }
+
+   /* Rows are handed out as the cursor advances, nothing is accumulated */
+   while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+   {
+      const unsigned char* srv = sqlite3_column_text(stmt, 1);
+      const unsigned char* met = sqlite3_column_text(stmt, 2);
+      const unsigned char* lab = sqlite3_column_text(stmt, 3);
+
+      memset(&record, 0, sizeof(struct history_record));
+
+      record.ts = (time_t)sqlite3_column_int64(stmt, 0);
+      if (srv)
+      {
+         pgexporter_snprintf(record.server, MISC_LENGTH, "%s", (const char*)srv);
+      }
+      if (met)
+      {
+         pgexporter_snprintf(record.metric, PROMETHEUS_LENGTH, "%s", (const char*)met);
+      }
+      /* Owned by SQLite until the next step */
+      record.labels = lab ? (char*)lab : (char*)"";
+      record.value = sqlite3_column_double(stmt, 4);
+
+      if (callback(data, &record))
+      {
+         goto error;
+      }
+   }
+
+   if (rc != SQLITE_DONE)
+   {
+      pgexporter_log_error("history_sqlite: query failed: %s", sqlite3_errmsg(db));
+      goto error;
+   }
+
+   sqlite3_finalize(stmt);
+   free(sql);
+
+   return 0;
+
+error:
+
+   if (stmt)
+   {
+      sqlite3_finalize(stmt);
+   }
+   free(sql);
+
+   return 1;
+}
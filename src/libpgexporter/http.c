@@ -51,6 +51,7 @@ pgexporter_http_create(char* hostname, int port, bool secure, struct http** resu
 {
    struct http* connection = NULL;
    int socket_fd = -1;
+   char peer[MISC_LENGTH];
    SSL* ssl = NULL;
    SSL_CTX* ctx = NULL;
 
@@ -109,6 +110,13 @@ pgexporter_http_create(char* hostname, int port, bool secure, struct http** resu
          goto error;
       }
 
+      pgexporter_snprintf(&peer[0], sizeof(peer), "https:%s:%d", hostname, port);
+      if (pgexporter_tls_session_prepare(ssl, &peer[0]))
+      {
+         pgexporter_log_error("Failed to prepare TLS session resumption");
+         goto error;
+      }
+
       int connect_result;
       do
       {
@@ -130,6 +138,8 @@ pgexporter_http_create(char* hostname, int port, bool secure, struct http** resu
       }
       while (connect_result != 1);
 
+      pgexporter_tls_session_account(ssl);
+
       connection->ssl = ssl;
    }
 
@@ -639,6 +649,7 @@ http_read_response_header(SSL* ssl, int socket,
    (*header_text)[header_len] = '\0';
    return MESSAGE_STATUS_OK;
 error:
+   *header_text = NULL;
    return MESSAGE_STATUS_ERROR;
 }
 
@@ -1046,7 +1057,14 @@ http_build_request(struct http* connection, struct http_request* request, char**
    headers = pgexporter_append(headers, user_agent);
    headers = pgexporter_append(headers, "\r\n");
 
-   headers = pgexporter_append(headers, "Connection: close\r\n");
+   if (request->keep_alive)
+   {
+      headers = pgexporter_append(headers, "Connection: keep-alive\r\n");
+   }
+   else
+   {
+      headers = pgexporter_append(headers, "Connection: close\r\n");
+   }
 
    if (request->read_cb == NULL)
    {
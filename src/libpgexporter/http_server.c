@@ -35,12 +35,39 @@
 #include <utils.h>
 
 /* system */
+#include <errno.h>
+#include <openssl/err.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <time.h>
 
+#define HTTP_SERVER_MAX_REQUEST_SIZE 16384
+#define HTTP_SERVER_READ_SIZE        4096
+#define HTTP_SERVER_MAX_IDLE_FDS     64
+#define HTTP_SERVER_IDLE_GRACE       50
+
+static int connection_read(struct http_server_connection* connection, int timeout, bool idle);
+static bool connection_wait_idle(struct http_server_connection* connection, int timeout, bool* readable);
+static ssize_t request_end(char* data, size_t length);
+static int parse_request(char* data, size_t length, struct http_server_request** req);
+static bool header_has_token(struct http_server_request* req, const char* name, const char* token);
+
+static const char*
+connection_header(struct http_server_request* req)
+{
+   return req != NULL && req->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+static bool
+has_body(struct http_server_request* req)
+{
+   return req == NULL || !req->head;
+}
+
 static void
 fill_date(char* buf, size_t len)
 {
@@ -50,6 +77,99 @@ fill_date(char* buf, size_t len)
    (void)len;
 }
 
+static int
+fill_http_date(char* buf, size_t len, time_t t)
+{
+   struct tm tm;
+
+   if (gmtime_r(&t, &tm) == NULL)
+   {
+      return 1;
+   }
+
+   return strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0;
+}
+
+static char*
+append_validators(char* data, struct http_validators* validators)
+{
+   char time_buf[64];
+
+   if (validators == NULL)
+   {
+      return data;
+   }
+
+   if (validators->etag[0] != '\0')
+   {
+      data = pgexporter_vappend(data, 3, "ETag: ", validators->etag, "\r\n");
+   }
+
+   if (validators->last_modified > 0 && !fill_http_date(time_buf, sizeof(time_buf), validators->last_modified))
+   {
+      data = pgexporter_vappend(data, 3, "Last-Modified: ", time_buf, "\r\n");
+   }
+
+   if (validators->expires > 0 && !fill_http_date(time_buf, sizeof(time_buf), validators->expires))
+   {
+      data = pgexporter_vappend(data, 3, "Expires: ", time_buf, "\r\n");
+   }
+
+   return data;
+}
+
+/**
+ * Build the head of a 200 OK response
+ * @param req The request, or NULL
+ * @param content_type The Content-Type header value
+ * @param len The length of the body
+ * @param validators The validators, or NULL
+ * @return The head, or NULL
+ */
+static char*
+ok_header(struct http_server_request* req, const char* content_type, size_t len, struct http_validators* validators)
+{
+   char* header = NULL;
+   char length[32];
+
+   pgexporter_snprintf(length, sizeof(length), "%zu", len);
+
+   header = pgexporter_vappend(header, 7,
+                               "HTTP/1.1 200 OK\r\n",
+                               "Content-Type: ",
+                               content_type,
+                               "\r\n",
+                               "Content-Length: ",
+                               length,
+                               "\r\n");
+   header = append_validators(header, validators);
+   header = pgexporter_vappend(header, 2,
+                               connection_header(req),
+                               "\r\n");
+
+   return header;
+}
+
+/**
+ * Compare two entity tags using the weak comparison, i.e. ignoring W/
+ */
+static bool
+etag_matches(const char* tag, size_t length, const char* etag)
+{
+   if (length >= 2 && !strncmp(tag, "W/", 2))
+   {
+      tag += 2;
+      length -= 2;
+   }
+
+   if (!strncmp(etag, "W/", 2))
+   {
+      etag += 2;
+   }
+
+   return length == strlen(etag) && !strncmp(tag, etag, length);
+}
+
 int
 pgexporter_http_server_ssl_accept(SSL* ssl, int fd)
 {
@@ -78,65 +198,314 @@ pgexporter_http_server_ssl_accept(SSL* ssl, int fd)
 int
 pgexporter_http_server_parse(SSL* ssl, int fd, struct http_server_request** req)
 {
-   struct message* msg = NULL;
-   struct configuration* config;
-   struct http_server_request* r = NULL;
-   char* from = NULL;
-   int index;
+   struct http_server_connection connection;
    int status;
 
-   *req = NULL;
+   pgexporter_http_server_connection_init(&connection, ssl, fd);
 
-   config = (struct configuration*)shmem;
+   status = pgexporter_http_server_next(&connection, req);
+
+   pgexporter_http_server_connection_destroy(&connection);
 
-   status = pgexporter_read_timeout_message(ssl, fd,
-                                            (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S),
-                                            &msg);
    if (status != MESSAGE_STATUS_OK)
    {
       pgexporter_log_debug("http_server: failed to read request");
       return MESSAGE_STATUS_ERROR;
    }
 
-   if (msg == NULL || msg->data == NULL || msg->length < 3 ||
-       strncmp((char*)msg->data, "GET", 3) != 0)
+   return MESSAGE_STATUS_OK;
+}
+
+void
+pgexporter_http_server_connection_init(struct http_server_connection* connection, SSL* ssl, int fd)
+{
+   memset(connection, 0, sizeof(struct http_server_connection));
+
+   connection->ssl = ssl;
+   connection->fd = fd;
+   connection->max_requests = 1;
+}
+
+int
+pgexporter_http_server_next(struct http_server_connection* connection, struct http_server_request** req)
+{
+   struct configuration* config;
+   bool idle;
+   int timeout;
+   int status;
+
+   *req = NULL;
+
+   config = (struct configuration*)shmem;
+
+   if (connection->requests >= connection->max_requests)
    {
-      pgexporter_log_debug("http_server: not a GET request");
-      return MESSAGE_STATUS_ERROR;
+      return MESSAGE_STATUS_ZERO;
    }
 
-   index = 4;
-   from = (char*)msg->data + index;
-
-   while (index < (int)msg->length && pgexporter_read_byte(msg->data + index) != ' ')
+   while ((status = pgexporter_http_server_parse_buffered(connection, req)) == MESSAGE_STATUS_ZERO)
    {
-      index++;
+      idle = connection->requests > 0 && connection->length == 0;
+      timeout = idle ? connection->idle_timeout : (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS);
+
+      status = connection_read(connection, timeout, idle);
+      if (status == MESSAGE_STATUS_ZERO)
+      {
+         /* Closing between requests is how a persistent connection ends */
+         return idle || (connection->requests == 0 && connection->length == 0) ? MESSAGE_STATUS_ZERO : MESSAGE_STATUS_ERROR;
+      }
+      else if (status != MESSAGE_STATUS_OK)
+      {
+         return MESSAGE_STATUS_ERROR;
+      }
    }
 
-   if (index >= (int)msg->length)
+   return status;
+}
+
+int
+pgexporter_http_server_parse_buffered(struct http_server_connection* connection, struct http_server_request** req)
+{
+   size_t length = 0;
+   int status;
+
+   status = pgexporter_http_server_peek(connection, req, &length);
+   if (status == MESSAGE_STATUS_OK)
    {
-      pgexporter_log_debug("http_server: malformed request line");
-      return MESSAGE_STATUS_ERROR;
+      pgexporter_http_server_consume(connection, length);
    }
 
-   pgexporter_write_byte(msg->data + index, '\0');
+   return status;
+}
 
-   r = malloc(sizeof(struct http_server_request));
-   if (r == NULL)
+int
+pgexporter_http_server_peek(struct http_server_connection* connection, struct http_server_request** req, size_t* length)
+{
+   struct http_server_request* r = NULL;
+   ssize_t end;
+
+   *req = NULL;
+   *length = 0;
+
+   if ((end = request_end(connection->buffer, connection->length)) < 0)
+   {
+      if (connection->length >= HTTP_SERVER_MAX_REQUEST_SIZE)
+      {
+         pgexporter_log_debug("http_server: request head too large");
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      return MESSAGE_STATUS_ZERO;
+   }
+
+   if (parse_request(connection->buffer, (size_t)end, &r))
    {
       return MESSAGE_STATUS_ERROR;
    }
 
-   memset(r, 0, sizeof(struct http_server_request));
-   strncpy(r->path, from, sizeof(r->path) - 1);
+   if (connection->requests + 1 >= connection->max_requests || connection->idle_timeout <= 0)
+   {
+      r->keep_alive = false;
+   }
 
    *req = r;
+   *length = (size_t)end;
+
    return MESSAGE_STATUS_OK;
 }
 
+void
+pgexporter_http_server_consume(struct http_server_connection* connection, size_t length)
+{
+   /* Keep a pipelined request for the next call */
+   memmove(connection->buffer, connection->buffer + length, connection->length - length);
+   connection->length -= length;
+
+   connection->requests++;
+}
+
+int
+pgexporter_http_server_serve(struct http_server_connection* connection,
+                             struct http_route* routes, int n_routes)
+{
+   struct http_server_request* req = NULL;
+   bool keep_alive;
+   int status;
+
+   while (true)
+   {
+      status = pgexporter_http_server_next(connection, &req);
+      if (status == MESSAGE_STATUS_ZERO)
+      {
+         return MESSAGE_STATUS_OK;
+      }
+      else if (status != MESSAGE_STATUS_OK)
+      {
+         pgexporter_http_respond_400(connection->ssl, connection->fd);
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      status = pgexporter_http_server_dispatch(connection->ssl, connection->fd, req, routes, n_routes);
+      keep_alive = req->keep_alive;
+
+      pgexporter_http_server_request_destroy(req);
+      req = NULL;
+
+      if (status != MESSAGE_STATUS_OK || !keep_alive)
+      {
+         return status;
+      }
+   }
+}
+
+int
+pgexporter_http_server_append(struct http_server_connection* connection, const void* data, size_t length)
+{
+   char* buffer = NULL;
+
+   if (length == 0)
+   {
+      return 0;
+   }
+
+   buffer = realloc(connection->buffer, connection->length + length);
+   if (buffer == NULL)
+   {
+      return 1;
+   }
+   connection->buffer = buffer;
+
+   memcpy(connection->buffer + connection->length, data, length);
+   connection->length += length;
+
+   return 0;
+}
+
+void
+pgexporter_http_server_connection_destroy(struct http_server_connection* connection)
+{
+   free(connection->buffer);
+   connection->buffer = NULL;
+   connection->length = 0;
+}
+
+bool
+pgexporter_http_server_get_header(struct http_server_request* req, const char* name, char* value, size_t size)
+{
+   size_t name_length = strlen(name);
+   char* line = NULL;
+   char* end = NULL;
+   char* p = NULL;
+
+   if (req == NULL || req->headers == NULL || size == 0)
+   {
+      return false;
+   }
+
+   line = req->headers;
+   while (*line != '\0' && *line != '\r' && *line != '\n')
+   {
+      end = strchr(line, '\n');
+      if (end == NULL)
+      {
+         end = line + strlen(line);
+      }
+
+      if (!strncasecmp(line, name, name_length) && line[name_length] == ':')
+      {
+         p = line + name_length + 1;
+         while (p < end && (*p == ' ' || *p == '\t'))
+         {
+            p++;
+         }
+
+         while (end > p && (*(end - 1) == '\r' || *(end - 1) == ' ' || *(end - 1) == '\t' || *(end - 1) == '\n'))
+         {
+            end--;
+         }
+
+         pgexporter_snprintf(value, size, "%.*s", (int)(end - p), p);
+         return true;
+      }
+
+      if (*end == '\0')
+      {
+         break;
+      }
+
+      line = end + 1;
+   }
+
+   return false;
+}
+
+bool
+pgexporter_http_server_not_modified(struct http_server_request* req, struct http_validators* validators)
+{
+   char value[1024];
+   char* p = NULL;
+   struct tm tm;
+
+   if (validators == NULL)
+   {
+      return false;
+   }
+
+   if (pgexporter_http_server_get_header(req, "If-None-Match", value, sizeof(value)))
+   {
+      if (validators->etag[0] == '\0')
+      {
+         return false;
+      }
+
+      p = value;
+      while (p != NULL && *p != '\0')
+      {
+         char* next = strchr(p, ',');
+         char* end = next != NULL ? next : p + strlen(p);
+
+         while (p < end && (*p == ' ' || *p == '\t'))
+         {
+            p++;
+         }
+
+         while (end > p && (*(end - 1) == ' ' || *(end - 1) == '\t'))
+         {
+            end--;
+         }
+
+         if ((end - p == 1 && *p == '*') || (end > p && etag_matches(p, (size_t)(end - p), validators->etag)))
+         {
+            return true;
+         }
+
+         p = next != NULL ? next + 1 : NULL;
+      }
+
+      return false;
+   }
+
+   if (validators->last_modified > 0 &&
+       pgexporter_http_server_get_header(req, "If-Modified-Since", value, sizeof(value)))
+   {
+      memset(&tm, 0, sizeof(struct tm));
+
+      if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+      {
+         return validators->last_modified <= timegm(&tm);
+      }
+   }
+
+   return false;
+}
+
 void
 pgexporter_http_server_request_destroy(struct http_server_request* req)
 {
+   if (req != NULL)
+   {
+      free(req->headers);
+   }
    free(req);
 }
 
@@ -153,42 +522,371 @@ pgexporter_http_server_dispatch(SSL* ssl, int fd, struct http_server_request* re
    {
       if (strcmp(req->path, routes[i].path) == 0)
       {
-         return routes[i].handler(ssl, fd);
+         return routes[i].handler(ssl, fd, req);
       }
    }
 
    pgexporter_log_debug("http_server: no route for path '%s'", req->path);
-   return pgexporter_http_respond_404(ssl, fd);
+   return pgexporter_http_respond_404(ssl, fd, req);
+}
+
+/**
+ * Read more of a request into the connection buffer
+ * @param connection The connection
+ * @param timeout The timeout in milliseconds, 0 or less waits forever
+ * @param idle Is the connection between requests
+ * @return MESSAGE_STATUS_OK when data was read, MESSAGE_STATUS_ZERO when the
+ *         connection was closed, timed out or gave way, otherwise MESSAGE_STATUS_ERROR
+ */
+static int
+connection_read(struct http_server_connection* connection, int timeout, bool idle)
+{
+   char* buffer = NULL;
+   ssize_t numbytes;
+   bool readable = false;
+   struct pollfd fds;
+
+   if (connection->ssl == NULL || SSL_pending(connection->ssl) <= 0)
+   {
+      if (idle && connection->idle_fds_length > 0)
+      {
+         if (!connection_wait_idle(connection, timeout, &readable) || !readable)
+         {
+            return MESSAGE_STATUS_ZERO;
+         }
+      }
+      else
+      {
+         fds.fd = connection->fd;
+         fds.events = POLLIN;
+         fds.revents = 0;
+
+         if (poll(&fds, 1, timeout > 0 ? timeout : -1) <= 0)
+         {
+            errno = 0;
+            return MESSAGE_STATUS_ZERO;
+         }
+      }
+   }
+
+   buffer = realloc(connection->buffer, connection->length + HTTP_SERVER_READ_SIZE);
+   if (buffer == NULL)
+   {
+      return MESSAGE_STATUS_ERROR;
+   }
+   connection->buffer = buffer;
+
+   if (connection->ssl != NULL)
+   {
+      numbytes = SSL_read(connection->ssl, connection->buffer + connection->length, HTTP_SERVER_READ_SIZE);
+      if (numbytes <= 0)
+      {
+         int err = SSL_get_error(connection->ssl, (int)numbytes);
+
+         ERR_clear_error();
+
+         return err == SSL_ERROR_ZERO_RETURN || err == SSL_ERROR_SYSCALL ? MESSAGE_STATUS_ZERO : MESSAGE_STATUS_ERROR;
+      }
+   }
+   else
+   {
+      do
+      {
+         numbytes = recv(connection->fd, connection->buffer + connection->length, HTTP_SERVER_READ_SIZE, 0);
+      }
+      while (numbytes == -1 && errno == EINTR);
+
+      if (numbytes <= 0)
+      {
+         errno = 0;
+         return MESSAGE_STATUS_ZERO;
+      }
+   }
+
+   connection->length += (size_t)numbytes;
+
+   return MESSAGE_STATUS_OK;
+}
+
+/**
+ * Wait for the next request of an idle connection, while watching the idle
+ * descriptors. When one of them is readable, the connection gives way if the
+ * idle_yield callback agrees after a short grace period, in which a free
+ * process may have taken care of it
+ * @param connection The connection
+ * @param timeout The timeout in milliseconds, 0 or less waits forever
+ * @param readable Is the client readable
+ * @return true if the connection should continue, otherwise false
+ */
+static bool
+connection_wait_idle(struct http_server_connection* connection, int timeout, bool* readable)
+{
+   struct pollfd fds[HTTP_SERVER_MAX_IDLE_FDS + 1];
+   int nfds;
+   int64_t wait;
+   struct timespec start;
+   struct timespec now;
+
+   *readable = false;
+
+   nfds = connection->idle_fds_length < HTTP_SERVER_MAX_IDLE_FDS ? connection->idle_fds_length : HTTP_SERVER_MAX_IDLE_FDS;
+
+   fds[0].fd = connection->fd;
+   fds[0].events = POLLIN;
+   for (int i = 0; i < nfds; i++)
+   {
+      fds[i + 1].fd = connection->idle_fds[i];
+      fds[i + 1].events = POLLIN;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   while (true)
+   {
+      wait = -1;
+      if (timeout > 0)
+      {
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         wait = timeout - ((int64_t)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+         if (wait <= 0)
+         {
+            return false;
+         }
+      }
+
+      for (int i = 0; i <= nfds; i++)
+      {
+         fds[i].revents = 0;
+      }
+
+      if (poll(&fds[0], nfds + 1, (int)wait) <= 0)
+      {
+         errno = 0;
+         return false;
+      }
+
+      if (fds[0].revents != 0)
+      {
+         *readable = true;
+         return true;
+      }
+
+      /* Someone else is waiting to be served */
+      fds[0].revents = 0;
+      if (poll(&fds[0], 1, HTTP_SERVER_IDLE_GRACE) > 0)
+      {
+         *readable = true;
+         return true;
+      }
+
+      for (int i = 1; i <= nfds; i++)
+      {
+         fds[i].revents = 0;
+      }
+
+      if (poll(&fds[1], nfds, 0) > 0 &&
+          (connection->idle_yield == NULL || connection->idle_yield()))
+      {
+         return false;
+      }
+   }
+}
+
+/**
+ * Find the end of the request head
+ * @param data The data
+ * @param length The length of the data
+ * @return The length of the request head including the empty line, or -1
+ */
+static ssize_t
+request_end(char* data, size_t length)
+{
+   for (size_t i = 0; data != NULL && i + 1 < length; i++)
+   {
+      if (data[i] == '\n')
+      {
+         if (data[i + 1] == '\n')
+         {
+            return (ssize_t)(i + 2);
+         }
+
+         if (data[i + 1] == '\r' && i + 2 < length && data[i + 2] == '\n')
+         {
+            return (ssize_t)(i + 3);
+         }
+      }
+   }
+
+   return -1;
+}
+
+/**
+ * Parse a request head
+ * @param data The request head
+ * @param length The length of the request head
+ * @param req The resulting request
+ * @return 0 on success, otherwise 1
+ */
+static int
+parse_request(char* data, size_t length, struct http_server_request** req)
+{
+   struct http_server_request* r = NULL;
+   char value[64];
+   char* path = NULL;
+   char* version = NULL;
+   char* eol = NULL;
+   size_t path_length;
+   bool head = false;
+
+   *req = NULL;
+
+   if (length > 4 && !strncmp(data, "GET ", 4))
+   {
+      path = data + 4;
+   }
+   else if (length > 5 && !strncmp(data, "HEAD ", 5))
+   {
+      path = data + 5;
+      head = true;
+   }
+   else
+   {
+      pgexporter_log_debug("http_server: not a GET or HEAD request");
+      goto error;
+   }
+
+   eol = memchr(data, '\n', length);
+   version = memchr(path, ' ', (size_t)(eol - path));
+   if (version == NULL)
+   {
+      pgexporter_log_debug("http_server: malformed request line");
+      goto error;
+   }
+
+   r = malloc(sizeof(struct http_server_request));
+   if (r == NULL)
+   {
+      goto error;
+   }
+
+   memset(r, 0, sizeof(struct http_server_request));
+
+   path_length = (size_t)(version - path);
+   if (path_length > sizeof(r->path) - 1)
+   {
+      path_length = sizeof(r->path) - 1;
+   }
+   memcpy(r->path, path, path_length);
+   r->head = head;
+
+   /* Keep the header lines, which start after the request line */
+   length -= (size_t)(eol + 1 - data);
+
+   r->headers = malloc(length + 1);
+   if (r->headers == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(r->headers, eol + 1, length);
+   r->headers[length] = '\0';
+
+   /* HTTP/1.1 is persistent unless asked otherwise, HTTP/1.0 only when asked */
+   if (!strncmp(version + 1, "HTTP/1.1", 8))
+   {
+      r->keep_alive = !header_has_token(r, "Connection", "close");
+   }
+   else
+   {
+      r->keep_alive = header_has_token(r, "Connection", "keep-alive");
+   }
+
+   /* A request body is not read, so the connection can't be reused */
+   if (pgexporter_http_server_get_header(r, "Transfer-Encoding", value, sizeof(value)) ||
+       (pgexporter_http_server_get_header(r, "Content-Length", value, sizeof(value)) && strcmp(value, "0")))
+   {
+      r->keep_alive = false;
+   }
+
+   *req = r;
+
+   return 0;
+
+error:
+
+   pgexporter_http_server_request_destroy(r);
+
+   return 1;
+}
+
+static bool
+header_has_token(struct http_server_request* req, const char* name, const char* token)
+{
+   char value[256];
+   char* p = NULL;
+   char* end = NULL;
+   size_t token_length = strlen(token);
+
+   if (!pgexporter_http_server_get_header(req, name, value, sizeof(value)))
+   {
+      return false;
+   }
+
+   p = value;
+   while (p != NULL && *p != '\0')
+   {
+      end = strchr(p, ',');
+
+      while (*p == ' ' || *p == '\t')
+      {
+         p++;
+      }
+
+      if (!strncasecmp(p, token, token_length) &&
+          (p[token_length] == '\0' || p[token_length] == ',' || p[token_length] == ' ' || p[token_length] == '\t'))
+      {
+         return true;
+      }
+
+      p = end != NULL ? end + 1 : NULL;
+   }
+
+   return false;
 }
 
 int
-pgexporter_http_respond_ok(SSL* ssl, int fd, const char* content_type,
+pgexporter_http_respond_ok(SSL* ssl, int fd, struct http_server_request* req, const char* content_type,
                            const void* body, size_t len)
 {
-   char header[512];
-   int header_len;
+   return pgexporter_http_respond_ok_validated(ssl, fd, req, content_type, body, len, NULL);
+}
+
+int
+pgexporter_http_respond_ok_validated(SSL* ssl, int fd, struct http_server_request* req, const char* content_type,
+                                     const void* body, size_t len, struct http_validators* validators)
+{
+   char* header = NULL;
    struct message msg;
    int status;
 
    memset(&msg, 0, sizeof(struct message));
 
-   header_len = pgexporter_snprintf(header, sizeof(header),
-                                    "HTTP/1.1 200 OK\r\n"
-                                    "Content-Type: %s\r\n"
-                                    "Content-Length: %zu\r\n"
-                                    "Connection: close\r\n"
-                                    "\r\n",
-                                    content_type, len);
+   header = ok_header(req, content_type, len, validators);
+   if (header == NULL)
+   {
+      return MESSAGE_STATUS_ERROR;
+   }
 
    msg.data = header;
-   msg.length = header_len;
+   msg.length = strlen(header);
    status = pgexporter_write_message(ssl, fd, &msg);
+   free(header);
    if (status != MESSAGE_STATUS_OK)
    {
       return status;
    }
 
-   if (len > 0 && body != NULL)
+   if (len > 0 && body != NULL && has_body(req))
    {
       memset(&msg, 0, sizeof(struct message));
       msg.data = (void*)body;
@@ -199,6 +897,95 @@ pgexporter_http_respond_ok(SSL* ssl, int fd, const char* content_type,
    return status;
 }
 
+int
+pgexporter_http_response_ok(struct http_server_request* req, const char* content_type, const void* body, size_t len,
+                            struct http_validators* validators, char** response, size_t* response_length)
+{
+   char* header = NULL;
+   char* data = NULL;
+   size_t header_length;
+   size_t body_length;
+
+   *response = NULL;
+   *response_length = 0;
+
+   header = ok_header(req, content_type, len, validators);
+   if (header == NULL)
+   {
+      goto error;
+   }
+
+   header_length = strlen(header);
+   body_length = body != NULL && has_body(req) ? len : 0;
+
+   data = malloc(header_length + body_length);
+   if (data == NULL)
+   {
+      goto error;
+   }
+
+   memcpy(data, header, header_length);
+   if (body_length > 0)
+   {
+      memcpy(data + header_length, body, body_length);
+   }
+
+   free(header);
+
+   *response = data;
+   *response_length = header_length + body_length;
+
+   return 0;
+
+error:
+
+   free(header);
+
+   return 1;
+}
+
+int
+pgexporter_http_response_not_modified(struct http_server_request* req, struct http_validators* validators,
+                                      char** response, size_t* response_length)
+{
+   char* data = NULL;
+
+   data = pgexporter_append(data, "HTTP/1.1 304 Not Modified\r\n");
+   data = append_validators(data, validators);
+   data = pgexporter_append(data, (char*)connection_header(req));
+   data = pgexporter_append(data, "\r\n");
+
+   *response = data;
+   *response_length = data != NULL ? strlen(data) : 0;
+
+   return data != NULL ? 0 : 1;
+}
+
+int
+pgexporter_http_respond_not_modified(SSL* ssl, int fd, struct http_server_request* req, struct http_validators* validators)
+{
+   char* data = NULL;
+   size_t length = 0;
+   struct message msg;
+   int status;
+
+   memset(&msg, 0, sizeof(struct message));
+
+   if (pgexporter_http_response_not_modified(req, validators, &data, &length))
+   {
+      return MESSAGE_STATUS_ERROR;
+   }
+
+   msg.kind = 0;
+   msg.length = length;
+   msg.data = data;
+
+   status = pgexporter_write_message(ssl, fd, &msg);
+
+   free(data);
+   return status;
+}
+
 int
 pgexporter_http_respond_400(SSL* ssl, int fd)
 {
@@ -224,7 +1011,7 @@ pgexporter_http_respond_400(SSL* ssl, int fd)
 }
 
 int
-pgexporter_http_respond_404(SSL* ssl, int fd)
+pgexporter_http_respond_404(SSL* ssl, int fd, struct http_server_request* req)
 {
    char* data = NULL;
    char time_buf[32];
@@ -234,13 +1021,14 @@ pgexporter_http_respond_404(SSL* ssl, int fd)
    memset(&msg, 0, sizeof(struct message));
    fill_date(time_buf, sizeof(time_buf));
 
-   data = pgexporter_vappend(data, 6,
+   data = pgexporter_vappend(data, 7,
                              "HTTP/1.1 404 Not Found\r\n",
                              "Date: ",
                              time_buf,
                              "\r\n",
                              "Content-Length: 0\r\n",
-                             "Connection: close\r\n\r\n");
+                             connection_header(req),
+                             "\r\n");
 
    msg.kind = 0;
    msg.length = strlen(data);
@@ -282,7 +1070,7 @@ pgexporter_http_respond_500(SSL* ssl, int fd)
 }
 
 int
-pgexporter_http_respond_redirect(SSL* ssl, int fd, const char* location)
+pgexporter_http_respond_redirect(SSL* ssl, int fd, struct http_server_request* req, const char* location)
 {
    char* data = NULL;
    char time_buf[32];
@@ -300,7 +1088,7 @@ pgexporter_http_respond_redirect(SSL* ssl, int fd, const char* location)
    data = pgexporter_append(data, time_buf);
    data = pgexporter_append(data, "\r\n");
    data = pgexporter_append(data, "Content-Length: 0\r\n");
-   data = pgexporter_append(data, "Connection: close\r\n");
+   data = pgexporter_append(data, (char*)connection_header(req));
    data = pgexporter_append(data, "\r\n");
 
    msg.kind = 0;
@@ -314,7 +1102,7 @@ pgexporter_http_respond_redirect(SSL* ssl, int fd, const char* location)
 }
 
 int
-pgexporter_http_respond_chunked_start(SSL* ssl, int fd, const char* content_type)
+pgexporter_http_respond_chunked_start(SSL* ssl, int fd, struct http_server_request* req, const char* content_type)
 {
    char* data = NULL;
    char time_buf[32];
@@ -324,14 +1112,16 @@ pgexporter_http_respond_chunked_start(SSL* ssl, int fd, const char* content_type
    memset(&msg, 0, sizeof(struct message));
    fill_date(time_buf, sizeof(time_buf));
 
-   data = pgexporter_vappend(data, 7,
+   data = pgexporter_vappend(data, 9,
                              "HTTP/1.1 200 OK\r\n",
                              "Content-Type: ",
                              content_type,
                              "\r\n",
                              "Date: ",
                              time_buf,
-                             "\r\nTransfer-Encoding: chunked\r\n\r\n");
+                             "\r\nTransfer-Encoding: chunked\r\n",
+                             connection_header(req),
+                             "\r\n");
 
    msg.kind = 0;
    msg.length = strlen(data);
@@ -30,15 +30,21 @@
 #include <pgexporter.h>
 #include <logging.h>
 #include <prometheus.h>
+#include <shmem.h>
 #include <utils.h>
 
 /* system */
 #include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
@@ -46,6 +52,19 @@
 #define LINE_LENGTH 32
 #define MAX_LENGTH  4096
 
+#define LOG_WRITER_BATCH    64
+#define LOG_WRITER_IDLE     1000000L
+#define LOG_WRITER_IDLE_MAX 100000000L
+
+/* Idle rounds (about one second) after which a claimed but unpublished slot is skipped */
+#define LOG_WRITER_STALE_ROUNDS 1000
+
+/* Marks the sequence of a slot that a producer is copying into */
+#define LOG_RECORD_BUSY (1UL << (sizeof(unsigned long) * 8 - 1))
+
+/* The most records a line may span, longer lines are truncated */
+#define LOG_RING_MAX_RECORDS (PGEXPORTER_LOGGING_RING_SLOTS / 4)
+
 FILE* log_file = NULL;
 
 time_t next_log_rotation_age; /* number of seconds at which the next location will happen */
@@ -61,6 +80,14 @@ static void log_file_rotate(void);
 
 static void output_log_line(char* l);
 
+static bool log_ring_active(struct configuration* config);
+static bool log_ring_line(struct configuration* config, int level, char* filename, int line, char* fmt, va_list vl);
+static bool log_ring_push(struct log_ring* ring, char* data, size_t length);
+static bool log_writer_skip(struct log_ring* ring, unsigned long tail);
+static void log_writer_write(struct iovec* iov, int count);
+
+static bool log_writer_process = false;
+
 // clang-format off
 static char* levels[] =
 {
@@ -190,6 +217,21 @@ pgexporter_log_line(int level, char* file, int line, char* fmt, ...)
             break;
       }
 
+      if (log_ring_active(config))
+      {
+         bool queued;
+         va_list vl;
+
+         va_start(vl, fmt);
+         queued = log_ring_line(config, level, file, line, fmt, vl);
+         va_end(vl);
+
+         if (queued)
+         {
+            return;
+         }
+      }
+
       if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
       {
          output = stdout;
@@ -522,6 +564,496 @@ retry:
    }
 }
 
+int
+pgexporter_log_ring_init(size_t* p_size, void** p_shmem)
+{
+   struct log_ring* ring = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   size_t size = sizeof(struct log_ring);
+
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   if (pgexporter_create_shared_memory(size, config->hugepage, (void*)&ring))
+   {
+      return 1;
+   }
+
+   memset(ring, 0, size);
+   atomic_init(&ring->head, 0);
+   atomic_init(&ring->tail, 0);
+   atomic_init(&ring->dropped, 0);
+   atomic_init(&ring->generation, 0);
+   atomic_init(&ring->stop, false);
+
+   for (unsigned long i = 0; i < PGEXPORTER_LOGGING_RING_SLOTS; i++)
+   {
+      atomic_init(&ring->records[i].sequence, i);
+   }
+
+   *p_size = size;
+   *p_shmem = ring;
+
+   return 0;
+}
+
+void
+pgexporter_log_writer(void)
+{
+   int count;
+   int stalled = 0;
+   long idle = LOG_WRITER_IDLE;
+   unsigned int generation;
+   unsigned long tail;
+   unsigned long stalled_tail = 0;
+   pid_t parent;
+   struct iovec iov[LOG_WRITER_BATCH];
+   struct log_record* record = NULL;
+   struct log_ring* ring = (struct log_ring*)log_ring_shmem;
+   struct configuration* config = (struct configuration*)shmem;
+
+   log_writer_process = true;
+   parent = getppid();
+   generation = atomic_load(&ring->generation);
+
+   while (true)
+   {
+      tail = atomic_load(&ring->tail);
+      count = 0;
+
+      while (count < LOG_WRITER_BATCH)
+      {
+         record = &ring->records[(tail + count) % PGEXPORTER_LOGGING_RING_SLOTS];
+
+         if (atomic_load_explicit(&record->sequence, memory_order_acquire) != tail + count + 1)
+         {
+            break;
+         }
+
+         iov[count].iov_base = record->data;
+         iov[count].iov_len = record->length;
+         count++;
+      }
+
+      if (count > 0)
+      {
+         log_writer_write(&iov[0], count);
+
+         for (int i = 0; i < count; i++)
+         {
+            record = &ring->records[(tail + i) % PGEXPORTER_LOGGING_RING_SLOTS];
+            atomic_store_explicit(&record->pid, 0, memory_order_relaxed);
+            atomic_store_explicit(&record->sequence, tail + i + PGEXPORTER_LOGGING_RING_SLOTS, memory_order_release);
+         }
+         atomic_store(&ring->tail, tail + count);
+
+         if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE && log_rotation_required())
+         {
+            log_file_rotate();
+         }
+
+         stalled = 0;
+         idle = LOG_WRITER_IDLE;
+         continue;
+      }
+
+      /* A producer that died between claiming the slot and publishing it
+       * would block the ring, so the slot is skipped after a while */
+      if (atomic_load(&ring->head) != tail)
+      {
+         if (stalled == 0 || stalled_tail != tail)
+         {
+            stalled_tail = tail;
+            stalled = 0;
+         }
+
+         /* The slot is about to be published, so don't back off */
+         idle = LOG_WRITER_IDLE;
+
+         if (++stalled >= LOG_WRITER_STALE_ROUNDS)
+         {
+            if (log_writer_skip(ring, tail))
+            {
+               atomic_store(&ring->tail, tail + 1);
+               atomic_fetch_add(&ring->dropped, 1);
+            }
+
+            stalled = 0;
+            continue;
+         }
+      }
+      else
+      {
+         stalled = 0;
+      }
+
+      /* Only stop once everything queued has been written */
+      if (atomic_load(&ring->stop) || getppid() != parent)
+      {
+         break;
+      }
+
+      if (generation != atomic_load(&ring->generation))
+      {
+         generation = atomic_load(&ring->generation);
+         pgexporter_stop_logging();
+         pgexporter_start_logging();
+      }
+
+      SLEEP(idle)
+
+      /* Back off while the ring stays empty */
+      idle = MIN(idle * 2, LOG_WRITER_IDLE_MAX);
+   }
+
+   pgexporter_stop_logging();
+
+   exit(0);
+}
+
+void
+pgexporter_log_writer_stop(void)
+{
+   pid_t pid;
+   struct log_ring* ring = (struct log_ring*)log_ring_shmem;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (ring == NULL)
+   {
+      return;
+   }
+
+   atomic_store(&ring->stop, true);
+
+   pid = (pid_t)atomic_load(&config->log_writer_pid);
+   if (pid > 0)
+   {
+      waitpid(pid, NULL, 0);
+      atomic_store(&config->log_writer_pid, 0);
+   }
+}
+
+void
+pgexporter_log_writer_reopen(void)
+{
+   struct log_ring* ring = (struct log_ring*)log_ring_shmem;
+
+   if (ring != NULL)
+   {
+      atomic_fetch_add(&ring->generation, 1);
+   }
+}
+
+static bool
+log_ring_active(struct configuration* config)
+{
+   struct log_ring* ring = (struct log_ring*)log_ring_shmem;
+
+   if (ring == NULL || log_writer_process)
+   {
+      return false;
+   }
+
+   if (config->log_type != PGEXPORTER_LOGGING_TYPE_CONSOLE && config->log_type != PGEXPORTER_LOGGING_TYPE_FILE)
+   {
+      return false;
+   }
+
+   return atomic_load(&config->log_writer_pid) > 0 && !atomic_load(&ring->stop);
+}
+
+/**
+ * Format a log line and queue it for the log writer. A full ring drops the
+ * line rather than waiting for the writer.
+ *
+ * @param config The configuration
+ * @param level The level
+ * @param file The file
+ * @param line The line number
+ * @param fmt The formatting code
+ * @param vl The arguments
+ * @return true if the line was queued or dropped, false if it must be written directly
+ */
+static bool
+log_ring_line(struct configuration* config, int level, char* file, int line, char* fmt, va_list vl)
+{
+   char buf[PGEXPORTER_LOGGING_RING_RECORD_SIZE];
+   char prefix[MISC_LENGTH * 2];
+   char* filename = NULL;
+   char* data = buf;
+   size_t size;
+   va_list copy;
+   int length;
+   int n;
+   struct tm tm;
+   time_t t;
+   struct log_ring* ring = (struct log_ring*)log_ring_shmem;
+
+#ifdef DEBUG
+   if (level > 4)
+   {
+      return false;
+   }
+#endif
+
+   t = time(NULL);
+   if (localtime_r(&t, &tm) == NULL)
+   {
+      return false;
+   }
+
+   filename = strrchr(file, '/');
+   if (filename != NULL)
+   {
+      filename = filename + 1;
+   }
+   else
+   {
+      filename = file;
+   }
+
+   if (strlen(config->log_line_prefix) == 0)
+   {
+      memcpy(config->log_line_prefix, PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX, strlen(PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX));
+   }
+
+   prefix[strftime(prefix, sizeof(prefix), config->log_line_prefix, &tm)] = '\0';
+
+   if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
+   {
+      length = snprintf(buf, sizeof(buf), "%s %s%-5s\x1b[0m \x1b[90m%s:%d\x1b[0m ",
+                        prefix, colors[level - 1], levels[level - 1], filename, line);
+   }
+   else
+   {
+      length = snprintf(buf, sizeof(buf), "%s %-5s %s:%d ", prefix, levels[level - 1], filename, line);
+   }
+
+   if (length < 0 || (size_t)length >= sizeof(buf))
+   {
+      return false;
+   }
+
+   va_copy(copy, vl);
+   n = vsnprintf(buf + length, sizeof(buf) - length, fmt, vl);
+
+   if (n < 0)
+   {
+      va_end(copy);
+      return false;
+   }
+
+   /* Too long for a record, the line spans several records so it keeps its place */
+   if ((size_t)(length + n + 1) >= sizeof(buf))
+   {
+      size = MIN((size_t)length + n + 2, (size_t)LOG_RING_MAX_RECORDS * PGEXPORTER_LOGGING_RING_RECORD_SIZE);
+
+      data = malloc(size);
+      if (data == NULL)
+      {
+         va_end(copy);
+         atomic_fetch_add(&ring->dropped, 1);
+         return true;
+      }
+
+      memcpy(data, buf, length);
+      n = vsnprintf(data + length, size - length - 1, fmt, copy);
+      n = MIN(n, (int)(size - length - 2));
+   }
+
+   va_end(copy);
+
+   length += n;
+   data[length++] = '\n';
+
+   if (!log_ring_push(ring, data, length))
+   {
+      atomic_fetch_add(&ring->dropped, 1);
+   }
+
+   if (data != buf)
+   {
+      free(data);
+   }
+
+   return true;
+}
+
+/**
+ * Add a line to the ring. The consecutive slots of the line are claimed
+ * at once by moving the head past them, so a line that spans several
+ * records is never interleaved with another one. A slot is marked busy
+ * before it is copied into and published afterwards. A slot that the
+ * writer skipped as stale in the meantime may belong to another line
+ * already, so it is left alone, and the rest of the line is published
+ * empty.
+ *
+ * @param ring The ring
+ * @param data The line
+ * @param length The length of the line
+ * @return true if the line was queued, false if the ring is full
+ */
+static bool
+log_ring_push(struct log_ring* ring, char* data, size_t length)
+{
+   bool skipped = false;
+   unsigned long head;
+   unsigned long sequence;
+   unsigned long expected;
+   unsigned long number_of_records;
+   struct log_record* record = NULL;
+
+   number_of_records = (length + PGEXPORTER_LOGGING_RING_RECORD_SIZE - 1) / PGEXPORTER_LOGGING_RING_RECORD_SIZE;
+
+   head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+   while (true)
+   {
+      record = &ring->records[head % PGEXPORTER_LOGGING_RING_SLOTS];
+      sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+      if (sequence == head)
+      {
+         /* The writer frees the slots in order, so the last one being free means they all are */
+         record = &ring->records[(head + number_of_records - 1) % PGEXPORTER_LOGGING_RING_SLOTS];
+         if (atomic_load_explicit(&record->sequence, memory_order_acquire) != head + number_of_records - 1)
+         {
+            return false;
+         }
+
+         if (atomic_compare_exchange_weak(&ring->head, &head, head + number_of_records))
+         {
+            break;
+         }
+      }
+      else if (!(sequence & LOG_RECORD_BUSY) && (long)(sequence - head) < 0)
+      {
+         return false;
+      }
+      else
+      {
+         head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+      }
+   }
+
+   for (unsigned long i = 0; i < number_of_records; i++)
+   {
+      size_t l = MIN(length - i * PGEXPORTER_LOGGING_RING_RECORD_SIZE, (size_t)PGEXPORTER_LOGGING_RING_RECORD_SIZE);
+
+      record = &ring->records[(head + i) % PGEXPORTER_LOGGING_RING_SLOTS];
+
+      expected = head + i;
+      if (!atomic_compare_exchange_strong(&record->sequence, &expected, (head + i) | LOG_RECORD_BUSY))
+      {
+         skipped = true;
+         continue;
+      }
+
+      atomic_store_explicit(&record->pid, getpid(), memory_order_relaxed);
+
+      if (!skipped)
+      {
+         memcpy(record->data, data + i * PGEXPORTER_LOGGING_RING_RECORD_SIZE, l);
+      }
+      record->length = skipped ? 0 : l;
+
+      atomic_store_explicit(&record->sequence, head + i + 1, memory_order_release);
+   }
+
+   return true;
+}
+
+/**
+ * Skip the slot at the tail of the ring, if its producer is gone. A slot
+ * that was claimed but not started on is skipped, since a late producer
+ * won't touch it anymore. A busy slot is only skipped once the process
+ * copying into it has exited.
+ *
+ * @param ring The ring
+ * @param tail The tail
+ * @return true if the slot was skipped, otherwise false
+ */
+static bool
+log_writer_skip(struct log_ring* ring, unsigned long tail)
+{
+   pid_t pid;
+   unsigned long expected;
+   struct log_record* record = &ring->records[tail % PGEXPORTER_LOGGING_RING_SLOTS];
+
+   expected = tail;
+   if (atomic_compare_exchange_strong(&record->sequence, &expected, tail + PGEXPORTER_LOGGING_RING_SLOTS))
+   {
+      return true;
+   }
+
+   if (expected != (tail | LOG_RECORD_BUSY))
+   {
+      return false;
+   }
+
+   pid = atomic_load_explicit(&record->pid, memory_order_relaxed);
+   if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+   {
+      errno = 0;
+      return false;
+   }
+
+   errno = 0;
+   atomic_store_explicit(&record->pid, 0, memory_order_relaxed);
+
+   return atomic_compare_exchange_strong(&record->sequence, &expected, tail + PGEXPORTER_LOGGING_RING_SLOTS);
+}
+
+static void
+log_writer_write(struct iovec* iov, int count)
+{
+   int fd = -1;
+   ssize_t written;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
+   {
+      fd = STDOUT_FILENO;
+   }
+   else
+   {
+      if (log_file == NULL && pgexporter_start_logging())
+      {
+         return;
+      }
+      fflush(log_file);
+      fd = fileno(log_file);
+   }
+
+   while (count > 0)
+   {
+      written = writev(fd, iov, count);
+      if (written < 0)
+      {
+         if (errno == EINTR)
+         {
+            errno = 0;
+            continue;
+         }
+         errno = 0;
+         return;
+      }
+
+      while (count > 0 && (size_t)written >= iov->iov_len)
+      {
+         written -= iov->iov_len;
+         iov++;
+         count--;
+      }
+
+      if (count > 0)
+      {
+         iov->iov_base = (char*)iov->iov_base + written;
+         iov->iov_len -= written;
+      }
+   }
+}
+
 static void
 output_log_line(char* l)
 {
@@ -36,12 +36,49 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <poll.h>
 #include <shmem.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#if HAVE_LINUX && HAVE_IO_URING
+#include <pthread.h>
+#endif
+
+#if HAVE_LINUX && HAVE_IO_URING
+#define CLIENT_RING_ENTRIES 8
+#define CLIENT_RING_READ    1
+#define CLIENT_RING_TIMEOUT 2
+#define CLIENT_RING_SEND    3
+#define CLIENT_RING_CANCEL  4
+#define CLIENT_RING_BGID    0
+
+static struct io_uring client_ring;
+static struct io_uring_buf_ring* client_ring_br = NULL; /* The buffers provided to the reads of client_ring */
+static void* client_ring_buffer = NULL;                 /* The memory of the provided buffer */
+static bool client_ring_active = false;    /* Is client_ring set up in this process */
+static bool client_ring_inherited = false; /* Was client_ring set up by the parent process */
+static bool client_ring_disabled = false;  /* Did the setup fail, so plain read() and write() are used */
+static bool client_ring_atfork = false;    /* Is the fork handler installed */
+
+static bool client_ring_ready(void);
+static void client_ring_atfork_child(void);
+static void client_ring_cancel(uint64_t data, int pending);
+static int client_ring_read_message(int socket, int timeout, struct timespec* start, struct message** msg);
+static int client_ring_write_message(int socket, struct message* msg);
+#endif /* HAVE_LINUX && HAVE_IO_URING */
+
+static struct timespec deadline;     /* The absolute CLOCK_MONOTONIC deadline for client I/O */
+static bool deadline_active = false; /* Is deadline set */
+
+static int io_wait_time(int timeout, struct timespec* start);
+static int io_wait(int fd, short events, int wait);
 
 static int read_message(int socket, bool block, int timeout, struct message** msg);
 static int write_message(int socket, struct message* msg);
@@ -52,6 +89,46 @@ static int write_message_from_buffer(struct io_watcher* watcher, struct message*
 static int ssl_read_message(SSL* ssl, int timeout, struct message** msg);
 static int ssl_write_message(SSL* ssl, struct message* msg);
 
+void
+pgexporter_set_deadline(int64_t timeout)
+{
+   if (timeout <= 0)
+   {
+      deadline_active = false;
+      return;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+   deadline.tv_sec += timeout / 1000;
+   deadline.tv_nsec += (timeout % 1000) * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L)
+   {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+
+   deadline_active = true;
+}
+
+int64_t
+pgexporter_deadline_remaining(void)
+{
+   struct timespec now;
+   int64_t remaining;
+
+   if (!deadline_active)
+   {
+      return -1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   remaining = (int64_t)(deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+
+   return remaining > 0 ? remaining : 0;
+}
+
 int
 pgexporter_read_block_message(SSL* ssl, int socket, struct message** msg)
 {
@@ -67,11 +144,23 @@ static int
 read_append(SSL* ssl, int socket, struct message* m, size_t needed)
 {
    ssize_t numbytes;
+   int wait;
 
    while ((size_t)m->length < needed)
    {
+      wait = io_wait_time(0, NULL);
+      if (wait == 0)
+      {
+         return MESSAGE_STATUS_ZERO;
+      }
+
       if (ssl != NULL)
       {
+         if (wait > 0 && SSL_pending(ssl) <= 0 && io_wait(SSL_get_fd(ssl), POLLIN, wait) < 0)
+         {
+            return MESSAGE_STATUS_ERROR;
+         }
+
          numbytes = SSL_read(ssl, (char*)m->data + m->length, DEFAULT_BUFFER_SIZE - m->length);
 
          if (numbytes <= 0)
@@ -82,7 +171,10 @@ read_append(SSL* ssl, int socket, struct message* m, size_t needed)
             switch (err)
             {
                case SSL_ERROR_WANT_READ:
+                  io_wait(SSL_get_fd(ssl), POLLIN, wait);
+                  continue;
                case SSL_ERROR_WANT_WRITE:
+                  io_wait(SSL_get_fd(ssl), POLLOUT, wait);
                   continue;
                case SSL_ERROR_ZERO_RETURN:
                   return MESSAGE_STATUS_ZERO;
@@ -93,7 +185,14 @@ read_append(SSL* ssl, int socket, struct message* m, size_t needed)
       }
       else
       {
-         numbytes = read(socket, (char*)m->data + m->length, DEFAULT_BUFFER_SIZE - m->length);
+         if (wait < 0)
+         {
+            numbytes = read(socket, (char*)m->data + m->length, DEFAULT_BUFFER_SIZE - m->length);
+         }
+         else
+         {
+            numbytes = recv(socket, (char*)m->data + m->length, DEFAULT_BUFFER_SIZE - m->length, MSG_DONTWAIT);
+         }
 
          if (numbytes == 0)
          {
@@ -101,9 +200,10 @@ read_append(SSL* ssl, int socket, struct message* m, size_t needed)
          }
          else if (numbytes < 0)
          {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
             {
                errno = 0;
+               io_wait(socket, POLLIN, wait);
                continue;
             }
 
@@ -400,6 +500,35 @@ pgexporter_write_terminate(SSL* ssl, int socket)
    return ssl_write_message(ssl, &msg);
 }
 
+int
+pgexporter_write_cancel_request(int socket, int pid, int secret)
+{
+   char cancel[16];
+   ssize_t numbytes;
+
+   memset(&cancel, 0, sizeof(cancel));
+
+   pgexporter_write_int32(&cancel, 16);
+   pgexporter_write_int32(&(cancel[4]), 80877102);
+   pgexporter_write_int32(&(cancel[8]), pid);
+   pgexporter_write_int32(&(cancel[12]), secret);
+
+   /* The deadline has usually passed, and 16 bytes always fit in a new socket */
+   do
+   {
+      numbytes = send(socket, &cancel, sizeof(cancel), MSG_NOSIGNAL);
+   }
+   while (numbytes < 0 && errno == EINTR);
+
+   if (numbytes != sizeof(cancel))
+   {
+      errno = 0;
+      return 1;
+   }
+
+   return 0;
+}
+
 int
 pgexporter_write_connection_refused(SSL* ssl, int socket)
 {
@@ -700,26 +829,105 @@ pgexporter_create_startup_message(char* username, char* database, struct message
    return MESSAGE_STATUS_OK;
 }
 
+static int
+io_wait_time(int timeout, struct timespec* start)
+{
+   struct timespec now;
+   int64_t wait = -1;
+   int64_t remaining;
+
+   if (timeout > 0)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      wait = timeout - ((int64_t)(now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000L);
+      if (wait < 0)
+      {
+         wait = 0;
+      }
+   }
+
+   remaining = pgexporter_deadline_remaining();
+   if (remaining >= 0 && (wait < 0 || remaining < wait))
+   {
+      wait = remaining;
+   }
+
+   if (wait > INT_MAX)
+   {
+      wait = INT_MAX;
+   }
+
+   return (int)wait;
+}
+
+static int
+io_wait(int fd, short events, int wait)
+{
+   struct pollfd pfd;
+   int ret;
+
+   pfd.fd = fd;
+   pfd.events = events;
+   pfd.revents = 0;
+
+   do
+   {
+      ret = poll(&pfd, 1, wait);
+   }
+   while (ret < 0 && errno == EINTR);
+
+   if (ret < 0)
+   {
+      pgexporter_log_debug("poll error: fd=%d errno=%d", fd, errno);
+      errno = 0;
+      return -1;
+   }
+
+   return ret > 0 ? 1 : 0;
+}
+
 static int
 read_message(int socket, bool block, int timeout, struct message** msg)
 {
-   bool keep_read = false;
    ssize_t numbytes;
-   struct timeval tv;
+   int wait;
+   struct timespec start;
    struct message* m = NULL;
 
    if (unlikely(timeout > 0))
    {
-      tv.tv_sec = timeout;
-      tv.tv_usec = 0;
-      setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+      clock_gettime(CLOCK_MONOTONIC, &start);
    }
 
-   do
+#if HAVE_LINUX && HAVE_IO_URING
+   /* Without a time limit a plain read() is a single system call as well */
+   if (block && io_wait_time(timeout, &start) >= 0 && client_ring_ready())
    {
+      return client_ring_read_message(socket, timeout, &start, msg);
+   }
+#endif
+
+   while (true)
+   {
+      /* A non-blocking read never waits, so only a blocking read is bounded */
+      wait = block ? io_wait_time(timeout, &start) : -1;
+      if (wait == 0)
+      {
+         return MESSAGE_STATUS_ZERO;
+      }
+
       m = pgexporter_memory_message();
 
-      numbytes = read(socket, m->data, DEFAULT_BUFFER_SIZE);
+      /* Without a time limit the read may block, otherwise poll() does the waiting */
+      if (likely(wait < 0))
+      {
+         numbytes = read(socket, m->data, DEFAULT_BUFFER_SIZE);
+      }
+      else
+      {
+         numbytes = recv(socket, m->data, DEFAULT_BUFFER_SIZE, MSG_DONTWAIT);
+      }
 
       if (likely(numbytes > 0))
       {
@@ -727,63 +935,30 @@ read_message(int socket, bool block, int timeout, struct message** msg)
          m->length = numbytes;
          *msg = m;
 
-         if (unlikely(timeout > 0))
-         {
-            tv.tv_sec = 0;
-            tv.tv_usec = 0;
-            setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-         }
-
          return MESSAGE_STATUS_OK;
       }
-      else if (numbytes == 0)
-      {
-         pgexporter_memory_free();
 
-         if ((errno == EAGAIN || errno == EWOULDBLOCK) && block)
-         {
-            keep_read = true;
-            errno = 0;
-         }
-         else
-         {
-            if (unlikely(timeout > 0))
-            {
-               tv.tv_sec = 0;
-               tv.tv_usec = 0;
-               setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-            }
+      pgexporter_memory_free();
 
-            return MESSAGE_STATUS_ZERO;
-         }
+      if (numbytes == 0)
+      {
+         return MESSAGE_STATUS_ZERO;
       }
-      else
+
+      if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && block))
       {
-         pgexporter_memory_free();
+         errno = 0;
 
-         if ((errno == EAGAIN || errno == EWOULDBLOCK) && block)
+         if (io_wait(socket, POLLIN, wait) < 0)
          {
-            keep_read = true;
-            errno = 0;
-         }
-         else
-         {
-            keep_read = false;
+            return MESSAGE_STATUS_ERROR;
          }
       }
+      else
+      {
+         return MESSAGE_STATUS_ERROR;
+      }
    }
-   while (keep_read);
-
-   if (unlikely(timeout > 0))
-   {
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
-      setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-      pgexporter_memory_free();
-   }
-
-   return MESSAGE_STATUS_ERROR;
 }
 
 static int
@@ -791,6 +966,7 @@ write_message(int socket, struct message* msg)
 {
    bool keep_write = false;
    ssize_t numbytes;
+   int wait;
    int offset;
    ssize_t totalbytes;
    ssize_t remaining;
@@ -800,6 +976,13 @@ write_message(int socket, struct message* msg)
    assert(msg != NULL);
 #endif
 
+#if HAVE_LINUX && HAVE_IO_URING
+   if (io_wait_time(0, NULL) >= 0 && client_ring_ready())
+   {
+      return client_ring_write_message(socket, msg);
+   }
+#endif
+
    numbytes = 0;
    offset = 0;
    totalbytes = 0;
@@ -809,9 +992,23 @@ write_message(int socket, struct message* msg)
    {
       keep_write = false;
 
+      wait = io_wait_time(0, NULL);
+      if (wait == 0)
+      {
+         pgexporter_log_debug("Deadline expired %d - %zd/%zd", socket, totalbytes, msg->length);
+         return MESSAGE_STATUS_ERROR;
+      }
+
       write_size = MIN(remaining, DEFAULT_BUFFER_SIZE);
 
-      numbytes = write(socket, msg->data + offset, write_size);
+      if (likely(wait < 0))
+      {
+         numbytes = write(socket, msg->data + offset, write_size);
+      }
+      else
+      {
+         numbytes = send(socket, msg->data + offset, write_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+      }
 
       if (numbytes >= 0)
       {
@@ -845,7 +1042,12 @@ write_message(int socket, struct message* msg)
          switch (errno)
          {
             case EAGAIN:
-               keep_write = true;
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+            case EINTR:
+               errno = 0;
+               keep_write = io_wait(socket, POLLOUT, wait) >= 0;
                break;
             default:
                keep_write = false;
@@ -864,17 +1066,35 @@ ssl_read_message(SSL* ssl, int timeout, struct message** msg)
 {
    bool keep_read = false;
    ssize_t numbytes;
-   time_t start_time;
+   int wait;
+   struct timespec start;
    struct message* m = NULL;
    unsigned long err;
 
    if (unlikely(timeout > 0))
    {
-      start_time = time(NULL);
+      clock_gettime(CLOCK_MONOTONIC, &start);
    }
 
    do
    {
+      keep_read = false;
+
+      wait = io_wait_time(timeout, &start);
+      if (wait == 0)
+      {
+         return MESSAGE_STATUS_ZERO;
+      }
+
+      /* Wait for the socket unless a record is already decrypted */
+      if (unlikely(wait > 0) && SSL_pending(ssl) <= 0)
+      {
+         if (io_wait(SSL_get_fd(ssl), POLLIN, wait) < 0)
+         {
+            return MESSAGE_STATUS_ERROR;
+         }
+      }
+
       m = pgexporter_memory_message();
 
       numbytes = SSL_read(ssl, m->data, DEFAULT_BUFFER_SIZE);
@@ -895,19 +1115,16 @@ ssl_read_message(SSL* ssl, int timeout, struct message** msg)
          switch (err)
          {
             case SSL_ERROR_ZERO_RETURN:
-               if (timeout > 0)
-               {
-                  if (difftime(time(NULL), start_time) >= timeout)
-                  {
-                     return MESSAGE_STATUS_ZERO;
-                  }
-
-                  /* Sleep for 100ms */
-                  SLEEP(100000000L);
-               }
-               __attribute__((fallthrough));
+               ERR_clear_error();
+               return MESSAGE_STATUS_ZERO;
             case SSL_ERROR_WANT_READ:
+               io_wait(SSL_get_fd(ssl), POLLIN, wait);
+               keep_read = true;
+               break;
             case SSL_ERROR_WANT_WRITE:
+               io_wait(SSL_get_fd(ssl), POLLOUT, wait);
+               keep_read = true;
+               break;
             case SSL_ERROR_WANT_CONNECT:
             case SSL_ERROR_WANT_ACCEPT:
             case SSL_ERROR_WANT_X509_LOOKUP:
@@ -945,6 +1162,7 @@ ssl_write_message(SSL* ssl, struct message* msg)
 {
    bool keep_write = false;
    ssize_t numbytes;
+   int wait;
    int offset;
    ssize_t totalbytes;
    ssize_t remaining;
@@ -961,6 +1179,13 @@ ssl_write_message(SSL* ssl, struct message* msg)
 
    do
    {
+      wait = io_wait_time(0, NULL);
+      if (wait == 0)
+      {
+         pgexporter_log_debug("Deadline expired %d - %zd/%zd", SSL_get_fd(ssl), totalbytes, msg->length);
+         return MESSAGE_STATUS_ERROR;
+      }
+
       numbytes = SSL_write(ssl, msg->data + offset, remaining);
 
       if (likely(numbytes == msg->length))
@@ -988,9 +1213,15 @@ ssl_write_message(SSL* ssl, struct message* msg)
 
          switch (err)
          {
-            case SSL_ERROR_ZERO_RETURN:
             case SSL_ERROR_WANT_READ:
+               errno = 0;
+               keep_write = io_wait(SSL_get_fd(ssl), POLLIN, wait) >= 0;
+               break;
             case SSL_ERROR_WANT_WRITE:
+               errno = 0;
+               keep_write = io_wait(SSL_get_fd(ssl), POLLOUT, wait) >= 0;
+               break;
+            case SSL_ERROR_ZERO_RETURN:
             case SSL_ERROR_WANT_CONNECT:
             case SSL_ERROR_WANT_ACCEPT:
             case SSL_ERROR_WANT_X509_LOOKUP:
@@ -1155,3 +1386,369 @@ write_message_from_buffer(struct io_watcher* watcher, struct message* msg)
    }
    return MESSAGE_STATUS_OK;
 }
+
+#if HAVE_LINUX && HAVE_IO_URING
+/**
+ * Is the io_uring client ring usable in this process. The ring is only used
+ * when io_uring is the event backend and a time limit applies, and is set up
+ * on first use. A child process sets up a ring of its own
+ * @return true if the ring is usable, otherwise false
+ */
+static bool
+client_ring_ready(void)
+{
+   struct configuration* config;
+   int ret;
+
+   config = (struct configuration*)shmem;
+
+   if (likely(client_ring_active && !client_ring_inherited))
+   {
+      return true;
+   }
+
+   if (client_ring_disabled || config == NULL || config->ev_backend != PGEXPORTER_EVENT_BACKEND_IO_URING)
+   {
+      return false;
+   }
+
+   if (client_ring_inherited)
+   {
+      /* Only unmaps our copy, the parent keeps its ring and its buffer */
+      io_uring_queue_exit(&client_ring);
+      free(client_ring_buffer);
+      client_ring_br = NULL;
+      client_ring_buffer = NULL;
+      client_ring_active = false;
+      client_ring_inherited = false;
+   }
+
+   ret = io_uring_queue_init(CLIENT_RING_ENTRIES, &client_ring, 0);
+   if (ret < 0)
+   {
+      pgexporter_log_debug("io_uring client ring: %s", strerror(-ret));
+      goto error;
+   }
+
+   /* Reads go into a buffer owned by the ring, so a read that is still in
+    * flight can never write into the message buffer of the process */
+   client_ring_br = io_uring_setup_buf_ring(&client_ring, 1, CLIENT_RING_BGID, 0, &ret);
+   if (client_ring_br == NULL)
+   {
+      pgexporter_log_debug("io_uring client ring buffers: %s", strerror(-ret));
+      io_uring_queue_exit(&client_ring);
+      goto error;
+   }
+
+   if (posix_memalign(&client_ring_buffer, sysconf(_SC_PAGESIZE), DEFAULT_BUFFER_SIZE))
+   {
+      pgexporter_log_debug("io_uring client ring buffers: %s", strerror(errno));
+      io_uring_free_buf_ring(&client_ring, client_ring_br, 1, CLIENT_RING_BGID);
+      io_uring_queue_exit(&client_ring);
+      client_ring_br = NULL;
+      client_ring_buffer = NULL;
+      goto error;
+   }
+
+   io_uring_buf_ring_add(client_ring_br, client_ring_buffer, DEFAULT_BUFFER_SIZE, 0, io_uring_buf_ring_mask(1), 0);
+   io_uring_buf_ring_advance(client_ring_br, 1);
+
+   if (!client_ring_atfork)
+   {
+      pthread_atfork(NULL, NULL, client_ring_atfork_child);
+      client_ring_atfork = true;
+   }
+
+   client_ring_active = true;
+
+   return true;
+
+error:
+
+   /* Use read() and write() from now on */
+   client_ring_disabled = true;
+
+   return false;
+}
+
+static void
+client_ring_atfork_child(void)
+{
+   if (client_ring_active)
+   {
+      client_ring_inherited = true;
+   }
+}
+
+/**
+ * Cancel the request in flight after waiting for it failed, and reap its
+ * completions, so it doesn't touch memory the caller reuses
+ * @param data The user data of the request
+ * @param pending The number of completions not yet reaped
+ */
+static void
+client_ring_cancel(uint64_t data, int pending)
+{
+   struct io_uring_sqe* sqe = NULL;
+   struct io_uring_cqe* cqe = NULL;
+   int ret;
+
+   sqe = io_uring_get_sqe(&client_ring);
+   if (sqe != NULL)
+   {
+      io_uring_prep_cancel64(sqe, data, 0);
+      io_uring_sqe_set_data64(sqe, CLIENT_RING_CANCEL);
+
+      if (io_uring_submit(&client_ring) == 1)
+      {
+         pending++;
+      }
+   }
+
+   while (pending > 0)
+   {
+      ret = io_uring_wait_cqe(&client_ring, &cqe);
+      if (ret == -EINTR)
+      {
+         continue;
+      }
+      else if (ret < 0)
+      {
+         pgexporter_log_error("io_uring client ring cancel: %s", strerror(-ret));
+         return;
+      }
+
+      io_uring_cqe_seen(&client_ring, cqe);
+      pending--;
+   }
+}
+
+/**
+ * Read a message through the client ring. The read and its time limit, a
+ * linked timeout, are submitted and waited for with one system call. The
+ * data is received into the provided buffer of the ring, and copied into
+ * the message
+ * @param socket The socket
+ * @param timeout The timeout in milliseconds, 0 or less waits until the deadline
+ * @param start The start of the timeout
+ * @param msg The message
+ * @return MESSAGE_STATUS_OK, MESSAGE_STATUS_ZERO when the socket is closed or
+ *         the time limit expired, otherwise MESSAGE_STATUS_ERROR
+ */
+static int
+client_ring_read_message(int socket, int timeout, struct timespec* start, struct message** msg)
+{
+   struct io_uring_sqe* sqe = NULL;
+   struct io_uring_cqe* cqe = NULL;
+   struct __kernel_timespec ts;
+   struct message* m = NULL;
+   int wait;
+   int pending;
+   int res;
+   int ret;
+
+   m = pgexporter_memory_message();
+
+   do
+   {
+      res = -ECANCELED;
+      pending = 0;
+
+      wait = io_wait_time(timeout, start);
+      if (wait == 0)
+      {
+         return MESSAGE_STATUS_ZERO;
+      }
+
+      sqe = io_uring_get_sqe(&client_ring);
+      io_uring_prep_recv(sqe, socket, NULL, DEFAULT_BUFFER_SIZE, 0);
+      io_uring_sqe_set_data64(sqe, CLIENT_RING_READ);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = CLIENT_RING_BGID;
+      pending++;
+
+      if (wait > 0)
+      {
+         sqe->flags |= IOSQE_IO_LINK;
+
+         ts.tv_sec = wait / 1000;
+         ts.tv_nsec = (wait % 1000) * 1000000L;
+
+         sqe = io_uring_get_sqe(&client_ring);
+         io_uring_prep_link_timeout(sqe, &ts, 0);
+         io_uring_sqe_set_data64(sqe, CLIENT_RING_TIMEOUT);
+         pending++;
+      }
+
+      do
+      {
+         ret = io_uring_submit_and_wait(&client_ring, pending);
+      }
+      while (ret == -EINTR);
+
+      if (ret < 0)
+      {
+         pgexporter_log_error("io_uring client ring submit: fd=%d %s", socket, strerror(-ret));
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      /* A linked timeout always completes too, either expired or cancelled */
+      while (pending > 0)
+      {
+         ret = io_uring_wait_cqe(&client_ring, &cqe);
+         if (ret == -EINTR)
+         {
+            continue;
+         }
+         else if (ret < 0)
+         {
+            pgexporter_log_error("io_uring client ring wait: fd=%d %s", socket, strerror(-ret));
+            client_ring_cancel(CLIENT_RING_READ, pending);
+            client_ring_active = false;
+            client_ring_disabled = true;
+            return MESSAGE_STATUS_ERROR;
+         }
+
+         if (io_uring_cqe_get_data64(cqe) == CLIENT_RING_READ)
+         {
+            res = cqe->res;
+
+            if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+            {
+               memcpy(m->data, client_ring_buffer, res);
+               io_uring_buf_ring_add(client_ring_br, client_ring_buffer, DEFAULT_BUFFER_SIZE, 0, io_uring_buf_ring_mask(1), 0);
+               io_uring_buf_ring_advance(client_ring_br, 1);
+            }
+         }
+
+         io_uring_cqe_seen(&client_ring, cqe);
+         pending--;
+      }
+   }
+   while (res == -EINTR || res == -EAGAIN);
+
+   if (likely(res > 0))
+   {
+      m->kind = (signed char)(*((char*)m->data));
+      m->length = res;
+      *msg = m;
+
+      return MESSAGE_STATUS_OK;
+   }
+
+   pgexporter_memory_free();
+
+   if (res == 0 || res == -ECANCELED)
+   {
+      /* Closed, or the linked timeout cancelled the read */
+      return MESSAGE_STATUS_ZERO;
+   }
+
+   pgexporter_log_error("read error: fd=%d %s", socket, strerror(-res));
+
+   return MESSAGE_STATUS_ERROR;
+}
+
+/**
+ * Write a message through the client ring. The deadline is linked to
+ * each send as a timeout, and both are submitted and waited for with
+ * one system call
+ * @param socket The socket
+ * @param msg The message
+ * @return MESSAGE_STATUS_OK upon success, otherwise MESSAGE_STATUS_ERROR
+ */
+static int
+client_ring_write_message(int socket, struct message* msg)
+{
+   struct io_uring_sqe* sqe = NULL;
+   struct io_uring_cqe* cqe = NULL;
+   struct __kernel_timespec ts;
+   size_t offset = 0;
+   int wait;
+   int pending;
+   int res;
+   int ret;
+
+   while (offset < (size_t)msg->length)
+   {
+      res = -ECANCELED;
+      pending = 0;
+
+      wait = io_wait_time(0, NULL);
+      if (wait == 0)
+      {
+         pgexporter_log_debug("Deadline expired %d - %zu/%zd", socket, offset, msg->length);
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      sqe = io_uring_get_sqe(&client_ring);
+      io_uring_prep_send(sqe, socket, (char*)msg->data + offset, msg->length - offset, MSG_NOSIGNAL);
+      io_uring_sqe_set_data64(sqe, CLIENT_RING_SEND);
+      pending++;
+
+      if (wait > 0)
+      {
+         sqe->flags |= IOSQE_IO_LINK;
+
+         ts.tv_sec = wait / 1000;
+         ts.tv_nsec = (wait % 1000) * 1000000L;
+
+         sqe = io_uring_get_sqe(&client_ring);
+         io_uring_prep_link_timeout(sqe, &ts, 0);
+         io_uring_sqe_set_data64(sqe, CLIENT_RING_TIMEOUT);
+         pending++;
+      }
+
+      do
+      {
+         ret = io_uring_submit_and_wait(&client_ring, pending);
+      }
+      while (ret == -EINTR);
+
+      if (ret < 0)
+      {
+         pgexporter_log_error("io_uring client ring submit: fd=%d %s", socket, strerror(-ret));
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      while (pending > 0)
+      {
+         ret = io_uring_wait_cqe(&client_ring, &cqe);
+         if (ret == -EINTR)
+         {
+            continue;
+         }
+         else if (ret < 0)
+         {
+            pgexporter_log_error("io_uring client ring wait: fd=%d %s", socket, strerror(-ret));
+            client_ring_cancel(CLIENT_RING_SEND, pending);
+            client_ring_active = false;
+            client_ring_disabled = true;
+            return MESSAGE_STATUS_ERROR;
+         }
+
+         if (io_uring_cqe_get_data64(cqe) == CLIENT_RING_SEND)
+         {
+            res = cqe->res;
+         }
+
+         io_uring_cqe_seen(&client_ring, cqe);
+         pending--;
+      }
+
+      if (res == -EINTR || res == -EAGAIN)
+      {
+         continue;
+      }
+      else if (res <= 0)
+      {
+         pgexporter_log_debug("Error %d - %zu/%zd - %s", socket, offset, msg->length, strerror(-res));
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      offset += (size_t)res;
+   }
+
+   return MESSAGE_STATUS_OK;
+}
+#endif /* HAVE_LINUX && HAVE_IO_URING */
@@ -37,6 +37,7 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -357,6 +358,89 @@ error:
    return 1;
 }
 
+int
+pgexporter_connect_timeout(const char* hostname, int port, int timeout, int* fd)
+{
+   struct addrinfo hints = {0};
+   struct addrinfo* servinfo = NULL;
+   struct addrinfo* p = NULL;
+   struct pollfd pfd;
+   socklen_t length;
+   int rv;
+   char sport[6];
+   int error = 0;
+
+   memset(&sport, 0, sizeof(sport));
+   pgexporter_snprintf(&sport[0], sizeof(sport), "%d", port);
+
+   memset(&hints, 0, sizeof hints);
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+
+   if ((rv = getaddrinfo(hostname, &sport[0], &hints, &servinfo)) != 0)
+   {
+      pgexporter_log_debug("getaddrinfo: %s", gai_strerror(rv));
+      return 1;
+   }
+
+   *fd = -1;
+
+   for (p = servinfo; *fd == -1 && p != NULL; p = p->ai_next)
+   {
+      if ((*fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+      {
+         error = errno;
+         errno = 0;
+         continue;
+      }
+
+      pgexporter_socket_nonblocking(*fd, true);
+
+      if (connect(*fd, p->ai_addr, p->ai_addrlen) == -1)
+      {
+         if (errno != EINPROGRESS)
+         {
+            error = errno;
+            goto next;
+         }
+
+         pfd.fd = *fd;
+         pfd.events = POLLOUT;
+         pfd.revents = 0;
+
+         if (poll(&pfd, 1, timeout) <= 0)
+         {
+            error = ETIMEDOUT;
+            goto next;
+         }
+
+         length = sizeof(error);
+         if (getsockopt(*fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+         {
+            goto next;
+         }
+      }
+
+      pgexporter_socket_nonblocking(*fd, false);
+      continue;
+
+next:
+      pgexporter_disconnect(*fd);
+      errno = 0;
+      *fd = -1;
+   }
+
+   freeaddrinfo(servinfo);
+
+   if (*fd == -1)
+   {
+      pgexporter_log_debug("pgexporter_connect_timeout: %s", strerror(error));
+      return 1;
+   }
+
+   return 0;
+}
+
 /**
  *
  */
@@ -30,8 +30,10 @@
 #include <openssl/crypto.h>
 #include <pgexporter.h>
 #include <art.h>
+#include <exposition.h>
 #include <extension.h>
 #include <fips.h>
+#include <fragment.h>
 #include <history.h>
 #include <http.h>
 #include <http_server.h>
@@ -54,10 +56,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 
 #define CHUNK_SIZE                       32768
 #define DEFAULT_BLOCKING_TIMEOUT_SECONDS 30
+#define SCRAPE_TIMEOUT_OFFSET_MS         500
 
 #define MAX_ARR_LENGTH                   256
 #define NUMBER_OF_HISTOGRAM_COLUMNS      4
@@ -114,27 +118,49 @@ typedef struct column_store
 } column_store_t;
 
 /**
- * ART-based metric value with timestamp
- */
-typedef struct prometheus_metric_value
+ * The fragments of the series of a family, looked up at once.
+ * The buffers are reused for the next family
+ **/
+typedef struct family_fragments
 {
-   time_t timestamp;
-   char* value;
-   char* help;
-   char* type;
-   int sort_type;
-} prometheus_metric_value_t;
+   struct fragment_lookup* lookups;
+   int capacity;
+   char* keys;
+   size_t keys_capacity;
+   char* buffer;
+   size_t buffer_capacity;
+} family_fragments_t;
 
 static void prometheus_metric_value_destroy_cb(uintptr_t data);
 static char* prometheus_metric_value_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
 static int create_metrics_container(prometheus_metrics_container_t** container);
 static int add_metric_to_art(struct art* art_tree, char* key, char* value,
                              char* help, char* type, int sort_type);
+static int sample_string_id(prometheus_metrics_container_t* container, char* str);
+static char* append_series(prometheus_metrics_container_t* container, char* data, char* prefix,
+                           char* name, char* server, char* labels, char* value);
+static void add_sample(prometheus_metrics_container_t* container, char* name, char* server, char* labels, char* value);
+static size_t series_key(char* key, char type, char* name, char* server, char* database,
+                         query_list_t* temp, struct tuple* tuple, int n_columns);
+static int lookup_family(family_fragments_t* fragments, char type, char* name, query_list_t* temp,
+                         int n_columns, int value_column);
+static void free_family(family_fragments_t* fragments);
+static char* family_header(char* tag, char* name, char* description, int type);
+static char* join_columns(column_store_t* store, int n_store);
+static char* append_sample(prometheus_metrics_container_t* container, char* data,
+                           char* name, char* server, char* labels, char* value);
+static char* art_metrics_to_string(struct art* art_tree);
 static void output_art_metrics(SSL* client_ssl, int client_fd, struct art* art_tree);
 static void output_all_metrics(SSL* client_ssl, int client_fd, prometheus_metrics_container_t* container);
 
-static int home_page(SSL* client_ssl, int client_fd);
-static int metrics_page(SSL* client_ssl, int client_fd);
+static int home_page(SSL* client_ssl, int client_fd, struct http_server_request* req);
+static int metrics_page(SSL* client_ssl, int client_fd, struct http_server_request* req);
+static int metrics_stream(SSL* client_ssl, int client_fd, struct http_server_request* req, int64_t budget);
+static void metrics_validators(int format, struct http_validators* validators);
+static void serve_close(struct http_server_connection* connection, SSL* client_ssl, int client_fd);
+static int metrics_text(char** text, prometheus_metrics_container_t** container);
+static int64_t scrape_budget(struct http_server_request* req);
+static bool is_scrape_incomplete(void);
 
 static bool allowed_collector(const char* collector);
 static bool excluded_collector(const char* collector);
@@ -147,6 +173,7 @@ static void general_information(prometheus_metrics_container_t* container);
 static void core_information(prometheus_metrics_container_t* container);
 static void extension_list_information(prometheus_metrics_container_t* container);
 static void server_information(prometheus_metrics_container_t* container);
+static void scrape_information(prometheus_metrics_container_t* container);
 static void version_information(prometheus_metrics_container_t* container);
 static void uptime_information(prometheus_metrics_container_t* container);
 static void primary_information(prometheus_metrics_container_t* container);
@@ -155,14 +182,14 @@ static void fips_information(prometheus_metrics_container_t* container);
 static void custom_metrics(prometheus_metrics_container_t* container); // Handles custom metrics provided in YAML format, both internal and external
 static void extension_metrics(prometheus_metrics_container_t* container);
 static void alert_information(prometheus_metrics_container_t* container);
-static void prometheus_endpoints_information(SSL* client_ssl, int client_fd);
+static char* prometheus_endpoints_information(void);
 static void append_help_info(char** data, char* tag, char* name, char* description);
 static void append_type_info(char** data, char* tag, char* name, int typeId);
 
-static void handle_histogram(column_store_t* store, int* n_store, query_list_t* temp);
-static void handle_default_histogram(column_store_t* store, int* n_store, query_list_t* temp);
-static void handle_gauge_counter(column_store_t* store, int* n_store, query_list_t* temp);
-static void handle_default_gauge_counter(column_store_t* store, int* n_store, query_list_t* temp);
+static void handle_histogram(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp);
+static void handle_default_histogram(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp);
+static void handle_gauge_counter(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp);
+static void handle_default_gauge_counter(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp);
 
 static int parse_list(char* list_str, char** strs, int* n_strs);
 
@@ -188,12 +215,29 @@ static struct http_route prometheus_routes[] = {
 void
 pgexporter_prometheus(SSL* client_ssl, int client_fd)
 {
-   struct http_server_request* req = NULL;
-   struct configuration* config;
+   struct http_server_connection connection;
+   int ret;
 
    pgexporter_start_logging();
    pgexporter_memory_init();
 
+   pgexporter_http_server_connection_init(&connection, client_ssl, client_fd);
+   ret = pgexporter_prometheus_serve(&connection);
+
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+   OPENSSL_cleanup();
+
+   exit(ret);
+}
+
+int
+pgexporter_prometheus_serve(struct http_server_connection* connection)
+{
+   SSL* client_ssl = connection->ssl;
+   int client_fd = connection->fd;
+   struct configuration* config;
+
    config = (struct configuration*)shmem;
 
    if (client_ssl)
@@ -211,13 +255,13 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
          /*
           * Plain HTTP on a TLS port — redirect to HTTPS. Read the raw message
           * here (not via pgexporter_http_server_parse) because we need the path
-          * for the redirect URL and the process exits immediately after.
+          * for the redirect URL and the connection is closed right after.
           */
          struct message* redirect_msg = NULL;
          char* path = "/";
          char* base_url = NULL;
 
-         if (pgexporter_read_timeout_message(NULL, client_fd, (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S), &redirect_msg) != MESSAGE_STATUS_OK)
+         if (pgexporter_read_timeout_message(NULL, client_fd, (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS), &redirect_msg) != MESSAGE_STATUS_OK)
          {
             pgexporter_log_error("Failed to read redirect message");
             goto error;
@@ -237,7 +281,7 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
 
          base_url = pgexporter_format_and_append(base_url, "https://localhost:%d%s", config->metrics, path);
 
-         if (pgexporter_http_respond_redirect(NULL, client_fd, base_url) != MESSAGE_STATUS_OK)
+         if (pgexporter_http_respond_redirect(NULL, client_fd, NULL, base_url) != MESSAGE_STATUS_OK)
          {
             pgexporter_log_error("Failed to redirect to: %s", base_url);
             free(base_url);
@@ -245,44 +289,107 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
          }
 
          free(base_url);
-         pgexporter_close_ssl(client_ssl);
-         pgexporter_disconnect(client_fd);
-         pgexporter_memory_destroy();
-         pgexporter_stop_logging();
-         exit(0);
+         serve_close(connection, client_ssl, client_fd);
+
+         return 0;
       }
       /* MESSAGE_STATUS_OK: TLS handshake done, proceed to parse */
    }
 
-   if (pgexporter_http_server_parse(client_ssl, client_fd, &req) != MESSAGE_STATUS_OK)
+   if (pgexporter_time_is_valid(config->metrics_keep_alive_timeout))
    {
-      goto error;
+      connection->max_requests = config->metrics_keep_alive_requests;
+      connection->idle_timeout = (int)pgexporter_time_convert(config->metrics_keep_alive_timeout, FORMAT_TIME_MS);
    }
 
-   pgexporter_http_server_dispatch(client_ssl, client_fd, req,
-                                   prometheus_routes,
-                                   sizeof(prometheus_routes) / sizeof(prometheus_routes[0]));
+   if (pgexporter_http_server_serve(connection, prometheus_routes,
+                                    sizeof(prometheus_routes) / sizeof(prometheus_routes[0])) != MESSAGE_STATUS_OK)
+   {
+      serve_close(connection, client_ssl, client_fd);
 
-   pgexporter_http_server_request_destroy(req);
-   pgexporter_close_ssl(client_ssl);
-   pgexporter_disconnect(client_fd);
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
-   OPENSSL_cleanup();
+      return 1;
+   }
 
-   exit(0);
+   serve_close(connection, client_ssl, client_fd);
+
+   return 0;
 
 error:
 
    pgexporter_http_respond_400(client_ssl, client_fd);
-   pgexporter_http_server_request_destroy(req);
+   serve_close(connection, client_ssl, client_fd);
+
+   return 1;
+}
+
+/**
+ * Close a served connection. The socket is shut down first, so copies
+ * inherited by other processes don't keep it open
+ * @param connection The connection
+ * @param client_ssl The client SSL context
+ * @param client_fd The client descriptor
+ */
+static void
+serve_close(struct http_server_connection* connection, SSL* client_ssl, int client_fd)
+{
+   pgexporter_http_server_connection_destroy(connection);
    pgexporter_close_ssl(client_ssl);
+   shutdown(client_fd, SHUT_RDWR);
    pgexporter_disconnect(client_fd);
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
-   OPENSSL_cleanup();
+}
 
-   exit(1);
+int
+pgexporter_prometheus_cached(struct http_server_request* req, char** response, size_t* response_length)
+{
+   char accept[1024];
+   int format = EXPOSITION_FORMAT_TEXT;
+   int ret = 1;
+   struct http_validators validators;
+   struct prometheus_cache* cache;
+   signed char cache_is_free;
+
+   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+
+   *response = NULL;
+   *response_length = 0;
+
+   if (strcmp(req->path, "/metrics"))
+   {
+      return 1;
+   }
+
+   memset(&validators, 0, sizeof(struct http_validators));
+
+   if (pgexporter_http_server_get_header(req, "Accept", accept, sizeof(accept)))
+   {
+      format = pgexporter_exposition_negotiate(accept);
+   }
+
+   cache_is_free = STATE_FREE;
+   if (!atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+   {
+      return 1;
+   }
+
+   if (is_metrics_cache_configured() && is_metrics_cache_valid())
+   {
+      metrics_validators(format, &validators);
+
+      if (pgexporter_http_server_not_modified(req, &validators))
+      {
+         ret = pgexporter_http_response_not_modified(req, &validators, response, response_length);
+      }
+      else if (format == EXPOSITION_FORMAT_TEXT)
+      {
+         ret = pgexporter_http_response_ok(req, pgexporter_exposition_content_type(format),
+                                           cache->data, strlen(cache->data), &validators,
+                                           response, response_length);
+      }
+   }
+
+   atomic_store(&cache->lock, STATE_FREE);
+
+   return ret;
 }
 
 void
@@ -342,7 +449,7 @@ pgexporter_prometheus_logging(int type)
 }
 
 static int
-home_page(SSL* client_ssl, int client_fd)
+home_page(SSL* client_ssl, int client_fd, struct http_server_request* req)
 {
    char* data = NULL;
    int status;
@@ -350,12 +457,17 @@ home_page(SSL* client_ssl, int client_fd)
 
    config = (struct configuration*)shmem;
 
-   status = pgexporter_http_respond_chunked_start(client_ssl, client_fd, "text/html; charset=utf-8");
+   status = pgexporter_http_respond_chunked_start(client_ssl, client_fd, req, "text/html; charset=utf-8");
    if (status != MESSAGE_STATUS_OK)
    {
       goto error;
    }
 
+   if (req->head)
+   {
+      return MESSAGE_STATUS_OK;
+   }
+
    data = pgexporter_vappend(data, 12,
                              "<html>\n",
                              "<head>\n",
@@ -380,10 +492,11 @@ home_page(SSL* client_ssl, int client_fd)
                              "  <li>pgexporter_logging_error</li>\n",
                              "  <li>pgexporter_logging_fatal</li>\n");
 
-   data = pgexporter_vappend(data, 3,
+   data = pgexporter_vappend(data, 4,
                              "  <li>pgexporter_query_executions_total</li>\n",
                              "  <li>pgexporter_query_errors_total</li>\n",
-                             "  <li>pgexporter_query_timeouts_total</li>\n");
+                             "  <li>pgexporter_query_timeouts_total</li>\n",
+                             "  <li>pgexporter_scrape_incomplete</li>\n");
 
    data = pgexporter_vappend(data, 7,
                              "  <li>pgexporter_alert_postgresql_down</li>\n",
@@ -437,25 +550,30 @@ home_page(SSL* client_ssl, int client_fd)
 
    pgexporter_http_respond_chunked_end(client_ssl, client_fd);
 
-   return 0;
+   return MESSAGE_STATUS_OK;
 
 error:
 
    free(data);
 
-   return 1;
+   return MESSAGE_STATUS_ERROR;
 }
 
 static int
-metrics_page(SSL* client_ssl, int client_fd)
+metrics_page(SSL* client_ssl, int client_fd, struct http_server_request* req)
 {
-   char* data = NULL;
+   char* text = NULL;
+   char accept[1024];
+   int format = EXPOSITION_FORMAT_TEXT;
+   void* body = NULL;
+   size_t body_size = 0;
    time_t start_time;
    int dt;
-   time_t now;
-   char time_buf[32];
    int status;
-   struct message msg;
+   int64_t budget;
+   bool not_modified = false;
+   bool head_only = false;
+   struct http_validators validators;
    struct prometheus_cache* cache;
    signed char cache_is_free;
    struct configuration* config;
@@ -463,7 +581,14 @@ metrics_page(SSL* client_ssl, int client_fd)
    config = (struct configuration*)shmem;
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-   memset(&msg, 0, sizeof(struct message));
+   memset(&validators, 0, sizeof(struct http_validators));
+
+   if (pgexporter_http_server_get_header(req, "Accept", accept, sizeof(accept)))
+   {
+      format = pgexporter_exposition_negotiate(accept);
+   }
+
+   budget = scrape_budget(req);
 
    start_time = time(NULL);
 
@@ -471,106 +596,55 @@ retry_cache_locking:
    cache_is_free = STATE_FREE;
    if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
    {
-      // can serve the message out of cache?
       if (is_metrics_cache_configured() && is_metrics_cache_valid())
       {
-         // serve the message directly out of the cache
+         // serve the message out of the cache, or tell the client it already has it
          pgexporter_log_debug("Serving metrics out of cache (%d/%d bytes valid until %lld)",
                               strlen(cache->data),
                               cache->size,
                               cache->valid_until);
 
-         msg.kind = 0;
-         msg.length = strlen(cache->data);
-         msg.data = cache->data;
+         metrics_validators(format, &validators);
 
-         status = pgexporter_write_message(client_ssl, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
+         if (pgexporter_http_server_not_modified(req, &validators))
          {
-            goto error;
+            not_modified = true;
+         }
+         else
+         {
+            text = pgexporter_append(NULL, cache->data);
          }
       }
-      else
+      else if (req->head)
       {
-         // build the message without the cache
-         metrics_cache_invalidate();
-
-         now = time(NULL);
-
-         memset(&time_buf, 0, sizeof(time_buf));
-         ctime_r(&now, &time_buf[0]);
-         time_buf[strlen(time_buf) - 1] = 0;
-
-         /*
-          * Build the response header manually instead of using
-          * pgexporter_http_respond_chunked_start() because the cache must store
-          * only the status line + content-type + date
-          */
-         data = pgexporter_vappend(data, 5,
-                                   "HTTP/1.1 200 OK\r\n",
-                                   "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n",
-                                   "Date: ",
-                                   &time_buf[0],
-                                   "\r\n");
-         metrics_cache_append(data);
-         data = pgexporter_vappend(data, 2,
-                                   "Transfer-Encoding: chunked\r\n",
-                                   "\r\n");
-
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
-
-         status = pgexporter_write_message(client_ssl, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
+         // nothing to describe the response with, so the servers aren't scraped for it
+         head_only = true;
+      }
+      else if (format == EXPOSITION_FORMAT_TEXT && !is_metrics_cache_configured())
+      {
+         // stream the message while the servers are scraped
+         if (metrics_stream(client_ssl, client_fd, req, budget))
          {
+            atomic_store(&cache->lock, STATE_FREE);
             goto error;
          }
+      }
+      else
+      {
+         // scrape, and publish the result to the cache
+         pgexporter_set_deadline(budget);
 
-         free(data);
-         data = NULL;
-
-         /* ART-based metrics container */
-         prometheus_metrics_container_t* container = NULL;
-         if (pgexporter_prometheus_scrape(&container))
+         if (metrics_text(&text, NULL))
          {
-            pgexporter_log_error("Failed to create metrics container");
+            atomic_store(&cache->lock, STATE_FREE);
             goto error;
          }
 
-         /* Output ART metrics */
-         output_all_metrics(client_ssl, client_fd, container);
-
-         /* Store metrics in history */
-         if (config->history > 0)
-         {
-            bool expected = false;
-            if (atomic_compare_exchange_strong(&config->history_worker_running, &expected, true))
-            {
-               if (pgexporter_history_init() == 0)
-               {
-                  if (pgexporter_history_store_metrics(container) != 0)
-                  {
-                     pgexporter_log_warn("history: failed to store metrics snapshot");
-                  }
-               }
-               atomic_store(&config->history_worker_running, false);
-            }
-         }
-
-         /* Destroy container */
-         pgexporter_prometheus_destroy_container(container);
-
-         prometheus_endpoints_information(client_ssl, client_fd);
-
-         /* Footer */
-         status = pgexporter_http_respond_chunked_end(client_ssl, client_fd);
-         if (status != MESSAGE_STATUS_OK)
+         if (is_metrics_cache_valid())
          {
-            goto error;
+            metrics_validators(format, &validators);
+            not_modified = pgexporter_http_server_not_modified(req, &validators);
          }
-
-         metrics_cache_finalize();
       }
 
       // free the cache
@@ -588,188 +662,676 @@ retry_cache_locking:
       SLEEP_AND_GOTO(10000000L, retry_cache_locking);
    }
 
-   free(data);
+   /* The deadline bounds the scrape, not the response */
+   pgexporter_set_deadline(0);
 
-   return 0;
+   if (not_modified)
+   {
+      pgexporter_log_debug("Metrics not modified (%s)", validators.etag);
+
+      status = pgexporter_http_respond_not_modified(client_ssl, client_fd, req, &validators);
+      if (status != MESSAGE_STATUS_OK)
+      {
+         goto error;
+      }
+   }
+   else if (head_only)
+   {
+      status = pgexporter_http_respond_chunked_start(client_ssl, client_fd, req, pgexporter_exposition_content_type(format));
+      if (status != MESSAGE_STATUS_OK)
+      {
+         goto error;
+      }
+   }
+   else if (text != NULL)
+   {
+      if (format != EXPOSITION_FORMAT_TEXT)
+      {
+         if (pgexporter_exposition_convert(text, format, &body, &body_size))
+         {
+            pgexporter_log_error("Failed to convert the metrics to %s", pgexporter_exposition_content_type(format));
+            goto error;
+         }
+      }
+      else
+      {
+         body = text;
+         body_size = strlen(text);
+         text = NULL;
+      }
+
+      status = pgexporter_http_respond_ok_validated(client_ssl, client_fd, req, pgexporter_exposition_content_type(format),
+                                                    body, body_size, &validators);
+      if (status != MESSAGE_STATUS_OK)
+      {
+         goto error;
+      }
+   }
+
+   free(text);
+   free(body);
+
+   return MESSAGE_STATUS_OK;
 
 error:
 
+   pgexporter_set_deadline(0);
+
    pgexporter_close_connections();
 
-   free(data);
+   free(text);
+   free(body);
 
-   return 1;
+   return MESSAGE_STATUS_ERROR;
 }
 
-static bool
-allowed_collector(const char* collector)
+/**
+ * Stream the metrics in the text format while the servers are scraped.
+ * Used when the cache is not configured
+ *
+ * @param client_ssl The client SSL structure
+ * @param client_fd The client descriptor
+ * @param req The request
+ * @param budget The time budget of the scrape in milliseconds, or 0
+ * @return 0 on success, otherwise 1
+ */
+static int
+metrics_stream(SSL* client_ssl, int client_fd, struct http_server_request* req, int64_t budget)
 {
-   struct configuration* config = NULL;
+   char* data = NULL;
+   int status;
+   prometheus_metrics_container_t* container = NULL;
+   struct configuration* config;
 
    config = (struct configuration*)shmem;
 
-   if (config->number_of_allowed_collectors == 0)
+   status = pgexporter_http_respond_chunked_start(client_ssl, client_fd, req, pgexporter_exposition_content_type(EXPOSITION_FORMAT_TEXT));
+   if (status != MESSAGE_STATUS_OK)
    {
-      return true;
+      goto error;
    }
 
-   for (int i = 0; i < config->number_of_allowed_collectors; i++)
+   /* The deadline bounds the scrape, not the head of the response */
+   pgexporter_set_deadline(budget);
+
+   /* ART-based metrics container */
+   if (pgexporter_prometheus_scrape(&container, config->history > 0))
    {
-      if (!strcmp(config->allowed_collectors[i], collector))
-      {
-         return true;
-      }
+      pgexporter_log_error("Failed to create metrics container");
+      goto error;
    }
 
-   return false;
-}
+   /* Whatever was collected is sent, however long that takes */
+   pgexporter_set_deadline(0);
 
-static bool
-excluded_collector(const char* collector)
-{
-   struct configuration* config = NULL;
+   /* Output ART metrics */
+   output_all_metrics(client_ssl, client_fd, container);
 
-   config = (struct configuration*)shmem;
+   /* Queue the samples for the history worker */
+   if (config->history > 0)
+   {
+      pgexporter_history_enqueue(container);
+   }
 
-   if (config->number_of_excluded_collectors == 0)
+   /* Destroy container */
+   pgexporter_prometheus_destroy_container(container);
+
+   data = prometheus_endpoints_information();
+   if (data != NULL)
    {
-      return false;
+      pgexporter_http_respond_chunked_write(client_ssl, client_fd, data);
+      free(data);
+      data = NULL;
    }
 
-   for (int i = 0; i < config->number_of_excluded_collectors; i++)
+   /* Footer */
+   status = pgexporter_http_respond_chunked_end(client_ssl, client_fd);
+   if (status != MESSAGE_STATUS_OK)
    {
-      if (!strcmp(config->excluded_collectors[i], collector))
-      {
-         return true;
-      }
+      goto error;
    }
 
-   return false;
+   return 0;
+
+error:
+
+   return 1;
 }
 
-static bool
-collector_pass(const char* name)
+/**
+ * Get the validators of the cached metrics in a format. The entity tag
+ * differs per format, as each format is a different representation.
+ * Requires the caller to hold the lock on the cache
+ *
+ * @param format The format
+ * @param validators The validators
+ */
+static void
+metrics_validators(int format, struct http_validators* validators)
 {
-   struct configuration* config = (struct configuration*)shmem;
+   char etag[sizeof(validators->etag)];
+   struct prometheus_cache* cache;
 
-   if (config->number_of_allowed_collectors == 0)
-   {
-      return !excluded_collector(name);
-   }
+   cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-   bool is_allowed = allowed_collector(name);
-   bool is_excluded = excluded_collector(name);
+   pgexporter_cache_validators(cache, validators);
 
-   if (is_allowed && is_excluded)
+   if (validators->etag[0] != '\0' && format != EXPOSITION_FORMAT_TEXT)
    {
-      goto error;
+      /* "hash" becomes "hash-openmetrics" or "hash-protobuf" */
+      pgexporter_snprintf(etag, sizeof(etag), "%.*s-%s\"",
+                          (int)strlen(validators->etag) - 1, validators->etag,
+                          format == EXPOSITION_FORMAT_OPENMETRICS ? "openmetrics" : "protobuf");
+      memcpy(validators->etag, etag, sizeof(etag));
    }
-
-   return is_allowed;
-
-error:
-   exit(1);
 }
 
-static void
-general_information(prometheus_metrics_container_t* container)
+/**
+ * Scrape the metrics in the text format, and publish them to the cache.
+ * Requires the caller to hold the lock on the cache
+ *
+ * @param text The metrics
+ * @param container The scraped container, or NULL if the caller doesn't need it
+ * @return 0 on success, otherwise 1
+ */
+static int
+metrics_text(char** text, prometheus_metrics_container_t** container)
 {
    char* data = NULL;
+   char* endpoints = NULL;
+   prometheus_metrics_container_t* scraped = NULL;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
-   /* pgexporter_state */
-   data = pgexporter_vappend(data, 3,
-                             "#HELP pgexporter_state The state of pgexporter\n",
-                             "#TYPE pgexporter_state gauge\n",
-                             "pgexporter_state 1\n");
-   add_metric_to_art(container->general_metrics, "pgexporter_state", data, NULL, NULL, 0);
-   free(data);
-   data = NULL;
+   *text = NULL;
 
-   /* pgexporter_logging_info */
-   data = pgexporter_vappend(data, 3,
-                             "#HELP pgexporter_logging_info The number of INFO logging statements\n",
-                             "#TYPE pgexporter_logging_info gauge\n",
-                             "pgexporter_logging_info ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->logging_info));
-   data = pgexporter_append(data, "\n");
-   add_metric_to_art(container->general_metrics, "pgexporter_logging_info", data, NULL, NULL, 0);
-   free(data);
-   data = NULL;
+   metrics_cache_invalidate();
 
-   /* pgexporter_logging_warn */
-   data = pgexporter_vappend(data, 3,
-                             "#HELP pgexporter_logging_warn The number of WARN logging statements\n",
-                             "#TYPE pgexporter_logging_warn gauge\n",
-                             "pgexporter_logging_warn ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->logging_warn));
-   data = pgexporter_append(data, "\n");
-   add_metric_to_art(container->general_metrics, "pgexporter_logging_warn", data, NULL, NULL, 0);
-   free(data);
-   data = NULL;
+   if (pgexporter_prometheus_scrape(&scraped, config->history > 0 || container != NULL))
+   {
+      pgexporter_log_error("Failed to create metrics container");
+      return 1;
+   }
 
-   /* pgexporter_logging_error */
-   data = pgexporter_vappend(data, 3,
-                             "#HELP pgexporter_logging_error The number of ERROR logging statements\n",
-                             "#TYPE pgexporter_logging_error gauge\n",
-                             "pgexporter_logging_error ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->logging_error));
-   data = pgexporter_append(data, "\n");
-   add_metric_to_art(container->general_metrics, "pgexporter_logging_error", data, NULL, NULL, 0);
-   free(data);
-   data = NULL;
+   data = pgexporter_prometheus_container_to_string(scraped);
 
-   /* pgexporter_logging_fatal */
-   data = pgexporter_vappend(data, 3,
-                             "#HELP pgexporter_logging_fatal The number of FATAL logging statements\n",
-                             "#TYPE pgexporter_logging_fatal gauge\n",
-                             "pgexporter_logging_fatal ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->logging_fatal));
-   data = pgexporter_append(data, "\n");
-   add_metric_to_art(container->general_metrics, "pgexporter_logging_fatal", data, NULL, NULL, 0);
-   free(data);
-   data = NULL;
+   /* Queue the samples for the history worker */
+   if (config->history > 0)
+   {
+      pgexporter_history_enqueue(scraped);
+   }
+
+   if (container != NULL)
+   {
+      *container = scraped;
+   }
+   else
+   {
+      pgexporter_prometheus_destroy_container(scraped);
+   }
+
+   endpoints = prometheus_endpoints_information();
+   if (endpoints != NULL)
+   {
+      data = pgexporter_append(data, endpoints);
+      free(endpoints);
+   }
+
+   if (data == NULL)
+   {
+      data = pgexporter_append(NULL, "");
+   }
+
+   /* A partial result is served, but not cached */
+   if (!is_scrape_incomplete())
+   {
+      metrics_cache_append(data);
+      metrics_cache_finalize();
+   }
+
+   *text = data;
+
+   return 0;
+}
+
+/**
+ * Get the time budget of a scrape, which is the lower of metrics_scrape_timeout
+ * and the X-Prometheus-Scrape-Timeout-Seconds header of the request. The header
+ * value loses an offset so the response reaches Prometheus in time
+ *
+ * @param req The request
+ * @return The budget in milliseconds, or 0 if there is none
+ */
+static int64_t
+scrape_budget(struct http_server_request* req)
+{
+   char value[32];
+   char* end = NULL;
+   double seconds;
+   int64_t header;
+   int64_t budget = 0;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (pgexporter_time_is_valid(config->metrics_scrape_timeout))
+   {
+      budget = pgexporter_time_convert(config->metrics_scrape_timeout, FORMAT_TIME_MS);
+   }
+
+   if (req != NULL && pgexporter_http_server_get_header(req, "X-Prometheus-Scrape-Timeout-Seconds", value, sizeof(value)))
+   {
+      errno = 0;
+      seconds = strtod(value, &end);
+
+      if (errno == 0 && end != value && *end == '\0' && seconds > 0 && seconds < 86400)
+      {
+         header = (int64_t)(seconds * 1000.0);
+         header -= MIN(header / 10, SCRAPE_TIMEOUT_OFFSET_MS);
+
+         if (header > 0 && (budget <= 0 || header < budget))
+         {
+            budget = header;
+         }
+      }
+      else
+      {
+         pgexporter_log_debug("Invalid X-Prometheus-Scrape-Timeout-Seconds: %s", value);
+      }
+   }
+
+   return budget;
+}
+
+/**
+ * Did the scrape deadline cut the last scrape short for any server
+ *
+ * @return True if so, otherwise false
+ */
+static bool
+is_scrape_incomplete(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      if (pgexporter_is_scrape_incomplete(server))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool
+allowed_collector(const char* collector)
+{
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   if (config->number_of_allowed_collectors == 0)
+   {
+      return true;
+   }
+
+   for (int i = 0; i < config->number_of_allowed_collectors; i++)
+   {
+      if (!strcmp(config->allowed_collectors[i], collector))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool
+excluded_collector(const char* collector)
+{
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   if (config->number_of_excluded_collectors == 0)
+   {
+      return false;
+   }
+
+   for (int i = 0; i < config->number_of_excluded_collectors; i++)
+   {
+      if (!strcmp(config->excluded_collectors[i], collector))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool
+collector_pass(const char* name)
+{
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (config->number_of_allowed_collectors == 0)
+   {
+      return !excluded_collector(name);
+   }
+
+   bool is_allowed = allowed_collector(name);
+   bool is_excluded = excluded_collector(name);
+
+   if (is_allowed && is_excluded)
+   {
+      goto error;
+   }
+
+   return is_allowed;
+
+error:
+   exit(1);
+}
+
+static void
+general_information(prometheus_metrics_container_t* container)
+{
+   char* data = NULL;
+   char number[21];
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   /* pgexporter_state */
+   data = pgexporter_vappend(data, 2,
+                             "#HELP pgexporter_state The state of pgexporter\n",
+                             "#TYPE pgexporter_state gauge\n");
+   data = append_sample(container, data, "pgexporter_state", NULL, NULL, "1");
+   add_metric_to_art(container->general_metrics, "pgexporter_state", data, NULL, NULL, 0);
+   free(data);
+   data = NULL;
+
+   /* pgexporter_logging_info */
+   data = pgexporter_vappend(data, 2,
+                             "#HELP pgexporter_logging_info The number of INFO logging statements\n",
+                             "#TYPE pgexporter_logging_info gauge\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->logging_info));
+   data = append_sample(container, data, "pgexporter_logging_info", NULL, NULL, number);
+   add_metric_to_art(container->general_metrics, "pgexporter_logging_info", data, NULL, NULL, 0);
+   free(data);
+   data = NULL;
+
+   /* pgexporter_logging_warn */
+   data = pgexporter_vappend(data, 2,
+                             "#HELP pgexporter_logging_warn The number of WARN logging statements\n",
+                             "#TYPE pgexporter_logging_warn gauge\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->logging_warn));
+   data = append_sample(container, data, "pgexporter_logging_warn", NULL, NULL, number);
+   add_metric_to_art(container->general_metrics, "pgexporter_logging_warn", data, NULL, NULL, 0);
+   free(data);
+   data = NULL;
+
+   /* pgexporter_logging_error */
+   data = pgexporter_vappend(data, 2,
+                             "#HELP pgexporter_logging_error The number of ERROR logging statements\n",
+                             "#TYPE pgexporter_logging_error gauge\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->logging_error));
+   data = append_sample(container, data, "pgexporter_logging_error", NULL, NULL, number);
+   add_metric_to_art(container->general_metrics, "pgexporter_logging_error", data, NULL, NULL, 0);
+   free(data);
+   data = NULL;
+
+   /* pgexporter_logging_fatal */
+   data = pgexporter_vappend(data, 2,
+                             "#HELP pgexporter_logging_fatal The number of FATAL logging statements\n",
+                             "#TYPE pgexporter_logging_fatal gauge\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->logging_fatal));
+   data = append_sample(container, data, "pgexporter_logging_fatal", NULL, NULL, number);
+   add_metric_to_art(container->general_metrics, "pgexporter_logging_fatal", data, NULL, NULL, 0);
+   free(data);
+   data = NULL;
+
+   if (log_ring_shmem != NULL)
+   {
+      struct log_ring* ring = (struct log_ring*)log_ring_shmem;
+
+      /* pgexporter_logging_dropped */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_logging_dropped The number of log lines dropped because the log ring was full\n",
+                                "#TYPE pgexporter_logging_dropped counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&ring->dropped));
+      data = append_sample(container, data, "pgexporter_logging_dropped", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_logging_dropped", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
+
+   if (config->history > 0)
+   {
+      struct history_queue* queue = (struct history_queue*)history_queue_shmem;
+
+      if (queue != NULL)
+      {
+         /* pgexporter_history_dropped */
+         data = pgexporter_vappend(data, 2,
+                                   "#HELP pgexporter_history_dropped The number of snapshots dropped because the history queue was full\n",
+                                   "#TYPE pgexporter_history_dropped counter\n");
+         pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&queue->dropped));
+         data = append_sample(container, data, "pgexporter_history_dropped", NULL, NULL, number);
+         add_metric_to_art(container->general_metrics, "pgexporter_history_dropped", data, NULL, NULL, 0);
+         free(data);
+         data = NULL;
+      }
+
+      /* pgexporter_history_prune_records */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_history_prune_records The number of history records removed by pruning\n",
+                                "#TYPE pgexporter_history_prune_records counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->history_prune_records));
+      data = append_sample(container, data, "pgexporter_history_prune_records", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_history_prune_records", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_history_prune_batches */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_history_prune_batches The number of history pruning batches\n",
+                                "#TYPE pgexporter_history_prune_batches counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->history_prune_batches));
+      data = append_sample(container, data, "pgexporter_history_prune_batches", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_history_prune_batches", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_history_prune_duration_seconds */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_history_prune_duration_seconds The duration of the last history prune\n",
+                                "#TYPE pgexporter_history_prune_duration_seconds gauge\n");
+      pgexporter_snprintf(number, sizeof(number), "%.3f", (double)atomic_load(&config->history_prune_duration) / 1000.0);
+      data = append_sample(container, data, "pgexporter_history_prune_duration_seconds", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_history_prune_duration_seconds", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_history_prune_pending */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_history_prune_pending 1 if the last history prune ran out of time with records left\n",
+                                "#TYPE pgexporter_history_prune_pending gauge\n");
+      data = append_sample(container, data, "pgexporter_history_prune_pending", NULL, NULL,
+                           atomic_load(&config->history_prune_pending) ? "1" : "0");
+      add_metric_to_art(container->general_metrics, "pgexporter_history_prune_pending", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
+
+   if (config->remote_write_url[0] != '\0')
+   {
+      /* pgexporter_remote_write_samples */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_remote_write_samples The number of samples sent to the remote write endpoint\n",
+                                "#TYPE pgexporter_remote_write_samples counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->remote_write_samples));
+      data = append_sample(container, data, "pgexporter_remote_write_samples", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_remote_write_samples", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_remote_write_failures */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_remote_write_failures The number of failed remote write requests\n",
+                                "#TYPE pgexporter_remote_write_failures counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->remote_write_failures));
+      data = append_sample(container, data, "pgexporter_remote_write_failures", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_remote_write_failures", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_remote_write_retries */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_remote_write_retries The number of retried remote write requests\n",
+                                "#TYPE pgexporter_remote_write_retries counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->remote_write_retries));
+      data = append_sample(container, data, "pgexporter_remote_write_retries", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_remote_write_retries", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_remote_write_dropped */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_remote_write_dropped The number of samples dropped by remote write\n",
+                                "#TYPE pgexporter_remote_write_dropped counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->remote_write_dropped));
+      data = append_sample(container, data, "pgexporter_remote_write_dropped", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_remote_write_dropped", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_remote_write_spool_bytes */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_remote_write_spool_bytes The size of the remote write spool\n",
+                                "#TYPE pgexporter_remote_write_spool_bytes gauge\n");
+      pgexporter_snprintf(number, sizeof(number), "%lld", (long long)atomic_load(&config->remote_write_spool_used));
+      data = append_sample(container, data, "pgexporter_remote_write_spool_bytes", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_remote_write_spool_bytes", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
+
+   if (fragment_shmem != NULL)
+   {
+      struct fragment_cache* fragments = (struct fragment_cache*)fragment_shmem;
+
+      /* pgexporter_fragment_hits */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_fragment_hits The number of series rendered from a pre-rendered fragment\n",
+                                "#TYPE pgexporter_fragment_hits counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%llu", (unsigned long long)atomic_load(&fragments->hits));
+      data = append_sample(container, data, "pgexporter_fragment_hits", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_fragment_hits", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_fragment_misses */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_fragment_misses The number of series rendered from scratch\n",
+                                "#TYPE pgexporter_fragment_misses counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%llu", (unsigned long long)atomic_load(&fragments->misses));
+      data = append_sample(container, data, "pgexporter_fragment_misses", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_fragment_misses", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
+
+   if (scram_cache_shmem != NULL)
+   {
+      struct scram_cache* scram = (struct scram_cache*)scram_cache_shmem;
+
+      /* pgexporter_scram_cache_hits */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_scram_cache_hits The number of SCRAM-SHA-256 logins that reused a cached SaltedPassword\n",
+                                "#TYPE pgexporter_scram_cache_hits counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%llu", (unsigned long long)atomic_load(&scram->hits));
+      data = append_sample(container, data, "pgexporter_scram_cache_hits", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_scram_cache_hits", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_scram_cache_misses */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_scram_cache_misses The number of SCRAM-SHA-256 logins that derived the SaltedPassword\n",
+                                "#TYPE pgexporter_scram_cache_misses counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%llu", (unsigned long long)atomic_load(&scram->misses));
+      data = append_sample(container, data, "pgexporter_scram_cache_misses", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_scram_cache_misses", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
+
+   if (tls_session_shmem != NULL)
+   {
+      struct tls_session_cache* sessions = (struct tls_session_cache*)tls_session_shmem;
+
+      /* pgexporter_tls_session_hits */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_tls_session_hits The number of client TLS handshakes that resumed a session\n",
+                                "#TYPE pgexporter_tls_session_hits counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%llu", (unsigned long long)atomic_load(&sessions->hits));
+      data = append_sample(container, data, "pgexporter_tls_session_hits", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_tls_session_hits", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+
+      /* pgexporter_tls_session_misses */
+      data = pgexporter_vappend(data, 2,
+                                "#HELP pgexporter_tls_session_misses The number of client TLS handshakes that were full handshakes\n",
+                                "#TYPE pgexporter_tls_session_misses counter\n");
+      pgexporter_snprintf(number, sizeof(number), "%llu", (unsigned long long)atomic_load(&sessions->misses));
+      data = append_sample(container, data, "pgexporter_tls_session_misses", NULL, NULL, number);
+      add_metric_to_art(container->general_metrics, "pgexporter_tls_session_misses", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
 }
 
 static void
 query_statistics_information(prometheus_metrics_container_t* container)
 {
    char* data = NULL;
+   char number[21];
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
    /* pgexporter_query_executions_total */
-   data = pgexporter_vappend(data, 3,
+   data = pgexporter_vappend(data, 2,
                              "#HELP pgexporter_query_executions_total The total number of metric queries executed\n",
-                             "#TYPE pgexporter_query_executions_total counter\n",
-                             "pgexporter_query_executions_total ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->query_executions_total));
-   data = pgexporter_append(data, "\n");
+                             "#TYPE pgexporter_query_executions_total counter\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->query_executions_total));
+   data = append_sample(container, data, "pgexporter_query_executions_total", NULL, NULL, number);
    add_metric_to_art(container->general_metrics, "pgexporter_query_executions_total", data, NULL, NULL, 0);
    free(data);
    data = NULL;
 
    /* pgexporter_query_errors_total */
-   data = pgexporter_vappend(data, 3,
+   data = pgexporter_vappend(data, 2,
                              "#HELP pgexporter_query_errors_total The total number of metric queries that failed\n",
-                             "#TYPE pgexporter_query_errors_total counter\n",
-                             "pgexporter_query_errors_total ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->query_errors_total));
-   data = pgexporter_append(data, "\n");
+                             "#TYPE pgexporter_query_errors_total counter\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->query_errors_total));
+   data = append_sample(container, data, "pgexporter_query_errors_total", NULL, NULL, number);
    add_metric_to_art(container->general_metrics, "pgexporter_query_errors_total", data, NULL, NULL, 0);
    free(data);
    data = NULL;
 
    /* pgexporter_query_timeouts_total */
-   data = pgexporter_vappend(data, 3,
+   data = pgexporter_vappend(data, 2,
                              "#HELP pgexporter_query_timeouts_total The total number of metric queries that timed out\n",
-                             "#TYPE pgexporter_query_timeouts_total counter\n",
-                             "pgexporter_query_timeouts_total ");
-   data = pgexporter_append_ulong(data, atomic_load(&config->query_timeouts_total));
-   data = pgexporter_append(data, "\n");
+                             "#TYPE pgexporter_query_timeouts_total counter\n");
+   pgexporter_snprintf(number, sizeof(number), "%lu", (unsigned long)atomic_load(&config->query_timeouts_total));
+   data = append_sample(container, data, "pgexporter_query_timeouts_total", NULL, NULL, number);
    add_metric_to_art(container->general_metrics, "pgexporter_query_timeouts_total", data, NULL, NULL, 0);
    free(data);
    data = NULL;
@@ -779,6 +1341,7 @@ static void
 server_information(prometheus_metrics_container_t* container)
 {
    char* data = NULL;
+   char* labels = NULL;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -789,19 +1352,15 @@ server_information(prometheus_metrics_container_t* container)
 
    for (int server = 0; server < config->number_of_servers; server++)
    {
-      data = pgexporter_vappend(data, 3,
-                                "pgexporter_postgresql_active{server=\"",
-                                &config->servers[server].name[0],
-                                "\"} ");
-      if (config->servers[server].fd != -1)
-      {
-         data = pgexporter_append(data, "1");
-      }
-      else
-      {
-         data = pgexporter_append(data, "0");
-      }
-      data = pgexporter_append(data, "\n");
+      labels = pgexporter_vappend(NULL, 3,
+                                  "server=\"",
+                                  &config->servers[server].name[0],
+                                  "\"");
+      data = append_sample(container, data, "pgexporter_postgresql_active",
+                           &config->servers[server].name[0], labels,
+                           config->servers[server].fd != -1 ? "1" : "0");
+      free(labels);
+      labels = NULL;
    }
 
    if (data != NULL)
@@ -812,12 +1371,47 @@ server_information(prometheus_metrics_container_t* container)
    }
 }
 
+static void
+scrape_information(prometheus_metrics_container_t* container)
+{
+   char* data = NULL;
+   char* labels = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   data = pgexporter_vappend(data, 2,
+                             "#HELP pgexporter_scrape_incomplete 1 if the scrape deadline cut the scrape of the server short\n",
+                             "#TYPE pgexporter_scrape_incomplete gauge\n");
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      labels = pgexporter_vappend(NULL, 3,
+                                  "server=\"",
+                                  &config->servers[server].name[0],
+                                  "\"");
+      data = append_sample(container, data, "pgexporter_scrape_incomplete",
+                           &config->servers[server].name[0], labels,
+                           pgexporter_is_scrape_incomplete(server) ? "1" : "0");
+      free(labels);
+      labels = NULL;
+   }
+
+   if (data != NULL)
+   {
+      add_metric_to_art(container->server_metrics, "pgexporter_scrape_incomplete", data, NULL, NULL, 0);
+      free(data);
+      data = NULL;
+   }
+}
+
 static void
 version_information(prometheus_metrics_container_t* container)
 {
    int ret;
    int server;
    char* data = NULL;
+   char* labels = NULL;
    char* safe_key1 = NULL;
    char* safe_key2 = NULL;
    struct query* all = NULL;
@@ -859,15 +1453,18 @@ version_information(prometheus_metrics_container_t* container)
          {
             safe_key1 = safe_prometheus_key(pgexporter_get_column(0, current));
             safe_key2 = safe_prometheus_key(pgexporter_get_column(1, current));
-            data = pgexporter_vappend(data, 8,
-                                      "pgexporter_postgresql_version{server=\"",
-                                      &config->servers[server].name[0],
-                                      "\", version=\"",
-                                      safe_key1,
-                                      "\", minor_version=\"",
-                                      safe_key2,
-                                      "\"} ",
-                                      "1\n");
+            labels = pgexporter_vappend(NULL, 7,
+                                        "server=\"",
+                                        &config->servers[server].name[0],
+                                        "\", version=\"",
+                                        safe_key1,
+                                        "\", minor_version=\"",
+                                        safe_key2,
+                                        "\"");
+            data = append_sample(container, data, "pgexporter_postgresql_version",
+                                 &config->servers[server].name[0], labels, "1");
+            free(labels);
+            labels = NULL;
             safe_prometheus_key_free(safe_key1);
             safe_prometheus_key_free(safe_key2);
 
@@ -893,6 +1490,7 @@ uptime_information(prometheus_metrics_container_t* container)
    int ret;
    int server;
    char* data = NULL;
+   char* labels = NULL;
    char* safe_key = NULL;
    struct query* all = NULL;
    struct query* query = NULL;
@@ -932,12 +1530,14 @@ uptime_information(prometheus_metrics_container_t* container)
          while (current != NULL)
          {
             safe_key = safe_prometheus_key(pgexporter_get_column(0, current));
-            data = pgexporter_vappend(data, 5,
-                                      "pgexporter_postgresql_uptime{server=\"",
-                                      &config->servers[server].name[0],
-                                      "\"} ",
-                                      safe_key,
-                                      "\n");
+            labels = pgexporter_vappend(NULL, 3,
+                                        "server=\"",
+                                        &config->servers[server].name[0],
+                                        "\"");
+            data = append_sample(container, data, "pgexporter_postgresql_uptime",
+                                 &config->servers[server].name[0], labels, safe_key);
+            free(labels);
+            labels = NULL;
             safe_prometheus_key_free(safe_key);
 
             server++;
@@ -962,6 +1562,7 @@ primary_information(prometheus_metrics_container_t* container)
    int ret;
    int server;
    char* data = NULL;
+   char* labels = NULL;
    struct query* all = NULL;
    struct query* query = NULL;
    struct tuple* current = NULL;
@@ -999,20 +1600,15 @@ primary_information(prometheus_metrics_container_t* container)
 
          while (current != NULL)
          {
-            data = pgexporter_vappend(data, 3,
-                                      "pgexporter_postgresql_primary{server=\"",
-                                      &config->servers[server].name[0],
-                                      "\"} ");
-
-            if (!strcmp("t", pgexporter_get_column(0, current)))
-            {
-               data = pgexporter_append(data, "1");
-            }
-            else
-            {
-               data = pgexporter_append(data, "0");
-            }
-            data = pgexporter_append(data, "\n");
+            labels = pgexporter_vappend(NULL, 3,
+                                        "server=\"",
+                                        &config->servers[server].name[0],
+                                        "\"");
+            data = append_sample(container, data, "pgexporter_postgresql_primary",
+                                 &config->servers[server].name[0], labels,
+                                 !strcmp("t", pgexporter_get_column(0, current)) ? "1" : "0");
+            free(labels);
+            labels = NULL;
 
             server++;
             current = current->next;
@@ -1036,6 +1632,7 @@ fips_information(prometheus_metrics_container_t* container)
    int ret;
    int server;
    char* data = NULL;
+   char* labels = NULL;
    bool openssl_fips = false;
    bool pg_fips = false;
    struct configuration* config;
@@ -1048,10 +1645,7 @@ fips_information(prometheus_metrics_container_t* container)
                              "#HELP pgexporter_fips Is pgexporter running with FIPS-compliant OpenSSL\n",
                              "#TYPE pgexporter_fips gauge\n");
 
-   data = pgexporter_vappend(data, 2,
-                             "pgexporter_fips ",
-                             openssl_fips ? "1" : "0");
-   data = pgexporter_append(data, "\n");
+   data = append_sample(container, data, "pgexporter_fips", NULL, NULL, openssl_fips ? "1" : "0");
 
    if (data != NULL)
    {
@@ -1076,12 +1670,14 @@ fips_information(prometheus_metrics_container_t* container)
             pg_fips = false;
          }
 
-         data = pgexporter_vappend(data, 3,
-                                   "pgexporter_postgresql_fips{server=\"",
-                                   &config->servers[server].name[0],
-                                   "\"} ");
-         data = pgexporter_append(data, pg_fips ? "1" : "0");
-         data = pgexporter_append(data, "\n");
+         labels = pgexporter_vappend(NULL, 3,
+                                     "server=\"",
+                                     &config->servers[server].name[0],
+                                     "\"");
+         data = append_sample(container, data, "pgexporter_postgresql_fips",
+                              &config->servers[server].name[0], labels, pg_fips ? "1" : "0");
+         free(labels);
+         labels = NULL;
       }
    }
 
@@ -1098,12 +1694,11 @@ core_information(prometheus_metrics_container_t* container)
 {
    char* data = NULL;
 
-   data = pgexporter_vappend(data, 5,
+   data = pgexporter_vappend(data, 2,
                              "#HELP pgexporter_version The pgexporter version\n",
-                             "#TYPE pgexporter_version counter\n",
-                             "pgexporter_version{pgexporter_version=\"",
-                             VERSION,
-                             "\"} 1\n");
+                             "#TYPE pgexporter_version counter\n");
+   data = append_sample(container, data, "pgexporter_version", NULL,
+                        "pgexporter_version=\"" VERSION "\"", "1");
 
    if (data != NULL)
    {
@@ -1117,6 +1712,7 @@ static void
 extension_list_information(prometheus_metrics_container_t* container)
 {
    char* data = NULL;
+   char* labels = NULL;
    char* safe_key1 = NULL;
    char* safe_key2 = NULL;
    char* safe_key3 = NULL;
@@ -1152,17 +1748,20 @@ extension_list_information(prometheus_metrics_container_t* container)
             }
             safe_key3 = safe_prometheus_key(config->servers[server].extensions[i].comment);
 
-            data = pgexporter_vappend(data, 10,
-                                      "pgexporter_postgresql_extension_info{server=\"",
-                                      &config->servers[server].name[0],
-                                      "\", extension=\"",
-                                      safe_key1,
-                                      "\", version=\"",
-                                      safe_key2,
-                                      "\", comment=\"",
-                                      safe_key3,
-                                      "\"} ",
-                                      "1\n");
+            labels = pgexporter_vappend(NULL, 9,
+                                        "server=\"",
+                                        &config->servers[server].name[0],
+                                        "\", extension=\"",
+                                        safe_key1,
+                                        "\", version=\"",
+                                        safe_key2,
+                                        "\", comment=\"",
+                                        safe_key3,
+                                        "\"");
+            data = append_sample(container, data, "pgexporter_postgresql_extension_info",
+                                 &config->servers[server].name[0], labels, "1");
+            free(labels);
+            labels = NULL;
 
             safe_prometheus_key_free(safe_key1);
             safe_prometheus_key_free(safe_key2);
@@ -1186,6 +1785,7 @@ settings_information(prometheus_metrics_container_t* container)
    char* data = NULL;
    char* safe_key = NULL;
    char* metric_key = NULL;
+   char* labels = NULL;
    struct query* all = NULL;
    struct query* query = NULL;
    struct tuple* current = NULL;
@@ -1243,18 +1843,15 @@ settings_information(prometheus_metrics_container_t* container)
          safe_prometheus_key_free(safe_key);
 
 data:
-         safe_key = safe_prometheus_key(pgexporter_get_column(0, current));
-         data = pgexporter_vappend(data, 9,
-                                   "pgexporter_",
-                                   &all->tag[0],
-                                   "_",
-                                   safe_key,
-                                   "{server=\"",
-                                   &config->servers[current->server].name[0],
-                                   "\"} ",
-                                   get_value(&all->tag[0], pgexporter_get_column(0, current), pgexporter_get_column(1, current)),
-                                   "\n");
-         safe_prometheus_key_free(safe_key);
+         labels = pgexporter_vappend(NULL, 3,
+                                     "server=\"",
+                                     &config->servers[current->server].name[0],
+                                     "\"");
+         data = append_sample(container, data, metric_key,
+                              &config->servers[current->server].name[0], labels,
+                              get_value(&all->tag[0], pgexporter_get_column(0, current), pgexporter_get_column(1, current)));
+         free(labels);
+         labels = NULL;
 
          if (current->next != NULL && !strcmp(pgexporter_get_column(0, current), pgexporter_get_column(0, current->next)))
          {
@@ -1317,6 +1914,7 @@ alert_information(prometheus_metrics_container_t* container)
    int ret;
    int server;
    char* data = NULL;
+   char* labels = NULL;
    struct query* query = NULL;
    struct configuration* config;
    char metric_name[PROMETHEUS_LENGTH];
@@ -1411,15 +2009,15 @@ alert_information(prometheus_metrics_container_t* container)
          if (firing >= 0)
          {
             char* type_str = (alert->alert_type == ALERT_TYPE_CONNECTION) ? "connection" : "query";
-            data = pgexporter_vappend(data, 3,
-                                      metric_name, "{server=\"",
-                                      &config->servers[server].name[0]);
-            data = pgexporter_vappend(data, 5,
-                                      "\",alert=\"", alert->name,
-                                      "\",type=\"", type_str,
-                                      "\"} ");
-            data = pgexporter_append(data, firing ? "1" : "0");
-            data = pgexporter_append(data, "\n");
+            labels = pgexporter_vappend(NULL, 7,
+                                        "server=\"", &config->servers[server].name[0],
+                                        "\",alert=\"", alert->name,
+                                        "\",type=\"", type_str,
+                                        "\"");
+            data = append_sample(container, data, metric_name,
+                                 &config->servers[server].name[0], labels, firing ? "1" : "0");
+            free(labels);
+            labels = NULL;
          }
       }
 
@@ -1560,44 +2158,29 @@ extension_metrics(prometheus_metrics_container_t* container)
          {
             if (ext_temp->query_alt->node.is_histogram)
             {
-               handle_default_histogram(ext_store, &ext_n_store, ext_temp);
+               handle_default_histogram(container, ext_store, &ext_n_store, ext_temp);
             }
             else
             {
-               handle_default_gauge_counter(ext_store, &ext_n_store, ext_temp);
+               handle_default_gauge_counter(container, ext_store, &ext_n_store, ext_temp);
             }
          }
          else
          {
             if (ext_temp->query_alt->node.is_histogram)
             {
-               handle_histogram(ext_store, &ext_n_store, ext_temp);
+               handle_histogram(container, ext_store, &ext_n_store, ext_temp);
             }
             else
             {
-               handle_gauge_counter(ext_store, &ext_n_store, ext_temp);
+               handle_gauge_counter(container, ext_store, &ext_n_store, ext_temp);
             }
          }
       }
       ext_temp = ext_temp->next;
    }
 
-   for (int i = 0; i < ext_n_store; i++)
-   {
-      column_node_t* temp = ext_store[i].columns;
-      column_node_t* last = NULL;
-
-      while (temp)
-      {
-         data = pgexporter_append(data, temp->data);
-         last = temp;
-         temp = temp->next;
-
-         free(last->data);
-         free(last);
-      }
-      data = pgexporter_append(data, "\n");
-   }
+   data = join_columns(ext_store, ext_n_store);
 
    if (data)
    {
@@ -1775,45 +2358,29 @@ custom_metrics(prometheus_metrics_container_t* container)
          {
             if (temp->query_alt->node.is_histogram)
             {
-               handle_default_histogram(store, &n_store, temp);
+               handle_default_histogram(container, store, &n_store, temp);
             }
             else
             {
-               handle_default_gauge_counter(store, &n_store, temp);
+               handle_default_gauge_counter(container, store, &n_store, temp);
             }
          }
          else
          {
             if (temp->query_alt->node.is_histogram)
             {
-               handle_histogram(store, &n_store, temp);
+               handle_histogram(container, store, &n_store, temp);
             }
             else
             {
-               handle_gauge_counter(store, &n_store, temp);
+               handle_gauge_counter(container, store, &n_store, temp);
             }
          }
       }
       temp = temp->next;
    }
 
-   for (int i = 0; i < n_store; i++)
-   {
-      column_node_t *temp = store[i].columns,
-                    *last = NULL;
-
-      while (temp)
-      {
-         data = pgexporter_append(data, temp->data);
-         last = temp;
-         temp = temp->next;
-
-         // Free it
-         free(last->data);
-         free(last);
-      }
-      data = pgexporter_append(data, "\n");
-   }
+   data = join_columns(store, n_store);
 
    if (data)
    {
@@ -1958,10 +2525,18 @@ add_column_to_store(column_store_t* store, int store_idx, char* data, int sort_t
 }
 
 static void
-handle_histogram(column_store_t* store, int* n_store, query_list_t* temp)
+handle_histogram(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp)
 {
    char* data = NULL;
    char* safe_key = NULL;
+   char* labels = NULL;
+   char* server_labels = NULL;
+   char* bucket_labels = NULL;
+   family_fragments_t fragments = {0};
+   struct fragment_lookup* lookup = NULL;
+   int number_of_lookups = 0;
+   int t = 0;
+   bool owned = false;
    struct configuration* config;
    int n_bounds = 0;
    int n_buckets = 0;
@@ -1994,6 +2569,9 @@ handle_histogram(column_store_t* store, int* n_store, query_list_t* temp)
    }
 
    char* names[4] = {0};
+   char* sum_name = NULL;
+   char* count_name = NULL;
+   char* bucket_name = NULL;
 
    /* generate column names X_sum, X_count, X, X_bucket*/
    names[0] = pgexporter_vappend(names[0], 2,
@@ -2008,6 +2586,20 @@ handle_histogram(column_store_t* store, int* n_store, query_list_t* temp)
                                  temp->query_alt->node.columns[h_idx].name,
                                  "_bucket");
 
+   /* generate metric names pgexporter_X_sum, pgexporter_X_count, pgexporter_X_bucket */
+   sum_name = pgexporter_vappend(NULL, 3,
+                                 "pgexporter_",
+                                 temp->tag,
+                                 "_sum");
+   count_name = pgexporter_vappend(NULL, 3,
+                                   "pgexporter_",
+                                   temp->tag,
+                                   "_count");
+   bucket_name = pgexporter_vappend(NULL, 3,
+                                    "pgexporter_",
+                                    temp->tag,
+                                    "_bucket");
+
    for (; idx < *n_store; idx++)
    {
       if (store[idx].type == HISTOGRAM_TYPE &&
@@ -2024,9 +2616,15 @@ append:
    {
       struct tuple* current = temp->query->tuples;
 
+      /* One lookup for the label sets of all the tuples */
+      number_of_lookups = lookup_family(&fragments, 'h', bucket_name, temp, h_idx, -1);
+      t = 0;
+
       while (current)
       {
          data = NULL;
+         lookup = t < number_of_lookups ? &fragments.lookups[t] : NULL;
+         t++;
 
          /* Free previous iteration's allocations */
          for (int i = 0; i < n_bounds; i++)
@@ -2040,25 +2638,13 @@ append:
             buckets_arr[i] = NULL;
          }
 
-         /* bucket */
-         char* bounds_str = pgexporter_get_column_by_name(names[2], temp->query, current);
-         parse_list(bounds_str, bounds_arr, &n_bounds);
-
-         char* buckets_str = pgexporter_get_column_by_name(names[3], temp->query, current);
-         parse_list(buckets_str, buckets_arr, &n_buckets);
-
-         for (int i = 0; i < n_bounds; i++)
+         /* Labels shared by all the lines of the tuple */
+         if (lookup != NULL && lookup->labels != NULL)
+         {
+            server_labels = lookup->labels;
+         }
+         else
          {
-            data = pgexporter_vappend(data, 8,
-                                      "pgexporter_",
-                                      temp->tag,
-                                      "_bucket{le=\"",
-                                      bounds_arr[i],
-                                      "\", ",
-                                      "server=\"",
-                                      &config->servers[current->server].name[0],
-                                      "\"");
-
             db_key_present = false;
             for (int j = 0; j < h_idx; j++)
             {
@@ -2069,154 +2655,86 @@ append:
 
                safe_key = safe_prometheus_attribute(pgexporter_get_column(j, current),
                                                     temp->query->type_oids[j]);
-               data = pgexporter_vappend(data, 5,
-                                         ", ",
-                                         temp->query_alt->node.columns[j].name,
-                                         "=\"",
-                                         safe_key,
-                                         "\"");
+               labels = pgexporter_vappend(labels, 5,
+                                           ", ",
+                                           temp->query_alt->node.columns[j].name,
+                                           "=\"",
+                                           safe_key,
+                                           "\"");
                safe_prometheus_key_free(safe_key);
             }
 
             // Database
             if (!db_key_present)
             {
-               data = pgexporter_vappend(data, 3,
-                                         ", database=\"",
-                                         temp->database,
-                                         "\"");
+               labels = pgexporter_vappend(labels, 3,
+                                           ", database=\"",
+                                           temp->database,
+                                           "\"");
             }
 
-            data = pgexporter_vappend(data, 3,
-                                      "} ",
-                                      buckets_arr[i],
-                                      "\n");
-         }
-
-         data = pgexporter_vappend(data, 6,
-                                   "pgexporter_",
-                                   temp->tag,
-                                   "_bucket{le=\"+Inf\", ",
-                                   "server=\"",
-                                   &config->servers[current->server].name[0],
-                                   "\"");
+            server_labels = pgexporter_vappend(NULL, 4,
+                                               "server=\"",
+                                               &config->servers[current->server].name[0],
+                                               "\"",
+                                               labels != NULL ? labels : "");
 
-         db_key_present = false;
-         for (int j = 0; j < h_idx; j++)
-         {
-            if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
+            if (lookup != NULL && lookup->key_length > 0)
             {
-               db_key_present = true;
+               /* The lines differ by their bound, so only the label set is kept */
+               pgexporter_fragment_store(lookup->key, lookup->key_length, server_labels, "");
             }
 
-            safe_key = safe_prometheus_attribute(pgexporter_get_column(j, current),
-                                                 temp->query->type_oids[j]);
-            data = pgexporter_vappend(data, 5,
-                                      ", ",
-                                      temp->query_alt->node.columns[j].name,
-                                      "=\"",
-                                      safe_key,
-                                      "\"");
-            safe_prometheus_key_free(safe_key);
+            /* A fragment that is found lives in the buffer of the family */
+            owned = true;
          }
 
-         // Database
-         if (!db_key_present)
-         {
-            data = pgexporter_vappend(data, 3,
-                                      ", database=\"",
-                                      temp->database,
-                                      "\"");
-         }
-
-         data = pgexporter_vappend(data, 3,
-                                   "} ",
-                                   pgexporter_get_column_by_name(names[1], temp->query, current),
-                                   "\n");
+         /* bucket */
+         char* bounds_str = pgexporter_get_column_by_name(names[2], temp->query, current);
+         parse_list(bounds_str, bounds_arr, &n_bounds);
 
-         /* sum */
-         data = pgexporter_vappend(data, 6,
-                                   "pgexporter_",
-                                   temp->tag,
-                                   "_sum",
-                                   "{server=\"",
-                                   &config->servers[current->server].name[0],
-                                   "\"");
+         char* buckets_str = pgexporter_get_column_by_name(names[3], temp->query, current);
+         parse_list(buckets_str, buckets_arr, &n_buckets);
 
-         db_key_present = false;
-         for (int j = 0; j < h_idx; j++)
+         for (int i = 0; i < n_bounds; i++)
          {
-            if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
-            {
-               db_key_present = true;
-            }
-
-            safe_key = safe_prometheus_attribute(pgexporter_get_column(j, current),
-                                                 temp->query->type_oids[j]);
-            data = pgexporter_vappend(data, 5,
-                                      ", ",
-                                      temp->query_alt->node.columns[j].name,
-                                      "=\"",
-                                      safe_key,
-                                      "\"");
-            safe_prometheus_key_free(safe_key);
+            bucket_labels = pgexporter_vappend(NULL, 4,
+                                               "le=\"",
+                                               bounds_arr[i],
+                                               "\", ",
+                                               server_labels);
+            data = append_sample(container, data, bucket_name,
+                                 &config->servers[current->server].name[0], bucket_labels, buckets_arr[i]);
+            free(bucket_labels);
+            bucket_labels = NULL;
          }
 
-         // Database
-         if (!db_key_present)
-         {
-            data = pgexporter_vappend(data, 3,
-                                      ", database=\"",
-                                      temp->database,
-                                      "\"");
-         }
+         bucket_labels = pgexporter_append(NULL, "le=\"+Inf\", ");
+         bucket_labels = pgexporter_append(bucket_labels, server_labels);
+         data = append_sample(container, data, bucket_name,
+                              &config->servers[current->server].name[0], bucket_labels,
+                              pgexporter_get_column_by_name(names[1], temp->query, current));
+         free(bucket_labels);
+         bucket_labels = NULL;
 
-         data = pgexporter_vappend(data, 3,
-                                   "} ",
-                                   pgexporter_get_column_by_name(names[0], temp->query, current),
-                                   "\n");
+         /* sum */
+         data = append_sample(container, data, sum_name,
+                              &config->servers[current->server].name[0], server_labels,
+                              pgexporter_get_column_by_name(names[0], temp->query, current));
 
          /* count */
-         data = pgexporter_vappend(data, 6,
-                                   "pgexporter_",
-                                   temp->tag,
-                                   "_count",
-                                   "{server=\"",
-                                   &config->servers[current->server].name[0],
-                                   "\"");
-
-         db_key_present = false;
-         for (int j = 0; j < h_idx; j++)
-         {
-            if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
-            {
-               db_key_present = true;
-            }
-
-            safe_key = safe_prometheus_attribute(pgexporter_get_column(j, current),
-                                                 temp->query->type_oids[j]);
-            data = pgexporter_vappend(data, 5,
-                                      ", ",
-                                      temp->query_alt->node.columns[j].name,
-                                      "=\"",
-                                      safe_key,
-                                      "\"");
-            safe_prometheus_key_free(safe_key);
-         }
+         data = append_sample(container, data, count_name,
+                              &config->servers[current->server].name[0], server_labels,
+                              pgexporter_get_column_by_name(names[1], temp->query, current));
 
-         // Database
-         if (!db_key_present)
+         free(labels);
+         labels = NULL;
+         if (owned)
          {
-            data = pgexporter_vappend(data, 3,
-                                      ", database=\"",
-                                      temp->database,
-                                      "\"");
+            free(server_labels);
+            owned = false;
          }
-
-         data = pgexporter_vappend(data, 3,
-                                   "} ",
-                                   pgexporter_get_column_by_name(names[1], temp->query, current),
-                                   "\n");
+         server_labels = NULL;
 
          add_column_to_store(store, idx, data, temp->sort_type, current);
 
@@ -2232,6 +2750,8 @@ append:
       {
          free(buckets_arr[i]);
       }
+
+      free_family(&fragments);
    }
    else
    {
@@ -2255,9 +2775,9 @@ append:
       memcpy(store[idx].tag, temp->tag, PROMETHEUS_LENGTH);
       memcpy(store[idx].name, temp->query_alt->node.columns[h_idx].name, PROMETHEUS_LENGTH);
 
-      data = NULL;
-      append_help_info(&data, store[idx].tag, "", temp->query_alt->node.columns[h_idx].description);
-      append_type_info(&data, store[idx].tag, "", temp->query_alt->node.columns[h_idx].type);
+      data = family_header(store[idx].tag, "",
+                           temp->query_alt->node.columns[h_idx].description,
+                           temp->query_alt->node.columns[h_idx].type);
 
       add_column_to_store(store, idx, data, SORT_NAME, NULL);
 
@@ -2272,17 +2792,25 @@ append:
    free(names[1]);
    free(names[2]);
    free(names[3]);
+   free(sum_name);
+   free(count_name);
+   free(bucket_name);
 }
 
 static void
-handle_default_gauge_counter(column_store_t* store, int* n_store, query_list_t* temp)
+handle_default_gauge_counter(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp)
 {
    char* data = NULL;
+   char* name = NULL;
+   char* labels = NULL;
+   char* server = NULL;
    struct configuration* config;
    bool db_key_present = false;
 
    config = (struct configuration*)shmem;
 
+   server = config->number_of_servers > 0 ? config->servers[0].name : "unknown";
+
    for (int i = 0; i < temp->query_alt->node.n_columns; i++)
    {
       if (temp->query_alt->node.columns[i].type == LABEL_TYPE)
@@ -2315,33 +2843,25 @@ handle_default_gauge_counter(column_store_t* store, int* n_store, query_list_t*
          store[idx].type = temp->query_alt->node.columns[i].type;
          memcpy(store[idx].tag, temp->tag, MISC_LENGTH);
 
-         data = NULL;
-         append_help_info(&data, store[idx].tag, store[idx].name, temp->query_alt->node.columns[i].description);
-         append_type_info(&data, store[idx].tag, store[idx].name, temp->query_alt->node.columns[i].type);
+         data = family_header(store[idx].tag, store[idx].name,
+                              temp->query_alt->node.columns[i].description,
+                              temp->query_alt->node.columns[i].type);
 
          add_column_to_store(store, idx, data, SORT_NAME, NULL);
       }
 
-      data = NULL;
-      data = pgexporter_append(data, "pgexporter_");
-      data = pgexporter_append(data, store[idx].tag);
+      name = pgexporter_append(NULL, "pgexporter_");
+      name = pgexporter_append(name, store[idx].tag);
 
       if (strlen(store[idx].name) > 0)
       {
-         data = pgexporter_append(data, "_");
-         data = pgexporter_append(data, store[idx].name);
+         name = pgexporter_append(name, "_");
+         name = pgexporter_append(name, store[idx].name);
       }
 
-      data = pgexporter_append(data, "{server=\"");
-      if (config->number_of_servers > 0)
-      {
-         data = pgexporter_append(data, config->servers[0].name);
-      }
-      else
-      {
-         data = pgexporter_append(data, "unknown");
-      }
-      data = pgexporter_append(data, "\"");
+      labels = pgexporter_append(NULL, "server=\"");
+      labels = pgexporter_append(labels, server);
+      labels = pgexporter_append(labels, "\"");
 
       db_key_present = false;
       for (int j = 0; j < temp->query_alt->node.n_columns; j++)
@@ -2356,40 +2876,51 @@ handle_default_gauge_counter(column_store_t* store, int* n_store, query_list_t*
             db_key_present = true;
          }
 
-         data = pgexporter_append(data, ", ");
-         data = pgexporter_append(data, temp->query_alt->node.columns[j].name);
-         data = pgexporter_append(data, "=\"n/a\"");
+         labels = pgexporter_append(labels, ", ");
+         labels = pgexporter_append(labels, temp->query_alt->node.columns[j].name);
+         labels = pgexporter_append(labels, "=\"n/a\"");
       }
 
       if (!db_key_present)
       {
-         data = pgexporter_append(data, ", database=\"");
+         labels = pgexporter_append(labels, ", database=\"");
          if (strlen(temp->database) > 0)
          {
-            data = pgexporter_append(data, temp->database);
+            labels = pgexporter_append(labels, temp->database);
          }
          else
          {
-            data = pgexporter_append(data, "unknown");
+            labels = pgexporter_append(labels, "unknown");
          }
-         data = pgexporter_append(data, "\"");
+         labels = pgexporter_append(labels, "\"");
       }
 
-      data = pgexporter_append(data, "} 0\n");
+      data = append_sample(container, NULL, name, server, labels, "0");
+
+      free(name);
+      name = NULL;
+      free(labels);
+      labels = NULL;
 
       add_column_to_store(store, idx, data, temp->sort_type, NULL);
    }
 }
 
 static void
-handle_default_histogram(column_store_t* store, int* n_store, query_list_t* temp)
+handle_default_histogram(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp)
 {
    char* data = NULL;
+   char* name = NULL;
+   char* labels = NULL;
+   char* bucket_labels = NULL;
+   char* server = NULL;
    struct configuration* config;
    bool db_key_present = false;
 
    config = (struct configuration*)shmem;
 
+   server = config->number_of_servers > 0 ? config->servers[0].name : "unknown";
+
    int h_idx = 0;
    for (; h_idx < temp->query_alt->node.n_columns; h_idx++)
    {
@@ -2426,28 +2957,18 @@ handle_default_histogram(column_store_t* store, int* n_store, query_list_t* temp
       memcpy(store[idx].tag, temp->tag, MISC_LENGTH);
       memcpy(store[idx].name, temp->query_alt->node.columns[h_idx].name, MISC_LENGTH);
 
-      data = NULL;
-      append_help_info(&data, store[idx].tag, "", temp->query_alt->node.columns[h_idx].description);
-      append_type_info(&data, store[idx].tag, "", temp->query_alt->node.columns[h_idx].type);
+      data = family_header(store[idx].tag, "",
+                           temp->query_alt->node.columns[h_idx].description,
+                           temp->query_alt->node.columns[h_idx].type);
 
       add_column_to_store(store, idx, data, SORT_NAME, NULL);
    }
 
    data = NULL;
 
-   // +Inf bucket
-   data = pgexporter_append(data, "pgexporter_");
-   data = pgexporter_append(data, temp->tag);
-   data = pgexporter_append(data, "_bucket{le=\"+Inf\", server=\"");
-   if (config->number_of_servers > 0)
-   {
-      data = pgexporter_append(data, config->servers[0].name);
-   }
-   else
-   {
-      data = pgexporter_append(data, "unknown");
-   }
-   data = pgexporter_append(data, "\"");
+   labels = pgexporter_append(NULL, "server=\"");
+   labels = pgexporter_append(labels, server);
+   labels = pgexporter_append(labels, "\"");
 
    db_key_present = false;
    for (int j = 0; j < h_idx; j++)
@@ -2457,121 +2978,61 @@ handle_default_histogram(column_store_t* store, int* n_store, query_list_t* temp
          db_key_present = true;
       }
 
-      data = pgexporter_append(data, ", ");
-      data = pgexporter_append(data, temp->query_alt->node.columns[j].name);
-      data = pgexporter_append(data, "=\"n/a\"");
+      labels = pgexporter_append(labels, ", ");
+      labels = pgexporter_append(labels, temp->query_alt->node.columns[j].name);
+      labels = pgexporter_append(labels, "=\"n/a\"");
    }
 
    if (!db_key_present)
    {
-      data = pgexporter_append(data, ", database=\"");
+      labels = pgexporter_append(labels, ", database=\"");
       if (strlen(temp->database) > 0)
       {
-         data = pgexporter_append(data, temp->database);
+         labels = pgexporter_append(labels, temp->database);
       }
       else
       {
-         data = pgexporter_append(data, "unknown");
+         labels = pgexporter_append(labels, "unknown");
       }
-      data = pgexporter_append(data, "\"");
+      labels = pgexporter_append(labels, "\"");
    }
 
-   data = pgexporter_append(data, "} 0\n");
+   // +Inf bucket
+   name = pgexporter_vappend(NULL, 3, "pgexporter_", temp->tag, "_bucket");
+   bucket_labels = pgexporter_append(NULL, "le=\"+Inf\", ");
+   bucket_labels = pgexporter_append(bucket_labels, labels);
+   data = append_sample(container, data, name, server, bucket_labels, "0");
+   free(bucket_labels);
+   free(name);
 
    // _sum
-   data = pgexporter_append(data, "pgexporter_");
-   data = pgexporter_append(data, temp->tag);
-   data = pgexporter_append(data, "_sum{server=\"");
-   if (config->number_of_servers > 0)
-   {
-      data = pgexporter_append(data, config->servers[0].name);
-   }
-   else
-   {
-      data = pgexporter_append(data, "unknown");
-   }
-   data = pgexporter_append(data, "\"");
-
-   db_key_present = false;
-   for (int j = 0; j < h_idx; j++)
-   {
-      if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
-      {
-         db_key_present = true;
-      }
-
-      data = pgexporter_append(data, ", ");
-      data = pgexporter_append(data, temp->query_alt->node.columns[j].name);
-      data = pgexporter_append(data, "=\"n/a\"");
-   }
-
-   if (!db_key_present)
-   {
-      data = pgexporter_append(data, ", database=\"");
-      if (strlen(temp->database) > 0)
-      {
-         data = pgexporter_append(data, temp->database);
-      }
-      else
-      {
-         data = pgexporter_append(data, "unknown");
-      }
-      data = pgexporter_append(data, "\"");
-   }
-
-   data = pgexporter_append(data, "} 0\n");
+   name = pgexporter_vappend(NULL, 3, "pgexporter_", temp->tag, "_sum");
+   data = append_sample(container, data, name, server, labels, "0");
+   free(name);
 
    // _count
-   data = pgexporter_append(data, "pgexporter_");
-   data = pgexporter_append(data, temp->tag);
-   data = pgexporter_append(data, "_count{server=\"");
-   if (config->number_of_servers > 0)
-   {
-      data = pgexporter_append(data, config->servers[0].name);
-   }
-   else
-   {
-      data = pgexporter_append(data, "unknown");
-   }
-   data = pgexporter_append(data, "\"");
-
-   db_key_present = false;
-   for (int j = 0; j < h_idx; j++)
-   {
-      if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
-      {
-         db_key_present = true;
-      }
-
-      data = pgexporter_append(data, ", ");
-      data = pgexporter_append(data, temp->query_alt->node.columns[j].name);
-      data = pgexporter_append(data, "=\"n/a\"");
-   }
-
-   if (!db_key_present)
-   {
-      data = pgexporter_append(data, ", database=\"");
-      if (strlen(temp->database) > 0)
-      {
-         data = pgexporter_append(data, temp->database);
-      }
-      else
-      {
-         data = pgexporter_append(data, "unknown");
-      }
-      data = pgexporter_append(data, "\"");
-   }
+   name = pgexporter_vappend(NULL, 3, "pgexporter_", temp->tag, "_count");
+   data = append_sample(container, data, name, server, labels, "0");
+   free(name);
 
-   data = pgexporter_append(data, "} 0\n");
+   free(labels);
 
    add_column_to_store(store, idx, data, temp->sort_type, NULL);
 }
 
 static void
-handle_gauge_counter(column_store_t* store, int* n_store, query_list_t* temp)
+handle_gauge_counter(prometheus_metrics_container_t* container, column_store_t* store, int* n_store, query_list_t* temp)
 {
    char* data = NULL;
+   char* name = NULL;
+   char* labels = NULL;
+   char* prefix = NULL;
    char* safe_key = NULL;
+   family_fragments_t fragments = {0};
+   struct fragment_lookup* lookup = NULL;
+   int number_of_lookups = 0;
+   int t = 0;
+   bool owned = false;
    struct configuration* config;
    bool db_key_present = false;
    config = (struct configuration*)shmem;
@@ -2609,8 +3070,26 @@ append:
 
          struct tuple* tuple = temp->query->tuples;
 
+         name = pgexporter_vappend(NULL, 2,
+                                   "pgexporter_",
+                                   store[idx].tag);
+
+         if (strlen(store[idx].name) > 0)
+         {
+            name = pgexporter_vappend(name, 2,
+                                      "_",
+                                      store[idx].name);
+         }
+
+         /* One lookup for the series of all the tuples */
+         number_of_lookups = lookup_family(&fragments, 's', name, temp, -1, i);
+         t = 0;
+
          while (tuple)
          {
+            lookup = t < number_of_lookups ? &fragments.lookups[t] : NULL;
+            t++;
+
             /* Skip tuples with NULL metric values */
             char* metric_val = pgexporter_get_column(i, tuple);
             if (metric_val == NULL)
@@ -2621,68 +3100,84 @@ append:
                continue;
             }
 
-            data = NULL;
-
-            data = pgexporter_vappend(data, 2,
-                                      "pgexporter_",
-                                      store[idx].tag);
-
-            if (strlen(store[idx].name) > 0)
+            if (lookup != NULL && lookup->prefix != NULL)
             {
-               data = pgexporter_vappend(data, 2,
-                                         "_",
-                                         store[idx].name);
+               labels = lookup->labels;
+               prefix = lookup->prefix;
             }
-
-            data = pgexporter_vappend(data, 3,
-                                      "{server=\"",
-                                      config->servers[temp->query->tuples->server].name,
-                                      "\"");
-
-            /* Labels */
-            for (int j = 0; j < temp->query_alt->node.n_columns; j++)
+            else
             {
-               if (temp->query_alt->node.columns[j].type != LABEL_TYPE)
+               labels = pgexporter_vappend(NULL, 3,
+                                           "server=\"",
+                                           config->servers[temp->query->tuples->server].name,
+                                           "\"");
+
+               /* Labels */
+               for (int j = 0; j < temp->query_alt->node.n_columns; j++)
                {
-                  continue;
+                  if (temp->query_alt->node.columns[j].type != LABEL_TYPE)
+                  {
+                     continue;
+                  }
+
+                  if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
+                  {
+                     db_key_present = true;
+                  }
+
+                  safe_key = safe_prometheus_attribute(pgexporter_get_column(j, tuple),
+                                                       temp->query->type_oids[j]);
+                  labels = pgexporter_vappend(labels, 5,
+                                              ", ",
+                                              temp->query_alt->node.columns[j].name,
+                                              "=\"",
+                                              safe_key,
+                                              "\"");
+                  safe_prometheus_key_free(safe_key);
                }
 
-               if (!db_key_present && !strcmp("database", temp->query_alt->node.columns[j].name))
+               // Database
+               if (!db_key_present)
                {
-                  db_key_present = true;
+                  labels = pgexporter_vappend(labels, 3,
+                                              ", database=\"",
+                                              temp->database,
+                                              "\"");
                }
 
-               safe_key = safe_prometheus_attribute(pgexporter_get_column(j, tuple),
-                                                    temp->query->type_oids[j]);
-               data = pgexporter_vappend(data, 5,
-                                         ", ",
-                                         temp->query_alt->node.columns[j].name,
-                                         "=\"",
-                                         safe_key,
-                                         "\"");
-               safe_prometheus_key_free(safe_key);
-            }
+               prefix = pgexporter_vappend(NULL, 4, name, "{", labels, "} ");
 
-            // Database
-            if (!db_key_present)
-            {
-               data = pgexporter_vappend(data, 3,
-                                         ", database=\"",
-                                         temp->database,
-                                         "\"");
+               if (lookup != NULL && lookup->key_length > 0)
+               {
+                  pgexporter_fragment_store(lookup->key, lookup->key_length, labels, prefix);
+               }
+
+               /* A fragment that is found lives in the buffer of the family */
+               owned = true;
             }
 
             safe_key = safe_prometheus_key(metric_val);
-            data = pgexporter_vappend(data, 3,
-                                      "} ",
-                                      get_value(store[idx].tag, store[idx].name, safe_key),
-                                      "\n");
+            data = append_series(container, NULL, prefix, name,
+                                 config->servers[temp->query->tuples->server].name, labels,
+                                 get_value(store[idx].tag, store[idx].name, safe_key));
             safe_prometheus_key_free(safe_key);
 
+            if (owned)
+            {
+               free(prefix);
+               free(labels);
+               owned = false;
+            }
+            prefix = NULL;
+            labels = NULL;
+
             add_column_to_store(store, idx, data, temp->sort_type, tuple);
 
             tuple = tuple->next;
          }
+
+         free(name);
+         name = NULL;
       }
       else
       {
@@ -2701,9 +3196,9 @@ append:
          memcpy(store[idx].tag, temp->tag, MIN(PROMETHEUS_LENGTH - 1, strlen(temp->tag)));
          store[idx].tag[MIN(PROMETHEUS_LENGTH - 1, strlen(temp->tag))] = '\0';
 
-         data = NULL;
-         append_help_info(&data, store[idx].tag, store[idx].name, temp->query_alt->node.columns[i].description);
-         append_type_info(&data, store[idx].tag, store[idx].name, temp->query_alt->node.columns[i].type);
+         data = family_header(store[idx].tag, store[idx].name,
+                              temp->query_alt->node.columns[i].description,
+                              temp->query_alt->node.columns[i].type);
 
          add_column_to_store(store, idx, data, SORT_NAME, NULL);
 
@@ -2714,6 +3209,8 @@ append:
          goto append;
       }
    }
+
+   free_family(&fragments);
 }
 
 static void
@@ -3088,9 +3585,15 @@ metrics_cache_finalize(void)
 
    return pgexporter_cache_finalize(cache, config->metrics_cache_max_age);
 }
-static void
-prometheus_endpoints_information(SSL* client_ssl, int client_fd)
+/**
+ * Scrape the Prometheus endpoints configured as servers
+ *
+ * @return The text, or NULL if there are no metrics
+ */
+static char*
+prometheus_endpoints_information(void)
 {
+   char* result = NULL;
    char* data = NULL;
    struct http* connection = NULL;
    struct http_request* request = NULL;
@@ -3163,8 +3666,7 @@ prometheus_endpoints_information(SSL* client_ssl, int client_fd)
 
          free(body_copy);
 
-         pgexporter_http_respond_chunked_write(client_ssl, client_fd, data);
-         metrics_cache_append(data);
+         result = pgexporter_append(result, data);
          free(data);
          data = NULL;
       }
@@ -3188,6 +3690,8 @@ next:
          connection = NULL;
       }
    }
+
+   return result;
 }
 
 /**
@@ -3264,7 +3768,8 @@ create_metrics_container(prometheus_metrics_container_t** container)
        pgexporter_art_create(&c->extension_list_metrics) ||
        pgexporter_art_create(&c->settings_metrics) ||
        pgexporter_art_create(&c->custom_metrics) ||
-       pgexporter_art_create(&c->alert_metrics))
+       pgexporter_art_create(&c->alert_metrics) ||
+       pgexporter_art_create(&c->sample_ids))
    {
       pgexporter_log_error("Failed to create ART for metrics container");
       goto error;
@@ -3283,73 +3788,498 @@ error:
  * Destroy a metrics container and all its ARTs
  * The destroy callbacks will free all metric values
  */
-void
-pgexporter_prometheus_destroy_container(prometheus_metrics_container_t* container)
+void
+pgexporter_prometheus_destroy_container(prometheus_metrics_container_t* container)
+{
+   if (container == NULL)
+   {
+      return;
+   }
+
+   pgexporter_art_destroy(container->general_metrics);
+   pgexporter_art_destroy(container->server_metrics);
+   pgexporter_art_destroy(container->version_metrics);
+   pgexporter_art_destroy(container->uptime_metrics);
+   pgexporter_art_destroy(container->primary_metrics);
+   pgexporter_art_destroy(container->fips_metrics);
+   pgexporter_art_destroy(container->core_metrics);
+   pgexporter_art_destroy(container->extension_metrics);
+   pgexporter_art_destroy(container->extension_list_metrics);
+   pgexporter_art_destroy(container->settings_metrics);
+   pgexporter_art_destroy(container->custom_metrics);
+   pgexporter_art_destroy(container->alert_metrics);
+   pgexporter_art_destroy(container->sample_ids);
+
+   for (int i = 0; i < container->number_of_sample_strings; i++)
+   {
+      free(container->sample_strings[i]);
+   }
+   free(container->sample_strings);
+   free(container->samples);
+
+   free(container);
+}
+
+/**
+ * Add a metric to an ART with proper destroy callback
+ */
+static int
+add_metric_to_art(struct art* art_tree, char* key, char* value,
+                  char* help, char* type, int sort_type)
+{
+   prometheus_metric_value_t* m = NULL;
+   struct value_config vc = {.destroy_data = &prometheus_metric_value_destroy_cb,
+                             .to_string = &prometheus_metric_value_string_cb};
+
+   m = (prometheus_metric_value_t*)malloc(sizeof(prometheus_metric_value_t));
+   if (m == NULL)
+   {
+      pgexporter_log_error("Failed to allocate metric value");
+      goto error;
+   }
+
+   memset(m, 0, sizeof(prometheus_metric_value_t));
+
+   m->timestamp = 0; /* Needed for cache */
+   m->value = value ? pgexporter_append(NULL, value) : NULL;
+   m->help = help ? pgexporter_append(NULL, help) : NULL;
+   m->type = type ? pgexporter_append(NULL, type) : NULL;
+   m->sort_type = sort_type;
+
+   if (pgexporter_art_insert_with_config(art_tree, key, (uintptr_t)m, &vc))
+   {
+      pgexporter_log_error("Failed to insert metric into ART");
+      goto error;
+   }
+
+   return 0;
+
+error:
+   if (m != NULL)
+   {
+      free(m->value);
+      free(m->help);
+      free(m->type);
+      free(m);
+   }
+   return 1;
+}
+
+/**
+ * Get the id of a sample string, adding it to the container if needed
+ *
+ * @param container The container
+ * @param str The string
+ * @return The id, or -1 upon error
+ */
+static int
+sample_string_id(prometheus_metrics_container_t* container, char* str)
+{
+   int id;
+
+   if (pgexporter_art_contains_key(container->sample_ids, str))
+   {
+      return (int)pgexporter_art_search(container->sample_ids, str);
+   }
+
+   if (container->number_of_sample_strings == container->sample_strings_capacity)
+   {
+      int capacity = container->sample_strings_capacity > 0 ? container->sample_strings_capacity * 2 : 256;
+      char** strings = realloc(container->sample_strings, capacity * sizeof(char*));
+
+      if (strings == NULL)
+      {
+         return -1;
+      }
+
+      container->sample_strings = strings;
+      container->sample_strings_capacity = capacity;
+   }
+
+   id = container->number_of_sample_strings;
+
+   container->sample_strings[id] = strdup(str);
+   if (container->sample_strings[id] == NULL)
+   {
+      return -1;
+   }
+
+   if (pgexporter_art_insert(container->sample_ids, str, (uintptr_t)id, ValueInt32))
+   {
+      free(container->sample_strings[id]);
+      return -1;
+   }
+
+   container->number_of_sample_strings++;
+
+   return id;
+}
+
+/**
+ * Append a sample line to the exposition text, and record it
+ * as a structured sample in the container
+ *
+ * @param container The container
+ * @param data The exposition text
+ * @param name The metric name
+ * @param server The server name, or NULL
+ * @param labels The label set, or NULL
+ * @param value The value
+ * @return The exposition text
+ */
+static char*
+append_sample(prometheus_metrics_container_t* container, char* data,
+              char* name, char* server, char* labels, char* value)
+{
+   if (labels != NULL && strlen(labels) > 0)
+   {
+      data = pgexporter_vappend(data, 6, name, "{", labels, "} ", value, "\n");
+   }
+   else
+   {
+      data = pgexporter_vappend(data, 4, name, " ", value, "\n");
+   }
+
+   add_sample(container, name, server, labels, value);
+
+   return data;
+}
+
+/**
+ * Append a sample line to the exposition text from a pre-rendered
+ * prefix, and record it as a structured sample in the container
+ *
+ * @param container The container
+ * @param data The exposition text
+ * @param prefix The prefix, i.e. "name{labels} "
+ * @param name The metric name
+ * @param server The server name, or NULL
+ * @param labels The label set, or NULL
+ * @param value The value
+ * @return The exposition text
+ */
+static char*
+append_series(prometheus_metrics_container_t* container, char* data, char* prefix,
+              char* name, char* server, char* labels, char* value)
+{
+   data = pgexporter_vappend(data, 3, prefix, value, "\n");
+
+   add_sample(container, name, server, labels, value);
+
+   return data;
+}
+
+/**
+ * Record a structured sample in the container, if it records samples
+ *
+ * @param container The container
+ * @param name The metric name
+ * @param server The server name, or NULL
+ * @param labels The label set, or NULL
+ * @param value The value
+ */
+static void
+add_sample(prometheus_metrics_container_t* container, char* name, char* server, char* labels, char* value)
+{
+   struct prometheus_sample* sample = NULL;
+
+   if (!container->record_samples)
+   {
+      return;
+   }
+
+   if (container->number_of_samples == container->samples_capacity)
+   {
+      int capacity = container->samples_capacity > 0 ? container->samples_capacity * 2 : 1024;
+      struct prometheus_sample* samples = realloc(container->samples, capacity * sizeof(struct prometheus_sample));
+
+      if (samples == NULL)
+      {
+         pgexporter_log_warn("Failed to allocate samples for %s", name);
+         return;
+      }
+
+      container->samples = samples;
+      container->samples_capacity = capacity;
+   }
+
+   sample = &container->samples[container->number_of_samples];
+
+   sample->name = sample_string_id(container, name);
+   sample->server = sample_string_id(container, server != NULL ? server : "");
+   sample->labels = sample_string_id(container, labels != NULL ? labels : "");
+   sample->value = strtod(value, NULL);
+
+   if (sample->name != -1 && sample->server != -1 && sample->labels != -1)
+   {
+      container->number_of_samples++;
+   }
+}
+
+/**
+ * Build the key of a pre-rendered fragment from the raw values the
+ * fragment is rendered from. NULL values are kept apart from empty ones.
+ *
+ * @param key The key buffer, FRAGMENT_MAX_KEY_LENGTH bytes
+ * @param type The type of the fragment
+ * @param name The metric name
+ * @param server The server name
+ * @param database The database
+ * @param temp The query
+ * @param tuple The tuple
+ * @param n_columns The number of leading label columns, or -1 for all of them
+ * @return The length of the key, or 0 if it does not fit
+ */
+static size_t
+series_key(char* key, char type, char* name, char* server, char* database,
+           query_list_t* temp, struct tuple* tuple, int n_columns)
+{
+   size_t length = 0;
+   char* parts[3] = {name, server, database};
+
+   key[length++] = type;
+
+   for (int i = 0; i < 3; i++)
+   {
+      size_t l = strlen(parts[i]);
+
+      if (length + l + 1 >= FRAGMENT_MAX_KEY_LENGTH)
+      {
+         return 0;
+      }
+
+      key[length++] = '\x1f';
+      memcpy(&key[length], parts[i], l);
+      length += l;
+   }
+
+   for (int j = 0; j < (n_columns >= 0 ? n_columns : temp->query_alt->node.n_columns); j++)
+   {
+      char* value = NULL;
+      size_t l;
+
+      if (n_columns < 0 && temp->query_alt->node.columns[j].type != LABEL_TYPE)
+      {
+         continue;
+      }
+
+      value = pgexporter_get_column(j, tuple);
+      l = value != NULL ? strlen(value) : 0;
+
+      if (length + l + 2 >= FRAGMENT_MAX_KEY_LENGTH)
+      {
+         return 0;
+      }
+
+      key[length++] = value != NULL ? '\x1f' : '\x1e';
+      if (value != NULL)
+      {
+         memcpy(&key[length], value, l);
+         length += l;
+      }
+   }
+
+   return length;
+}
+
+/**
+ * Look up the fragments of all the series of a family at once
+ *
+ * @param fragments The fragments
+ * @param type The type of the keys
+ * @param name The metric name
+ * @param temp The query
+ * @param n_columns The number of columns in the key, or -1 for the label columns
+ * @param value_column The column without which a series is skipped, or -1
+ * @return The number of lookups, one per tuple, or 0 upon failure
+ */
+static int
+lookup_family(family_fragments_t* fragments, char type, char* name, query_list_t* temp,
+              int n_columns, int value_column)
+{
+   char key[FRAGMENT_MAX_KEY_LENGTH];
+   char* p = NULL;
+   size_t used = 0;
+   int n = 0;
+   struct configuration* config = (struct configuration*)shmem;
+
+   for (struct tuple* tuple = temp->query->tuples; tuple != NULL; tuple = tuple->next)
+   {
+      size_t key_length = 0;
+
+      if (n == fragments->capacity)
+      {
+         int capacity = fragments->capacity > 0 ? fragments->capacity * 2 : 64;
+         struct fragment_lookup* lookups = realloc(fragments->lookups, capacity * sizeof(struct fragment_lookup));
+
+         if (lookups == NULL)
+         {
+            return 0;
+         }
+
+         fragments->lookups = lookups;
+         fragments->capacity = capacity;
+      }
+
+      if (value_column < 0 || pgexporter_get_column(value_column, tuple) != NULL)
+      {
+         key_length = series_key(key, type, name, config->servers[tuple->server].name,
+                                 temp->database, temp, tuple, n_columns);
+      }
+
+      if (used + key_length > fragments->keys_capacity)
+      {
+         size_t capacity = MAX(MAX(fragments->keys_capacity * 2, used + key_length), (size_t)4096);
+         char* keys = realloc(fragments->keys, capacity);
+
+         if (keys == NULL)
+         {
+            return 0;
+         }
+
+         fragments->keys = keys;
+         fragments->keys_capacity = capacity;
+      }
+
+      if (key_length > 0)
+      {
+         memcpy(fragments->keys + used, key, key_length);
+         used += key_length;
+      }
+
+      fragments->lookups[n].key_length = key_length;
+      n++;
+   }
+
+   p = fragments->keys;
+   for (int i = 0; i < n; i++)
+   {
+      fragments->lookups[i].key = p;
+      p += fragments->lookups[i].key_length;
+   }
+
+   pgexporter_fragment_lookup(fragments->lookups, n, &fragments->buffer, &fragments->buffer_capacity);
+
+   return n;
+}
+
+static void
+free_family(family_fragments_t* fragments)
+{
+   free(fragments->lookups);
+   free(fragments->keys);
+   free(fragments->buffer);
+   memset(fragments, 0, sizeof(family_fragments_t));
+}
+
+/**
+ * Get the HELP and TYPE header of a metric family, pre-rendered
+ * if the family was seen before
+ *
+ * @param tag The tag
+ * @param name The column name
+ * @param description The description, or NULL
+ * @param type The type
+ * @return The header; the caller must free it
+ */
+static char*
+family_header(char* tag, char* name, char* description, int type)
 {
-   if (container == NULL)
+   char key[FRAGMENT_MAX_KEY_LENGTH];
+   struct fragment_lookup lookup = {0};
+   size_t capacity = 0;
+   char* data = NULL;
+   size_t length = 0;
+
+   length = (size_t)pgexporter_snprintf(key, sizeof(key), "#\x1f%s\x1f%s\x1f%d\x1f%s",
+                                        tag, name, type, description != NULL ? description : "");
+
+   lookup.key = key;
+   lookup.key_length = length < sizeof(key) ? length : 0;
+
+   if (pgexporter_fragment_lookup(&lookup, 1, &data, &capacity) == 1)
    {
-      return;
+      /* The header has no label set, so the buffer becomes the header */
+      memmove(data, lookup.prefix, strlen(lookup.prefix) + 1);
+      return data;
    }
 
-   pgexporter_art_destroy(container->general_metrics);
-   pgexporter_art_destroy(container->server_metrics);
-   pgexporter_art_destroy(container->version_metrics);
-   pgexporter_art_destroy(container->uptime_metrics);
-   pgexporter_art_destroy(container->primary_metrics);
-   pgexporter_art_destroy(container->fips_metrics);
-   pgexporter_art_destroy(container->core_metrics);
-   pgexporter_art_destroy(container->extension_metrics);
-   pgexporter_art_destroy(container->extension_list_metrics);
-   pgexporter_art_destroy(container->settings_metrics);
-   pgexporter_art_destroy(container->custom_metrics);
-   pgexporter_art_destroy(container->alert_metrics);
+   free(data);
+   data = NULL;
 
-   free(container);
+   append_help_info(&data, tag, name, description);
+   append_type_info(&data, tag, name, type);
+
+   if (length < sizeof(key))
+   {
+      pgexporter_fragment_store(key, length, NULL, data);
+   }
+
+   return data;
 }
 
 /**
- * Add a metric to an ART with proper destroy callback
+ * Join the columns of a store into one text, and free them
+ *
+ * @param store The store
+ * @param n_store The number of columns
+ * @return The text, or NULL if there is none
  */
-static int
-add_metric_to_art(struct art* art_tree, char* key, char* value,
-                  char* help, char* type, int sort_type)
+static char*
+join_columns(column_store_t* store, int n_store)
 {
-   prometheus_metric_value_t* m = NULL;
-   struct value_config vc = {.destroy_data = &prometheus_metric_value_destroy_cb,
-                             .to_string = &prometheus_metric_value_string_cb};
+   size_t size = 0;
+   size_t offset = 0;
+   char* data = NULL;
 
-   m = (prometheus_metric_value_t*)malloc(sizeof(prometheus_metric_value_t));
-   if (m == NULL)
+   for (int i = 0; i < n_store; i++)
    {
-      pgexporter_log_error("Failed to allocate metric value");
-      goto error;
+      for (column_node_t* node = store[i].columns; node != NULL; node = node->next)
+      {
+         size += node->data != NULL ? strlen(node->data) : 0;
+      }
+      size += 1;
    }
 
-   memset(m, 0, sizeof(prometheus_metric_value_t));
-
-   m->timestamp = 0; /* Needed for cache */
-   m->value = value ? pgexporter_append(NULL, value) : NULL;
-   m->help = help ? pgexporter_append(NULL, help) : NULL;
-   m->type = type ? pgexporter_append(NULL, type) : NULL;
-   m->sort_type = sort_type;
-
-   if (pgexporter_art_insert_with_config(art_tree, key, (uintptr_t)m, &vc))
+   if (n_store > 0)
    {
-      pgexporter_log_error("Failed to insert metric into ART");
-      goto error;
+      data = malloc(size + 1);
    }
 
-   return 0;
+   for (int i = 0; i < n_store; i++)
+   {
+      column_node_t* node = store[i].columns;
 
-error:
-   if (m != NULL)
+      while (node != NULL)
+      {
+         column_node_t* last = node;
+
+         if (data != NULL && node->data != NULL)
+         {
+            size_t l = strlen(node->data);
+
+            memcpy(data + offset, node->data, l);
+            offset += l;
+         }
+
+         node = node->next;
+
+         free(last->data);
+         free(last);
+      }
+
+      if (data != NULL)
+      {
+         data[offset++] = '\n';
+      }
+   }
+
+   if (data != NULL)
    {
-      free(m->value);
-      free(m->help);
-      free(m->type);
-      free(m);
+      data[offset] = '\0';
    }
-   return 1;
+
+   return data;
 }
 
 int
@@ -3373,8 +4303,12 @@ pgexporter_prometheus_iterator_value(struct art_iterator* iter, char** value)
 }
 
 int
-pgexporter_prometheus_scrape(prometheus_metrics_container_t** container)
+pgexporter_prometheus_scrape(prometheus_metrics_container_t** container, bool samples)
 {
+   pgexporter_fragment_begin();
+
+   pgexporter_scrape_incomplete_reset();
+
    pgexporter_open_connections();
 
    if (create_metrics_container(container))
@@ -3383,12 +4317,15 @@ pgexporter_prometheus_scrape(prometheus_metrics_container_t** container)
       return 1;
    }
 
+   (*container)->record_samples = samples;
+
+   /* A server abandoned at the deadline was still active when the scrape started */
+   server_information(*container);
    general_information(*container);
    version_information(*container);
    uptime_information(*container);
    primary_information(*container);
    fips_information(*container);
-   server_information(*container);
    core_information(*container);
    extension_list_information(*container);
    settings_information(*container);
@@ -3396,6 +4333,7 @@ pgexporter_prometheus_scrape(prometheus_metrics_container_t** container)
    extension_metrics(*container);
    query_statistics_information(*container);
    alert_information(*container);
+   scrape_information(*container);
 
    pgexporter_close_connections();
 
@@ -3403,22 +4341,25 @@ pgexporter_prometheus_scrape(prometheus_metrics_container_t** container)
 }
 
 /**
- * Output all metrics from an ART in sorted order
+ * Render all metrics from an ART in sorted order
+ *
+ * @param art_tree The ART
+ * @return The text, or NULL if there are no metrics
  */
-static void
-output_art_metrics(SSL* client_ssl, int client_fd, struct art* art_tree)
+static char*
+art_metrics_to_string(struct art* art_tree)
 {
    char* data = NULL;
    struct art_iterator* iter = NULL;
 
    if (art_tree == NULL)
    {
-      return;
+      return NULL;
    }
 
    if (pgexporter_art_iterator_create(art_tree, &iter))
    {
-      return;
+      return NULL;
    }
 
    while (pgexporter_art_iterator_next(iter))
@@ -3432,14 +4373,26 @@ output_art_metrics(SSL* client_ssl, int client_fd, struct art* art_tree)
       }
    }
 
+   pgexporter_art_iterator_destroy(iter);
+
+   return data;
+}
+
+/**
+ * Output all metrics from an ART in sorted order
+ */
+static void
+output_art_metrics(SSL* client_ssl, int client_fd, struct art* art_tree)
+{
+   char* data = NULL;
+
+   data = art_metrics_to_string(art_tree);
+
    if (data != NULL)
    {
       pgexporter_http_respond_chunked_write(client_ssl, client_fd, data);
-      metrics_cache_append(data);
       free(data);
    }
-
-   pgexporter_art_iterator_destroy(iter);
 }
 
 /**
@@ -3466,3 +4419,259 @@ output_all_metrics(SSL* client_ssl, int client_fd, prometheus_metrics_container_
    output_art_metrics(client_ssl, client_fd, container->custom_metrics);
    output_art_metrics(client_ssl, client_fd, container->alert_metrics);
 }
+
+char*
+pgexporter_prometheus_container_to_string(prometheus_metrics_container_t* container)
+{
+   char* data = NULL;
+   struct art* trees[12];
+
+   if (container == NULL)
+   {
+      return NULL;
+   }
+
+   /* Same order as the /metrics response */
+   trees[0] = container->general_metrics;
+   trees[1] = container->server_metrics;
+   trees[2] = container->version_metrics;
+   trees[3] = container->uptime_metrics;
+   trees[4] = container->primary_metrics;
+   trees[5] = container->fips_metrics;
+   trees[6] = container->core_metrics;
+   trees[7] = container->extension_metrics;
+   trees[8] = container->extension_list_metrics;
+   trees[9] = container->settings_metrics;
+   trees[10] = container->custom_metrics;
+   trees[11] = container->alert_metrics;
+
+   for (int i = 0; i < 12; i++)
+   {
+      char* tree = art_metrics_to_string(trees[i]);
+
+      if (tree != NULL)
+      {
+         data = pgexporter_append(data, tree);
+         free(tree);
+      }
+   }
+
+   return data;
+}
+
+int
+pgexporter_prometheus_metrics_bridge(struct prometheus_bridge* bridge)
+{
+   time_t start_time;
+   int dt;
+   bool locked = false;
+   signed char cache_is_free;
+   char* data = NULL;
+   prometheus_metrics_container_t* container = NULL;
+   struct prometheus_cache* cache;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+
+   if (cache != NULL && is_metrics_cache_configured())
+   {
+      start_time = time(NULL);
+
+retry_cache_locking:
+      cache_is_free = STATE_FREE;
+      if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+      {
+         locked = true;
+
+         /* Use the published response if there is one */
+         if (is_metrics_cache_valid())
+         {
+            data = pgexporter_append(NULL, cache->data);
+
+            atomic_store(&cache->lock, STATE_FREE);
+            locked = false;
+         }
+      }
+      else
+      {
+         dt = (int)difftime(time(NULL), start_time);
+         if (dt < (pgexporter_time_convert(config->blocking_timeout, FORMAT_TIME_S) > 0 ? pgexporter_time_convert(config->blocking_timeout, FORMAT_TIME_S) : DEFAULT_BLOCKING_TIMEOUT_SECONDS))
+         {
+            /* Sleep for 10ms */
+            SLEEP_AND_GOTO(10000000L, retry_cache_locking);
+         }
+      }
+   }
+
+   if (data != NULL)
+   {
+      pgexporter_log_debug("Metrics out of cache (%zu bytes)", strlen(data));
+
+      if (pgexporter_prometheus_client_parse(data, bridge))
+      {
+         goto error;
+      }
+
+      free(data);
+
+      return 0;
+   }
+
+   if (locked)
+   {
+      /* Publish the scrape, so the metrics endpoint can serve it too */
+      if (metrics_text(&data, &container))
+      {
+         atomic_store(&cache->lock, STATE_FREE);
+         goto error;
+      }
+
+      atomic_store(&cache->lock, STATE_FREE);
+
+      free(data);
+      data = NULL;
+   }
+   else if (pgexporter_prometheus_scrape(&container, true))
+   {
+      goto error;
+   }
+
+   if (pgexporter_prometheus_container_to_bridge(container, bridge))
+   {
+      goto error;
+   }
+
+   pgexporter_prometheus_destroy_container(container);
+
+   return 0;
+
+error:
+
+   pgexporter_prometheus_destroy_container(container);
+   free(data);
+
+   return 1;
+}
+
+int
+pgexporter_prometheus_container_to_bridge(prometheus_metrics_container_t* container, struct prometheus_bridge* bridge)
+{
+   time_t now;
+   char value[64];
+   struct art* helps = NULL;
+   struct art* types = NULL;
+   struct art_iterator* iter = NULL;
+   struct art* trees[12];
+
+   now = time(NULL);
+
+   if (pgexporter_art_create(&helps) || pgexporter_art_create(&types))
+   {
+      goto error;
+   }
+
+   trees[0] = container->general_metrics;
+   trees[1] = container->server_metrics;
+   trees[2] = container->version_metrics;
+   trees[3] = container->uptime_metrics;
+   trees[4] = container->primary_metrics;
+   trees[5] = container->fips_metrics;
+   trees[6] = container->core_metrics;
+   trees[7] = container->extension_metrics;
+   trees[8] = container->extension_list_metrics;
+   trees[9] = container->settings_metrics;
+   trees[10] = container->custom_metrics;
+   trees[11] = container->alert_metrics;
+
+   /* Only the header lines of each family are looked at */
+   for (int i = 0; i < 12; i++)
+   {
+      if (trees[i] == NULL || pgexporter_art_iterator_create(trees[i], &iter))
+      {
+         continue;
+      }
+
+      while (pgexporter_art_iterator_next(iter))
+      {
+         prometheus_metric_value_t* m = (prometheus_metric_value_t*)iter->value->data;
+         char* line = m != NULL ? m->value : NULL;
+
+         while (line != NULL && *line != '\0')
+         {
+            char* end = strchr(line, '\n');
+            size_t length = end != NULL ? (size_t)(end - line) : strlen(line);
+
+            if (length > 6 && (!strncmp(line, "#HELP ", 6) || !strncmp(line, "#TYPE ", 6)))
+            {
+               char* name = line + 6;
+               char* text = memchr(name, ' ', length - 6);
+
+               if (text != NULL)
+               {
+                  char key[PROMETHEUS_LENGTH];
+                  char description[MAX_PATH];
+
+                  pgexporter_snprintf(key, sizeof(key), "%.*s", (int)(text - name), name);
+                  pgexporter_snprintf(description, sizeof(description), "%.*s", (int)(length - (text + 1 - line)), text + 1);
+
+                  pgexporter_art_insert(line[1] == 'H' ? helps : types, key, (uintptr_t)description, ValueString);
+               }
+            }
+
+            line = end != NULL ? end + 1 : NULL;
+         }
+      }
+
+      pgexporter_art_iterator_destroy(iter);
+      iter = NULL;
+   }
+
+   for (int i = 0; i < container->number_of_samples; i++)
+   {
+      struct prometheus_sample* sample = &container->samples[i];
+      char* name = container->sample_strings[sample->name];
+      char family[PROMETHEUS_LENGTH];
+      char* help = NULL;
+
+      pgexporter_snprintf(family, sizeof(family), "%s", name);
+      help = (char*)pgexporter_art_search(helps, family);
+
+      /* The series of a histogram are described by the header of the histogram */
+      for (int j = 0; help == NULL && j < 3; j++)
+      {
+         char* suffixes[] = {"_bucket", "_sum", "_count"};
+
+         if (pgexporter_ends_with(name, suffixes[j]))
+         {
+            pgexporter_snprintf(family, sizeof(family), "%.*s", (int)(strlen(name) - strlen(suffixes[j])), name);
+            help = (char*)pgexporter_art_search(helps, family);
+         }
+      }
+
+      if (help == NULL)
+      {
+         continue;
+      }
+
+      snprintf(value, sizeof(value), "%.15g", sample->value);
+
+      if (pgexporter_prometheus_client_add(bridge, name, help, (char*)pgexporter_art_search(types, family),
+                                           container->sample_strings[sample->labels], value, now))
+      {
+         goto error;
+      }
+   }
+
+   pgexporter_art_destroy(helps);
+   pgexporter_art_destroy(types);
+
+   return 0;
+
+error:
+
+   pgexporter_art_destroy(helps);
+   pgexporter_art_destroy(types);
+
+   return 1;
+}
@@ -47,7 +47,7 @@
 
 static int parse_body_to_bridge(int endpoint, time_t timestamp, char* body, struct prometheus_bridge* bridge);
 static int metric_find_create(struct prometheus_bridge* bridge, char* name, struct prometheus_metric** metric);
-static int metric_set_name(struct prometheus_metric* metric, char* name);
+static int sample_metric(struct prometheus_bridge* bridge, char* family, char* help, char* type, char* line, struct prometheus_metric** metric);
 static int metric_set_help(struct prometheus_metric* metric, char* help);
 static int metric_set_type(struct prometheus_metric* metric, char* type);
 static bool attributes_contains(struct deque* attributes, struct prometheus_attribute* attribute);
@@ -55,6 +55,8 @@ static int attributes_find_create(struct deque* definitions, struct deque* input
 static int add_attribute(struct deque* attributes, char* key, char* value);
 static int add_value(struct deque* values, time_t timestamp, char* value);
 static int add_line(struct prometheus_metric* metric, char* line, int endpoint, time_t timestamp);
+static int parse_labels(char* p, char* labels_end, struct deque* attributes);
+static int add_series(struct prometheus_metric* metric, struct deque* attributes, char* value, time_t timestamp);
 
 static void prometheus_metric_destroy_cb(uintptr_t data);
 static char* deque_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
@@ -184,6 +186,141 @@ error:
    return 1;
 }
 
+int
+pgexporter_prometheus_client_parse(char* body, struct prometheus_bridge* bridge)
+{
+   if (body == NULL || bridge == NULL)
+   {
+      return 1;
+   }
+
+   return parse_body_to_bridge(-1, time(NULL), body, bridge);
+}
+
+int
+pgexporter_prometheus_client_add(struct prometheus_bridge* bridge, char* name, char* help, char* type,
+                                 char* labels, char* value, time_t timestamp)
+{
+   struct deque* attributes = NULL;
+   struct prometheus_metric* metric = NULL;
+
+   if (bridge == NULL || name == NULL || value == NULL)
+   {
+      goto error;
+   }
+
+   if (metric_find_create(bridge, name, &metric))
+   {
+      goto error;
+   }
+
+   if (help != NULL && metric_set_help(metric, help))
+   {
+      goto error;
+   }
+
+   if (type != NULL && metric_set_type(metric, type))
+   {
+      goto error;
+   }
+
+   if (pgexporter_deque_create(false, &attributes))
+   {
+      goto error;
+   }
+
+   if (labels != NULL && parse_labels(labels, labels + strlen(labels), attributes))
+   {
+      goto error;
+   }
+
+   /* The series takes the attributes */
+   return add_series(metric, attributes, value, timestamp);
+
+error:
+
+   pgexporter_deque_destroy(attributes);
+
+   return 1;
+}
+
+int
+pgexporter_prometheus_client_expire(struct prometheus_bridge* bridge, time_t since)
+{
+   struct art_iterator* metrics_iterator = NULL;
+   struct deque* empty = NULL;
+   struct deque_iterator* empty_iterator = NULL;
+
+   if (bridge == NULL || bridge->metrics == NULL)
+   {
+      return 0;
+   }
+
+   if (pgexporter_deque_create(false, &empty))
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_iterator_create(bridge->metrics, &metrics_iterator))
+   {
+      goto error;
+   }
+
+   while (pgexporter_art_iterator_next(metrics_iterator))
+   {
+      struct prometheus_metric* metric = (struct prometheus_metric*)metrics_iterator->value->data;
+      struct deque_iterator* definition_iterator = NULL;
+
+      if (pgexporter_deque_iterator_create(metric->definitions, &definition_iterator))
+      {
+         goto error;
+      }
+
+      while (pgexporter_deque_iterator_next(definition_iterator))
+      {
+         struct prometheus_attributes* attrs = (struct prometheus_attributes*)definition_iterator->value->data;
+
+         if (attrs->last_seen < since)
+         {
+            pgexporter_deque_iterator_remove(definition_iterator);
+            metric->changed = true;
+         }
+      }
+
+      pgexporter_deque_iterator_destroy(definition_iterator);
+
+      if (pgexporter_deque_empty(metric->definitions))
+      {
+         pgexporter_deque_add(empty, NULL, (uintptr_t)metrics_iterator->key, ValueString);
+      }
+   }
+
+   pgexporter_art_iterator_destroy(metrics_iterator);
+   metrics_iterator = NULL;
+
+   if (pgexporter_deque_iterator_create(empty, &empty_iterator))
+   {
+      goto error;
+   }
+
+   while (pgexporter_deque_iterator_next(empty_iterator))
+   {
+      pgexporter_art_delete(bridge->metrics, (char*)empty_iterator->value->data);
+   }
+
+   pgexporter_deque_iterator_destroy(empty_iterator);
+   pgexporter_deque_destroy(empty);
+
+   return 0;
+
+error:
+
+   pgexporter_art_iterator_destroy(metrics_iterator);
+   pgexporter_deque_destroy(empty);
+
+   return 1;
+}
+
 static void
 prometheus_metric_destroy_cb(uintptr_t data)
 {
@@ -276,6 +413,7 @@ metric_find_create(struct prometheus_bridge* bridge, char* name,
 
       m->name = strdup(name);
       m->definitions = defs;
+      m->changed = true;
 
       if (pgexporter_art_insert_with_config(bridge->metrics, (char*)name,
                                             (uintptr_t)m, &vc))
@@ -293,28 +431,77 @@ error:
    return 1;
 }
 
+/**
+ * Find or create the metric of a sample line. A line belongs to the family
+ * of the last HELP, either under the name of the family or with a suffix,
+ * like the _bucket, _sum and _count series of a histogram. Each name is a
+ * metric of its own, carrying the HELP and TYPE of the family
+ *
+ * @param bridge The bridge
+ * @param family The name of the family
+ * @param help The HELP of the family
+ * @param type The TYPE of the family, or an empty string
+ * @param line The sample line
+ * @param metric The metric of the previous line, updated to the metric of this line
+ * @return 0 if success, otherwise 1
+ */
 static int
-metric_set_name(struct prometheus_metric* metric, char* name)
+sample_metric(struct prometheus_bridge* bridge, char* family, char* help, char* type, char* line, struct prometheus_metric** metric)
 {
-   if (metric->name != NULL)
+   char name[MISC_LENGTH];
+   size_t family_length = strlen(family);
+   size_t length = strcspn(line, "{ \t");
+
+   if (*metric != NULL && strlen((*metric)->name) == length && !strncmp((*metric)->name, line, length))
    {
-      /* Assumes information is already present. */
       return 0;
    }
 
-   metric->name = strdup(name);
-   if (metric->name == NULL)
+   *metric = NULL;
+
+   if (family_length == 0 || length < family_length || length >= sizeof(name) ||
+       strncmp(line, family, family_length))
    {
-      errno = 0;
-      return 1;
+      goto error;
+   }
+
+   memcpy(name, line, length);
+   name[length] = '\0';
+
+   if (metric_find_create(bridge, name, metric))
+   {
+      goto error;
+   }
+
+   if (metric_set_help(*metric, help))
+   {
+      goto error;
+   }
+
+   if (strlen(type) > 0 && metric_set_type(*metric, type))
+   {
+      goto error;
    }
 
    return 0;
+
+error:
+
+   *metric = NULL;
+
+   return 1;
 }
 
 static int
 metric_set_help(struct prometheus_metric* metric, char* help)
 {
+   if (metric->help != NULL && !strcmp(metric->help, help))
+   {
+      return 0;
+   }
+
+   metric->changed = true;
+
    if (metric->help != NULL)
    {
       free(metric->help);
@@ -335,6 +522,13 @@ metric_set_help(struct prometheus_metric* metric, char* help)
 static int
 metric_set_type(struct prometheus_metric* metric, char* type)
 {
+   if (metric->type != NULL && !strcmp(metric->type, type))
+   {
+      return 0;
+   }
+
+   metric->changed = true;
+
    if (metric->type != NULL)
    {
       free(metric->type);
@@ -503,6 +697,7 @@ attributes_find_create(struct deque* definitions, struct deque* input,
       }
 
       m->attributes = input;
+      m->last_seen = 0;
 
       if (pgexporter_deque_add_with_config(definitions, NULL, (uintptr_t)m, &vc))
       {
@@ -711,10 +906,8 @@ static int
 add_line(struct prometheus_metric* metric, char* line, int endpoint, time_t timestamp)
 {
    char* e = NULL;
-   bool new = false;
    char* line_value = NULL;
    struct deque* line_attrs = NULL;
-   struct prometheus_attributes* attributes = NULL;
    struct configuration* config = NULL;
    char* p = NULL;
    char* labels_end = NULL;
@@ -733,13 +926,17 @@ add_line(struct prometheus_metric* metric, char* line, int endpoint, time_t time
       goto error;
    }
 
-   e = pgexporter_append(e, config->endpoints[endpoint].host);
-   e = pgexporter_append_char(e, ':');
-   e = pgexporter_append_int(e, config->endpoints[endpoint].port);
-
-   if (add_attribute(line_attrs, "endpoint", e))
+   /* Local metrics don't come from an endpoint */
+   if (endpoint >= 0)
    {
-      goto error;
+      e = pgexporter_append(e, config->endpoints[endpoint].host);
+      e = pgexporter_append_char(e, ':');
+      e = pgexporter_append_int(e, config->endpoints[endpoint].port);
+
+      if (add_attribute(line_attrs, "endpoint", e))
+      {
+         goto error;
+      }
    }
 
    p = line;
@@ -787,187 +984,259 @@ add_line(struct prometheus_metric* metric, char* line, int endpoint, time_t time
          goto error;
       }
 
-      while (p < labels_end)
+      if (parse_labels(p, labels_end, line_attrs))
       {
-         char key[PROMETHEUS_LENGTH] = {0};
-         char value[PROMETHEUS_LENGTH] = {0};
-         size_t key_len = 0;
-         size_t value_len = 0;
+         goto error;
+      }
 
-         while (p < labels_end && isspace((unsigned char)*p))
-         {
-            p++;
-         }
+      value_start = labels_end + 1;
+   }
+   else
+   {
+      value_start = p;
+   }
 
-         if (p >= labels_end)
-         {
-            break;
-         }
+   while (*value_start != '\0' && isspace((unsigned char)*value_start))
+   {
+      value_start++;
+   }
 
-         while (p < labels_end && *p != '=' && !isspace((unsigned char)*p))
-         {
-            if (key_len + 1 >= sizeof(key))
-            {
-               goto error;
-            }
+   if (*value_start == '\0')
+   {
+      goto error;
+   }
 
-            key[key_len++] = *p;
-            p++;
-         }
+   value_end = value_start;
+   while (*value_end != '\0' && !isspace((unsigned char)*value_end))
+   {
+      value_end++;
+   }
 
-         while (p < labels_end && isspace((unsigned char)*p))
-         {
-            p++;
-         }
+   if (value_end == value_start)
+   {
+      goto error;
+   }
+
+   line_value = strndup(value_start, (size_t)(value_end - value_start));
+   if (line_value == NULL)
+   {
+      goto error;
+   }
+
+   /* The series takes the attributes */
+   if (add_series(metric, line_attrs, line_value, timestamp))
+   {
+      line_attrs = NULL;
+      goto error;
+   }
+
+   free(e);
+   free(line_value);
+
+   return 0;
+
+error:
+
+   pgexporter_deque_destroy(line_attrs);
+
+   free(e);
+   free(line_value);
 
-         if (p >= labels_end || *p != '=')
+   return 1;
+}
+
+/**
+ * Parse the labels of a series, i.e. the text between the braces
+ *
+ * @param p The start of the labels
+ * @param labels_end The end of the labels
+ * @param attributes The attributes to add to
+ * @return 0 if success, otherwise 1
+ */
+static int
+parse_labels(char* p, char* labels_end, struct deque* attributes)
+{
+   while (p < labels_end)
+   {
+      char key[PROMETHEUS_LENGTH] = {0};
+      char value[PROMETHEUS_LENGTH] = {0};
+      size_t key_len = 0;
+      size_t value_len = 0;
+
+      while (p < labels_end && isspace((unsigned char)*p))
+      {
+         p++;
+      }
+
+      if (p >= labels_end)
+      {
+         break;
+      }
+
+      while (p < labels_end && *p != '=' && !isspace((unsigned char)*p))
+      {
+         if (key_len + 1 >= sizeof(key))
          {
             goto error;
          }
+
+         key[key_len++] = *p;
          p++;
+      }
 
-         while (p < labels_end && isspace((unsigned char)*p))
-         {
-            p++;
-         }
+      while (p < labels_end && isspace((unsigned char)*p))
+      {
+         p++;
+      }
+
+      if (p >= labels_end || *p != '=')
+      {
+         goto error;
+      }
+      p++;
 
-         if (p >= labels_end || *p != '"')
+      while (p < labels_end && isspace((unsigned char)*p))
+      {
+         p++;
+      }
+
+      if (p >= labels_end || *p != '"')
+      {
+         goto error;
+      }
+      p++;
+
+      while (p < labels_end)
+      {
+         if (*p == '"')
          {
-            goto error;
+            p++;
+            break;
          }
-         p++;
 
-         while (p < labels_end)
+         if (*p == '\\' && (p + 1) < labels_end)
          {
-            if (*p == '"')
-            {
-               p++;
-               break;
-            }
+            p++;
 
-            if (*p == '\\' && (p + 1) < labels_end)
+            if (value_len + 1 >= sizeof(value))
             {
-               p++;
-
-               if (value_len + 1 >= sizeof(value))
-               {
-                  goto error;
-               }
-
-               switch (*p)
-               {
-                  case 'n':
-                     value[value_len++] = '\n';
-                     break;
-                  case 't':
-                     value[value_len++] = '\t';
-                     break;
-                  case 'r':
-                     value[value_len++] = '\r';
-                     break;
-                  default:
-                     value[value_len++] = *p;
-                     break;
-               }
-
-               p++;
-               continue;
+               goto error;
             }
 
-            if (value_len + 1 >= sizeof(value))
+            switch (*p)
             {
-               goto error;
+               case 'n':
+                  value[value_len++] = '\n';
+                  break;
+               case 't':
+                  value[value_len++] = '\t';
+                  break;
+               case 'r':
+                  value[value_len++] = '\r';
+                  break;
+               default:
+                  value[value_len++] = *p;
+                  break;
             }
 
-            value[value_len++] = *p;
             p++;
+            continue;
          }
 
-         if (key_len == 0)
+         if (value_len + 1 >= sizeof(value))
          {
             goto error;
          }
 
-         if (add_attribute(line_attrs, key, value))
-         {
-            goto error;
-         }
+         value[value_len++] = *p;
+         p++;
+      }
 
-         while (p < labels_end && isspace((unsigned char)*p))
-         {
-            p++;
-         }
+      if (key_len == 0)
+      {
+         goto error;
+      }
+
+      if (add_attribute(attributes, key, value))
+      {
+         goto error;
+      }
 
-         if (p < labels_end)
+      while (p < labels_end && isspace((unsigned char)*p))
+      {
+         p++;
+      }
+
+      if (p < labels_end)
+      {
+         if (*p != ',')
          {
-            if (*p != ',')
-            {
-               goto error;
-            }
-            p++;
+            goto error;
          }
+         p++;
       }
-
-      value_start = labels_end + 1;
-   }
-   else
-   {
-      value_start = p;
    }
 
-   while (*value_start != '\0' && isspace((unsigned char)*value_start))
-   {
-      value_start++;
-   }
+   return 0;
 
-   if (*value_start == '\0')
-   {
-      goto error;
-   }
+error:
 
-   value_end = value_start;
-   while (*value_end != '\0' && !isspace((unsigned char)*value_end))
-   {
-      value_end++;
-   }
+   return 1;
+}
 
-   if (value_end == value_start)
-   {
-      goto error;
-   }
+/**
+ * Add a value to the series of a metric with the given attributes.
+ * The attributes are consumed, also on failure
+ *
+ * @param metric The metric
+ * @param attributes The attributes
+ * @param value The value
+ * @param timestamp The timestamp
+ * @return 0 if success, otherwise 1
+ */
+static int
+add_series(struct prometheus_metric* metric, struct deque* attributes, char* value, time_t timestamp)
+{
+   bool new = false;
+   struct prometheus_attributes* series = NULL;
 
-   line_value = strndup(value_start, (size_t)(value_end - value_start));
-   if (line_value == NULL)
+   if (attributes_find_create(metric->definitions, attributes, &series, &new))
    {
       goto error;
    }
 
-   if (attributes_find_create(metric->definitions, line_attrs, &attributes, &new))
+   series->last_seen = timestamp;
+
+   if (new)
    {
-      goto error;
+      metric->changed = true;
    }
-
-   if (add_value(attributes->values, timestamp, line_value))
+   else
    {
-      goto error;
+      struct prometheus_value* last = (struct prometheus_value*)pgexporter_deque_peek_last(series->values, NULL);
+
+      pgexporter_deque_destroy(attributes);
+      attributes = NULL;
+
+      if (last != NULL && !strcmp(last->value, value))
+      {
+         /* Same value as last time, so keep the existing sample */
+         return 0;
+      }
+
+      metric->changed = true;
    }
 
-   if (!new)
+   if (add_value(series->values, timestamp, value))
    {
-      pgexporter_deque_destroy(line_attrs);
+      return 1;
    }
 
-   free(e);
-   free(line_value);
-
    return 0;
 
 error:
 
-   pgexporter_deque_destroy(line_attrs);
-
-   free(e);
-   free(line_value);
+   pgexporter_deque_destroy(attributes);
 
    return 1;
 }
@@ -980,22 +1249,15 @@ parse_body_to_bridge(int endpoint, time_t timestamp, char* body, struct promethe
    char name[MISC_LENGTH] = {0};
    char help[MAX_PATH] = {0};
    char type[MISC_LENGTH] = {0};
-   struct value_config vc = {.destroy_data = &prometheus_metric_destroy_cb,
-                             .to_string = &prometheus_metric_string_cb};
    struct prometheus_metric* metric = NULL;
 
    line = strtok_r(body, "\n", &saveptr); /* We ideally should not care if body is modified. */
 
    while (line != NULL)
    {
-      if ((!strcmp(line, "") || !strcmp(line, "\r")) &&
-          metric != NULL && metric->definitions->size > 0) /* Basically empty strings, empty lines, or empty Windows lines. */
+      if (!strcmp(line, "") || !strcmp(line, "\r"))
       {
-         /* Previous metric is over. */
-         pgexporter_art_insert_with_config(bridge->metrics, (char*)metric->name, (uintptr_t)metric, &vc);
-
-         metric = NULL;
-         continue;
+         /* Basically empty strings, empty lines, or empty Windows lines. */
       }
       else if (line[0] == '#')
       {
@@ -1003,22 +1265,20 @@ parse_body_to_bridge(int endpoint, time_t timestamp, char* body, struct promethe
          {
             sscanf(line + 6, "%127s %1021[^\n]", name, help);
 
-            metric_find_create(bridge, name, &metric);
-
-            metric_set_name(metric, name);
-            metric_set_help(metric, help);
+            /* The metrics are created by the samples of the family */
+            type[0] = '\0';
+            metric = NULL;
          }
          else if (!strncmp(&line[1], "TYPE", 4))
          {
             sscanf(line + 6, "%127s %127[^\n]", name, type);
-            metric_set_type(metric, type);
          }
          else
          {
             goto error;
          }
       }
-      else
+      else if (!sample_metric(bridge, name, help, type, line, &metric))
       {
          add_line(metric, line, endpoint, timestamp);
       }
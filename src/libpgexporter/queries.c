@@ -45,6 +45,12 @@
 
 #define SQLSTATE_QUERY_CANCELED "57014"
 
+/* How long a CancelRequest may wait for its connection, in milliseconds */
+#define QUERY_CANCEL_CONNECT_TIMEOUT 100
+
+/* The servers whose scrape in this process was cut short by the deadline */
+static bool scrape_incomplete[NUMBER_OF_SERVERS];
+
 static int query_execute(int server, char* qs, char* tag, int columns, char* names[], struct query** query);
 static bool is_query_timeout_error(struct message* error_msg);
 static void* data_append(void* orig, size_t orig_size, void* n, size_t n_size);
@@ -57,6 +63,7 @@ static int pgexporter_detect_databases(int server);
 static int pgexporter_detect_extensions(int server);
 static int pgexporter_connect_db(int server, char* database);
 static void pgexporter_apply_metrics_timeout(int server);
+static void query_abandon(int server, bool cancel);
 
 int
 pgexporter_check_pg_monitor_role(int server)
@@ -132,6 +139,12 @@ pgexporter_open_connections(void)
          continue;
       }
 
+      if (pgexporter_deadline_remaining() == 0)
+      {
+         query_abandon(server, false);
+         continue;
+      }
+
       if (config->servers[server].fd != -1)
       {
          if (!pgexporter_connection_isvalid(config->servers[server].ssl, config->servers[server].fd))
@@ -173,6 +186,7 @@ pgexporter_open_connections(void)
          if (ret == AUTH_SUCCESS)
          {
             config->servers[server].new = true;
+            pgexporter_extract_backend_key(&config->servers[server].backend_pid, &config->servers[server].backend_secret);
             pgexporter_server_info(server);
             if (!pgexporter_extract_server_parameters(&server_parameters))
             {
@@ -182,6 +196,12 @@ pgexporter_open_connections(void)
 
             if (pgexporter_check_pg_monitor_role(server) != 0)
             {
+               if (scrape_incomplete[server])
+               {
+                  /* The deadline passed during the check */
+                  continue;
+               }
+
                pgexporter_log_fatal("Server '%s': pg_monitor role check failed. pgexporter cannot function without proper permissions.",
                                     &config->servers[server].name[0]);
                if (config->servers[server].ssl != NULL)
@@ -202,6 +222,10 @@ pgexporter_open_connections(void)
 
             pgexporter_apply_metrics_timeout(server);
          }
+         else if (pgexporter_deadline_remaining() == 0)
+         {
+            query_abandon(server, false);
+         }
          else
          {
             pgexporter_log_error("Failed login for '%s' on server '%s'", &config->users[user].username, &config->servers[server].name);
@@ -210,6 +234,18 @@ pgexporter_open_connections(void)
    }
 }
 
+void
+pgexporter_scrape_incomplete_reset(void)
+{
+   memset(&scrape_incomplete, 0, sizeof(scrape_incomplete));
+}
+
+bool
+pgexporter_is_scrape_incomplete(int server)
+{
+   return server >= 0 && server < NUMBER_OF_SERVERS && scrape_incomplete[server];
+}
+
 void
 pgexporter_close_connections(void)
 {
@@ -258,6 +294,12 @@ pgexporter_execute_command(int server, char* sql)
 
    config = (struct configuration*)shmem;
 
+   if (pgexporter_deadline_remaining() == 0)
+   {
+      query_abandon(server, false);
+      return 1;
+   }
+
    size = 1 + 4 + strlen(sql) + 1;
    content = (char*)malloc(size);
    memset(content, 0, size);
@@ -273,6 +315,10 @@ pgexporter_execute_command(int server, char* sql)
    status = pgexporter_write_message(config->servers[server].ssl, config->servers[server].fd, &qmsg);
    if (status != MESSAGE_STATUS_OK)
    {
+      if (pgexporter_deadline_remaining() == 0)
+      {
+         query_abandon(server, true);
+      }
       pgexporter_log_error("pgexporter_execute_command: failed to write message");
       goto error;
    }
@@ -293,6 +339,10 @@ pgexporter_execute_command(int server, char* sql)
       }
       else
       {
+         if (pgexporter_deadline_remaining() == 0)
+         {
+            query_abandon(server, true);
+         }
          pgexporter_log_error("pgexporter_execute_command: failed to read message, status=%d", status);
          goto error;
       }
@@ -729,10 +779,16 @@ query_execute(int server, char* qs, char* tag, int columns, char* names[], struc
 
    config = (struct configuration*)shmem;
 
-   atomic_fetch_add(&config->query_executions_total, 1);
-
    *query = NULL;
 
+   if (pgexporter_deadline_remaining() == 0)
+   {
+      query_abandon(server, false);
+      return 1;
+   }
+
+   atomic_fetch_add(&config->query_executions_total, 1);
+
    memset(&qmsg, 0, sizeof(struct message));
 
    size = 1 + 4 + strlen(qs) + 1;
@@ -750,7 +806,7 @@ query_execute(int server, char* qs, char* tag, int columns, char* names[], struc
    status = pgexporter_write_message(config->servers[server].ssl, config->servers[server].fd, &qmsg);
    if (status != MESSAGE_STATUS_OK)
    {
-      goto error;
+      goto deadline;
    }
 
    cont = true;
@@ -770,7 +826,7 @@ query_execute(int server, char* qs, char* tag, int columns, char* names[], struc
       }
       else
       {
-         goto error;
+         goto deadline;
       }
 
       pgexporter_clear_message();
@@ -865,6 +921,13 @@ query_execute(int server, char* qs, char* tag, int columns, char* names[], struc
 
    return 0;
 
+deadline:
+   if (pgexporter_deadline_remaining() == 0)
+   {
+      query_timeout = true;
+      query_abandon(server, true);
+   }
+
 error:
    atomic_fetch_add(&config->query_errors_total, 1);
    if (query_timeout)
@@ -1246,8 +1309,13 @@ pgexporter_connect_db(int server, char* database)
                                             &config->servers[server].fd);
    if (ret == 0)
    {
+      pgexporter_extract_backend_key(&config->servers[server].backend_pid, &config->servers[server].backend_secret);
       pgexporter_apply_metrics_timeout(server);
    }
+   else if (pgexporter_deadline_remaining() == 0)
+   {
+      query_abandon(server, false);
+   }
    return ret;
 }
 
@@ -1312,3 +1380,67 @@ pgexporter_apply_metrics_timeout(int server)
       free(set_query);
    }
 }
+
+/**
+ * Give up on a server once the scrape deadline has passed. A query in
+ * flight is cancelled with a CancelRequest, and the connection is closed
+ * so the remaining collectors skip the server
+ * @param server The server
+ * @param cancel Is a query in flight
+ */
+static void
+query_abandon(int server, bool cancel)
+{
+   int ret;
+   int fd = -1;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   scrape_incomplete[server] = true;
+
+   if (config->servers[server].fd == -1)
+   {
+      return;
+   }
+
+   pgexporter_log_warn("Scrape deadline expired for server '%s'", &config->servers[server].name[0]);
+
+   if (cancel && config->servers[server].backend_pid != 0)
+   {
+      if (config->servers[server].host[0] == '/')
+      {
+         char pgsql[MISC_LENGTH];
+
+         memset(&pgsql, 0, sizeof(pgsql));
+         pgexporter_snprintf(&pgsql[0], sizeof(pgsql), ".s.PGSQL.%d", config->servers[server].port);
+         ret = pgexporter_connect_unix_socket(config->servers[server].host, &pgsql[0], &fd);
+      }
+      else
+      {
+         /* The deadline has passed already, so the cancel only gets a short while */
+         ret = pgexporter_connect_timeout(config->servers[server].host, config->servers[server].port,
+                                          QUERY_CANCEL_CONNECT_TIMEOUT, &fd);
+      }
+
+      if (ret == 0)
+      {
+         if (pgexporter_write_cancel_request(fd, config->servers[server].backend_pid, config->servers[server].backend_secret))
+         {
+            pgexporter_log_debug("Failed to cancel the query on server '%s'", &config->servers[server].name[0]);
+         }
+         pgexporter_disconnect(fd);
+      }
+   }
+
+   if (config->servers[server].ssl != NULL)
+   {
+      pgexporter_close_ssl(config->servers[server].ssl);
+      config->servers[server].ssl = NULL;
+   }
+
+   pgexporter_disconnect(config->servers[server].fd);
+   config->servers[server].fd = -1;
+   config->servers[server].new = false;
+   config->servers[server].state = SERVER_UNKNOWN;
+}
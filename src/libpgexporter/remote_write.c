@@ -0,0 +1,1028 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <deque.h>
+#include <history.h>
+#include <http.h>
+#include <logging.h>
+#include <remote_write.h>
+#include <shmem.h>
+#include <snappy_compression.h>
+#include <utils.h>
+
+/* system */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * The spool holds one file per snapshot and shard, named
+ * <sequence>-<shard>.wal, with a small header followed by the snappy
+ * compressed WriteRequest exactly as it is sent to the endpoint.
+ */
+#define REMOTE_WRITE_MAGIC        "PGEXRW01"
+#define REMOTE_WRITE_MAGIC_LENGTH 8
+#define REMOTE_WRITE_HEADER_SIZE  16
+#define REMOTE_WRITE_SUFFIX       ".wal"
+#define REMOTE_WRITE_MAX_LABELS   32
+
+/* Backoff before the second attempt, doubled for every further attempt */
+#define REMOTE_WRITE_BACKOFF 100000000L
+
+struct remote_write_buffer
+{
+   unsigned char* data;
+   size_t size;
+   size_t capacity;
+};
+
+struct remote_write_label
+{
+   char name[MISC_LENGTH];
+   char value[PROMETHEUS_LENGTH];
+};
+
+static int buffer_reserve(struct remote_write_buffer* buffer, size_t size);
+static int buffer_append(struct remote_write_buffer* buffer, const void* data, size_t size);
+static int buffer_varint(struct remote_write_buffer* buffer, uint64_t value);
+static int buffer_string(struct remote_write_buffer* buffer, int field, const char* s);
+static int encode_series(struct remote_write_buffer* buffer, struct remote_write_buffer* scratch, struct history_record* record, bool* rejected);
+static int compare_labels(const void* a, const void* b);
+static int record_shard(struct history_record* record, int shards);
+static void spool_directory(char* directory, size_t size);
+static bool is_segment(char* name);
+static unsigned long long segment_sequence(char* name);
+static int segment_shard(char* name);
+static int segment_read(char* path, void** data, size_t* size, uint32_t* samples);
+static int segment_write(char* directory, unsigned long long sequence, int shard, void* data, size_t size, uint32_t samples);
+static void spool_bound(char* directory);
+static int flush_shard(char* directory, char** files, int number_of_files, int shard, int shards);
+static int send_segment(struct http** http, char* host, int port, bool secure, char* path, void* data, size_t size);
+
+int
+pgexporter_remote_write_parse_url(char* url, char* host, size_t host_size, int* port, bool* secure, char* path, size_t path_size)
+{
+   char* p = NULL;
+   char* end = NULL;
+   char* colon = NULL;
+   size_t length;
+
+   if (url == NULL || strlen(url) == 0)
+   {
+      goto error;
+   }
+
+   if (!strncasecmp(url, "http://", 7))
+   {
+      *secure = false;
+      *port = 80;
+      p = url + 7;
+   }
+   else if (!strncasecmp(url, "https://", 8))
+   {
+      *secure = true;
+      *port = 443;
+      p = url + 8;
+   }
+   else
+   {
+      goto error;
+   }
+
+   end = strchr(p, '/');
+   if (end == NULL)
+   {
+      end = p + strlen(p);
+   }
+
+   colon = memchr(p, ':', (size_t)(end - p));
+   length = (size_t)((colon != NULL ? colon : end) - p);
+
+   if (length == 0 || length >= host_size)
+   {
+      goto error;
+   }
+
+   memset(host, 0, host_size);
+   memcpy(host, p, length);
+
+   if (colon != NULL)
+   {
+      char* number_end = NULL;
+      long l;
+
+      errno = 0;
+      l = strtol(colon + 1, &number_end, 10);
+      if (errno != 0 || number_end != end || l <= 0 || l > 65535)
+      {
+         goto error;
+      }
+
+      *port = (int)l;
+   }
+
+   if (*end == '\0')
+   {
+      pgexporter_snprintf(path, path_size, "/");
+   }
+   else
+   {
+      if (strlen(end) >= path_size)
+      {
+         goto error;
+      }
+
+      pgexporter_snprintf(path, path_size, "%s", end);
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgexporter_remote_write_encode(struct history_record* records, int count, int shard, int shards,
+                               void** buffer, size_t* size, int* number_of_samples)
+{
+   struct remote_write_buffer request = {0};
+   struct remote_write_buffer scratch = {0};
+   bool rejected = false;
+   int n = 0;
+   struct configuration* config = (struct configuration*)shmem;
+
+   *buffer = NULL;
+   *size = 0;
+   *number_of_samples = 0;
+
+   for (int i = 0; i < count; i++)
+   {
+      if (record_shard(&records[i], shards) != shard)
+      {
+         continue;
+      }
+
+      if (encode_series(&request, &scratch, &records[i], &rejected))
+      {
+         goto error;
+      }
+
+      if (rejected)
+      {
+         pgexporter_log_warn("remote_write: %s on %s has more than %d labels, dropping the sample",
+                             records[i].metric, records[i].server, REMOTE_WRITE_MAX_LABELS);
+         atomic_fetch_add(&config->remote_write_dropped, 1);
+         continue;
+      }
+
+      n++;
+   }
+
+   free(scratch.data);
+
+   *buffer = request.data;
+   *size = request.size;
+   *number_of_samples = n;
+
+   return 0;
+
+error:
+
+   free(request.data);
+   free(scratch.data);
+
+   return 1;
+}
+
+int
+pgexporter_remote_write_spool(struct history_record* records, int count)
+{
+   char directory[MAX_PATH];
+   char** files = NULL;
+   int number_of_files = 0;
+   unsigned long long sequence = 0;
+   struct configuration* config = (struct configuration*)shmem;
+   int shards;
+   int status = 0;
+
+   if (config->remote_write_url[0] == '\0' || count <= 0)
+   {
+      return 0;
+   }
+
+   shards = MAX(config->remote_write_shards, 1);
+   spool_directory(directory, sizeof(directory));
+
+   if (pgexporter_mkdir(directory))
+   {
+      pgexporter_log_error("remote_write: failed to create spool %s", directory);
+      return 1;
+   }
+
+   if (pgexporter_get_files(directory, &number_of_files, &files) == 0)
+   {
+      for (int i = 0; i < number_of_files; i++)
+      {
+         if (is_segment(files[i]))
+         {
+            sequence = MAX(sequence, segment_sequence(files[i]));
+         }
+         free(files[i]);
+      }
+      free(files);
+   }
+
+   sequence++;
+
+   for (int shard = 0; shard < shards; shard++)
+   {
+      void* request = NULL;
+      size_t request_size = 0;
+      void* compressed = NULL;
+      size_t compressed_size = 0;
+      int samples = 0;
+
+      if (pgexporter_remote_write_encode(records, count, shard, shards, &request, &request_size, &samples))
+      {
+         pgexporter_log_error("remote_write: failed to encode shard %d", shard);
+         status = 1;
+         continue;
+      }
+
+      if (samples == 0)
+      {
+         free(request);
+         continue;
+      }
+
+      if (pgexporter_snappy_compress(request, request_size, &compressed, &compressed_size) ||
+          segment_write(directory, sequence, shard, compressed, compressed_size, (uint32_t)samples))
+      {
+         pgexporter_log_error("remote_write: failed to spool shard %d", shard);
+         atomic_fetch_add(&config->remote_write_dropped, (unsigned long)samples);
+         status = 1;
+      }
+
+      free(request);
+      free(compressed);
+   }
+
+   spool_bound(directory);
+
+   return status;
+}
+
+int
+pgexporter_remote_write_flush(void)
+{
+   char directory[MAX_PATH];
+   char** files = NULL;
+   int number_of_files = 0;
+   pid_t pids[REMOTE_WRITE_MAX_SHARDS];
+   struct configuration* config = (struct configuration*)shmem;
+   int shards;
+   int status = 0;
+
+   if (config->remote_write_url[0] == '\0')
+   {
+      return 0;
+   }
+
+   shards = MAX(MIN(config->remote_write_shards, REMOTE_WRITE_MAX_SHARDS), 1);
+   spool_directory(directory, sizeof(directory));
+
+   if (!pgexporter_exists(directory) || pgexporter_get_files(directory, &number_of_files, &files))
+   {
+      return 0;
+   }
+
+   if (shards == 1)
+   {
+      status = flush_shard(directory, files, number_of_files, 0, 1);
+   }
+   else
+   {
+      /* The shards are sent in parallel, each by its own process */
+      for (int shard = 0; shard < shards; shard++)
+      {
+         pids[shard] = fork();
+
+         if (pids[shard] == 0)
+         {
+            exit(flush_shard(directory, files, number_of_files, shard, shards));
+         }
+         else if (pids[shard] < 0)
+         {
+            pgexporter_log_error("remote_write: failed to fork shard %d", shard);
+            status = 1;
+         }
+      }
+
+      for (int shard = 0; shard < shards; shard++)
+      {
+         int child_status = 0;
+
+         if (pids[shard] > 0)
+         {
+            if (waitpid(pids[shard], &child_status, 0) < 0 ||
+                !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0)
+            {
+               status = 1;
+            }
+         }
+      }
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   spool_bound(directory);
+
+   return status;
+}
+
+void
+pgexporter_remote_write_tick_cb(void)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   pid_t pid;
+   bool expected = false;
+
+   if (config == NULL || config->remote_write_url[0] == '\0')
+   {
+      return;
+   }
+
+   if (!atomic_compare_exchange_strong(&config->remote_write_running, &expected, true))
+   {
+      /* Previous sender still running */
+      return;
+   }
+
+   pid = fork();
+   if (pid < 0)
+   {
+      pgexporter_log_error("remote_write: failed to fork sender");
+      atomic_store(&config->remote_write_running, false);
+      return;
+   }
+   else if (pid > 0)
+   {
+      /* Record sender pid so sigchld_cb can clear the running flag
+       * if the sender dies before resetting it itself. */
+      atomic_store(&config->remote_write_pid, (int)pid);
+      return;
+   }
+
+   if (pgexporter_remote_write_flush() != 0)
+   {
+      pgexporter_log_debug("remote_write: flush incomplete, segments kept in the spool");
+   }
+
+   atomic_store(&config->remote_write_pid, 0);
+   atomic_store(&config->remote_write_running, false);
+   exit(0);
+}
+
+static int
+buffer_reserve(struct remote_write_buffer* buffer, size_t size)
+{
+   unsigned char* data = NULL;
+   size_t capacity;
+
+   if (buffer->size + size <= buffer->capacity)
+   {
+      return 0;
+   }
+
+   capacity = MAX(buffer->capacity * 2, buffer->size + size);
+   capacity = MAX(capacity, (size_t)4096);
+
+   data = realloc(buffer->data, capacity);
+   if (data == NULL)
+   {
+      return 1;
+   }
+
+   buffer->data = data;
+   buffer->capacity = capacity;
+
+   return 0;
+}
+
+static int
+buffer_append(struct remote_write_buffer* buffer, const void* data, size_t size)
+{
+   if (buffer_reserve(buffer, size))
+   {
+      return 1;
+   }
+
+   if (size > 0)
+   {
+      memcpy(buffer->data + buffer->size, data, size);
+      buffer->size += size;
+   }
+
+   return 0;
+}
+
+static int
+buffer_varint(struct remote_write_buffer* buffer, uint64_t value)
+{
+   unsigned char bytes[10];
+   size_t n = 0;
+
+   while (value >= 0x80)
+   {
+      bytes[n++] = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+   bytes[n++] = (unsigned char)value;
+
+   return buffer_append(buffer, bytes, n);
+}
+
+static int
+buffer_string(struct remote_write_buffer* buffer, int field, const char* s)
+{
+   size_t length = strlen(s);
+
+   if (buffer_varint(buffer, ((uint64_t)field << 3) | 2) ||
+       buffer_varint(buffer, length) ||
+       buffer_append(buffer, s, length))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Encode a record as a TimeSeries with a single sample. A record with
+ * more than REMOTE_WRITE_MAX_LABELS labels is rejected instead of being
+ * sent with a truncated label set
+ *
+ * message TimeSeries { repeated Label labels = 1; repeated Sample samples = 2; }
+ * message Label { string name = 1; string value = 2; }
+ * message Sample { double value = 1; int64 timestamp = 2; }
+ */
+static int
+encode_series(struct remote_write_buffer* buffer, struct remote_write_buffer* scratch, struct history_record* record, bool* rejected)
+{
+   struct remote_write_label labels[REMOTE_WRITE_MAX_LABELS];
+   struct remote_write_label extra;
+   struct remote_write_label* label = NULL;
+   const char* position = record->labels;
+   unsigned char sample[9];
+   struct remote_write_buffer s = {0};
+   uint64_t bits;
+   int number_of_labels = 0;
+   bool has_server = false;
+
+   *rejected = false;
+
+   pgexporter_snprintf(labels[0].name, sizeof(labels[0].name), "__name__");
+   pgexporter_snprintf(labels[0].value, sizeof(labels[0].value), "%s", record->metric);
+   number_of_labels = 1;
+
+   while (number_of_labels < REMOTE_WRITE_MAX_LABELS)
+   {
+      label = &labels[number_of_labels];
+
+      if (!pgexporter_history_label_next(&position, label->name, sizeof(label->name),
+                                         label->value, sizeof(label->value)))
+      {
+         break;
+      }
+
+      if (!strcmp(label->name, "server"))
+      {
+         has_server = true;
+      }
+
+      number_of_labels++;
+   }
+
+   /* The server label needs a slot of its own unless the record has one */
+   if (number_of_labels == REMOTE_WRITE_MAX_LABELS &&
+       (!has_server || pgexporter_history_label_next(&position, extra.name, sizeof(extra.name),
+                                                     extra.value, sizeof(extra.value))))
+   {
+      *rejected = true;
+      return 0;
+   }
+
+   if (!has_server)
+   {
+      label = &labels[number_of_labels++];
+      pgexporter_snprintf(label->name, sizeof(label->name), "server");
+      pgexporter_snprintf(label->value, sizeof(label->value), "%s", record->server);
+   }
+
+   /* Receivers expect the labels sorted by name */
+   qsort(labels, number_of_labels, sizeof(struct remote_write_label), compare_labels);
+
+   scratch->size = 0;
+
+   for (int i = 0; i < number_of_labels; i++)
+   {
+      s.size = 0;
+
+      if (buffer_string(&s, 1, labels[i].name) ||
+          buffer_string(&s, 2, labels[i].value) ||
+          buffer_varint(scratch, (1 << 3) | 2) ||
+          buffer_varint(scratch, s.size) ||
+          buffer_append(scratch, s.data, s.size))
+      {
+         goto error;
+      }
+   }
+
+   memcpy(&bits, &record->value, sizeof(bits));
+   s.size = 0;
+   sample[0] = (1 << 3) | 1;
+   for (int i = 0; i < 8; i++)
+   {
+      sample[1 + i] = (unsigned char)(bits >> (8 * i));
+   }
+
+   if (buffer_append(&s, sample, 9) ||
+       buffer_varint(&s, (2 << 3) | 0) ||
+       buffer_varint(&s, (uint64_t)((int64_t)record->ts * 1000)) ||
+       buffer_varint(scratch, (2 << 3) | 2) ||
+       buffer_varint(scratch, s.size) ||
+       buffer_append(scratch, s.data, s.size))
+   {
+      goto error;
+   }
+
+   if (buffer_varint(buffer, (1 << 3) | 2) ||
+       buffer_varint(buffer, scratch->size) ||
+       buffer_append(buffer, scratch->data, scratch->size))
+   {
+      goto error;
+   }
+
+   free(s.data);
+
+   return 0;
+
+error:
+
+   free(s.data);
+
+   return 1;
+}
+
+static int
+compare_labels(const void* a, const void* b)
+{
+   return strcmp(((struct remote_write_label*)a)->name, ((struct remote_write_label*)b)->name);
+}
+
+/**
+ * A series always maps to the same shard, so its samples are sent in order
+ */
+static int
+record_shard(struct history_record* record, int shards)
+{
+   uint32_t hash = 2166136261U;
+   const char* parts[3] = {record->server, record->metric, record->labels != NULL ? record->labels : ""};
+
+   if (shards <= 1)
+   {
+      return 0;
+   }
+
+   for (int i = 0; i < 3; i++)
+   {
+      for (const char* p = parts[i]; *p != '\0'; p++)
+      {
+         hash = (hash ^ (unsigned char)*p) * 16777619U;
+      }
+      hash = (hash ^ 0x1F) * 16777619U;
+   }
+
+   return (int)(hash % (uint32_t)shards);
+}
+
+static void
+spool_directory(char* directory, size_t size)
+{
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (config->remote_write_spool[0] != '\0')
+   {
+      pgexporter_snprintf(directory, size, "%s", config->remote_write_spool);
+   }
+   else
+   {
+      pgexporter_snprintf(directory, size, "%s.remote_write", config->history_path);
+   }
+}
+
+static bool
+is_segment(char* name)
+{
+   size_t length = strlen(name);
+   size_t suffix = strlen(REMOTE_WRITE_SUFFIX);
+
+   return length > suffix && !strcmp(name + length - suffix, REMOTE_WRITE_SUFFIX) &&
+          strchr(name, '-') != NULL;
+}
+
+static unsigned long long
+segment_sequence(char* name)
+{
+   return strtoull(name, NULL, 10);
+}
+
+static int
+segment_shard(char* name)
+{
+   char* dash = strchr(name, '-');
+
+   return dash != NULL ? atoi(dash + 1) : 0;
+}
+
+static int
+segment_read(char* path, void** data, size_t* size, uint32_t* samples)
+{
+   FILE* file = NULL;
+   unsigned char header[REMOTE_WRITE_HEADER_SIZE];
+   struct stat st;
+   void* d = NULL;
+   size_t s;
+
+   if (data != NULL)
+   {
+      *data = NULL;
+      *size = 0;
+   }
+   *samples = 0;
+
+   file = fopen(path, "r");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   if (fstat(fileno(file), &st) != 0 || st.st_size < REMOTE_WRITE_HEADER_SIZE)
+   {
+      goto error;
+   }
+
+   if (fread(header, 1, REMOTE_WRITE_HEADER_SIZE, file) != REMOTE_WRITE_HEADER_SIZE ||
+       memcmp(header, REMOTE_WRITE_MAGIC, REMOTE_WRITE_MAGIC_LENGTH))
+   {
+      goto error;
+   }
+
+   memcpy(samples, header + REMOTE_WRITE_MAGIC_LENGTH, sizeof(uint32_t));
+
+   if (data != NULL)
+   {
+      s = (size_t)st.st_size - REMOTE_WRITE_HEADER_SIZE;
+      d = malloc(s > 0 ? s : 1);
+
+      if (d == NULL || fread(d, 1, s, file) != s)
+      {
+         goto error;
+      }
+
+      *data = d;
+      *size = s;
+   }
+
+   fclose(file);
+
+   return 0;
+
+error:
+
+   free(d);
+
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+
+   return 1;
+}
+
+static int
+segment_write(char* directory, unsigned long long sequence, int shard, void* data, size_t size, uint32_t samples)
+{
+   char tmp[MAX_PATH];
+   char path[MAX_PATH];
+   unsigned char header[REMOTE_WRITE_HEADER_SIZE];
+   FILE* file = NULL;
+
+   memset(header, 0, sizeof(header));
+   memcpy(header, REMOTE_WRITE_MAGIC, REMOTE_WRITE_MAGIC_LENGTH);
+   memcpy(header + REMOTE_WRITE_MAGIC_LENGTH, &samples, sizeof(uint32_t));
+
+   pgexporter_snprintf(tmp, sizeof(tmp), "%s/%016llu-%02d.tmp", directory, sequence, shard);
+   pgexporter_snprintf(path, sizeof(path), "%s/%016llu-%02d%s", directory, sequence, shard, REMOTE_WRITE_SUFFIX);
+
+   file = fopen(tmp, "w");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+       fwrite(data, 1, size, file) != size ||
+       fflush(file) != 0 || fsync(fileno(file)) != 0)
+   {
+      goto error;
+   }
+
+   fclose(file);
+   file = NULL;
+
+   /* A segment is only visible to the sender once it is complete */
+   if (rename(tmp, path) != 0)
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   unlink(tmp);
+
+   return 1;
+}
+
+/**
+ * Drop the oldest segments until the spool fits remote_write_spool_size
+ */
+static void
+spool_bound(char* directory)
+{
+   char path[MAX_PATH];
+   char** files = NULL;
+   off_t* sizes = NULL;
+   int number_of_files = 0;
+   int64_t total = 0;
+   struct stat st;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (pgexporter_get_files(directory, &number_of_files, &files))
+   {
+      return;
+   }
+
+   sizes = calloc(number_of_files > 0 ? number_of_files : 1, sizeof(off_t));
+   if (sizes == NULL)
+   {
+      goto cleanup;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      pgexporter_snprintf(path, sizeof(path), "%s/%s", directory, files[i]);
+
+      if (is_segment(files[i]) && stat(path, &st) == 0)
+      {
+         sizes[i] = st.st_size;
+         total += st.st_size;
+      }
+   }
+
+   for (int i = 0; i < number_of_files && total > (int64_t)config->remote_write_spool_size; i++)
+   {
+      uint32_t samples = 0;
+
+      if (sizes[i] == 0)
+      {
+         continue;
+      }
+
+      pgexporter_snprintf(path, sizeof(path), "%s/%s", directory, files[i]);
+      segment_read(path, NULL, NULL, &samples);
+
+      if (pgexporter_delete_file(path) == 0)
+      {
+         pgexporter_log_warn("remote_write: spool full, dropped %s (%u samples)", files[i], samples);
+         atomic_fetch_add(&config->remote_write_dropped, (unsigned long)samples);
+         total -= sizes[i];
+      }
+   }
+
+   atomic_store(&config->remote_write_spool_used, total);
+
+cleanup:
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+   free(sizes);
+}
+
+static int
+flush_shard(char* directory, char** files, int number_of_files, int shard, int shards)
+{
+   char host[MISC_LENGTH];
+   char path[MAX_PATH];
+   char file[MAX_PATH];
+   int port = 0;
+   bool secure = false;
+   struct http* http = NULL;
+   int result = 0;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (pgexporter_remote_write_parse_url(config->remote_write_url, host, sizeof(host), &port, &secure, path, sizeof(path)))
+   {
+      pgexporter_log_error("remote_write: invalid url %s", config->remote_write_url);
+      return 1;
+   }
+
+   /* The files are sorted, so every shard sends its oldest segment first */
+   for (int i = 0; i < number_of_files; i++)
+   {
+      void* data = NULL;
+      size_t size = 0;
+      uint32_t samples = 0;
+      int status;
+
+      if (!is_segment(files[i]) || segment_shard(files[i]) % shards != shard)
+      {
+         continue;
+      }
+
+      pgexporter_snprintf(file, sizeof(file), "%s/%s", directory, files[i]);
+
+      if (segment_read(file, &data, &size, &samples))
+      {
+         if (!pgexporter_exists(file))
+         {
+            /* Dropped by spool_bound in the meantime */
+            continue;
+         }
+
+         pgexporter_log_warn("remote_write: removing unreadable segment %s", file);
+         pgexporter_delete_file(file);
+         continue;
+      }
+
+      status = 0;
+      for (int attempt = 0; attempt < REMOTE_WRITE_ATTEMPTS; attempt++)
+      {
+         if (attempt > 0)
+         {
+            atomic_fetch_add(&config->remote_write_retries, 1);
+            SLEEP(REMOTE_WRITE_BACKOFF << (attempt - 1));
+         }
+
+         status = send_segment(&http, host, port, secure, path, data, size);
+
+         /* Only connection errors, 5xx and 429 are worth another attempt */
+         if ((status >= 200 && status < 300) || (status >= 400 && status < 500 && status != 429))
+         {
+            break;
+         }
+      }
+
+      free(data);
+
+      if (status >= 200 && status < 300)
+      {
+         atomic_fetch_add(&config->remote_write_samples, (unsigned long)samples);
+         pgexporter_delete_file(file);
+      }
+      else if (status >= 400 && status < 500 && status != 429)
+      {
+         pgexporter_log_error("remote_write: %s rejected with %d, dropping %u samples", file, status, samples);
+         atomic_fetch_add(&config->remote_write_failures, 1);
+         atomic_fetch_add(&config->remote_write_dropped, (unsigned long)samples);
+         pgexporter_delete_file(file);
+      }
+      else
+      {
+         /* Keep the order of the series, the segment and its successors are retried on the next flush */
+         pgexporter_log_warn("remote_write: failed to send %s (%d)", file, status);
+         atomic_fetch_add(&config->remote_write_failures, 1);
+         result = 1;
+         break;
+      }
+   }
+
+   if (http != NULL)
+   {
+      pgexporter_http_destroy(http);
+   }
+
+   return result;
+}
+
+/**
+ * Send a compressed WriteRequest. The connection is opened on first use
+ * and kept for the following segments of the shard, it is closed when
+ * the request fails or the endpoint does not keep it alive
+ * @return The HTTP status code, or 0 if the request failed
+ */
+static int
+send_segment(struct http** http, char* host, int port, bool secure, char* path, void* data, size_t size)
+{
+   struct http_request* request = NULL;
+   struct http_response* response = NULL;
+   char* connection = NULL;
+   bool reuse = false;
+   int status = 0;
+
+   if (*http == NULL && pgexporter_http_create(host, port, secure, http) != PGEXPORTER_HTTP_STATUS_OK)
+   {
+      *http = NULL;
+      goto cleanup;
+   }
+
+   if (pgexporter_http_request_create(PGEXPORTER_HTTP_POST, path, &request) != PGEXPORTER_HTTP_STATUS_OK ||
+       pgexporter_http_request_add_header(request, "Content-Encoding", "snappy") != PGEXPORTER_HTTP_STATUS_OK ||
+       pgexporter_http_request_add_header(request, "Content-Type", "application/x-protobuf") != PGEXPORTER_HTTP_STATUS_OK ||
+       pgexporter_http_request_add_header(request, "X-Prometheus-Remote-Write-Version", "0.1.0") != PGEXPORTER_HTTP_STATUS_OK ||
+       pgexporter_http_set_data(request, data, size) != PGEXPORTER_HTTP_STATUS_OK)
+   {
+      goto cleanup;
+   }
+
+   request->keep_alive = true;
+
+   if (pgexporter_http_invoke(*http, request, &response) != PGEXPORTER_HTTP_STATUS_OK || response == NULL)
+   {
+      goto cleanup;
+   }
+
+   status = response->status_code;
+
+   /* Without a framed body the response ends with the connection */
+   connection = (char*)pgexporter_deque_get(response->payload.headers, "Connection");
+   reuse = (connection == NULL || strcasestr(connection, "close") == NULL) &&
+           ((char*)pgexporter_deque_get(response->payload.headers, "Content-Length") != NULL ||
+            (char*)pgexporter_deque_get(response->payload.headers, "Transfer-Encoding") != NULL);
+
+cleanup:
+
+   if (response != NULL)
+   {
+      pgexporter_http_response_destroy(response);
+   }
+   if (request != NULL)
+   {
+      pgexporter_http_request_destroy(request);
+   }
+   if (!reuse && *http != NULL)
+   {
+      pgexporter_http_destroy(*http);
+      *http = NULL;
+   }
+
+   return status;
+}
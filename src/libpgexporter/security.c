@@ -35,6 +35,7 @@
 #include <network.h>
 #include <prometheus.h>
 #include <security.h>
+#include <shmem.h>
 #include <utf8.h>
 #include <utils.h>
 
@@ -42,6 +43,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -51,6 +53,7 @@
 #include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
@@ -72,8 +75,11 @@
 
 #define NUMBER_OF_SECURITY_MESSAGES 5
 #define SECURITY_BUFFER_SIZE        16384 /* Must hold a PasswordMessage carrying a MAX_PASSWORD_LENGTH credential (cloud IAM tokens) */
+#define SHARED_CACHE_LOCK_ATTEMPTS  1000
 
 static signed char has_security;
+static int tls_session_index = -1;
+static unsigned char scram_cache_secret[SHA256_DIGEST_LENGTH];
 static ssize_t security_lengths[NUMBER_OF_SECURITY_MESSAGES];
 static char security_messages[NUMBER_OF_SECURITY_MESSAGES][SECURITY_BUFFER_SIZE];
 
@@ -83,7 +89,7 @@ static int client_scram256(SSL* c_ssl, int client_fd, char* username, char* pass
 
 static int server_trust(void);
 static int server_password(char* username, char* password, SSL* ssl, int server_fd);
-static int server_scram256(char* username, char* password, SSL* ssl, int server_fd);
+static int server_scram256(int server, char* username, char* password, SSL* ssl, int server_fd);
 
 static char* get_admin_password(char* username);
 
@@ -91,17 +97,26 @@ static int sasl_prep(char* password, char** password_prep);
 static int generate_nounce(char** nounce);
 static int scram_parse_iterations(char* str, int* iterations);
 static int get_scram_attribute(char attribute, char* input, size_t size, char** value);
-static int client_proof(char* password, char* salt, int salt_length, int iterations,
+static int client_proof(unsigned char* salted_password, int salted_password_length,
                         char* client_first_message_bare, size_t client_first_message_bare_length,
                         char* server_first_message, size_t server_first_message_length,
                         char* client_final_message_wo_proof, size_t client_final_message_wo_proof_length,
                         unsigned char** result, size_t* result_length);
 static int salted_password(char* password, char* salt, int salt_length, int iterations, unsigned char** result, int* result_length);
+static int scram_cache_find(struct scram_cache* cache, char* server, char* username, char* salt, int salt_length,
+                            int iterations, unsigned char* verifier);
+static int scram_cache_victim(struct scram_cache* cache);
+static bool shared_cache_lock(atomic_schar* lock);
+static void shared_cache_lock_wait(atomic_schar* lock);
+static void shared_cache_unlock(atomic_schar* lock);
+static int tls_session_ex_index(void);
+static void tls_session_peer_free(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+static int tls_session_new_cb(SSL* ssl, SSL_SESSION* session);
 static int salted_password_key(unsigned char* salted_password, int salted_password_length, char* key,
                                unsigned char** result, int* result_length);
 static int stored_key(unsigned char* client_key, int client_key_length, unsigned char** result, int* result_length);
 static int generate_salt(char** salt, int* size);
-static int server_signature(char* password, char* salt, int salt_length, int iterations,
+static int server_signature(unsigned char* salted_password, int salted_password_length,
                             char* server_key, int server_key_length,
                             char* client_first_message_bare, size_t client_first_message_bare_length,
                             char* server_first_message, size_t server_first_message_length,
@@ -129,7 +144,7 @@ pgexporter_remote_management_auth(int client_fd, char* address, SSL** client_ssl
    *client_ssl = NULL;
 
    /* Receive client calls - at any point if client exits return AUTH_ERROR */
-   status = pgexporter_read_timeout_message(NULL, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S), &msg);
+   status = pgexporter_read_timeout_message(NULL, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS), &msg);
    if (status != MESSAGE_STATUS_OK)
    {
       goto error;
@@ -177,7 +192,7 @@ pgexporter_remote_management_auth(int client_fd, char* address, SSL** client_ssl
             goto error;
          }
 
-         status = pgexporter_read_timeout_message(c_ssl, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S), &msg);
+         status = pgexporter_read_timeout_message(c_ssl, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS), &msg);
          if (status != MESSAGE_STATUS_OK)
          {
             goto error;
@@ -193,7 +208,7 @@ pgexporter_remote_management_auth(int client_fd, char* address, SSL** client_ssl
          }
          pgexporter_clear_message();
 
-         status = pgexporter_read_timeout_message(NULL, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S), &msg);
+         status = pgexporter_read_timeout_message(NULL, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS), &msg);
          if (status != MESSAGE_STATUS_OK)
          {
             goto error;
@@ -304,6 +319,8 @@ pgexporter_remote_management_scram_sha256(char* username, char* password, int se
    char* salt = NULL;
    size_t salt_length = 0;
    char* password_prep = NULL;
+   unsigned char* s_p = NULL;
+   int s_p_length = 0;
    char* client_nounce = NULL;
    char* combined_nounce = NULL;
    char* base64_salt = NULL;
@@ -526,7 +543,12 @@ pgexporter_remote_management_scram_sha256(char* username, char* password, int se
    /* r=...,s=...,i=4096 */
    server_first_message = sasl_continue->data + 9;
 
-   if (client_proof(password_prep, salt, salt_length, iteration,
+   if (salted_password(password_prep, salt, salt_length, iteration, &s_p, &s_p_length))
+   {
+      goto error;
+   }
+
+   if (client_proof(s_p, s_p_length,
                     client_first_message_bare, sasl_response->length - 26,
                     server_first_message, sasl_continue->length - 9,
                     &wo_proof[0], strlen(wo_proof),
@@ -570,7 +592,7 @@ pgexporter_remote_management_scram_sha256(char* username, char* password, int se
    base64_server_signature = sasl_final->data + 11;
    pgexporter_base64_decode(base64_server_signature, sasl_final->length - 11, (void**)&server_signature_received, &server_signature_received_length);
 
-   if (server_signature(password_prep, salt, salt_length, iteration,
+   if (server_signature(s_p, s_p_length,
                         NULL, 0,
                         client_first_message_bare, sasl_response->length - 26,
                         server_first_message, sasl_continue->length - 9,
@@ -598,6 +620,7 @@ pgexporter_remote_management_scram_sha256(char* username, char* password, int se
    free(salt);
    free(err);
    free(password_prep);
+   free(s_p);
    free(client_nounce);
    free(combined_nounce);
    free(base64_salt);
@@ -624,6 +647,7 @@ bad_password:
    free(salt);
    free(err);
    free(password_prep);
+   free(s_p);
    free(client_nounce);
    free(combined_nounce);
    free(base64_salt);
@@ -650,6 +674,7 @@ error:
    free(salt);
    free(err);
    free(password_prep);
+   free(s_p);
    free(client_nounce);
    free(combined_nounce);
    free(base64_salt);
@@ -769,6 +794,8 @@ client_scram256(SSL* c_ssl, int client_fd, char* username __attribute__((unused)
    time_t start_time;
    bool non_blocking;
    char* password_prep = NULL;
+   unsigned char* s_p = NULL;
+   int s_p_length = 0;
    char* client_first_message_bare = NULL;
    char* server_first_message = NULL;
    char* client_final_message_without_proof = NULL;
@@ -809,7 +836,7 @@ client_scram256(SSL* c_ssl, int client_fd, char* username __attribute__((unused)
 
    /* psql may just close the connection without word, so loop */
 retry:
-   status = pgexporter_read_timeout_message(c_ssl, client_fd, 1, &msg);
+   status = pgexporter_read_timeout_message(c_ssl, client_fd, 1000, &msg);
    if (status != MESSAGE_STATUS_OK)
    {
       if (difftime(time(NULL), start_time) < pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S))
@@ -874,7 +901,7 @@ retry:
       goto error;
    }
 
-   status = pgexporter_read_timeout_message(c_ssl, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_S), &msg);
+   status = pgexporter_read_timeout_message(c_ssl, client_fd, pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS), &msg);
    if (status != MESSAGE_STATUS_OK)
    {
       goto error;
@@ -901,7 +928,12 @@ retry:
 
    sasl_prep(password, &password_prep);
 
-   if (client_proof(password_prep, salt, salt_length, 4096,
+   if (salted_password(password_prep, salt, salt_length, 4096, &s_p, &s_p_length))
+   {
+      goto error;
+   }
+
+   if (client_proof(s_p, s_p_length,
                     client_first_message_bare, strlen(client_first_message_bare),
                     server_first_message, strlen(server_first_message),
                     client_final_message_without_proof, strlen(client_final_message_without_proof),
@@ -916,7 +948,7 @@ retry:
       goto bad_password;
    }
 
-   if (server_signature(password_prep, salt, salt_length, 4096,
+   if (server_signature(s_p, s_p_length,
                         NULL, 0,
                         client_first_message_bare, strlen(client_first_message_bare),
                         server_first_message, strlen(server_first_message),
@@ -948,6 +980,7 @@ retry:
    pgexporter_log_debug("client_scram256 done");
 
    free(password_prep);
+   free(s_p);
    free(client_first_message_bare);
    free(server_first_message);
    free(client_final_message_without_proof);
@@ -968,6 +1001,7 @@ retry:
 
 bad_password:
    free(password_prep);
+   free(s_p);
    free(client_first_message_bare);
    free(server_first_message);
    free(client_final_message_without_proof);
@@ -988,6 +1022,7 @@ bad_password:
 
 error:
    free(password_prep);
+   free(s_p);
    free(client_first_message_bare);
    free(server_first_message);
    free(client_final_message_without_proof);
@@ -1015,6 +1050,7 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
    int ret;
    int status = AUTH_ERROR;
    int connect;
+   char peer[MISC_LENGTH];
    SSL* c_ssl = NULL;
    struct message* ssl_msg = NULL;
    struct message* startup_msg = NULL;
@@ -1102,6 +1138,12 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
             goto error;
          }
 
+         pgexporter_snprintf(&peer[0], sizeof(peer), "postgresql:%s", config->servers[server].name);
+         if (pgexporter_tls_session_prepare(c_ssl, &peer[0]))
+         {
+            goto error;
+         }
+
          do
          {
             connect = SSL_connect(c_ssl);
@@ -1141,6 +1183,8 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
             }
          }
          while (connect != 1);
+
+         pgexporter_tls_session_account(c_ssl);
       }
    }
 
@@ -1186,7 +1230,7 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
    }
    else if (auth_type == SECURITY_SCRAM256)
    {
-      status = server_scram256(username, password, c_ssl, server_fd);
+      status = server_scram256(server, username, password, c_ssl, server_fd);
    }
 
    if (status == AUTH_BAD_PASSWORD)
@@ -1351,13 +1395,15 @@ error:
 }
 
 static int
-server_scram256(char* username, char* password, SSL* ssl, int server_fd)
+server_scram256(int server, char* username, char* password, SSL* ssl, int server_fd)
 {
    int status = MESSAGE_STATUS_ERROR;
    int auth_index = 1;
    char* salt = NULL;
    size_t salt_length = 0;
    char* password_prep = NULL;
+   unsigned char* s_p = NULL;
+   int s_p_length = 0;
    char* client_nounce = NULL;
    char* combined_nounce = NULL;
    char* base64_salt = NULL;
@@ -1465,7 +1511,12 @@ server_scram256(char* username, char* password, SSL* ssl, int server_fd)
    /* r=...,s=...,i=4096 */
    server_first_message = security_messages[2] + 9;
 
-   if (client_proof(password_prep, salt, salt_length, iteration,
+   if (pgexporter_scram_salted_password(server, username, password_prep, salt, salt_length, iteration, &s_p, &s_p_length))
+   {
+      goto error;
+   }
+
+   if (client_proof(s_p, s_p_length,
                     client_first_message_bare, security_lengths[1] - 26,
                     server_first_message, security_lengths[2] - 9,
                     &wo_proof[0], strlen(wo_proof),
@@ -1525,7 +1576,7 @@ server_scram256(char* username, char* password, SSL* ssl, int server_fd)
    pgexporter_base64_decode(base64_server_signature, sasl_final->length - 11,
                             (void**)&server_signature_received, &server_signature_received_length);
 
-   if (server_signature(password_prep, salt, salt_length, iteration,
+   if (server_signature(s_p, s_p_length,
                         NULL, 0,
                         client_first_message_bare, security_lengths[1] - 26,
                         server_first_message, security_lengths[2] - 9,
@@ -1546,6 +1597,7 @@ server_scram256(char* username, char* password, SSL* ssl, int server_fd)
    free(salt);
    free(err);
    free(password_prep);
+   free(s_p);
    free(client_nounce);
    free(combined_nounce);
    free(base64_salt);
@@ -1569,6 +1621,7 @@ bad_password:
    free(salt);
    free(err);
    free(password_prep);
+   free(s_p);
    free(client_nounce);
    free(combined_nounce);
    free(base64_salt);
@@ -1590,6 +1643,7 @@ error:
    free(salt);
    free(err);
    free(password_prep);
+   free(s_p);
    free(client_nounce);
    free(combined_nounce);
    free(base64_salt);
@@ -2088,15 +2142,13 @@ error:
 }
 
 static int
-client_proof(char* password, char* salt, int salt_length, int iterations,
+client_proof(unsigned char* salted_password, int salted_password_length,
              char* client_first_message_bare, size_t client_first_message_bare_length,
              char* server_first_message, size_t server_first_message_length,
              char* client_final_message_wo_proof, size_t client_final_message_wo_proof_length,
              unsigned char** result, size_t* result_length)
 {
    size_t size = 32;
-   unsigned char* s_p = NULL;
-   int s_p_length;
    unsigned char* c_k = NULL;
    int c_k_length;
    unsigned char* s_k = NULL;
@@ -2119,12 +2171,8 @@ client_proof(char* password, char* salt, int salt_length, int iterations,
    OSSL_PARAM params[2];
    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
    params[1] = OSSL_PARAM_construct_end();
-   if (salted_password(password, salt, salt_length, iterations, &s_p, &s_p_length))
-   {
-      goto error;
-   }
 
-   if (salted_password_key(s_p, s_p_length, "Client Key", &c_k, &c_k_length))
+   if (salted_password_key(salted_password, salted_password_length, "Client Key", &c_k, &c_k_length))
    {
       goto error;
    }
@@ -2188,7 +2236,6 @@ client_proof(char* password, char* salt, int salt_length, int iterations,
    EVP_MAC_CTX_free(ctx);
    EVP_MAC_free(mac);
 
-   free(s_p);
    free(c_k);
    free(s_k);
    free(c_s);
@@ -2208,7 +2255,6 @@ error:
       EVP_MAC_free(mac);
    }
 
-   free(s_p);
    free(c_k);
    free(s_k);
    free(c_s);
@@ -2327,6 +2373,327 @@ error:
    return 1;
 }
 
+int
+pgexporter_scram_salted_password(int server, char* username, char* password, char* salt, int salt_length, int iterations,
+                                 unsigned char** result, int* result_length)
+{
+   unsigned char verifier[SHA256_DIGEST_LENGTH];
+   size_t verifier_length = 0;
+   unsigned char* r = NULL;
+   int r_length = 0;
+   int slot = -1;
+   struct scram_cache* cache = (struct scram_cache*)scram_cache_shmem;
+   struct scram_cache_entry* entry = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   char* name = config->servers[server].name;
+
+   if (cache == NULL || salt_length <= 0 || salt_length > SCRAM_CACHE_MAX_SALT_LENGTH ||
+       strlen(name) >= MISC_LENGTH || strlen(username) >= MAX_USERNAME_LENGTH)
+   {
+      return salted_password(password, salt, salt_length, iterations, result, result_length);
+   }
+
+   /* The password is only kept as a keyed hash, so the shared memory can not be used to test guesses */
+   if (EVP_Q_mac(NULL, "HMAC", NULL, "SHA256", NULL, scram_cache_secret, sizeof(scram_cache_secret),
+                 (unsigned char*)password, strlen(password), &verifier[0], sizeof(verifier), &verifier_length) == NULL)
+   {
+      goto error;
+   }
+
+   if (shared_cache_lock(&cache->lock))
+   {
+      slot = scram_cache_find(cache, name, username, salt, salt_length, iterations, verifier);
+
+      if (slot != -1)
+      {
+         entry = &cache->entries[slot];
+
+         r = malloc(SHA256_DIGEST_LENGTH);
+         if (r != NULL)
+         {
+            memcpy(r, entry->salted_password, SHA256_DIGEST_LENGTH);
+            entry->last_used = ++cache->tick;
+         }
+         shared_cache_unlock(&cache->lock);
+
+         if (r == NULL)
+         {
+            goto error;
+         }
+
+         atomic_fetch_add(&cache->hits, 1);
+
+         *result = r;
+         *result_length = SHA256_DIGEST_LENGTH;
+
+         return 0;
+      }
+
+      shared_cache_unlock(&cache->lock);
+   }
+
+   atomic_fetch_add(&cache->misses, 1);
+
+   if (salted_password(password, salt, salt_length, iterations, &r, &r_length))
+   {
+      goto error;
+   }
+
+   if (r_length == SHA256_DIGEST_LENGTH && shared_cache_lock(&cache->lock))
+   {
+      /* Another process may have added the entry, or taken the slot, while the lock was released */
+      slot = scram_cache_find(cache, name, username, salt, salt_length, iterations, verifier);
+
+      if (slot == -1)
+      {
+         slot = scram_cache_victim(cache);
+         entry = &cache->entries[slot];
+
+         memset(entry, 0, sizeof(struct scram_cache_entry));
+         memcpy(entry->server, name, strlen(name));
+         memcpy(entry->username, username, strlen(username));
+         memcpy(entry->salt, salt, salt_length);
+         entry->salt_length = salt_length;
+         entry->iterations = iterations;
+         memcpy(entry->verifier, verifier, sizeof(verifier));
+         memcpy(entry->salted_password, r, SHA256_DIGEST_LENGTH);
+         entry->in_use = true;
+      }
+
+      cache->entries[slot].last_used = ++cache->tick;
+
+      shared_cache_unlock(&cache->lock);
+   }
+
+   OPENSSL_cleanse(verifier, sizeof(verifier));
+
+   *result = r;
+   *result_length = r_length;
+
+   return 0;
+
+error:
+
+   OPENSSL_cleanse(verifier, sizeof(verifier));
+
+   *result = NULL;
+   *result_length = 0;
+
+   return 1;
+}
+
+/**
+ * Find the SCRAM cache entry of a key.
+ * Requires the caller to hold the lock.
+ *
+ * @param cache The cache
+ * @param server The server name
+ * @param username The user name
+ * @param salt The salt
+ * @param salt_length The length of the salt
+ * @param iterations The iteration count
+ * @param verifier The keyed hash of the password
+ * @return The slot, or -1 if there is no entry
+ */
+static int
+scram_cache_find(struct scram_cache* cache, char* server, char* username, char* salt, int salt_length,
+                 int iterations, unsigned char* verifier)
+{
+   for (int i = 0; i < SCRAM_CACHE_ENTRIES; i++)
+   {
+      struct scram_cache_entry* entry = &cache->entries[i];
+
+      if (entry->in_use && entry->iterations == iterations && entry->salt_length == salt_length &&
+          !memcmp(entry->salt, salt, salt_length) &&
+          !strcmp(entry->server, server) &&
+          !strcmp(entry->username, username) &&
+          !memcmp(entry->verifier, verifier, SHA256_DIGEST_LENGTH))
+      {
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+/**
+ * Choose the slot for a new SCRAM cache entry, a free one
+ * or else the least recently used one.
+ * Requires the caller to hold the lock.
+ *
+ * @param cache The cache
+ * @return The slot
+ */
+static int
+scram_cache_victim(struct scram_cache* cache)
+{
+   int victim = 0;
+
+   for (int i = 0; i < SCRAM_CACHE_ENTRIES; i++)
+   {
+      if (!cache->entries[i].in_use)
+      {
+         return i;
+      }
+
+      if (cache->entries[i].last_used < cache->entries[victim].last_used)
+      {
+         victim = i;
+      }
+   }
+
+   return victim;
+}
+
+/**
+ * Take the lock of a shared cache. The caches are only an optimization,
+ * so a busy cache is skipped rather than waited for.
+ *
+ * @param lock The lock
+ * @return true if the lock was taken, otherwise false
+ */
+static bool
+shared_cache_lock(atomic_schar* lock)
+{
+   signed char cache_is_free;
+
+   for (int i = 0; i < SHARED_CACHE_LOCK_ATTEMPTS; i++)
+   {
+      cache_is_free = STATE_FREE;
+      if (atomic_compare_exchange_strong(lock, &cache_is_free, STATE_IN_USE))
+      {
+         return true;
+      }
+
+      sched_yield();
+   }
+
+   return false;
+}
+
+static void
+shared_cache_lock_wait(atomic_schar* lock)
+{
+   signed char cache_is_free = STATE_FREE;
+
+   while (!atomic_compare_exchange_strong(lock, &cache_is_free, STATE_IN_USE))
+   {
+      cache_is_free = STATE_FREE;
+      sched_yield();
+   }
+}
+
+static void
+shared_cache_unlock(atomic_schar* lock)
+{
+   atomic_store(lock, STATE_FREE);
+}
+
+static int
+tls_session_ex_index(void)
+{
+   if (tls_session_index < 0)
+   {
+      tls_session_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, tls_session_peer_free);
+   }
+
+   return tls_session_index;
+}
+
+static void
+tls_session_peer_free(void* parent __attribute__((unused)), void* ptr, CRYPTO_EX_DATA* ad __attribute__((unused)),
+                      int idx __attribute__((unused)), long argl __attribute__((unused)), void* argp __attribute__((unused)))
+{
+   free(ptr);
+}
+
+/**
+ * Store a new session of a peer prepared by pgexporter_tls_session_prepare.
+ * For TLS 1.3 this is called when the ticket arrives after the handshake.
+ *
+ * @param ssl The SSL structure
+ * @param session The session
+ * @return 0, the session is copied and not kept
+ */
+static int
+tls_session_new_cb(SSL* ssl, SSL_SESSION* session)
+{
+   char* peer = NULL;
+   int length;
+   int victim = -1;
+   time_t expires;
+   unsigned char data[TLS_SESSION_MAX_LENGTH];
+   unsigned char* p = NULL;
+   struct tls_session_cache* cache = (struct tls_session_cache*)tls_session_shmem;
+   struct tls_session_entry* entry = NULL;
+
+   if (cache == NULL || tls_session_index < 0)
+   {
+      return 0;
+   }
+
+   peer = (char*)SSL_get_ex_data(ssl, tls_session_index);
+   if (peer == NULL || !SSL_SESSION_is_resumable(session))
+   {
+      return 0;
+   }
+
+   length = i2d_SSL_SESSION(session, NULL);
+   if (length <= 0 || length > TLS_SESSION_MAX_LENGTH)
+   {
+      return 0;
+   }
+
+   p = &data[0];
+   if (i2d_SSL_SESSION(session, &p) != length)
+   {
+      OPENSSL_cleanse(&data[0], sizeof(data));
+      return 0;
+   }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30300000L
+   expires = (time_t)SSL_SESSION_get_time_ex(session) + (time_t)SSL_SESSION_get_timeout(session);
+#else
+   expires = (time_t)SSL_SESSION_get_time(session) + (time_t)SSL_SESSION_get_timeout(session);
+#endif
+
+   if (shared_cache_lock(&cache->lock))
+   {
+      for (int i = 0; i < TLS_SESSION_ENTRIES; i++)
+      {
+         entry = &cache->entries[i];
+
+         if (entry->in_use && !strcmp(entry->peer, peer))
+         {
+            victim = i;
+            break;
+         }
+
+         if (victim == -1 ||
+             (cache->entries[victim].in_use && (!entry->in_use || entry->last_used < cache->entries[victim].last_used)))
+         {
+            victim = i;
+         }
+      }
+
+      entry = &cache->entries[victim];
+
+      OPENSSL_cleanse(entry, sizeof(struct tls_session_entry));
+      memcpy(entry->peer, peer, strlen(peer));
+      entry->expires = expires;
+      entry->last_used = ++cache->tick;
+      entry->length = length;
+      memcpy(entry->data, &data[0], length);
+      entry->in_use = true;
+
+      shared_cache_unlock(&cache->lock);
+   }
+
+   OPENSSL_cleanse(&data[0], sizeof(data));
+
+   return 0;
+}
+
 static int
 salted_password_key(unsigned char* salted_password, int salted_password_length, char* key, unsigned char** result, int* result_length)
 {
@@ -2450,7 +2817,7 @@ error:
    return 1;
 }
 static int
-server_signature(char* password, char* salt, int salt_length, int iterations,
+server_signature(unsigned char* salted_password, int salted_password_length,
                  char* s_key, int s_key_length,
                  char* client_first_message_bare, size_t client_first_message_bare_length,
                  char* server_first_message, size_t server_first_message_length,
@@ -2459,8 +2826,6 @@ server_signature(char* password, char* salt, int salt_length, int iterations,
 {
    size_t size = 32;
    unsigned char* r = NULL;
-   unsigned char* s_p = NULL;
-   int s_p_length;
    unsigned char* s_k = NULL;
    int s_k_length;
    size_t length;
@@ -2484,14 +2849,9 @@ server_signature(char* password, char* salt, int salt_length, int iterations,
    OSSL_PARAM params[2];
    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
    params[1] = OSSL_PARAM_construct_end();
-   if (password != NULL)
+   if (salted_password != NULL)
    {
-      if (salted_password(password, salt, salt_length, iterations, &s_p, &s_p_length))
-      {
-         goto error;
-      }
-
-      if (salted_password_key(s_p, s_p_length, "Server Key", &s_k, &s_k_length))
+      if (salted_password_key(salted_password, salted_password_length, "Server Key", &s_k, &s_k_length))
       {
          goto error;
       }
@@ -2545,7 +2905,6 @@ server_signature(char* password, char* salt, int salt_length, int iterations,
    EVP_MAC_CTX_free(ctx);
    EVP_MAC_free(mac);
 
-   free(s_p);
    if (do_free)
    {
       free(s_k);
@@ -2566,7 +2925,6 @@ error:
    {
       EVP_MAC_free(mac);
    }
-   free(s_p);
    if (do_free)
    {
       free(s_k);
@@ -2575,6 +2933,210 @@ error:
    return 1;
 }
 
+int
+pgexporter_scram_cache_init(size_t* p_size, void** p_shmem)
+{
+   struct scram_cache* cache = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   size_t size = sizeof(struct scram_cache);
+
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   if (pgexporter_create_shared_memory(size, config->hugepage, (void*)&cache))
+   {
+      pgexporter_log_error("Cannot allocate shared memory for the SCRAM cache");
+      return 1;
+   }
+
+   memset(cache, 0, size);
+   atomic_init(&cache->lock, STATE_FREE);
+   atomic_init(&cache->hits, 0);
+   atomic_init(&cache->misses, 0);
+
+   /* The key of the password hashes lives in process memory only, and is inherited by the workers */
+   if (RAND_bytes(scram_cache_secret, sizeof(scram_cache_secret)) != 1)
+   {
+      pgexporter_log_error("Cannot generate the SCRAM cache secret");
+      pgexporter_destroy_shared_memory(cache, size);
+      return 1;
+   }
+
+   *p_size = size;
+   *p_shmem = cache;
+
+   return 0;
+}
+
+void
+pgexporter_scram_cache_reset(void)
+{
+   struct scram_cache* cache = (struct scram_cache*)scram_cache_shmem;
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   /* Users and passwords may have changed, so wait for the lock */
+   shared_cache_lock_wait(&cache->lock);
+
+   OPENSSL_cleanse(&cache->entries[0], sizeof(cache->entries));
+   cache->tick = 0;
+
+   shared_cache_unlock(&cache->lock);
+}
+
+int
+pgexporter_tls_session_init(size_t* p_size, void** p_shmem)
+{
+   struct tls_session_cache* cache = NULL;
+   struct configuration* config = (struct configuration*)shmem;
+   size_t size = sizeof(struct tls_session_cache);
+
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   if (pgexporter_create_shared_memory(size, config->hugepage, (void*)&cache))
+   {
+      pgexporter_log_error("Cannot allocate shared memory for the TLS sessions");
+      return 1;
+   }
+
+   memset(cache, 0, size);
+   atomic_init(&cache->lock, STATE_FREE);
+   atomic_init(&cache->hits, 0);
+   atomic_init(&cache->misses, 0);
+
+   *p_size = size;
+   *p_shmem = cache;
+
+   return 0;
+}
+
+void
+pgexporter_tls_session_reset(void)
+{
+   struct tls_session_cache* cache = (struct tls_session_cache*)tls_session_shmem;
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   /* Hosts and certificates may have changed, so wait for the lock */
+   shared_cache_lock_wait(&cache->lock);
+
+   OPENSSL_cleanse(&cache->entries[0], sizeof(cache->entries));
+   cache->tick = 0;
+
+   shared_cache_unlock(&cache->lock);
+}
+
+int
+pgexporter_tls_session_prepare(SSL* ssl, char* peer)
+{
+   char* key = NULL;
+   int index;
+   int length = 0;
+   unsigned char data[TLS_SESSION_MAX_LENGTH];
+   const unsigned char* p = NULL;
+   SSL_SESSION* session = NULL;
+   struct tls_session_cache* cache = (struct tls_session_cache*)tls_session_shmem;
+   struct tls_session_entry* entry = NULL;
+
+   if (cache == NULL || ssl == NULL || peer == NULL || strlen(peer) >= MISC_LENGTH)
+   {
+      return 0;
+   }
+
+   index = tls_session_ex_index();
+   if (index < 0)
+   {
+      goto error;
+   }
+
+   key = strdup(peer);
+   if (key == NULL)
+   {
+      goto error;
+   }
+
+   if (SSL_set_ex_data(ssl, index, key) != 1)
+   {
+      free(key);
+      goto error;
+   }
+
+   if (shared_cache_lock(&cache->lock))
+   {
+      for (int i = 0; i < TLS_SESSION_ENTRIES; i++)
+      {
+         entry = &cache->entries[i];
+
+         if (entry->in_use && !strcmp(entry->peer, peer))
+         {
+            if (entry->expires > time(NULL))
+            {
+               length = entry->length;
+               memcpy(&data[0], entry->data, length);
+               entry->last_used = ++cache->tick;
+            }
+            else
+            {
+               OPENSSL_cleanse(entry, sizeof(struct tls_session_entry));
+            }
+            break;
+         }
+      }
+
+      shared_cache_unlock(&cache->lock);
+   }
+
+   if (length > 0)
+   {
+      p = &data[0];
+      session = d2i_SSL_SESSION(NULL, &p, length);
+
+      if (session != NULL)
+      {
+         if (SSL_set_session(ssl, session) != 1)
+         {
+            pgexporter_log_debug("Could not offer the TLS session of %s", peer);
+         }
+         SSL_SESSION_free(session);
+      }
+
+      OPENSSL_cleanse(&data[0], sizeof(data));
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+void
+pgexporter_tls_session_account(SSL* ssl)
+{
+   struct tls_session_cache* cache = (struct tls_session_cache*)tls_session_shmem;
+
+   if (cache == NULL || ssl == NULL)
+   {
+      return;
+   }
+
+   if (SSL_session_reused(ssl))
+   {
+      atomic_fetch_add(&cache->hits, 1);
+   }
+   else
+   {
+      atomic_fetch_add(&cache->misses, 1);
+   }
+}
+
 int
 pgexporter_create_ssl_ctx(bool client, SSL_CTX** ctx)
 {
@@ -2600,8 +3162,26 @@ pgexporter_create_ssl_ctx(bool client, SSL_CTX** ctx)
    }
 
    SSL_CTX_set_mode(c, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
-   SSL_CTX_set_options(c, SSL_OP_NO_TICKET);
-   SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+
+   if (client && tls_session_shmem != NULL)
+   {
+      /* Sessions are kept in shared memory, see pgexporter_tls_session_prepare */
+      SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      SSL_CTX_sess_set_new_cb(c, tls_session_new_cb);
+   }
+   else if (client)
+   {
+      SSL_CTX_set_options(c, SSL_OP_NO_TICKET);
+      SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+   }
+   else
+   {
+      /* Stateless session tickets. The ticket keys belong to the context, so
+       * every process that inherits it can resume the sessions of the others */
+      SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+      SSL_CTX_set_session_id_context(c, (const unsigned char*)"pgexporter", strlen("pgexporter"));
+      SSL_CTX_set_num_tickets(c, 1);
+   }
 
    *ctx = c;
 
@@ -2709,6 +3289,38 @@ int
 pgexporter_create_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root, int socket, SSL** ssl)
 {
    SSL* s = NULL;
+
+   if (pgexporter_configure_ssl_server(ctx, key, cert, root))
+   {
+      goto error;
+   }
+
+   s = SSL_new(ctx);
+
+   if (s == NULL)
+   {
+      goto error;
+   }
+
+   if (SSL_set_fd(s, socket) == 0)
+   {
+      goto error;
+   }
+
+   *ssl = s;
+
+   return 0;
+
+error:
+
+   pgexporter_close_ssl(s);
+
+   return 1;
+}
+
+int
+pgexporter_configure_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root)
+{
    STACK_OF(X509_NAME)* root_cert_list = NULL;
 
    if (strlen(cert) == 0)
@@ -2780,27 +3392,43 @@ pgexporter_create_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root, in
       SSL_CTX_set_client_CA_list(ctx, root_cert_list);
    }
 
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgexporter_new_ssl_server(SSL_CTX* ctx, int socket, SSL** ssl)
+{
+   SSL* s = NULL;
+
+   *ssl = NULL;
+
+   /* pgexporter_close_ssl frees the context of the connection */
+   if (SSL_CTX_up_ref(ctx) != 1)
+   {
+      return 1;
+   }
+
    s = SSL_new(ctx);
 
    if (s == NULL)
    {
-      goto error;
+      SSL_CTX_free(ctx);
+      return 1;
    }
 
    if (SSL_set_fd(s, socket) == 0)
    {
-      goto error;
+      pgexporter_close_ssl(s);
+      return 1;
    }
 
    *ssl = s;
 
    return 0;
-
-error:
-
-   pgexporter_close_ssl(s);
-
-   return 1;
 }
 
 int
@@ -2845,3 +3473,39 @@ pgexporter_extract_server_parameters(struct deque** server_parameters)
    *server_parameters = sp;
    return 0;
 }
+
+int
+pgexporter_extract_backend_key(int* pid, int* secret)
+{
+   char* data = NULL;
+   ssize_t data_length;
+   size_t offset;
+   struct message* msg = NULL;
+
+   *pid = 0;
+   *secret = 0;
+
+   for (int i = 0; i < NUMBER_OF_SECURITY_MESSAGES; ++i)
+   {
+      if ((data_length = security_lengths[i]) > 0)
+      {
+         data = &security_messages[i][0];
+         offset = 0;
+
+         while (offset < (size_t)data_length)
+         {
+            offset = pgexporter_extract_message_offset(offset, data, &msg);
+            if (msg->kind == 'K' && msg->length >= 13)
+            {
+               *pid = pgexporter_read_int32(msg->data + 5); // 1 byte for kind + 4 bytes for length
+               *secret = pgexporter_read_int32(msg->data + 9);
+               pgexporter_free_message(msg);
+               return 0;
+            }
+            pgexporter_free_message(msg);
+         }
+      }
+   }
+
+   return 1;
+}
@@ -39,6 +39,11 @@ void* shmem = NULL;
 void* prometheus_cache_shmem = NULL;
 void* bridge_cache_shmem = NULL;
 void* bridge_json_cache_shmem = NULL;
+void* history_queue_shmem = NULL;
+void* fragment_shmem = NULL;
+void* scram_cache_shmem = NULL;
+void* tls_session_shmem = NULL;
+void* log_ring_shmem = NULL;
 
 int
 pgexporter_create_shared_memory(size_t size, unsigned char hp, void** shmem)
@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <snappy_compression.h>
+
+/* system */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The block format compresses independent 64 KB fragments */
+#define SNAPPY_BLOCK_SIZE (1 << 16)
+#define SNAPPY_HASH_BITS  14
+#define SNAPPY_HASH_SIZE  (1 << SNAPPY_HASH_BITS)
+
+#define SNAPPY_TAG_LITERAL 0
+#define SNAPPY_TAG_COPY_1  1
+#define SNAPPY_TAG_COPY_2  2
+#define SNAPPY_TAG_COPY_4  3
+
+static uint32_t load32(unsigned char* p);
+static uint32_t hash32(uint32_t v);
+static unsigned char* emit_literal(unsigned char* out, unsigned char* literal, size_t length);
+static unsigned char* emit_copy(unsigned char* out, size_t offset, size_t length);
+static unsigned char* compress_block(unsigned char* input, size_t length, unsigned char* out, uint16_t* table);
+
+int
+pgexporter_snappy_compress(void* data, size_t size, void** buffer, size_t* buffer_size)
+{
+   unsigned char* input = (unsigned char*)data;
+   unsigned char* output = NULL;
+   unsigned char* out = NULL;
+   uint16_t* table = NULL;
+   size_t max;
+   size_t n;
+   size_t pos;
+
+   *buffer = NULL;
+   *buffer_size = 0;
+
+   /* Worst case expansion as documented by the format */
+   max = 32 + size + size / 6;
+
+   output = (unsigned char*)malloc(max);
+   table = (uint16_t*)malloc(SNAPPY_HASH_SIZE * sizeof(uint16_t));
+
+   if (output == NULL || table == NULL)
+   {
+      goto error;
+   }
+
+   out = output;
+
+   /* Preamble: uncompressed length as a varint */
+   n = size;
+   while (n >= 0x80)
+   {
+      *out++ = (unsigned char)(n | 0x80);
+      n >>= 7;
+   }
+   *out++ = (unsigned char)n;
+
+   pos = 0;
+   while (pos < size)
+   {
+      n = MIN(size - pos, (size_t)SNAPPY_BLOCK_SIZE);
+      out = compress_block(input + pos, n, out, table);
+      pos += n;
+   }
+
+   free(table);
+
+   *buffer = output;
+   *buffer_size = out - output;
+
+   return 0;
+
+error:
+
+   free(output);
+   free(table);
+
+   return 1;
+}
+
+int
+pgexporter_snappy_decompress(void* data, size_t size, void** buffer, size_t* buffer_size)
+{
+   unsigned char* in = (unsigned char*)data;
+   unsigned char* end = in + size;
+   unsigned char* output = NULL;
+   size_t length = 0;
+   size_t pos = 0;
+   size_t literal;
+   size_t copy;
+   size_t offset;
+   int shift = 0;
+   unsigned char tag;
+
+   *buffer = NULL;
+   *buffer_size = 0;
+
+   while (in < end)
+   {
+      if (shift > 56)
+      {
+         goto error;
+      }
+
+      length |= (size_t)(*in & 0x7F) << shift;
+      shift += 7;
+
+      if (!(*in++ & 0x80))
+      {
+         break;
+      }
+   }
+
+   output = (unsigned char*)malloc(length > 0 ? length : 1);
+   if (output == NULL)
+   {
+      goto error;
+   }
+
+   while (in < end)
+   {
+      tag = *in++;
+
+      switch (tag & 0x03)
+      {
+         case SNAPPY_TAG_LITERAL:
+            literal = tag >> 2;
+            if (literal >= 60)
+            {
+               int bytes = (int)literal - 59;
+
+               if (end - in < bytes)
+               {
+                  goto error;
+               }
+
+               literal = 0;
+               for (int i = 0; i < bytes; i++)
+               {
+                  literal |= (size_t)in[i] << (8 * i);
+               }
+               in += bytes;
+            }
+            literal++;
+
+            if ((size_t)(end - in) < literal || length - pos < literal)
+            {
+               goto error;
+            }
+
+            memcpy(output + pos, in, literal);
+            in += literal;
+            pos += literal;
+            continue;
+         case SNAPPY_TAG_COPY_1:
+            if (end - in < 1)
+            {
+               goto error;
+            }
+            copy = ((tag >> 2) & 0x07) + 4;
+            offset = ((size_t)(tag >> 5) << 8) | in[0];
+            in += 1;
+            break;
+         case SNAPPY_TAG_COPY_2:
+            if (end - in < 2)
+            {
+               goto error;
+            }
+            copy = (tag >> 2) + 1;
+            offset = (size_t)in[0] | ((size_t)in[1] << 8);
+            in += 2;
+            break;
+         default:
+            if (end - in < 4)
+            {
+               goto error;
+            }
+            copy = (tag >> 2) + 1;
+            offset = load32(in);
+            in += 4;
+            break;
+      }
+
+      if (offset == 0 || offset > pos || length - pos < copy)
+      {
+         goto error;
+      }
+
+      /* Byte by byte as the source may overlap the destination */
+      for (size_t i = 0; i < copy; i++)
+      {
+         output[pos + i] = output[pos - offset + i];
+      }
+      pos += copy;
+   }
+
+   if (pos != length)
+   {
+      goto error;
+   }
+
+   *buffer = output;
+   *buffer_size = length;
+
+   return 0;
+
+error:
+
+   free(output);
+
+   return 1;
+}
+
+static uint32_t
+load32(unsigned char* p)
+{
+   return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t
+hash32(uint32_t v)
+{
+   return (v * 0x1E35A7BDU) >> (32 - SNAPPY_HASH_BITS);
+}
+
+static unsigned char*
+emit_literal(unsigned char* out, unsigned char* literal, size_t length)
+{
+   size_t n = length - 1;
+
+   if (length == 0)
+   {
+      return out;
+   }
+
+   if (n < 60)
+   {
+      *out++ = (unsigned char)(n << 2);
+   }
+   else
+   {
+      unsigned char* tag = out++;
+      int bytes = 0;
+
+      while (n > 0)
+      {
+         *out++ = (unsigned char)(n & 0xFF);
+         n >>= 8;
+         bytes++;
+      }
+      *tag = (unsigned char)((59 + bytes) << 2);
+   }
+
+   memcpy(out, literal, length);
+
+   return out + length;
+}
+
+static unsigned char*
+emit_copy(unsigned char* out, size_t offset, size_t length)
+{
+   /* Copies longer than 64 bytes are split, keeping the tail at least 4 bytes */
+   while (length >= 68)
+   {
+      *out++ = (unsigned char)((63 << 2) | SNAPPY_TAG_COPY_2);
+      *out++ = (unsigned char)(offset & 0xFF);
+      *out++ = (unsigned char)(offset >> 8);
+      length -= 64;
+   }
+
+   if (length > 64)
+   {
+      *out++ = (unsigned char)((59 << 2) | SNAPPY_TAG_COPY_2);
+      *out++ = (unsigned char)(offset & 0xFF);
+      *out++ = (unsigned char)(offset >> 8);
+      length -= 60;
+   }
+
+   if (length >= 4 && length < 12 && offset < 2048)
+   {
+      *out++ = (unsigned char)(((offset >> 8) << 5) | ((length - 4) << 2) | SNAPPY_TAG_COPY_1);
+      *out++ = (unsigned char)(offset & 0xFF);
+   }
+   else
+   {
+      *out++ = (unsigned char)(((length - 1) << 2) | SNAPPY_TAG_COPY_2);
+      *out++ = (unsigned char)(offset & 0xFF);
+      *out++ = (unsigned char)(offset >> 8);
+   }
+
+   return out;
+}
+
+static unsigned char*
+compress_block(unsigned char* input, size_t length, unsigned char* out, uint16_t* table)
+{
+   size_t pos = 0;
+   size_t literal = 0;
+   size_t candidate;
+   size_t match;
+   uint32_t h;
+
+   memset(table, 0, SNAPPY_HASH_SIZE * sizeof(uint16_t));
+
+   if (length < 15)
+   {
+      return emit_literal(out, input, length);
+   }
+
+   /* Leave room so that 4 byte loads never run past the block */
+   while (pos + 4 <= length)
+   {
+      h = hash32(load32(input + pos));
+      candidate = table[h];
+      table[h] = (uint16_t)pos;
+
+      if (candidate >= pos || load32(input + candidate) != load32(input + pos))
+      {
+         pos++;
+         continue;
+      }
+
+      match = 4;
+      while (pos + match < length && input[candidate + match] == input[pos + match])
+      {
+         match++;
+      }
+
+      out = emit_literal(out, input + literal, pos - literal);
+      out = emit_copy(out, pos - candidate, match);
+
+      pos += match;
+      literal = pos;
+   }
+
+   return emit_literal(out, input + literal, length - literal);
+}
@@ -37,6 +37,7 @@
 #include <extension.h>
 #include <ext_query_alts.h>
 #include <fips.h>
+#include <fragment.h>
 #include <history.h>
 #include <internal.h>
 #include <json.h>
@@ -48,6 +49,7 @@
 #include <pg_query_alts.h>
 #include <queries.h>
 #include <remote.h>
+#include <remote_write.h>
 #include <security.h>
 #include <server.h>
 #include <shmem.h>
@@ -62,11 +64,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -84,6 +89,8 @@
 
 #define MAX_FDS 64
 
+#define METRICS_WORKER_MAX_REQUESTS 1000
+
 /* Forward declarations - updated signatures for new event layer */
 static void accept_mgt_cb(struct io_watcher* watcher);
 static void accept_transfer_cb(struct io_watcher* watcher);
@@ -96,6 +103,13 @@ static void reload_cb(void);
 static void service_reload_cb(void);
 static void coredump_cb(void);
 static void sigchld_cb(void);
+static void bridge_poller_cb(void);
+static void start_bridge_poller(void);
+static void stop_bridge_poller(bool poller);
+static void log_writer_cb(void);
+static void metrics_workers_cb(void);
+static void metrics_worker(void);
+static bool metrics_worker_yield(void);
 static void accept_console_cb(struct io_watcher* watcher);
 static void accept_history_cb(struct io_watcher* watcher);
 static bool accept_fatal(int error);
@@ -115,15 +129,40 @@ struct accept_io
    char** argv;
 };
 
+/**
+ * A connection on the metrics port served from the main event loop
+ */
+struct metrics_front
+{
+   struct io_watcher watcher;                /**< First member: the loop hands it back */
+   struct http_server_connection connection; /**< The connection */
+   struct accept_io* ai;                     /**< The accepting socket */
+   struct timespec last_activity;            /**< When the client was last heard from */
+   bool in_use;                              /**< Is the slot in use */
+};
+
 static void http_child_serve(int client_fd, struct accept_io* ai, const char* title,
-                             const char* cert_file, const char* key_file, const char* ca_file,
-                             void (*serve_fn)(SSL* ssl, int fd));
+                             SSL_CTX* ctx, void (*serve_fn)(SSL* ssl, int fd));
+static int accept_client(struct io_watcher* watcher, const char* title, void (*restart_fn)(void));
+static void fork_http_child(int client_fd, struct accept_io* ai, const char* title,
+                            SSL_CTX* ctx, void (*serve_fn)(SSL* ssl, int fd), int fork_error_code);
+static void metrics_front_open(int client_fd, struct accept_io* ai);
+static void metrics_front_cb(struct io_watcher* watcher);
+static void metrics_front_serve(struct metrics_front* front);
+static void metrics_front_handoff(struct metrics_front* front, char* pending, size_t pending_length, bool serve);
+static void metrics_front_close(struct metrics_front* front, bool shut);
+static void metrics_front_release(struct metrics_front* keep);
+static void metrics_front_atfork_child(void);
+static void metrics_front_timeout_cb(void);
 static void accept_http_cb(struct io_watcher* watcher,
                            void (*serve_fn)(SSL* ssl, int fd),
                            const char* title,
-                           const char* cert_file, const char* key_file, const char* ca_file,
+                           bool tls, SSL_CTX* ctx,
                            int fork_error_code,
                            void (*restart_fn)(void));
+static bool server_tls(char* cert_file, char* key_file);
+static void load_server_ssl_ctx(const char* title, char* cert_file, char* key_file, char* ca_file, SSL_CTX** ctx);
+static void load_server_ssl_contexts(void);
 static void restart_metrics(void);
 static void restart_console(void);
 static void restart_history(void);
@@ -487,10 +526,33 @@ usage(void)
 /* Fixed interval for the history retention pruning tick (1 hour, in ms) */
 #define HISTORY_RETENTION_PRUNE_INTERVAL_MS (60 * 60 * 1000)
 
+/* Maximum interval for the history tick, which drains the history queue (5 seconds, in ms) */
+#define HISTORY_QUEUE_DRAIN_INTERVAL_MS (5 * 1000)
+
+/* Maximum number of metrics connections served from the main event loop, the rest fork */
+#define METRICS_FRONT_MAX_CONNECTIONS 128
+
 static struct periodic_watcher history_watcher;
 static struct periodic_watcher history_retention_watcher;
 static bool history_started = false;
 static bool history_retention_started = false;
+static struct periodic_watcher remote_write_watcher;
+static bool remote_write_started = false;
+
+static struct periodic_watcher bridge_poller_watcher;
+static bool bridge_poller_started = false;
+static struct periodic_watcher log_writer_watcher;
+static bool log_writer_started = false;
+static struct periodic_watcher metrics_workers_watcher;
+static bool metrics_workers_started = false;
+static struct metrics_front metrics_front[METRICS_FRONT_MAX_CONNECTIONS];
+static int metrics_front_next = 0;
+static struct periodic_watcher metrics_front_watcher;
+static bool metrics_front_started = false;
+static struct metrics_front* metrics_front_keep = NULL;
+static SSL_CTX* metrics_ssl_ctx = NULL;
+static SSL_CTX* history_ssl_ctx = NULL;
+static pid_t metrics_workers[MAX_METRICS_WORKERS];
 
 int
 main(int argc, char** argv)
@@ -512,6 +574,11 @@ main(int argc, char** argv)
    size_t prometheus_cache_shmem_size = 0;
    size_t bridge_cache_shmem_size = 0;
    size_t bridge_json_cache_shmem_size = 0;
+   size_t history_queue_shmem_size = 0;
+   size_t fragment_shmem_size = 0;
+   size_t scram_cache_shmem_size = 0;
+   size_t tls_session_shmem_size = 0;
+   size_t log_ring_shmem_size = 0;
    struct configuration* config = NULL;
    int ret;
    int allowed_collectors_idx = 0;
@@ -1222,6 +1289,58 @@ main(int argc, char** argv)
       }
    }
 
+   if (config->history > 0)
+   {
+      if (pgexporter_history_init_queue(&history_queue_shmem_size, &history_queue_shmem))
+      {
+#ifdef HAVE_SYSTEMD
+         sd_notifyf(0, "STATUS=Error in creating and initializing history queue shared memory");
+#endif
+         errx(1, "Error in creating and initializing history queue shared memory");
+      }
+   }
+
+   if (config->metrics > 0 || config->history > 0)
+   {
+      if (pgexporter_fragment_init(&fragment_shmem_size, &fragment_shmem))
+      {
+#ifdef HAVE_SYSTEMD
+         sd_notifyf(0, "STATUS=Error in creating and initializing exposition fragment shared memory");
+#endif
+         errx(1, "Error in creating and initializing exposition fragment shared memory");
+      }
+   }
+
+   if (pgexporter_scram_cache_init(&scram_cache_shmem_size, &scram_cache_shmem))
+   {
+#ifdef HAVE_SYSTEMD
+      sd_notifyf(0, "STATUS=Error in creating and initializing SCRAM cache shared memory");
+#endif
+      errx(1, "Error in creating and initializing SCRAM cache shared memory");
+   }
+
+   if (pgexporter_tls_session_init(&tls_session_shmem_size, &tls_session_shmem))
+   {
+#ifdef HAVE_SYSTEMD
+      sd_notifyf(0, "STATUS=Error in creating and initializing TLS session shared memory");
+#endif
+      errx(1, "Error in creating and initializing TLS session shared memory");
+   }
+
+   if (config->log_async &&
+       (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE || config->log_type == PGEXPORTER_LOGGING_TYPE_FILE))
+   {
+      if (pgexporter_log_ring_init(&log_ring_shmem_size, &log_ring_shmem))
+      {
+#ifdef HAVE_SYSTEMD
+         sd_notifyf(0, "STATUS=Error in creating and initializing log ring shared memory");
+#endif
+         errx(1, "Error in creating and initializing log ring shared memory");
+      }
+   }
+
+   load_server_ssl_contexts();
+
    /* Bind Unix Domain Socket: Main */
    if (pgexporter_bind_unix_socket(config->unix_socket_dir, MAIN_UDS, &unix_management_socket))
    {
@@ -1266,6 +1385,22 @@ main(int argc, char** argv)
       pgexporter_signal_start(&signal_watchers[i]);
    }
 
+   if (log_ring_shmem != NULL)
+   {
+      /* The watcher only restarts the log writer if it went away */
+      if (pgexporter_periodic_init(&log_writer_watcher, log_writer_cb, 1000) == 0)
+      {
+         pgexporter_periodic_start(&log_writer_watcher);
+         log_writer_started = true;
+
+         log_writer_cb();
+      }
+      else
+      {
+         pgexporter_log_error("Failed to initialize the log writer watcher; logging directly");
+      }
+   }
+
    if (pgexporter_tls_valid())
    {
       pgexporter_log_fatal("pgexporter: Invalid TLS configuration");
@@ -1302,7 +1437,27 @@ main(int argc, char** argv)
          exit(1);
       }
 
-      start_metrics();
+      if (config->metrics_workers > 0)
+      {
+         /* The workers accept on the metrics sockets themselves; the
+          * watcher replaces the workers that went away */
+         if (pgexporter_periodic_init(&metrics_workers_watcher, metrics_workers_cb, 1000) == 0)
+         {
+            pgexporter_periodic_start(&metrics_workers_watcher);
+            metrics_workers_started = true;
+
+            metrics_workers_cb();
+         }
+         else
+         {
+            pgexporter_log_error("Failed to initialize the metrics workers watcher; forking per request");
+            start_metrics();
+         }
+      }
+      else
+      {
+         start_metrics();
+      }
    }
 
    if (config->console > 0)
@@ -1399,6 +1554,8 @@ main(int argc, char** argv)
 
          start_bridge_json();
       }
+
+      start_bridge_poller();
    }
 
    if (config->management > 0)
@@ -1429,34 +1586,31 @@ main(int argc, char** argv)
    if (config->history > 0)
    {
       int64_t history_interval_s = pgexporter_time_convert(config->history_interval, FORMAT_TIME_S);
-      pgexporter_log_debug("History configured. Tick interval: %lld seconds", (long long)history_interval_s);
-      if (history_interval_s > 0)
-      {
-         int64_t history_interval_ms = pgexporter_time_convert(config->history_interval, FORMAT_TIME_MS);
+      int history_tick_ms = HISTORY_QUEUE_DRAIN_INTERVAL_MS;
 
-         /* pgexporter_periodic_init takes an int millisecond value; clamp so a very
-          * large configured interval cannot overflow into a negative/garbage timer.
-          * INT_MAX ms is ~24.8 days, which is far beyond any sane snapshot interval. */
-         if (history_interval_ms > INT_MAX)
-         {
-            pgexporter_log_warn("History: interval exceeds the maximum supported timer value; capping at ~24.8 days");
-            history_interval_ms = INT_MAX;
-         }
+      pgexporter_log_debug("History configured. Snapshot interval: %lld seconds", (long long)history_interval_s);
 
-         if (pgexporter_periodic_init(&history_watcher, pgexporter_history_tick_cb, (int)history_interval_ms) == 0)
-         {
-            pgexporter_periodic_start(&history_watcher);
-            history_started = true;
-         }
-         else
-         {
-            pgexporter_log_error("History: failed to initialize the periodic tick watcher; history snapshots disabled");
-         }
+      /* The tick drains the snapshots queued by /metrics, and takes
+       * the automatic snapshots when the interval has passed */
+      if (history_interval_s > 0 && pgexporter_time_convert(config->history_interval, FORMAT_TIME_MS) < history_tick_ms)
+      {
+         history_tick_ms = (int)pgexporter_time_convert(config->history_interval, FORMAT_TIME_MS);
+      }
+
+      if (pgexporter_periodic_init(&history_watcher, pgexporter_history_tick_cb, history_tick_ms) == 0)
+      {
+         pgexporter_periodic_start(&history_watcher);
+         history_started = true;
+      }
+      else
+      {
+         pgexporter_log_error("History: failed to initialize the periodic tick watcher; history snapshots disabled");
       }
 
-      /* Retention pruning runs on a fixed hourly tick, independent of the
-       * snapshot interval */
-      if (pgexporter_time_is_valid(config->history_retention))
+      /* Rollups and retention pruning run on a fixed hourly tick,
+       * independent of the snapshot interval */
+      if (pgexporter_time_is_valid(config->history_retention) ||
+          pgexporter_time_is_valid(config->history_raw_retention))
       {
          if (pgexporter_periodic_init(&history_retention_watcher, pgexporter_history_retention_tick_cb, HISTORY_RETENTION_PRUNE_INTERVAL_MS) == 0)
          {
@@ -1471,6 +1625,21 @@ main(int argc, char** argv)
             pgexporter_log_error("History: failed to initialize the retention tick watcher; pruning disabled");
          }
       }
+
+      /* The spool is sent by its own process, so a slow endpoint
+       * never holds up the history tick */
+      if (config->remote_write_url[0] != '\0')
+      {
+         if (pgexporter_periodic_init(&remote_write_watcher, pgexporter_remote_write_tick_cb, REMOTE_WRITE_FLUSH_INTERVAL_MS) == 0)
+         {
+            pgexporter_periodic_start(&remote_write_watcher);
+            remote_write_started = true;
+         }
+         else
+         {
+            pgexporter_log_error("History: failed to initialize the remote write watcher; remote write disabled");
+         }
+      }
    }
    pgexporter_log_debug("Management: %d", unix_management_socket);
    pgexporter_log_debug("Transfer: %d", unix_transfer_socket);
@@ -1575,6 +1744,39 @@ main(int argc, char** argv)
       }
    }
 
+   if (metrics_front_started)
+   {
+      pgexporter_periodic_stop(&metrics_front_watcher);
+
+      for (int i = 0; i < METRICS_FRONT_MAX_CONNECTIONS; i++)
+      {
+         if (metrics_front[i].in_use)
+         {
+            metrics_front_close(&metrics_front[i], true);
+         }
+      }
+   }
+
+   if (metrics_workers_started)
+   {
+      pgexporter_periodic_stop(&metrics_workers_watcher);
+
+      for (int i = 0; i < config->metrics_workers; i++)
+      {
+         if (metrics_workers[i] > 0)
+         {
+            kill(metrics_workers[i], SIGTERM);
+         }
+      }
+   }
+
+   stop_bridge_poller(true);
+
+   if (remote_write_started)
+   {
+      pgexporter_periodic_stop(&remote_write_watcher);
+   }
+
    if (history_retention_started)
    {
       pgexporter_periodic_stop(&history_retention_watcher);
@@ -1597,6 +1799,15 @@ main(int argc, char** argv)
 
    pgexporter_event_loop_destroy();
 
+   if (metrics_ssl_ctx != NULL)
+   {
+      SSL_CTX_free(metrics_ssl_ctx);
+   }
+   if (history_ssl_ctx != NULL)
+   {
+      SSL_CTX_free(history_ssl_ctx);
+   }
+
    free(metrics_fds);
    free(console_fds);
    free(history_fds);
@@ -1612,6 +1823,12 @@ main(int argc, char** argv)
    remove_lockfile(config->bridge);
    remove_lockfile(config->bridge_json);
 
+   if (log_writer_started)
+   {
+      pgexporter_periodic_stop(&log_writer_watcher);
+      pgexporter_log_writer_stop();
+   }
+
    pgexporter_stop_logging();
 
    pgexporter_free_pg_query_alts(config);
@@ -1620,6 +1837,28 @@ main(int argc, char** argv)
    pgexporter_destroy_shared_memory(shmem, shmem_size);
    pgexporter_destroy_shared_memory(prometheus_cache_shmem,
                                     prometheus_cache_shmem_size);
+   if (history_queue_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(history_queue_shmem, history_queue_shmem_size);
+   }
+   if (fragment_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(fragment_shmem, fragment_shmem_size);
+   }
+   if (scram_cache_shmem != NULL)
+   {
+      pgexporter_scram_cache_reset();
+      pgexporter_destroy_shared_memory(scram_cache_shmem, scram_cache_shmem_size);
+   }
+   if (tls_session_shmem != NULL)
+   {
+      pgexporter_tls_session_reset();
+      pgexporter_destroy_shared_memory(tls_session_shmem, tls_session_shmem_size);
+   }
+   if (log_ring_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(log_ring_shmem, log_ring_shmem_size);
+   }
 
 #ifdef HAVE_LINUX
    pgexporter_free_proc_title();
@@ -2013,10 +2252,8 @@ error:
 
 static void
 http_child_serve(int client_fd, struct accept_io* ai, const char* title,
-                 const char* cert_file, const char* key_file, const char* ca_file,
-                 void (*serve_fn)(SSL* ssl, int fd))
+                 SSL_CTX* ctx, void (*serve_fn)(SSL* ssl, int fd))
 {
-   SSL_CTX* ctx = NULL;
    SSL* client_ssl = NULL;
 
    if (main_loop)
@@ -2026,19 +2263,11 @@ http_child_serve(int client_fd, struct accept_io* ai, const char* title,
 
    shutdown_ports(false);
 
-   if (cert_file != NULL && key_file != NULL &&
-       strlen(cert_file) > 0 && strlen(key_file) > 0)
+   if (ctx != NULL)
    {
-      if (pgexporter_create_ssl_ctx(false, &ctx))
-      {
-         pgexporter_log_error("http_child_serve: could not create SSL context for %s", title);
-         exit(1);
-      }
-
-      if (pgexporter_create_ssl_server(ctx, (char*)key_file, (char*)cert_file, (char*)ca_file, client_fd, &client_ssl))
+      if (pgexporter_new_ssl_server(ctx, client_fd, &client_ssl))
       {
          pgexporter_log_error("http_child_serve: could not create SSL server for %s", title);
-         SSL_CTX_free(ctx);
          exit(1);
       }
    }
@@ -2047,6 +2276,65 @@ http_child_serve(int client_fd, struct accept_io* ai, const char* title,
    serve_fn(client_ssl, client_fd);
 }
 
+static bool
+server_tls(char* cert_file, char* key_file)
+{
+   return cert_file != NULL && key_file != NULL && strlen(cert_file) > 0 && strlen(key_file) > 0;
+}
+
+static void
+load_server_ssl_ctx(const char* title, char* cert_file, char* key_file, char* ca_file, SSL_CTX** ctx)
+{
+   SSL_CTX* c = NULL;
+
+   if (!server_tls(cert_file, key_file))
+   {
+      if (*ctx != NULL)
+      {
+         SSL_CTX_free(*ctx);
+         *ctx = NULL;
+      }
+      return;
+   }
+
+   if (pgexporter_create_ssl_ctx(false, &c))
+   {
+      pgexporter_log_error("Could not create SSL context for %s", title);
+      return;
+   }
+
+   if (pgexporter_configure_ssl_server(c, key_file, cert_file, ca_file))
+   {
+      /* Keep serving with the previous certificate, if any */
+      pgexporter_log_error("Could not load TLS configuration for %s", title);
+      SSL_CTX_free(c);
+      return;
+   }
+
+   if (*ctx != NULL)
+   {
+      SSL_CTX_free(*ctx);
+   }
+
+   *ctx = c;
+}
+
+/**
+ * Build the server SSL contexts once in the main process. Children inherit
+ * them, so the certificate chain and key are only read at startup and on
+ * reload, and all children share the same session ticket keys.
+ */
+static void
+load_server_ssl_contexts(void)
+{
+   struct configuration* config = (struct configuration*)shmem;
+
+   load_server_ssl_ctx("metrics", config->metrics_cert_file, config->metrics_key_file,
+                       config->metrics_ca_file, &metrics_ssl_ctx);
+   load_server_ssl_ctx("history", config->history_cert_file, config->history_key_file,
+                       config->history_ca_file, &history_ssl_ctx);
+}
+
 static void
 bridge_serve(SSL* ssl __attribute__((unused)), int fd)
 {
@@ -2214,23 +2502,22 @@ restart_bridge_json(void)
    }
 }
 
-static void
-accept_http_cb(struct io_watcher* watcher,
-               void (*serve_fn)(SSL* ssl, int fd),
-               const char* title,
-               const char* cert_file, const char* key_file, const char* ca_file,
-               int fork_error_code,
-               void (*restart_fn)(void))
+/**
+ * Accept a client on a listening socket
+ * @param watcher The watcher of the listening socket
+ * @param title The title of the port
+ * @param restart_fn The function restarting the port
+ * @return The client descriptor, or -1
+ */
+static int
+accept_client(struct io_watcher* watcher, const char* title, void (*restart_fn)(void))
 {
    struct sockaddr_in6 client_addr;
    socklen_t client_addr_length;
    int client_fd;
-   pid_t pid;
-   struct accept_io* ai;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
-   ai = (struct accept_io*)watcher;
 
    pgexporter_log_trace("accept_%s_cb: %d", title, watcher->fds.main.listen_fd);
 
@@ -2260,9 +2547,17 @@ accept_http_cb(struct io_watcher* watcher,
          pgexporter_log_debug("accept: %s (%d)", strerror(errno), watcher->fds.main.listen_fd);
       }
       errno = 0;
-      return;
    }
 
+   return client_fd;
+}
+
+static void
+fork_http_child(int client_fd, struct accept_io* ai, const char* title,
+                SSL_CTX* ctx, void (*serve_fn)(SSL* ssl, int fd), int fork_error_code)
+{
+   pid_t pid;
+
    pid = fork();
    if (pid == -1)
    {
@@ -2273,86 +2568,498 @@ accept_http_cb(struct io_watcher* watcher,
 
    if (pid == 0)
    {
-      http_child_serve(client_fd, ai, title, cert_file, key_file, ca_file, serve_fn);
+      http_child_serve(client_fd, ai, title, ctx, serve_fn);
    }
 
    pgexporter_disconnect(client_fd);
 }
 
 static void
-accept_metrics_cb(struct io_watcher* watcher)
-{
-   struct configuration* config = (struct configuration*)shmem;
-   accept_http_cb(watcher, pgexporter_prometheus, "metrics",
-                  config->metrics_cert_file, config->metrics_key_file,
-                  config->metrics_ca_file, MANAGEMENT_ERROR_METRICS_NOFORK,
-                  restart_metrics);
-}
-
-static void
-accept_console_cb(struct io_watcher* watcher)
+accept_http_cb(struct io_watcher* watcher,
+               void (*serve_fn)(SSL* ssl, int fd),
+               const char* title,
+               bool tls, SSL_CTX* ctx,
+               int fork_error_code,
+               void (*restart_fn)(void))
 {
-   accept_http_cb(watcher, pgexporter_console, "console",
-                  NULL, NULL, NULL, MANAGEMENT_ERROR_CONSOLE_NOFORK,
-                  restart_console);
-}
+   int client_fd;
 
-static void
-accept_history_cb(struct io_watcher* watcher)
-{
-   struct configuration* config = (struct configuration*)shmem;
-   accept_http_cb(watcher, pgexporter_history_http, "history",
-                  config->history_cert_file, config->history_key_file,
-                  config->history_ca_file, MANAGEMENT_ERROR_HISTORY_NOFORK,
-                  restart_history);
-}
+   client_fd = accept_client(watcher, title, restart_fn);
+   if (client_fd == -1)
+   {
+      return;
+   }
 
-static void
-accept_bridge_cb(struct io_watcher* watcher)
-{
-   accept_http_cb(watcher, bridge_serve, "bridge",
-                  NULL, NULL, NULL, MANAGEMENT_ERROR_BRIDGE_NOFORK,
-                  restart_bridge);
-}
+   if (tls && ctx == NULL)
+   {
+      pgexporter_log_error("%s: No TLS context", title);
+      pgexporter_disconnect(client_fd);
+      return;
+   }
 
-static void
-accept_bridge_json_cb(struct io_watcher* watcher)
-{
-   accept_http_cb(watcher, bridge_json_serve, "bridge_json",
-                  NULL, NULL, NULL, MANAGEMENT_ERROR_BRIDGE_JSON_NOFORK,
-                  restart_bridge_json);
+   fork_http_child(client_fd, (struct accept_io*)watcher, title, ctx, serve_fn, fork_error_code);
 }
 
 static void
-accept_management_cb(struct io_watcher* watcher)
+accept_metrics_cb(struct io_watcher* watcher)
 {
-   struct sockaddr_in6 client_addr;
-   socklen_t client_addr_length;
    int client_fd;
-   char address[INET6_ADDRSTRLEN];
-   struct configuration* config;
+   bool tls;
+   struct configuration* config = (struct configuration*)shmem;
 
-   pgexporter_log_trace("accept_management_cb: %d", watcher->fds.main.listen_fd);
+   tls = server_tls(config->metrics_cert_file, config->metrics_key_file);
 
-   memset(&address, 0, sizeof(address));
+   if (config->metrics_event_loop && !tls)
+   {
+      client_fd = accept_client(watcher, "metrics", restart_metrics);
+      if (client_fd != -1)
+      {
+         metrics_front_open(client_fd, (struct accept_io*)watcher);
+      }
+      return;
+   }
 
-   config = (struct configuration*)shmem;
+   accept_http_cb(watcher, pgexporter_prometheus, "metrics",
+                  tls, metrics_ssl_ctx, MANAGEMENT_ERROR_METRICS_NOFORK,
+                  restart_metrics);
+}
 
-   errno = 0;
+/**
+ * Serve a metrics connection from the main event loop. The loop reads the
+ * requests without blocking and answers them while the cache is valid, so
+ * most scrapes never fork. A request that needs the metrics collected, a
+ * page other than /metrics, or a response the client doesn't take at once,
+ * hands the connection over to a child process
+ * @param client_fd The client descriptor
+ * @param ai The accepting socket
+ */
+static void
+metrics_front_open(int client_fd, struct accept_io* ai)
+{
+   struct metrics_front* front = NULL;
+   struct configuration* config = (struct configuration*)shmem;
 
-   memset(&client_addr, 0, sizeof(client_addr));
-   client_addr_length = sizeof(client_addr);
-   if (watcher->fds.main.client_fd != -1)
+   /* Slots are reused round-robin; the loop drops completions queued for the previous connection */
+   for (int i = 0; i < METRICS_FRONT_MAX_CONNECTIONS; i++)
    {
-      client_fd = watcher->fds.main.client_fd;
-      watcher->fds.main.client_fd = -1;
-      if (getpeername(client_fd, (struct sockaddr*)&client_addr, &client_addr_length) == -1)
+      int slot = (metrics_front_next + i) % METRICS_FRONT_MAX_CONNECTIONS;
+
+      if (!metrics_front[slot].in_use)
       {
-         pgexporter_log_debug("getpeername error for fd %d: %s", client_fd, strerror(errno));
-         pgexporter_snprintf(address, sizeof(address), "%s", "unknown");
+         front = &metrics_front[slot];
+         metrics_front_next = (slot + 1) % METRICS_FRONT_MAX_CONNECTIONS;
+         break;
       }
    }
-   else
+
+   if (front == NULL)
+   {
+      fork_http_child(client_fd, ai, "metrics", NULL, pgexporter_prometheus, MANAGEMENT_ERROR_METRICS_NOFORK);
+      return;
+   }
+
+   if (!metrics_front_started)
+   {
+      if (pthread_atfork(NULL, NULL, metrics_front_atfork_child) ||
+          pgexporter_periodic_init(&metrics_front_watcher, metrics_front_timeout_cb, 1000) ||
+          pgexporter_periodic_start(&metrics_front_watcher))
+      {
+         pgexporter_log_error("Failed to initialize the metrics connection timer");
+         fork_http_child(client_fd, ai, "metrics", NULL, pgexporter_prometheus, MANAGEMENT_ERROR_METRICS_NOFORK);
+         return;
+      }
+      metrics_front_started = true;
+   }
+
+   pgexporter_socket_nonblocking(client_fd, true);
+
+   pgexporter_http_server_connection_init(&front->connection, NULL, client_fd);
+   if (pgexporter_time_is_valid(config->metrics_keep_alive_timeout))
+   {
+      front->connection.max_requests = config->metrics_keep_alive_requests;
+      front->connection.idle_timeout = (int)pgexporter_time_convert(config->metrics_keep_alive_timeout, FORMAT_TIME_MS);
+   }
+
+   front->ai = ai;
+   front->in_use = true;
+   clock_gettime(CLOCK_MONOTONIC, &front->last_activity);
+
+   pgexporter_event_worker_init(&front->watcher, client_fd, client_fd, metrics_front_cb);
+   if (pgexporter_io_start(&front->watcher))
+   {
+      pgexporter_log_error("metrics: Could not watch connection %d", client_fd);
+      metrics_front_close(front, true);
+   }
+}
+
+static void
+metrics_front_cb(struct io_watcher* watcher)
+{
+   char buffer[4096];
+   ssize_t numbytes;
+   struct metrics_front* front = (struct metrics_front*)watcher;
+
+   if (!front->in_use)
+   {
+      /* An event that was already queued when the connection was closed */
+      return;
+   }
+
+   if (watcher->msg != NULL)
+   {
+      /* io_uring already received the data */
+      if (watcher->msg->length == 0 ||
+          pgexporter_http_server_append(&front->connection, watcher->msg->data, watcher->msg->length))
+      {
+         metrics_front_close(front, true);
+         return;
+      }
+   }
+   else
+   {
+      numbytes = recv(front->connection.fd, buffer, sizeof(buffer), 0);
+      if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      {
+         errno = 0;
+         return;
+      }
+
+      if (numbytes <= 0 || pgexporter_http_server_append(&front->connection, buffer, (size_t)numbytes))
+      {
+         errno = 0;
+         metrics_front_close(front, true);
+         return;
+      }
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &front->last_activity);
+
+   metrics_front_serve(front);
+}
+
+/**
+ * Answer the complete requests of a connection, in order
+ * @param front The connection
+ */
+static void
+metrics_front_serve(struct metrics_front* front)
+{
+   struct http_server_request* req = NULL;
+   size_t request_length = 0;
+   char* response = NULL;
+   size_t response_length = 0;
+   size_t offset;
+   ssize_t numbytes;
+   bool keep_alive;
+   int status;
+
+   while (front->in_use && front->connection.length > 0)
+   {
+      /* The request stays in the buffer, in case a child has to answer it */
+      status = pgexporter_http_server_peek(&front->connection, &req, &request_length);
+      if (status == MESSAGE_STATUS_ZERO)
+      {
+         return;
+      }
+      else if (status != MESSAGE_STATUS_OK)
+      {
+         /* The child answers with a 400 */
+         metrics_front_handoff(front, NULL, 0, true);
+         return;
+      }
+
+      keep_alive = req->keep_alive;
+
+      if (pgexporter_prometheus_cached(req, &response, &response_length))
+      {
+         pgexporter_http_server_request_destroy(req);
+
+         metrics_front_handoff(front, NULL, 0, true);
+         return;
+      }
+
+      pgexporter_http_server_request_destroy(req);
+      req = NULL;
+
+      pgexporter_http_server_consume(&front->connection, request_length);
+
+      offset = 0;
+      while (offset < response_length)
+      {
+         numbytes = send(front->connection.fd, response + offset, response_length - offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+         if (numbytes == -1 && errno == EINTR)
+         {
+            continue;
+         }
+         else if (numbytes <= 0)
+         {
+            break;
+         }
+         offset += (size_t)numbytes;
+      }
+
+      if (offset < response_length)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            /* The client is slow; a child writes the rest, the loop moves on */
+            metrics_front_handoff(front, response + offset, response_length - offset, keep_alive);
+         }
+         else
+         {
+            metrics_front_close(front, true);
+         }
+
+         errno = 0;
+         free(response);
+         return;
+      }
+
+      free(response);
+      response = NULL;
+
+      if (!keep_alive)
+      {
+         metrics_front_close(front, true);
+         return;
+      }
+   }
+}
+
+/**
+ * Hand a connection over to a child process
+ * @param front The connection
+ * @param pending Response data to write first, or NULL
+ * @param pending_length The length of the pending data
+ * @param serve Should the child serve the connection afterwards
+ */
+static void
+metrics_front_handoff(struct metrics_front* front, char* pending, size_t pending_length, bool serve)
+{
+   pid_t pid;
+   int ret = 0;
+   struct message msg;
+
+   stop_io_watcher(&front->watcher);
+
+   metrics_front_keep = front;
+   pid = fork();
+   metrics_front_keep = NULL;
+   if (pid == -1)
+   {
+      pgexporter_log_error("metrics: No fork (%d)", MANAGEMENT_ERROR_METRICS_NOFORK);
+      pgexporter_disconnect(front->connection.fd);
+      pgexporter_http_server_connection_destroy(&front->connection);
+      front->in_use = false;
+      return;
+   }
+
+   if (pid == 0)
+   {
+      pgexporter_event_loop_fork();
+      shutdown_ports(false);
+
+      pgexporter_set_proc_title(1, front->ai->argv, "metrics", NULL);
+
+      pgexporter_start_logging();
+      pgexporter_memory_init();
+
+      pgexporter_socket_nonblocking(front->connection.fd, false);
+
+      if (pending_length > 0)
+      {
+         memset(&msg, 0, sizeof(struct message));
+         msg.data = pending;
+         msg.length = pending_length;
+
+         if (pgexporter_write_message(NULL, front->connection.fd, &msg) != MESSAGE_STATUS_OK)
+         {
+            serve = false;
+            ret = 1;
+         }
+      }
+
+      if (serve)
+      {
+         ret = pgexporter_prometheus_serve(&front->connection);
+      }
+      else
+      {
+         pgexporter_http_server_connection_destroy(&front->connection);
+         shutdown(front->connection.fd, SHUT_RDWR);
+         pgexporter_disconnect(front->connection.fd);
+      }
+
+      pgexporter_memory_destroy();
+      pgexporter_stop_logging();
+      OPENSSL_cleanup();
+
+      exit(ret);
+   }
+
+   /* The child owns the connection now */
+   pgexporter_disconnect(front->connection.fd);
+   pgexporter_http_server_connection_destroy(&front->connection);
+   front->in_use = false;
+}
+
+/**
+ * Close a connection served from the main event loop
+ * @param front The connection
+ * @param shut Shut the socket down, so copies held by children don't keep it open
+ */
+static void
+metrics_front_close(struct metrics_front* front, bool shut)
+{
+   stop_io_watcher(&front->watcher);
+
+   if (shut)
+   {
+      shutdown(front->connection.fd, SHUT_RDWR);
+   }
+
+   pgexporter_disconnect(front->connection.fd);
+   pgexporter_http_server_connection_destroy(&front->connection);
+   front->in_use = false;
+}
+
+/**
+ * Close the inherited copies of the connections served from the main
+ * event loop in a child process
+ * @param keep The connection the child serves, or NULL
+ */
+static void
+metrics_front_release(struct metrics_front* keep)
+{
+   for (int i = 0; i < METRICS_FRONT_MAX_CONNECTIONS; i++)
+   {
+      if (metrics_front[i].in_use && &metrics_front[i] != keep)
+      {
+         pgexporter_disconnect(metrics_front[i].connection.fd);
+         metrics_front[i].in_use = false;
+      }
+   }
+}
+
+/**
+ * Close the inherited copies of the connections served from the main
+ * event loop in every child process, also the ones forked by the library.
+ * The connection being handed off is kept
+ */
+static void
+metrics_front_atfork_child(void)
+{
+   metrics_front_release(metrics_front_keep);
+   metrics_front_keep = NULL;
+}
+
+/**
+ * Close the connections that have been quiet for too long. A started request
+ * gets the authentication timeout, an idle connection the keep-alive timeout
+ */
+static void
+metrics_front_timeout_cb(void)
+{
+   struct timespec now;
+   long long elapsed;
+   int timeout;
+   struct configuration* config = (struct configuration*)shmem;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   for (int i = 0; i < METRICS_FRONT_MAX_CONNECTIONS; i++)
+   {
+      struct metrics_front* front = &metrics_front[i];
+
+      if (!front->in_use)
+      {
+         continue;
+      }
+
+      if (front->connection.requests > 0 && front->connection.length == 0)
+      {
+         timeout = front->connection.idle_timeout;
+      }
+      else
+      {
+         timeout = (int)pgexporter_time_convert(config->authentication_timeout, FORMAT_TIME_MS);
+      }
+
+      elapsed = (now.tv_sec - front->last_activity.tv_sec) * 1000LL +
+                (now.tv_nsec - front->last_activity.tv_nsec) / 1000000LL;
+
+      if (timeout > 0 && elapsed >= timeout)
+      {
+         pgexporter_log_debug("metrics: Closing quiet connection %d", front->connection.fd);
+         metrics_front_close(front, true);
+      }
+   }
+}
+
+static void
+accept_console_cb(struct io_watcher* watcher)
+{
+   accept_http_cb(watcher, pgexporter_console, "console",
+                  false, NULL, MANAGEMENT_ERROR_CONSOLE_NOFORK,
+                  restart_console);
+}
+
+static void
+accept_history_cb(struct io_watcher* watcher)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   accept_http_cb(watcher, pgexporter_history_http, "history",
+                  server_tls(config->history_cert_file, config->history_key_file),
+                  history_ssl_ctx, MANAGEMENT_ERROR_HISTORY_NOFORK,
+                  restart_history);
+}
+
+static void
+accept_bridge_cb(struct io_watcher* watcher)
+{
+   accept_http_cb(watcher, bridge_serve, "bridge",
+                  false, NULL, MANAGEMENT_ERROR_BRIDGE_NOFORK,
+                  restart_bridge);
+}
+
+static void
+accept_bridge_json_cb(struct io_watcher* watcher)
+{
+   accept_http_cb(watcher, bridge_json_serve, "bridge_json",
+                  false, NULL, MANAGEMENT_ERROR_BRIDGE_JSON_NOFORK,
+                  restart_bridge_json);
+}
+
+static void
+accept_management_cb(struct io_watcher* watcher)
+{
+   struct sockaddr_in6 client_addr;
+   socklen_t client_addr_length;
+   int client_fd;
+   char address[INET6_ADDRSTRLEN];
+   struct configuration* config;
+
+   pgexporter_log_trace("accept_management_cb: %d", watcher->fds.main.listen_fd);
+
+   memset(&address, 0, sizeof(address));
+
+   config = (struct configuration*)shmem;
+
+   errno = 0;
+
+   memset(&client_addr, 0, sizeof(client_addr));
+   client_addr_length = sizeof(client_addr);
+   if (watcher->fds.main.client_fd != -1)
+   {
+      client_fd = watcher->fds.main.client_fd;
+      watcher->fds.main.client_fd = -1;
+      if (getpeername(client_fd, (struct sockaddr*)&client_addr, &client_addr_length) == -1)
+      {
+         pgexporter_log_debug("getpeername error for fd %d: %s", client_fd, strerror(errno));
+         pgexporter_snprintf(address, sizeof(address), "%s", "unknown");
+      }
+   }
+   else
    {
       client_fd = accept(watcher->fds.main.listen_fd, (struct sockaddr*)&client_addr, &client_addr_length);
    }
@@ -2469,9 +3176,331 @@ sigchld_cb(void)
          atomic_store(&config->history_retention_worker_pid, 0);
          atomic_store(&config->history_retention_worker_running, false);
       }
+
+      /* And for the remote write sender. */
+      if (config != NULL && pid == (pid_t)atomic_load(&config->remote_write_pid))
+      {
+         atomic_store(&config->remote_write_pid, 0);
+         atomic_store(&config->remote_write_running, false);
+      }
+
+      /* The bridge poller is restarted by its watcher */
+      if (config != NULL && pid == (pid_t)atomic_load(&config->bridge_poller_pid))
+      {
+         atomic_store(&config->bridge_poller_pid, 0);
+      }
+
+      /* The log writer is restarted by its watcher; until then lines are written directly */
+      if (config != NULL && pid == (pid_t)atomic_load(&config->log_writer_pid))
+      {
+         atomic_store(&config->log_writer_pid, 0);
+      }
+
+      /* Metrics workers are replaced by their watcher */
+      for (int i = 0; i < MAX_METRICS_WORKERS; i++)
+      {
+         if (metrics_workers[i] == pid)
+         {
+            metrics_workers[i] = 0;
+         }
+      }
+   }
+}
+
+/**
+ * Start the watcher that keeps the bridge poller running, if the
+ * configuration asks for a poller
+ */
+static void
+start_bridge_poller(void)
+{
+   int64_t bridge_poll_interval_ms;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (bridge_poller_started || config->bridge <= 0)
+   {
+      return;
+   }
+
+   if (!pgexporter_time_is_valid(config->bridge_poll_interval) ||
+       !pgexporter_time_is_valid(config->bridge_cache_max_age) || config->bridge_cache_max_size <= 0)
+   {
+      return;
+   }
+
+   bridge_poll_interval_ms = pgexporter_time_convert(config->bridge_poll_interval, FORMAT_TIME_MS);
+
+   if (bridge_poll_interval_ms > INT_MAX)
+   {
+      bridge_poll_interval_ms = INT_MAX;
+   }
+
+   /* The watcher only restarts the poller if it went away; the
+    * poller itself fetches the endpoints at the configured interval */
+   if (pgexporter_periodic_init(&bridge_poller_watcher, bridge_poller_cb, (int)bridge_poll_interval_ms) == 0)
+   {
+      pgexporter_periodic_start(&bridge_poller_watcher);
+      bridge_poller_started = true;
+
+      bridge_poller_cb();
+   }
+   else
+   {
+      pgexporter_log_error("Bridge: failed to initialize the poller watcher; bridge is served on demand");
    }
 }
 
+/**
+ * Stop the watcher of the bridge poller
+ * @param poller Also stop the poller itself
+ */
+static void
+stop_bridge_poller(bool poller)
+{
+   pid_t poller_pid;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (bridge_poller_started)
+   {
+      pgexporter_periodic_stop(&bridge_poller_watcher);
+      bridge_poller_started = false;
+   }
+
+   if (!poller)
+   {
+      return;
+   }
+
+   poller_pid = (pid_t)atomic_load(&config->bridge_poller_pid);
+   if (poller_pid > 0)
+   {
+      kill(poller_pid, SIGTERM);
+   }
+}
+
+static void
+bridge_poller_cb(void)
+{
+   pid_t pid;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (!config->keep_running || !pgexporter_time_is_valid(config->bridge_poll_interval))
+   {
+      return;
+   }
+
+   if (atomic_load(&config->bridge_poller_pid) != 0)
+   {
+      return;
+   }
+
+   pid = fork();
+   if (pid < 0)
+   {
+      pgexporter_log_error("Bridge: failed to fork the poller");
+      return;
+   }
+   else if (pid > 0)
+   {
+      atomic_store(&config->bridge_poller_pid, (int)pid);
+      return;
+   }
+
+   if (main_loop)
+   {
+      pgexporter_event_loop_fork();
+   }
+
+   shutdown_ports(false);
+
+   pgexporter_set_proc_title(1, argv_ptr, "bridge poller", NULL);
+   pgexporter_bridge_poller();
+}
+
+static void
+log_writer_cb(void)
+{
+   pid_t pid;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (!config->keep_running || atomic_load(&config->log_writer_pid) != 0)
+   {
+      return;
+   }
+
+   pid = fork();
+   if (pid < 0)
+   {
+      pgexporter_log_error("Failed to fork the log writer");
+      return;
+   }
+   else if (pid > 0)
+   {
+      atomic_store(&config->log_writer_pid, (int)pid);
+      return;
+   }
+
+   if (main_loop)
+   {
+      pgexporter_event_loop_fork();
+   }
+
+   shutdown_ports(false);
+
+   pgexporter_set_proc_title(1, argv_ptr, "log writer", NULL);
+   pgexporter_log_writer();
+}
+
+static void
+metrics_workers_cb(void)
+{
+   pid_t pid;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (!config->keep_running)
+   {
+      return;
+   }
+
+   for (int i = 0; i < config->metrics_workers; i++)
+   {
+      if (metrics_workers[i] != 0)
+      {
+         continue;
+      }
+
+      pid = fork();
+      if (pid < 0)
+      {
+         pgexporter_log_error("metrics: No fork (%d)", MANAGEMENT_ERROR_METRICS_NOFORK);
+         return;
+      }
+      else if (pid > 0)
+      {
+         metrics_workers[i] = pid;
+         continue;
+      }
+
+      metrics_worker();
+   }
+}
+
+/**
+ * A pre-forked metrics worker. It accepts on the metrics sockets and serves
+ * requests until it has served METRICS_WORKER_MAX_REQUESTS, the configuration
+ * is reloaded or pgexporter shuts down.
+ */
+static void
+metrics_worker(void)
+{
+   int served = 0;
+   int client_fd;
+   bool tls;
+   unsigned int generation;
+   pid_t parent;
+   struct pollfd fds[MAX_FDS];
+   SSL* client_ssl = NULL;
+   struct http_server_connection connection;
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (main_loop)
+   {
+      pgexporter_event_loop_fork();
+   }
+
+   shutdown_management(false);
+
+   pgexporter_set_proc_title(1, argv_ptr, "metrics worker", NULL);
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+
+   tls = server_tls(config->metrics_cert_file, config->metrics_key_file);
+
+   parent = getppid();
+   generation = atomic_load(&config->metrics_workers_generation);
+
+   for (int i = 0; i < metrics_fds_length; i++)
+   {
+      /* Workers race for each connection, so the losers must not block in accept() */
+      pgexporter_socket_nonblocking(metrics_fds[i], true);
+
+      fds[i].fd = metrics_fds[i];
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+   }
+
+   while (config->keep_running && served < METRICS_WORKER_MAX_REQUESTS && getppid() == parent &&
+          generation == atomic_load(&config->metrics_workers_generation))
+   {
+      if (poll(&fds[0], metrics_fds_length, 1000) <= 0)
+      {
+         errno = 0;
+         continue;
+      }
+
+      /* A free worker is here, so nobody has to give up a connection */
+      atomic_store(&config->metrics_workers_yield, false);
+
+      for (int i = 0; i < metrics_fds_length; i++)
+      {
+         if (!(fds[i].revents & POLLIN))
+         {
+            continue;
+         }
+
+         client_fd = accept(fds[i].fd, NULL, NULL);
+         if (client_fd == -1)
+         {
+            errno = 0;
+            continue;
+         }
+
+         pgexporter_socket_nonblocking(client_fd, false);
+
+         client_ssl = NULL;
+         if (tls && (metrics_ssl_ctx == NULL || pgexporter_new_ssl_server(metrics_ssl_ctx, client_fd, &client_ssl)))
+         {
+            pgexporter_log_error("metrics worker: could not create SSL server");
+            pgexporter_disconnect(client_fd);
+            continue;
+         }
+
+         pgexporter_http_server_connection_init(&connection, client_ssl, client_fd);
+         connection.idle_fds = metrics_fds;
+         connection.idle_fds_length = metrics_fds_length;
+         connection.idle_yield = metrics_worker_yield;
+
+         pgexporter_prometheus_serve(&connection);
+         pgexporter_clear_message();
+         served += connection.requests > 0 ? connection.requests : 1;
+      }
+   }
+
+   pgexporter_log_debug("metrics worker: served %d requests", served);
+
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+   OPENSSL_cleanup();
+
+   exit(0);
+}
+
+/**
+ * Should this worker close its idle keep-alive connection, because a new
+ * connection is waiting and no worker is free? Only one worker gives way
+ * at a time, the flag is cleared by the next worker back in accept
+ * @return true if the connection should be closed, otherwise false
+ */
+static bool
+metrics_worker_yield(void)
+{
+   bool expected = false;
+   struct configuration* config = (struct configuration*)shmem;
+
+   return atomic_compare_exchange_strong(&config->metrics_workers_yield, &expected, true);
+}
+
 static bool
 accept_fatal(int error)
 {
@@ -2564,6 +3593,28 @@ reload_configuration(bool* restart)
       return 0;
    }
 
+   /* Metric definitions and server names may have changed */
+   pgexporter_fragment_reset();
+
+   /* Users, passwords, servers and certificates may have changed */
+   pgexporter_scram_cache_reset();
+   pgexporter_tls_session_reset();
+
+   /* Certificates are only read here, children inherit the contexts */
+   load_server_ssl_contexts();
+
+   /* Metrics workers pick up the new configuration when they are replaced */
+   atomic_fetch_add(&((struct configuration*)shmem)->metrics_workers_generation, 1);
+
+   /* The poll interval may have been enabled, disabled or changed. A running
+    * poller reads the interval itself, so only the watcher is recreated */
+   stop_bridge_poller(false);
+   start_bridge_poller();
+   if (!bridge_poller_started)
+   {
+      stop_bridge_poller(true);
+   }
+
    /* Non-structural configuration changes have been applied successfully */
    pgexporter_log_info("Configuration reloaded successfully");
 
@@ -29,15 +29,20 @@
 #include <pgexporter.h>
 #include <cache.h>
 #include <configuration.h>
+#include <http_server.h>
 #include <memory.h>
+#include <message.h>
 #include <shmem.h>
 
 #include <mctf.h>
 #include <tscommon.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
 
 MCTF_TEST_SETUP(cache)
 {
@@ -264,3 +269,226 @@ cleanup:
    }
    MCTF_FINISH();
 }
+
+// Test the entity tag of a cache generation
+MCTF_TEST(test_cache_etag)
+{
+   size_t total_size = 0;
+   void* cache_shmem = NULL;
+   struct prometheus_cache* cache = NULL;
+   char etag[sizeof(cache->etag)];
+   time_t last_modified;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_cache_init(64, &total_size, &cache_shmem), 0, cleanup, "cache_init failed");
+   cache = (struct prometheus_cache*)cache_shmem;
+
+   MCTF_ASSERT(pgexporter_cache_append(cache, "metric1 42\n"), cleanup, "append failed");
+   MCTF_ASSERT(pgexporter_cache_finalize(cache, PGEXPORTER_TIME_SEC(60)), cleanup, "finalize failed");
+   MCTF_ASSERT_INT_EQ(strlen(cache->etag), 18, cleanup, "unexpected entity tag %s", cache->etag);
+   MCTF_ASSERT(cache->last_modified > 0, cleanup, "last_modified not set");
+   memcpy(etag, cache->etag, sizeof(etag));
+   last_modified = cache->last_modified;
+   sleep(1);
+
+   // The same payload in the next generation keeps its entity tag and modification time
+   pgexporter_cache_invalidate(cache);
+   MCTF_ASSERT_INT_EQ(cache->etag[0], '\0', cleanup, "etag not cleared");
+   MCTF_ASSERT(pgexporter_cache_append(cache, "metric1 42\n"), cleanup, "append failed");
+   MCTF_ASSERT(pgexporter_cache_finalize(cache, PGEXPORTER_TIME_SEC(60)), cleanup, "finalize failed");
+   MCTF_ASSERT_STR_EQ(cache->etag, etag, cleanup, "etag changed for the same payload");
+   MCTF_ASSERT(cache->last_modified == last_modified, cleanup, "last_modified changed for the same payload");
+
+   pgexporter_cache_invalidate(cache);
+   MCTF_ASSERT(pgexporter_cache_append(cache, "metric1 43\n"), cleanup, "append failed");
+   MCTF_ASSERT(pgexporter_cache_finalize(cache, PGEXPORTER_TIME_SEC(60)), cleanup, "finalize failed");
+   MCTF_ASSERT(strcmp(cache->etag, etag), cleanup, "etag unchanged for another payload");
+   MCTF_ASSERT(cache->last_modified > last_modified, cleanup, "last_modified unchanged for another payload");
+
+   // A payload that overflowed is not finalized, even if later appends fit
+   pgexporter_cache_invalidate(cache);
+   MCTF_ASSERT(!pgexporter_cache_append(cache, "0123456789012345678901234567890123456789012345678901234567890123456789"),
+               cleanup, "append should have failed on overflow");
+   MCTF_ASSERT(!pgexporter_cache_append(cache, "tail\n"), cleanup, "append after overflow should fail");
+   MCTF_ASSERT(!pgexporter_cache_finalize(cache, PGEXPORTER_TIME_SEC(60)), cleanup, "overflowed cache finalized");
+   MCTF_ASSERT(!pgexporter_cache_is_valid(cache), cleanup, "overflowed cache should be invalid");
+
+cleanup:
+   if (cache_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(cache_shmem, total_size);
+   }
+   MCTF_FINISH();
+}
+
+// Test conditional requests against the validators of a cache generation
+MCTF_TEST(test_cache_conditional_request)
+{
+   struct http_server_request req;
+   struct http_validators validators;
+
+   memset(&req, 0, sizeof(struct http_server_request));
+   memset(&validators, 0, sizeof(struct http_validators));
+
+   snprintf(validators.etag, sizeof(validators.etag), "\"0123456789abcdef\"");
+   validators.last_modified = 1700000000; /* Tue, 14 Nov 2023 22:13:20 GMT */
+
+   MCTF_ASSERT(!pgexporter_http_server_not_modified(&req, &validators), cleanup, "no conditional header");
+
+   req.headers = "If-None-Match: \"0123456789abcdef\"\r\n\r\n";
+   MCTF_ASSERT(pgexporter_http_server_not_modified(&req, &validators), cleanup, "exact match");
+
+   req.headers = "if-none-match: \"other\", W/\"0123456789abcdef\"\r\n\r\n";
+   MCTF_ASSERT(pgexporter_http_server_not_modified(&req, &validators), cleanup, "weak match in a list");
+
+   req.headers = "If-None-Match: *\r\n\r\n";
+   MCTF_ASSERT(pgexporter_http_server_not_modified(&req, &validators), cleanup, "wildcard");
+
+   req.headers = "If-None-Match: \"0123456789abcdef-protobuf\"\r\n\r\n";
+   MCTF_ASSERT(!pgexporter_http_server_not_modified(&req, &validators), cleanup, "other representation matched");
+
+   // If-Modified-Since is ignored when If-None-Match is present
+   req.headers = "If-None-Match: \"other\"\r\nIf-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n\r\n";
+   MCTF_ASSERT(!pgexporter_http_server_not_modified(&req, &validators), cleanup, "If-Modified-Since used with If-None-Match");
+
+   req.headers = "If-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n\r\n";
+   MCTF_ASSERT(pgexporter_http_server_not_modified(&req, &validators), cleanup, "not modified since");
+
+   req.headers = "If-Modified-Since: Tue, 14 Nov 2023 22:13:19 GMT\r\n\r\n";
+   MCTF_ASSERT(!pgexporter_http_server_not_modified(&req, &validators), cleanup, "modified since");
+
+cleanup:
+   req.headers = NULL;
+   MCTF_FINISH();
+}
+
+// Test pipelined requests on a persistent connection
+MCTF_TEST(test_cache_keep_alive_requests)
+{
+   int sv[2] = {-1, -1};
+   const char* requests = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                          "HEAD /metrics HTTP/1.1\r\n\r\n"
+                          "GET / HTTP/1.0\r\n\r\n";
+   struct http_server_connection connection;
+   struct http_server_request* req = NULL;
+
+   memset(&connection, 0, sizeof(struct http_server_connection));
+
+   MCTF_ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, cleanup, "socketpair failed");
+   MCTF_ASSERT(write(sv[1], requests, strlen(requests)) == (ssize_t)strlen(requests), cleanup, "write failed");
+   close(sv[1]);
+   sv[1] = -1;
+
+   pgexporter_http_server_connection_init(&connection, NULL, sv[0]);
+   connection.max_requests = 10;
+   connection.idle_timeout = 100;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_next(&connection, &req), MESSAGE_STATUS_OK, cleanup, "first request");
+   MCTF_ASSERT_STR_EQ(req->path, "/metrics", cleanup, "first path");
+   MCTF_ASSERT(!req->head && req->keep_alive, cleanup, "HTTP/1.1 GET is persistent");
+   pgexporter_http_server_request_destroy(req);
+   req = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_next(&connection, &req), MESSAGE_STATUS_OK, cleanup, "second request");
+   MCTF_ASSERT(req->head && req->keep_alive, cleanup, "HEAD request");
+   pgexporter_http_server_request_destroy(req);
+   req = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_next(&connection, &req), MESSAGE_STATUS_OK, cleanup, "third request");
+   MCTF_ASSERT_STR_EQ(req->path, "/", cleanup, "third path");
+   MCTF_ASSERT(!req->keep_alive, cleanup, "HTTP/1.0 closes by default");
+   pgexporter_http_server_request_destroy(req);
+   req = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_next(&connection, &req), MESSAGE_STATUS_ZERO, cleanup, "closed between requests");
+   MCTF_ASSERT_INT_EQ(connection.requests, 3, cleanup, "request count");
+
+cleanup:
+   pgexporter_http_server_request_destroy(req);
+   pgexporter_http_server_connection_destroy(&connection);
+   if (sv[0] >= 0)
+   {
+      close(sv[0]);
+   }
+   if (sv[1] >= 0)
+   {
+      close(sv[1]);
+   }
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_cache_parse_buffered)
+{
+   const char* requests = "HEAD /metrics HTTP/1.1\r\n\r\n"
+                          "GET /metr";
+   struct http_server_connection connection;
+   struct http_server_request* req = NULL;
+   char* response = NULL;
+   size_t response_length = 0;
+
+   pgexporter_http_server_connection_init(&connection, NULL, -1);
+   connection.max_requests = 10;
+   connection.idle_timeout = 100;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_append(&connection, requests, strlen(requests)), 0, cleanup, "append failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_parse_buffered(&connection, &req), MESSAGE_STATUS_OK, cleanup, "first request");
+   MCTF_ASSERT(req->head && req->keep_alive, cleanup, "HEAD request");
+
+   /* The response to a HEAD request has no body */
+   MCTF_ASSERT_INT_EQ(pgexporter_http_response_ok(req, "text/plain", "abc", 3, NULL, &response, &response_length), 0, cleanup, "response failed");
+   MCTF_ASSERT(response_length > 4 && !memcmp(response + response_length - 4, "\r\n\r\n", 4), cleanup, "response without body");
+   MCTF_ASSERT(strstr(response, "Content-Length: 3\r\n") != NULL, cleanup, "content length of the body");
+   pgexporter_http_server_request_destroy(req);
+   req = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_parse_buffered(&connection, &req), MESSAGE_STATUS_ZERO, cleanup, "incomplete request");
+   MCTF_ASSERT_INT_EQ((int)connection.length, 9, cleanup, "incomplete request is kept");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_append(&connection, "ics HTTP/1.1\r\n\r\n", 16), 0, cleanup, "append failed");
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_parse_buffered(&connection, &req), MESSAGE_STATUS_OK, cleanup, "second request");
+   MCTF_ASSERT_STR_EQ(req->path, "/metrics", cleanup, "second path");
+   MCTF_ASSERT_INT_EQ(connection.requests, 2, cleanup, "request count");
+
+cleanup:
+   free(response);
+   pgexporter_http_server_request_destroy(req);
+   pgexporter_http_server_connection_destroy(&connection);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_cache_peek_request)
+{
+   const char* requests = "GET /metrics HTTP/1.1\r\n\r\n"
+                          "GET /metrics HTTP/1.1\r\n\r\n";
+   struct http_server_connection connection;
+   struct http_server_request* req = NULL;
+   size_t length = 0;
+
+   pgexporter_http_server_connection_init(&connection, NULL, -1);
+   connection.max_requests = 2;
+   connection.idle_timeout = 100;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_append(&connection, requests, strlen(requests)), 0, cleanup, "append failed");
+
+   /* A peeked request stays in the buffer */
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_peek(&connection, &req, &length), MESSAGE_STATUS_OK, cleanup, "first peek");
+   MCTF_ASSERT_INT_EQ((int)length, (int)strlen(requests) / 2, cleanup, "request length");
+   MCTF_ASSERT_INT_EQ((int)connection.length, (int)strlen(requests), cleanup, "buffer kept");
+   MCTF_ASSERT_INT_EQ(connection.requests, 0, cleanup, "not counted yet");
+   MCTF_ASSERT(req->keep_alive, cleanup, "first request keeps the connection");
+   pgexporter_http_server_request_destroy(req);
+   req = NULL;
+
+   pgexporter_http_server_consume(&connection, length);
+   MCTF_ASSERT_INT_EQ((int)connection.length, (int)strlen(requests) / 2, cleanup, "first request consumed");
+   MCTF_ASSERT_INT_EQ(connection.requests, 1, cleanup, "first request counted");
+
+   /* The last allowed request closes the connection */
+   MCTF_ASSERT_INT_EQ(pgexporter_http_server_peek(&connection, &req, &length), MESSAGE_STATUS_OK, cleanup, "second peek");
+   MCTF_ASSERT(!req->keep_alive, cleanup, "second request closes the connection");
+
+cleanup:
+   pgexporter_http_server_request_destroy(req);
+   pgexporter_http_server_connection_destroy(&connection);
+   MCTF_FINISH();
+}
@@ -154,6 +154,12 @@ MCTF_TEST(test_configuration_accept_time)
    MCTF_ASSERT(pgexporter_test_assert_conf_set_ok(CONFIGURATION_ARGUMENT_METRICS_QUERY_TIMEOUT, "2M", 120000) == 0,
                cleanup, "conf set failed for metrics_query_timeout=2M");
 
+   MCTF_ASSERT(pgexporter_test_assert_conf_set_ok(CONFIGURATION_ARGUMENT_METRICS_SCRAPE_TIMEOUT, "500ms", 500) == 0,
+               cleanup, "conf set failed for metrics_scrape_timeout=500ms");
+
+   MCTF_ASSERT(pgexporter_test_assert_conf_set_ok(CONFIGURATION_ARGUMENT_METRICS_SCRAPE_TIMEOUT, "10s", 10000) == 0,
+               cleanup, "conf set failed for metrics_scrape_timeout=10s");
+
    MCTF_ASSERT(pgexporter_test_assert_conf_set_ok(CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_AGE, "1H", 3600) == 0,
                cleanup, "conf set failed for metrics_cache_max_age=1H");
 
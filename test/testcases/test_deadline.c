@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pgexporter.h>
+#include <memory.h>
+#include <message.h>
+
+#include <mctf.h>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t
+elapsed_ms(struct timespec* start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (int64_t)(now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+MCTF_TEST(test_deadline_remaining)
+{
+   int64_t remaining;
+
+   pgexporter_set_deadline(0);
+   MCTF_ASSERT(pgexporter_deadline_remaining() == -1, cleanup, "no deadline should be set");
+
+   pgexporter_set_deadline(1500);
+   remaining = pgexporter_deadline_remaining();
+   MCTF_ASSERT(remaining > 1000 && remaining <= 1500, cleanup, "unexpected remaining time %lld", (long long)remaining);
+
+   pgexporter_set_deadline(-5);
+   MCTF_ASSERT(pgexporter_deadline_remaining() == -1, cleanup, "a negative timeout should clear the deadline");
+
+   pgexporter_set_deadline(1);
+   usleep(5 * 1000);
+   MCTF_ASSERT(pgexporter_deadline_remaining() == 0, cleanup, "the deadline should have passed");
+
+cleanup:
+   pgexporter_set_deadline(0);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_deadline_clamps_timeout)
+{
+   int sv[2] = {-1, -1};
+   int status;
+   int64_t elapsed;
+   struct timespec start;
+   struct message* msg = NULL;
+
+   pgexporter_memory_init();
+
+   MCTF_ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, cleanup, "socketpair failed");
+
+   /* A deadline that comes first cuts the millisecond timeout short */
+   pgexporter_set_deadline(50);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   status = pgexporter_read_timeout_message(NULL, sv[0], 5000, &msg);
+   elapsed = elapsed_ms(&start);
+
+   MCTF_ASSERT_INT_EQ(status, MESSAGE_STATUS_ZERO, cleanup, "read past the deadline should return ZERO");
+   MCTF_ASSERT(elapsed >= 40 && elapsed < 1000, cleanup, "read took %lld ms, expected the 50 ms deadline", (long long)elapsed);
+
+   /* A timeout that comes first is kept */
+   pgexporter_set_deadline(5000);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   status = pgexporter_read_timeout_message(NULL, sv[0], 50, &msg);
+   elapsed = elapsed_ms(&start);
+
+   MCTF_ASSERT_INT_EQ(status, MESSAGE_STATUS_ZERO, cleanup, "read past the timeout should return ZERO");
+   MCTF_ASSERT(elapsed >= 40 && elapsed < 1000, cleanup, "read took %lld ms, expected the 50 ms timeout", (long long)elapsed);
+
+cleanup:
+   pgexporter_set_deadline(0);
+   if (sv[0] >= 0)
+   {
+      close(sv[0]);
+   }
+   if (sv[1] >= 0)
+   {
+      close(sv[1]);
+   }
+   pgexporter_memory_destroy();
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_deadline_passed)
+{
+   int sv[2] = {-1, -1};
+   int status;
+   int64_t elapsed;
+   char data[] = "Q";
+   struct timespec start;
+   struct message out = {0};
+   struct message* msg = NULL;
+
+   pgexporter_memory_init();
+
+   MCTF_ASSERT_INT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, cleanup, "socketpair failed");
+
+   pgexporter_set_deadline(1);
+   usleep(5 * 1000);
+
+   /* A blocking read gives up at once, even with a peer that never writes */
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   status = pgexporter_read_block_message(NULL, sv[0], &msg);
+   elapsed = elapsed_ms(&start);
+
+   MCTF_ASSERT_INT_EQ(status, MESSAGE_STATUS_ZERO, cleanup, "read past the deadline should return ZERO");
+   MCTF_ASSERT(elapsed < 100, cleanup, "read took %lld ms after the deadline", (long long)elapsed);
+
+   out.kind = 'Q';
+   out.length = 1;
+   out.data = &data[0];
+   MCTF_ASSERT_INT_EQ(pgexporter_write_message(NULL, sv[1], &out), MESSAGE_STATUS_ERROR, cleanup,
+                      "write past the deadline should fail");
+
+   /* Without the deadline the same socket works */
+   pgexporter_set_deadline(0);
+   MCTF_ASSERT_INT_EQ(pgexporter_write_message(NULL, sv[1], &out), MESSAGE_STATUS_OK, cleanup, "write failed");
+   status = pgexporter_read_block_message(NULL, sv[0], &msg);
+   MCTF_ASSERT_INT_EQ(status, MESSAGE_STATUS_OK, cleanup, "read failed");
+   MCTF_ASSERT(msg->kind == 'Q' && msg->length == 1, cleanup, "unexpected message");
+
+cleanup:
+   pgexporter_set_deadline(0);
+   if (sv[0] >= 0)
+   {
+      close(sv[0]);
+   }
+   if (sv[1] >= 0)
+   {
+      close(sv[1]);
+   }
+   pgexporter_memory_destroy();
+   MCTF_FINISH();
+}
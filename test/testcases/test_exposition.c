@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pgexporter.h>
+#include <art.h>
+#include <exposition.h>
+#include <prometheus.h>
+#include <prometheus_client.h>
+
+#include <mctf.h>
+#include <tscommon.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char* exposition_text =
+   "#HELP pgexporter_state The state of pgexporter\n"
+   "#TYPE pgexporter_state gauge\n"
+   "pgexporter_state 1\n"
+   "\n"
+   "#HELP pgexporter_pg_stat_database_xact_commit Number of \"commits\"\n"
+   "#TYPE pgexporter_pg_stat_database_xact_commit counter\n"
+   "pgexporter_pg_stat_database_xact_commit{server=\"primary\", database=\"postgres\"} 123\n"
+   "\n"
+   "# HELP http_requests_total Requests\n"
+   "# TYPE http_requests_total counter\n"
+   "http_requests_total{code=\"200\"} 7\n"
+   "\n"
+   "#HELP pgexporter_wait_seconds Wait time\n"
+   "#TYPE pgexporter_wait_seconds histogram\n"
+   "pgexporter_wait_seconds_bucket{le=\"0.5\", server=\"primary\"} 1\n"
+   "pgexporter_wait_seconds_bucket{le=\"1\", server=\"primary\"} 1\n"
+   "pgexporter_wait_seconds_bucket{le=\"2\", server=\"primary\"} 1\n"
+   "pgexporter_wait_seconds_bucket{le=\"4\", server=\"primary\"} 3\n"
+   "pgexporter_wait_seconds_bucket{le=\"+Inf\", server=\"primary\"} 3\n"
+   "pgexporter_wait_seconds_sum{server=\"primary\"} 5.5\n"
+   "pgexporter_wait_seconds_count{server=\"primary\"} 3\n";
+
+static void
+metric_value_destroy_cb(uintptr_t data)
+{
+   prometheus_metric_value_t* m = (prometheus_metric_value_t*)data;
+
+   free(m->value);
+   free(m);
+}
+
+static int
+add_sample(prometheus_metrics_container_t* container, char* name, char* labels, double value)
+{
+   struct prometheus_sample* sample = NULL;
+   char** strings = NULL;
+
+   strings = realloc(container->sample_strings, (container->number_of_sample_strings + 2) * sizeof(char*));
+   if (strings == NULL)
+   {
+      return 1;
+   }
+   container->sample_strings = strings;
+
+   sample = realloc(container->samples, (container->number_of_samples + 1) * sizeof(struct prometheus_sample));
+   if (sample == NULL)
+   {
+      return 1;
+   }
+   container->samples = sample;
+
+   sample = &container->samples[container->number_of_samples++];
+   sample->name = container->number_of_sample_strings;
+   container->sample_strings[container->number_of_sample_strings++] = strdup(name);
+   sample->labels = container->number_of_sample_strings;
+   container->sample_strings[container->number_of_sample_strings++] = strdup(labels);
+   sample->server = sample->labels;
+   sample->value = value;
+
+   return 0;
+}
+
+static uint64_t
+read_varint(unsigned char* data, size_t size, size_t* position)
+{
+   uint64_t value = 0;
+   int shift = 0;
+
+   while (*position < size)
+   {
+      unsigned char b = data[(*position)++];
+
+      value |= (uint64_t)(b & 0x7F) << shift;
+      shift += 7;
+
+      if (!(b & 0x80))
+      {
+         break;
+      }
+   }
+
+   return value;
+}
+
+MCTF_TEST(test_exposition_negotiate)
+{
+   pgexporter_test_setup();
+
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate(NULL), EXPOSITION_FORMAT_TEXT, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("*/*"), EXPOSITION_FORMAT_TEXT, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("text/plain;version=0.0.4;q=1,*/*;q=0.1"),
+                      EXPOSITION_FORMAT_TEXT, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("application/openmetrics-text;version=1.0.0,application/openmetrics-text;version=0.0.1;q=0.75,text/plain;version=0.0.4;q=0.5,*/*;q=0.1"),
+                      EXPOSITION_FORMAT_OPENMETRICS, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;encoding=delimited;q=0.7,text/plain;version=0.0.4;q=0.3,*/*;q=0.2"),
+                      EXPOSITION_FORMAT_PROTOBUF, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("text/plain;q=0.9, application/openmetrics-text"),
+                      EXPOSITION_FORMAT_OPENMETRICS, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("application/vnd.google.protobuf;encoding=text,text/plain;q=0.1"),
+                      EXPOSITION_FORMAT_TEXT, cleanup, "only the delimited protobuf encoding is served");
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_negotiate("application/openmetrics-text;q=0,text/plain;q=0.1"),
+                      EXPOSITION_FORMAT_TEXT, cleanup, "q=0 is not acceptable");
+
+cleanup:
+   pgexporter_test_teardown();
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_exposition_openmetrics)
+{
+   void* data = NULL;
+   size_t size = 0;
+   char* text = NULL;
+
+   pgexporter_test_setup();
+
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_convert(exposition_text, EXPOSITION_FORMAT_OPENMETRICS, &data, &size), 0, cleanup);
+
+   text = strndup((char*)data, size);
+   MCTF_ASSERT_PTR_NONNULL(text, cleanup);
+
+   MCTF_ASSERT(strstr(text, "# TYPE pgexporter_state gauge\npgexporter_state 1\n") != NULL, cleanup, "gauge");
+   MCTF_ASSERT(strstr(text, "# HELP pgexporter_pg_stat_database_xact_commit Number of \\\"commits\\\"\n") != NULL, cleanup, "escaped help");
+   MCTF_ASSERT(strstr(text, "# TYPE pgexporter_pg_stat_database_xact_commit unknown\n") != NULL, cleanup,
+               "counters without _total are unknown");
+   MCTF_ASSERT(strstr(text, "pgexporter_pg_stat_database_xact_commit{server=\"primary\",database=\"postgres\"} 123\n") != NULL, cleanup,
+               "labels without spaces");
+   MCTF_ASSERT(strstr(text, "# TYPE http_requests counter\nhttp_requests_total{code=\"200\"} 7\n") != NULL, cleanup,
+               "counter family without _total");
+   MCTF_ASSERT(strstr(text, "pgexporter_wait_seconds_bucket{le=\"+Inf\",server=\"primary\"} 3\n") != NULL, cleanup, "histogram");
+   MCTF_ASSERT(size >= 6 && !strcmp(text + size - 6, "# EOF\n"), cleanup, "missing # EOF");
+
+cleanup:
+   free(text);
+   free(data);
+   pgexporter_test_teardown();
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_exposition_protobuf)
+{
+   void* data = NULL;
+   size_t size = 0;
+   size_t position = 0;
+   unsigned char* bytes = NULL;
+   int families = 0;
+   /* Histogram fields: schema 0, a zero_threshold of 0.5 and a zero_count of 1 */
+   unsigned char native[] = {0x28, 0x00, 0x31, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xE0, 0x3F, 0x38, 0x01};
+   /* Span of the bucket (2, 4], at index 2 */
+   unsigned char spans[] = {0x62, 0x04, 0x08, 0x04, 0x10, 0x01};
+
+   pgexporter_test_setup();
+
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_convert(exposition_text, EXPOSITION_FORMAT_PROTOBUF, &data, &size), 0, cleanup);
+
+   bytes = (unsigned char*)data;
+
+   /* Length delimited MetricFamily messages, each starting with its name */
+   while (position < size)
+   {
+      uint64_t length = read_varint(bytes, size, &position);
+
+      MCTF_ASSERT(position + length <= size, cleanup, "family %d overruns the response", families);
+      MCTF_ASSERT(bytes[position] == 0x0A, cleanup, "family %d does not start with its name", families);
+
+      position += length;
+      families++;
+   }
+
+   MCTF_ASSERT_INT_EQ(families, 4, cleanup);
+   MCTF_ASSERT(memmem(data, size, native, sizeof(native)) != NULL, cleanup, "missing native histogram schema");
+   MCTF_ASSERT(memmem(data, size, spans, sizeof(spans)) != NULL, cleanup, "unexpected native histogram spans");
+
+cleanup:
+   free(data);
+   pgexporter_test_teardown();
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_exposition_protobuf_classic_only)
+{
+   char* text =
+      "#HELP pgexporter_wait_seconds Wait time\n"
+      "#TYPE pgexporter_wait_seconds histogram\n"
+      "pgexporter_wait_seconds_bucket{le=\"0.1\"} 1\n"
+      "pgexporter_wait_seconds_bucket{le=\"0.25\"} 2\n"
+      "pgexporter_wait_seconds_bucket{le=\"1\"} 3\n"
+      "pgexporter_wait_seconds_bucket{le=\"+Inf\"} 3\n"
+      "pgexporter_wait_seconds_sum 1.5\n"
+      "pgexporter_wait_seconds_count 3\n";
+   void* data = NULL;
+   size_t size = 0;
+   unsigned char* bytes = NULL;
+   /* Classic bucket: cumulative_count 1, then the upper_bound 0.1 */
+   unsigned char bucket[] = {0x08, 0x01, 0x11, 0x9A, 0x99, 0x99, 0x99, 0x99, 0x99, 0xB9, 0x3F};
+
+   pgexporter_test_setup();
+
+   MCTF_ASSERT_INT_EQ(pgexporter_exposition_convert(text, EXPOSITION_FORMAT_PROTOBUF, &data, &size), 0, cleanup);
+
+   bytes = (unsigned char*)data;
+
+   MCTF_ASSERT(memmem(data, size, bucket, sizeof(bucket)) != NULL, cleanup, "missing classic bucket");
+
+   /* The bounds are no consecutive native boundaries, so there is no schema followed by a zero_threshold */
+   for (size_t i = 0; i + 2 < size; i++)
+   {
+      MCTF_ASSERT(!(bytes[i] == 0x28 && bytes[i + 2] == 0x31), cleanup, "unexpected native histogram fields");
+   }
+
+cleanup:
+   free(data);
+   pgexporter_test_teardown();
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_exposition_bridge_histogram)
+{
+   char* family =
+      "#HELP pgexporter_wait_seconds Wait time\n"
+      "#TYPE pgexporter_wait_seconds histogram\n"
+      "pgexporter_wait_seconds_bucket{le=\"1\", server=\"primary\"} 1\n"
+      "pgexporter_wait_seconds_bucket{le=\"2\", server=\"primary\"} 2\n"
+      "pgexporter_wait_seconds_bucket{le=\"+Inf\", server=\"primary\"} 3\n"
+      "pgexporter_wait_seconds_sum{server=\"primary\"} 4\n"
+      "pgexporter_wait_seconds_count{server=\"primary\"} 3\n";
+   prometheus_metric_value_t* m = NULL;
+   struct value_config vc = {.destroy_data = &metric_value_destroy_cb, .to_string = NULL};
+   prometheus_metrics_container_t* container = NULL;
+   struct prometheus_bridge* cold = NULL;
+   struct prometheus_bridge* warm = NULL;
+   struct art_iterator* iter = NULL;
+   char* text = NULL;
+   int metrics = 0;
+
+   pgexporter_test_setup();
+
+   container = calloc(1, sizeof(prometheus_metrics_container_t));
+   MCTF_ASSERT_PTR_NONNULL(container, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_art_create(&container->custom_metrics), 0, cleanup);
+
+   m = calloc(1, sizeof(prometheus_metric_value_t));
+   MCTF_ASSERT_PTR_NONNULL(m, cleanup);
+   m->value = strdup(family);
+   MCTF_ASSERT_INT_EQ(pgexporter_art_insert_with_config(container->custom_metrics, "pgexporter_wait_seconds", (uintptr_t)m, &vc), 0, cleanup);
+
+   MCTF_ASSERT_INT_EQ(add_sample(container, "pgexporter_wait_seconds_bucket", "le=\"1\", server=\"primary\"", 1), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(add_sample(container, "pgexporter_wait_seconds_bucket", "le=\"2\", server=\"primary\"", 2), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(add_sample(container, "pgexporter_wait_seconds_bucket", "le=\"+Inf\", server=\"primary\"", 3), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(add_sample(container, "pgexporter_wait_seconds_sum", "server=\"primary\"", 4), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(add_sample(container, "pgexporter_wait_seconds_count", "server=\"primary\"", 3), 0, cleanup);
+
+   /* A cold cache builds the bridge from the samples, a warm one parses the text */
+   MCTF_ASSERT_INT_EQ(pgexporter_prometheus_client_create_bridge(&cold), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_prometheus_container_to_bridge(container, cold), 0, cleanup);
+
+   text = pgexporter_prometheus_container_to_string(container);
+   MCTF_ASSERT_PTR_NONNULL(text, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_prometheus_client_create_bridge(&warm), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_prometheus_client_parse(text, warm), 0, cleanup);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_art_iterator_create(cold->metrics, &iter), 0, cleanup);
+   while (pgexporter_art_iterator_next(iter))
+   {
+      struct prometheus_metric* c = (struct prometheus_metric*)iter->value->data;
+      struct prometheus_metric* w = (struct prometheus_metric*)pgexporter_art_search(warm->metrics, c->name);
+
+      MCTF_ASSERT_PTR_NONNULL(w, cleanup, "%s is missing from the parsed text", c->name);
+      MCTF_ASSERT_STR_EQ(c->help, w->help, cleanup, "HELP of %s", c->name);
+      MCTF_ASSERT_STR_EQ(c->type, "histogram", cleanup, "TYPE of %s", c->name);
+      MCTF_ASSERT_STR_EQ(c->type, w->type, cleanup, "TYPE of %s", c->name);
+      MCTF_ASSERT_INT_EQ((int)c->definitions->size, (int)w->definitions->size, cleanup, "series of %s", c->name);
+      MCTF_ASSERT_INT_EQ((int)c->definitions->size, strcmp(c->name, "pgexporter_wait_seconds_bucket") ? 1 : 3, cleanup,
+                         "expected a series per bucket");
+      metrics++;
+   }
+   pgexporter_art_iterator_destroy(iter);
+   iter = NULL;
+
+   MCTF_ASSERT_INT_EQ(metrics, 3, cleanup, "expected the _bucket, _sum and _count series");
+   MCTF_ASSERT_INT_EQ((int)warm->metrics->size, metrics, cleanup, "the parsed text has other series");
+
+cleanup:
+   pgexporter_art_iterator_destroy(iter);
+   pgexporter_prometheus_client_destroy_bridge(cold);
+   pgexporter_prometheus_client_destroy_bridge(warm);
+   pgexporter_prometheus_destroy_container(container);
+   free(text);
+   pgexporter_test_teardown();
+   MCTF_FINISH();
+}
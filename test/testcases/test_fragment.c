@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pgexporter.h>
+#include <fragment.h>
+#include <shmem.h>
+
+#include <mctf.h>
+#include <tscommon.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t fragment_size = 0;
+
+static bool
+lookup_one(char* key, struct fragment_lookup* lookup, char** buffer, size_t* capacity)
+{
+   lookup->key = key;
+   lookup->key_length = strlen(key);
+
+   return pgexporter_fragment_lookup(lookup, 1, buffer, capacity) == 1;
+}
+
+MCTF_TEST_SETUP(fragment)
+{
+   pgexporter_fragment_init(&fragment_size, &fragment_shmem);
+}
+
+MCTF_TEST_TEARDOWN(fragment)
+{
+   if (fragment_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(fragment_shmem, fragment_size);
+      fragment_shmem = NULL;
+   }
+}
+
+MCTF_TEST(test_fragment_store_lookup)
+{
+   char key[] = "s\x1f" "pgexporter_db_size\x1f" "primary\x1f" "postgres\x1f" "app";
+   struct fragment_lookup lookup = {0};
+   char* buffer = NULL;
+   size_t capacity = 0;
+
+   MCTF_ASSERT_PTR_NONNULL(fragment_shmem, cleanup, "fragment cache not initialized");
+
+   MCTF_ASSERT(!lookup_one(key, &lookup, &buffer, &capacity), cleanup, "unexpected fragment");
+   MCTF_ASSERT(pgexporter_fragment_store(key, strlen(key), "server=\"primary\", database=\"app\"",
+                                         "pgexporter_db_size{server=\"primary\", database=\"app\"} "),
+               cleanup, "store failed");
+   MCTF_ASSERT(lookup_one(key, &lookup, &buffer, &capacity), cleanup, "fragment not found");
+   MCTF_ASSERT_STR_EQ(lookup.labels, "server=\"primary\", database=\"app\"", cleanup, "label set mismatch");
+   MCTF_ASSERT_STR_EQ(lookup.prefix, "pgexporter_db_size{server=\"primary\", database=\"app\"} ", cleanup, "prefix mismatch");
+
+   /* A key only differing by a NULL value is another series */
+   key[strlen(key) - 4] = '\x1e';
+   MCTF_ASSERT(!lookup_one(key, &lookup, &buffer, &capacity), cleanup, "NULL value matched");
+   MCTF_ASSERT_PTR_NULL(lookup.prefix, cleanup, "missing fragment has a prefix");
+
+cleanup:
+   free(buffer);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_fragment_compact_vanished)
+{
+   char key[64];
+   struct fragment_lookup lookup = {0};
+   char* buffer = NULL;
+   size_t capacity = 0;
+   int stored = 0;
+   struct fragment_cache* cache = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(fragment_shmem, cleanup, "fragment cache not initialized");
+   cache = (struct fragment_cache*)fragment_shmem;
+
+   /* Series that vanish after the first scrape */
+   pgexporter_fragment_begin();
+   for (int i = 0; i < FRAGMENT_SLOTS / 2; i++)
+   {
+      snprintf(key, sizeof(key), "old-%d", i);
+      stored += pgexporter_fragment_store(key, strlen(key), NULL, "old ") ? 1 : 0;
+   }
+   MCTF_ASSERT_INT_EQ(stored, FRAGMENT_SLOTS / 2, cleanup, "expected all old series to be stored");
+
+   /* Series that are seen in every scrape */
+   pgexporter_fragment_begin();
+   pgexporter_fragment_begin();
+   stored = 0;
+   for (int i = 0; i < FRAGMENT_SLOTS / 2; i++)
+   {
+      snprintf(key, sizeof(key), "new-%d", i);
+      stored += pgexporter_fragment_store(key, strlen(key), NULL, "new ") ? 1 : 0;
+   }
+   MCTF_ASSERT_INT_EQ(stored, FRAGMENT_SLOTS / 2, cleanup, "expected the full cache to be compacted");
+   MCTF_ASSERT_INT_EQ(cache->number_of_entries, FRAGMENT_SLOTS / 2, cleanup, "expected the old series to be dropped");
+
+   snprintf(key, sizeof(key), "old-%d", 0);
+   MCTF_ASSERT(!lookup_one(key, &lookup, &buffer, &capacity), cleanup, "vanished series kept");
+
+   snprintf(key, sizeof(key), "new-%d", 0);
+   MCTF_ASSERT(lookup_one(key, &lookup, &buffer, &capacity), cleanup, "current series dropped");
+   MCTF_ASSERT_STR_EQ(lookup.prefix, "new ", cleanup, "prefix mismatch after compaction");
+
+cleanup:
+   free(buffer);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_fragment_reset)
+{
+   char* key = "#\x1f" "db\x1f" "size\x1f" "1\x1f";
+   struct fragment_lookup lookup = {0};
+   char* buffer = NULL;
+   size_t capacity = 0;
+
+   MCTF_ASSERT_PTR_NONNULL(fragment_shmem, cleanup, "fragment cache not initialized");
+
+   MCTF_ASSERT(pgexporter_fragment_store(key, strlen(key), NULL, "#HELP pgexporter_db_size\n"), cleanup, "store failed");
+   pgexporter_fragment_reset();
+   MCTF_ASSERT(!lookup_one(key, &lookup, &buffer, &capacity), cleanup, "fragment survived the reset");
+
+cleanup:
+   free(buffer);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_fragment_lookup_family)
+{
+   struct fragment_lookup lookups[4];
+   char* keys[] = {"s\x1f" "db\x1f" "a", "s\x1f" "db\x1f" "b", "s\x1f" "db\x1f" "c", ""};
+   char* buffer = NULL;
+   size_t capacity = 0;
+   unsigned long long hits;
+   unsigned long long misses;
+   struct fragment_cache* cache = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(fragment_shmem, cleanup, "fragment cache not initialized");
+   cache = (struct fragment_cache*)fragment_shmem;
+
+   MCTF_ASSERT(pgexporter_fragment_store(keys[0], strlen(keys[0]), "database=\"a\"", "db{database=\"a\"} "),
+               cleanup, "store failed");
+   MCTF_ASSERT(pgexporter_fragment_store(keys[2], strlen(keys[2]), "database=\"c\"", "db{database=\"c\"} "),
+               cleanup, "store failed");
+
+   for (int i = 0; i < 4; i++)
+   {
+      lookups[i].key = keys[i];
+      lookups[i].key_length = strlen(keys[i]);
+   }
+
+   hits = atomic_load(&cache->hits);
+   misses = atomic_load(&cache->misses);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_fragment_lookup(lookups, 4, &buffer, &capacity), 2, cleanup);
+   MCTF_ASSERT_STR_EQ(lookups[0].prefix, "db{database=\"a\"} ", cleanup, "first prefix mismatch");
+   MCTF_ASSERT_PTR_NULL(lookups[1].labels, cleanup, "unexpected fragment");
+   MCTF_ASSERT_STR_EQ(lookups[2].labels, "database=\"c\"", cleanup, "label set mismatch");
+   MCTF_ASSERT_STR_EQ(lookups[2].prefix, "db{database=\"c\"} ", cleanup, "second prefix mismatch");
+   MCTF_ASSERT_PTR_NULL(lookups[3].prefix, cleanup, "a series without key has no fragment");
+   MCTF_ASSERT(atomic_load(&cache->hits) == hits + 2, cleanup, "expected two hits");
+   MCTF_ASSERT(atomic_load(&cache->misses) == misses + 1, cleanup, "a series without key is no miss");
+
+cleanup:
+   free(buffer);
+   MCTF_FINISH();
+}
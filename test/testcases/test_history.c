@@ -29,6 +29,7 @@
 
 #include <pgexporter.h>
 #include <history.h>
+#include <history_columnar.h>
 #include <prometheus.h>
 #include <art.h>
 #include <memory.h>
@@ -40,6 +41,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sqlite3.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -181,6 +183,168 @@ cleanup:
    MCTF_FINISH();
 }
 
+static int
+stream_collect(void* data, struct history_record* record)
+{
+   time_t* ts = (time_t*)data;
+
+   ts[0]++;
+   ts[ts[0]] = record->ts;
+
+   /* Stop the query on the third record */
+   return ts[0] == 3 ? 1 : 0;
+}
+
+MCTF_TEST(test_history_query_stream)
+{
+   struct history_record in[3];
+   time_t seen[4] = {0};
+   time_t now = time(NULL);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   make_record(&in[0], now + 2, "s", "m", "", 1.0);
+   make_record(&in[1], now, "s", "m", "", 2.0);
+   make_record(&in[2], now + 1, "s", "m", "", 3.0);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 2), 0, cleanup, "write failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_stream("m", now, now + 10, stream_collect, seen), 0,
+                      cleanup, "stream failed");
+   MCTF_ASSERT(seen[0] == 2 && seen[1] == now && seen[2] == now + 2, cleanup, "records not streamed in order");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(&in[2], 1), 0, cleanup, "write failed");
+
+   seen[0] = 0;
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_stream("m", now, now + 10, stream_collect, seen), 1,
+                      cleanup, "a failing callback should fail the query");
+   MCTF_ASSERT(seen[0] == 3, cleanup, "the query should stop at the failing callback");
+
+cleanup:
+   MCTF_FINISH();
+}
+
+struct query_result
+{
+   int count;
+   time_t ts[8];
+   double value[8];
+};
+
+static int
+query_collect(void* data, struct history_record* record)
+{
+   struct query_result* result = (struct query_result*)data;
+
+   if (result->count < 8)
+   {
+      result->ts[result->count] = record->ts;
+      result->value[result->count] = record->value;
+   }
+   result->count++;
+
+   return 0;
+}
+
+MCTF_TEST(test_history_query_step_and_matchers)
+{
+   struct history_record in[8];
+   struct history_query query;
+   struct query_result result;
+   time_t base = 1800000000;
+
+   memset(&query, 0, sizeof(struct history_query));
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   /* A counter per database, scraped every 10s, with a reset at base + 30 */
+   for (int i = 0; i < 4; i++)
+   {
+      make_record(&in[i * 2], base + i * 10, "s", "m", "server=\"s\", database=\"a\"", i == 3 ? 5.0 : (double)(i * 10));
+      make_record(&in[i * 2 + 1], base + i * 10, "s", "m", "server=\"s\", database=\"b\"", 100.0);
+   }
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 8), 0, cleanup, "write failed");
+
+   query.start = base;
+   query.end = base + 100;
+   query.step = 20;
+   query.aggregation = HISTORY_AGGREGATION_AVG;
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("database=\"a\"", &query.matchers[0]), 0, cleanup, "matcher parse failed");
+   query.number_of_matchers = 1;
+
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "avg query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 2, cleanup, "expected 2 buckets, got %d", result.count);
+   MCTF_ASSERT(result.ts[0] == base && result.value[0] == 5.0, cleanup, "bucket0 avg mismatch");
+   MCTF_ASSERT(result.ts[1] == base + 20 && result.value[1] == 12.5, cleanup, "bucket1 avg mismatch");
+
+   query.aggregation = HISTORY_AGGREGATION_RATE;
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "rate query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 2, cleanup, "expected 2 rate buckets, got %d", result.count);
+   MCTF_ASSERT(result.value[0] == 1.0, cleanup, "bucket0 rate mismatch");
+   MCTF_ASSERT(result.value[1] == 0.75, cleanup, "bucket1 rate should count the reset as an increase");
+
+   pgexporter_history_query_destroy(&query);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("database!~\"a|c\"", &query.matchers[0]), 0, cleanup, "regex parse failed");
+   query.number_of_matchers = 1;
+   query.step = 0;
+   query.aggregation = HISTORY_AGGREGATION_NONE;
+
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "raw query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 4, cleanup, "expected the 4 samples of database b, got %d", result.count);
+   MCTF_ASSERT(result.value[0] == 100.0, cleanup, "raw value mismatch");
+
+cleanup:
+   pgexporter_history_query_destroy(&query);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_query_agg_whole_window)
+{
+   struct history_record in[4];
+   struct history_query query;
+   struct query_result result;
+   time_t base = 1800000007;
+
+   memset(&query, 0, sizeof(struct history_query));
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   for (int i = 0; i < 4; i++)
+   {
+      make_record(&in[i], base + i * 10, "s", "m", "", (double)(i + 1));
+   }
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 4), 0, cleanup, "write failed");
+
+   /* agg without a step: the window is not aligned to its own length */
+   query.start = base;
+   query.end = base + 30;
+   query.step = query.end - query.start + 1;
+   query.aggregation = HISTORY_AGGREGATION_AVG;
+
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "avg query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 1, cleanup, "expected 1 bucket, got %d", result.count);
+   MCTF_ASSERT(result.ts[0] == base && result.value[0] == 2.5, cleanup, "bucket avg mismatch");
+
+cleanup:
+   pgexporter_history_query_destroy(&query);
+   MCTF_FINISH();
+}
+
+MCTF_TEST_NEGATIVE(test_history_matcher_parse_invalid)
+{
+   struct history_matcher matcher;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("=\"a\"", &matcher), 1, cleanup, "a matcher needs a name");
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("database", &matcher), 1, cleanup, "a matcher needs an operator");
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("database=~\"(\"", &matcher), 1, cleanup, "an invalid regex should fail");
+
+cleanup:
+   MCTF_FINISH();
+}
+
 MCTF_TEST(test_history_write_empty_batch)
 {
    int count = -1;
@@ -369,75 +533,245 @@ cleanup:
    MCTF_FINISH();
 }
 
-struct mock_prometheus_metric_value
+MCTF_TEST(test_history_series_reused_after_reopen)
 {
-   time_t timestamp;
-   char* value;
-   char* help;
-   char* type;
-   int sort_type;
-};
+   struct history_record in[2];
+   struct history_record* out = NULL;
+   int count = 0;
+   time_t now = time(NULL);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   make_record(&in[0], now, "srv1", "pg_up", "server=\"srv1\"", 1.0);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 1), 0, cleanup, "first write failed");
+
+   /* A new connection starts with an empty series cache */
+   pgexporter_history_shutdown();
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "reinit failed");
+
+   make_record(&in[0], now + 1, "srv1", "pg_up", "server=\"srv1\"", 2.0);
+   make_record(&in[1], now + 1, "srv2", "pg_up", "server=\"srv2\"", 3.0);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 2), 0, cleanup, "second write failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("pg_up", now, now + 10, &out, &count), 0,
+                      cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(count, 3, cleanup, "expected 3 rows, got %d", count);
+   MCTF_ASSERT_STR_EQ(out[1].labels, "server=\"srv1\"", cleanup, "row1 labels mismatch");
+   MCTF_ASSERT(out[1].value == 2.0, cleanup, "row1 value mismatch");
+   MCTF_ASSERT_STR_EQ(out[2].server, "srv2", cleanup, "row2 server mismatch");
+
+cleanup:
+   pgexporter_history_records_free(out, count);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_migrates_flat_table)
+{
+   sqlite3* db = NULL;
+   struct history_record* out = NULL;
+   int count = 0;
+
+   /* The layout written by earlier versions */
+   MCTF_ASSERT_INT_EQ(sqlite3_open(db_path, &db), SQLITE_OK, cleanup, "open failed");
+   MCTF_ASSERT_INT_EQ(sqlite3_exec(db,
+                                   "CREATE TABLE history (ts INTEGER, server TEXT, metric TEXT, labels TEXT, value REAL);"
+                                   "INSERT INTO history VALUES (100, 's', 'm', 'a=\"1\"', 1.0);"
+                                   "INSERT INTO history VALUES (200, 's', 'm', 'a=\"1\"', 2.0);"
+                                   "INSERT INTO history VALUES (150, 's', 'm', '', 3.0);",
+                                   NULL, NULL, NULL),
+                      SQLITE_OK, cleanup, "create failed");
+   sqlite3_close(db);
+   db = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("m", 0, 1000, &out, &count), 0,
+                      cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(count, 3, cleanup, "expected 3 migrated rows, got %d", count);
+   MCTF_ASSERT(out[0].ts == 100 && out[1].ts == 150 && out[2].ts == 200, cleanup, "rows not ordered by ts");
+   MCTF_ASSERT_STR_EQ(out[1].labels, "", cleanup, "row1 labels mismatch");
+   MCTF_ASSERT(out[2].value == 2.0, cleanup, "row2 value mismatch");
+
+cleanup:
+   if (db != NULL)
+   {
+      sqlite3_close(db);
+   }
+   pgexporter_history_records_free(out, count);
+   MCTF_FINISH();
+}
+
+static int
+label_index_count(const char* name, const char* value)
+{
+   sqlite3* db = NULL;
+   sqlite3_stmt* stmt = NULL;
+   int count = -1;
+
+   if (sqlite3_open(db_path, &db) == SQLITE_OK &&
+       sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM series_labels WHERE name = ? AND value = ?;", -1, &stmt, NULL) == SQLITE_OK)
+   {
+      sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC);
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+      {
+         count = sqlite3_column_int(stmt, 0);
+      }
+   }
+
+   sqlite3_finalize(stmt);
+   sqlite3_close(db);
+
+   return count;
+}
+
+MCTF_TEST(test_history_label_index)
+{
+   sqlite3* db = NULL;
+   struct history_record in[4];
+   struct history_query query;
+   struct query_result result;
+
+   memset(&query, 0, sizeof(struct history_query));
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   make_record(&in[0], 100, "primary", "m", "database=\"a\"", 1.0);
+   make_record(&in[1], 100, "primary", "m", "database=\"b\"", 2.0);
+   make_record(&in[2], 100, "replica", "m", "database=\"b\"", 3.0);
+   make_record(&in[3], 200, "primary", "m", "database=\"b\"", 4.0);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 4), 0, cleanup, "write failed");
+
+   MCTF_ASSERT_INT_EQ(label_index_count("database", "b"), 2, cleanup, "database=b should index 2 series");
+   MCTF_ASSERT_INT_EQ(label_index_count("server", "primary"), 2, cleanup, "server=primary should index 2 series");
+
+   query.start = 0;
+   query.end = 1000;
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("database=\"b\"", &query.matchers[0]), 0, cleanup, "matcher parse failed");
+   MCTF_ASSERT_INT_EQ(pgexporter_history_matcher_parse("server=\"primary\"", &query.matchers[1]), 0, cleanup, "matcher parse failed");
+   query.number_of_matchers = 2;
+
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 2, cleanup, "expected 2 samples, got %d", result.count);
+   MCTF_ASSERT(result.value[0] == 2.0 && result.value[1] == 4.0, cleanup, "wrong series");
+
+   /* The index of a database without one is built when it is opened */
+   pgexporter_history_shutdown();
+   MCTF_ASSERT_INT_EQ(sqlite3_open(db_path, &db), SQLITE_OK, cleanup, "open failed");
+   MCTF_ASSERT_INT_EQ(sqlite3_exec(db, "DELETE FROM series_labels;", NULL, NULL, NULL), SQLITE_OK, cleanup, "delete failed");
+   sqlite3_close(db);
+   db = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "reinit failed");
+   MCTF_ASSERT_INT_EQ(label_index_count("database", "b"), 2, cleanup, "index not rebuilt");
 
-MCTF_TEST(test_history_store_metrics_edge_cases)
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "query after reopen failed");
+   MCTF_ASSERT_INT_EQ(result.count, 2, cleanup, "expected 2 samples after reopen, got %d", result.count);
+
+cleanup:
+   if (db != NULL)
+   {
+      sqlite3_close(db);
+   }
+   pgexporter_history_query_destroy(&query);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_store_metrics_samples)
 {
    struct configuration* config = (struct configuration*)shmem;
    prometheus_metrics_container_t* container = NULL;
-   struct art* t = NULL;
    struct history_record* out = NULL;
    int out_len = 0;
+   char* strings[] = {"edge_case_no_labels", "", "edge_case_with_server", "db1", "server=\"db1\""};
+   struct prometheus_sample samples[] = {
+      {.name = 0, .server = 1, .labels = 1, .value = 42.0},
+      {.name = 2, .server = 3, .labels = 4, .value = 10.5}};
 
    /* Set up an in-memory test database */
    unlink_db("test_edge_cases.db");
    pgexporter_snprintf(config->history_path, MAX_PATH, "test_edge_cases.db");
    MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "history_init failed");
 
-   /* Create a dummy container */
+   /* Create a dummy container with structured samples */
    container = malloc(sizeof(prometheus_metrics_container_t));
    memset(container, 0, sizeof(prometheus_metrics_container_t));
 
-   pgexporter_art_create(&t);
-   container->general_metrics = t;
-
-   struct mock_prometheus_metric_value m1;
-   memset(&m1, 0, sizeof(m1));
-   m1.value = "pgexporter_up 1\n";
-   pgexporter_art_insert(t, "m1", (uintptr_t)&m1, ValueRef);
+   container->sample_strings = strings;
+   container->number_of_sample_strings = sizeof(strings) / sizeof(strings[0]);
+   container->samples = samples;
+   container->number_of_samples = sizeof(samples) / sizeof(samples[0]);
 
-   struct mock_prometheus_metric_value m2;
-   memset(&m2, 0, sizeof(m2));
-   m2.value = "edge_case_no_labels 42\nedge_case_with_server{server=\"db1\"} 10.5\n";
-   pgexporter_art_insert(t, "m2", (uintptr_t)&m2, ValueRef);
-
-   struct mock_prometheus_metric_value m3;
-   memset(&m3, 0, sizeof(m3));
-   m3.value = "   weird_leading_space 1\nempty_line\n\n# comment\nmetric{broken} 2";
-   pgexporter_art_insert(t, "m3", (uintptr_t)&m3, ValueRef);
-
-   /* Run the parser on these edge cases */
    MCTF_ASSERT_INT_EQ(pgexporter_history_store_metrics(container), 0, cleanup, "store_metrics returned error");
 
    time_t now = time(NULL);
    MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("edge_case_no_labels", now - 10, now + 10, &out, &out_len), 0, cleanup, "query failed");
    MCTF_ASSERT_INT_EQ(out_len, 1, cleanup, "Expected 1 record for edge_case_no_labels");
    MCTF_ASSERT(out[0].value == 42.0, cleanup, "Expected value 42");
+   MCTF_ASSERT_INT_EQ(strlen(out[0].server), 0, cleanup, "Expected no server");
    pgexporter_history_records_free(out, out_len);
    out = NULL;
 
    MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("edge_case_with_server", now - 10, now + 10, &out, &out_len), 0, cleanup, "query failed");
    MCTF_ASSERT_INT_EQ(out_len, 1, cleanup, "Expected 1 record for edge_case_with_server");
    MCTF_ASSERT_INT_EQ(strcmp(out[0].server, "db1"), 0, cleanup, "Expected server db1");
+   MCTF_ASSERT(out[0].labels != NULL && !strcmp(out[0].labels, "server=\"db1\""), cleanup, "Expected the label set");
    MCTF_ASSERT(out[0].value == 10.5, cleanup, "Expected value 10.5");
 
 cleanup:
    pgexporter_history_records_free(out, out_len);
-   if (container)
+   free(container);
+   pgexporter_history_shutdown();
+   unlink_db("test_edge_cases.db");
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_queue_drain)
+{
+   prometheus_metrics_container_t* container = NULL;
+   struct history_record* out = NULL;
+   int out_len = 0;
+   size_t queue_size = 0;
+   char* strings[] = {"queued_metric", "db1", "server=\"db1\", database=\"postgres\""};
+   struct prometheus_sample samples[] = {
+      {.name = 0, .server = 1, .labels = 2, .value = 7.0}};
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "history_init failed");
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init_queue(&queue_size, &history_queue_shmem), 0, cleanup, "init_queue failed");
+
+   container = malloc(sizeof(prometheus_metrics_container_t));
+   memset(container, 0, sizeof(prometheus_metrics_container_t));
+
+   container->sample_strings = strings;
+   container->number_of_sample_strings = sizeof(strings) / sizeof(strings[0]);
+   container->samples = samples;
+   container->number_of_samples = sizeof(samples) / sizeof(samples[0]);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_enqueue(container), 0, cleanup, "first enqueue failed");
+   samples[0].value = 8.0;
+   MCTF_ASSERT_INT_EQ(pgexporter_history_enqueue(container), 0, cleanup, "second enqueue failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_drain(), 0, cleanup, "drain failed");
+   MCTF_ASSERT_INT_EQ(pgexporter_history_drain(), 0, cleanup, "drain of an empty queue failed");
+
+   time_t now = time(NULL);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("queued_metric", now - 10, now + 10, &out, &out_len), 0, cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(out_len, 2, cleanup, "Expected 2 queued records, got %d", out_len);
+   MCTF_ASSERT(out[0].value + out[1].value == 15.0, cleanup, "Expected values 7 and 8");
+   MCTF_ASSERT_INT_EQ(strcmp(out[0].server, "db1"), 0, cleanup, "Expected server db1");
+   MCTF_ASSERT(out[0].labels != NULL && !strcmp(out[0].labels, strings[2]), cleanup, "Expected the label set");
+
+cleanup:
+   pgexporter_history_records_free(out, out_len);
+   free(container);
+   if (history_queue_shmem != NULL)
    {
-      if (container->general_metrics)
-         pgexporter_art_destroy(container->general_metrics);
-      free(container);
+      pgexporter_destroy_shared_memory(history_queue_shmem, queue_size);
+      history_queue_shmem = NULL;
    }
    pgexporter_history_shutdown();
-   unlink_db("test_edge_cases.db");
    MCTF_FINISH();
 }
 
@@ -600,3 +934,203 @@ MCTF_TEST(test_history_prune_spans_all_metrics)
 cleanup:
    MCTF_FINISH();
 }
+
+MCTF_TEST(test_history_prune_in_batches)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record* in = NULL;
+   int count = -1;
+   int n = 25000;
+   unsigned long records;
+   unsigned long batches;
+   time_t now = time(NULL);
+
+   in = calloc(n, sizeof(struct history_record));
+   MCTF_ASSERT_PTR_NONNULL(in, cleanup, "calloc failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   config->history_retention = PGEXPORTER_TIME_SEC(3600);
+
+   for (int i = 0; i < n - 1; i++)
+   {
+      make_record(&in[i], now - 7200 - i, "s", "m", "", (double)i);
+   }
+   make_record(&in[n - 1], now, "s", "m", "", 1.0);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, n), 0, cleanup, "write failed");
+
+   records = atomic_load(&config->history_prune_records);
+   batches = atomic_load(&config->history_prune_batches);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_prune(), 0, cleanup, "prune failed");
+
+   MCTF_ASSERT(atomic_load(&config->history_prune_records) - records == (unsigned long)(n - 1), cleanup,
+               "expected %d pruned records", n - 1);
+   MCTF_ASSERT(atomic_load(&config->history_prune_batches) - batches == 3, cleanup, "expected 3 batches");
+   MCTF_ASSERT(!atomic_load(&config->history_prune_pending), cleanup, "prune should be complete");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("m", 0, now + 10, NULL, &count), 0, cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(count, 1, cleanup, "expected 1 row after prune, got %d", count);
+
+cleanup:
+   free(in);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_rollup_tiers)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record in[8];
+   struct history_query query;
+   struct query_result result;
+   time_t now = time(NULL);
+   time_t old = (now / 3600 - 72) * 3600;
+   time_t mid = now / 60 * 60 - 7200;
+
+   memset(&query, 0, sizeof(struct history_query));
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   config->history_retention = PGEXPORTER_TIME_SEC(30 * 86400);
+   config->history_raw_retention = PGEXPORTER_TIME_SEC(3600);
+   config->history_minute_retention = PGEXPORTER_TIME_SEC(86400);
+
+   /* Only in samples_1h after prune */
+   make_record(&in[0], old, "s", "m", "", 1.0);
+   make_record(&in[1], old + 20, "s", "m", "", 2.0);
+   make_record(&in[2], old + 40, "s", "m", "", 3.0);
+   make_record(&in[3], old + 60, "s", "m", "", 10.0);
+   make_record(&in[4], old + 80, "s", "m", "", 20.0);
+   /* Only in samples_1m after prune */
+   make_record(&in[5], mid, "s", "m", "", 4.0);
+   make_record(&in[6], mid + 30, "s", "m", "", 6.0);
+   /* Not rolled up yet */
+   make_record(&in[7], now - 60, "s", "m", "", 7.0);
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 8), 0, cleanup, "write failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_rollup(), 0, cleanup, "rollup failed");
+   MCTF_ASSERT_INT_EQ(pgexporter_history_prune(), 0, cleanup, "prune failed");
+   /* Nothing is rolled up twice */
+   MCTF_ASSERT_INT_EQ(pgexporter_history_rollup(), 0, cleanup, "second rollup failed");
+
+   query.start = old;
+   query.end = now;
+
+   /* Raw queries read the last value of the rollups that replaced the samples */
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "raw query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 3, cleanup, "expected 3 records, got %d", result.count);
+   MCTF_ASSERT(result.ts[0] == old && result.value[0] == 20.0, cleanup, "hour rollup mismatch");
+   MCTF_ASSERT(result.ts[1] == mid && result.value[1] == 6.0, cleanup, "minute rollup mismatch");
+   MCTF_ASSERT(result.ts[2] == now - 60 && result.value[2] == 7.0, cleanup, "raw sample mismatch");
+
+   query.step = 3600;
+   query.aggregation = HISTORY_AGGREGATION_AVG;
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "avg query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 3, cleanup, "expected 3 buckets, got %d", result.count);
+   MCTF_ASSERT(result.ts[0] == old && result.value[0] == 7.2, cleanup, "hour avg mismatch");
+   MCTF_ASSERT(result.value[1] == 5.0, cleanup, "minute avg mismatch");
+   MCTF_ASSERT(result.value[2] == 7.0, cleanup, "raw avg mismatch");
+
+   query.aggregation = HISTORY_AGGREGATION_MIN;
+   memset(&result, 0, sizeof(result));
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query("m", &query, query_collect, &result), 0, cleanup, "min query failed");
+   MCTF_ASSERT_INT_EQ(result.count, 3, cleanup, "expected 3 min buckets, got %d", result.count);
+   MCTF_ASSERT(result.value[0] == 1.0 && result.value[1] == 4.0, cleanup, "min mismatch");
+
+cleanup:
+   pgexporter_history_query_destroy(&query);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_columnar_compaction_roundtrip)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record in[6];
+   struct history_record* out = NULL;
+   int count = 0;
+   char dir[MAX_PATH];
+   char raw[MAX_PATH];
+   time_t base = time(NULL) - 3 * HISTORY_COLUMNAR_PARTITION_SECONDS;
+   double values[3] = {1.0, 1.5, 123456.789};
+
+   base -= base % HISTORY_COLUMNAR_PARTITION_SECONDS;
+
+   pgexporter_snprintf(dir, MAX_PATH, "/tmp/pgexporter-test/history-columnar-%d", (int)getpid());
+   pgexporter_delete_directory(dir);
+   pgexporter_snprintf(config->history_path, MAX_PATH, "%s", dir);
+   config->history_backend = HISTORY_BACKEND_COLUMNAR;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   /* Irregular intervals exercise the delta-of-delta encoding */
+   for (int i = 0; i < 3; i++)
+   {
+      time_t offset = i == 0 ? 0 : i == 1 ? 15 : 1000;
+
+      make_record(&in[i * 2], base + offset, "srv1", "pg_up", "server=\"srv1\"", values[i]);
+      make_record(&in[i * 2 + 1], base + offset, "srv2", "pg_up", "server=\"srv2\"", -values[i]);
+   }
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 6), 0, cleanup, "write failed");
+
+   pgexporter_snprintf(raw, MAX_PATH, "%s/%012lld.raw", dir, (long long)base);
+   MCTF_ASSERT(!pgexporter_exists(raw), cleanup, "closed partition should be compacted");
+
+   /* Reopen so the series dictionary is read back from disk */
+   pgexporter_history_shutdown();
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "reinit failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("pg_up", base, base + 15, &out, &count), 0,
+                      cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(count, 4, cleanup, "expected 4 rows, got %d", count);
+   MCTF_ASSERT(out[0].ts == base && out[3].ts == base + 15, cleanup, "rows not ordered by ts");
+   MCTF_ASSERT_STR_EQ(out[1].labels, "server=\"srv2\"", cleanup, "row1 labels mismatch");
+   MCTF_ASSERT(out[2].value == 1.5 && out[3].value == -1.5, cleanup, "values mismatch");
+   pgexporter_history_records_free(out, count);
+   out = NULL;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("pg_up", base + 16, base + 3600, &out, &count), 0,
+                      cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(count, 2, cleanup, "expected 2 rows, got %d", count);
+   MCTF_ASSERT(out[0].value == 123456.789, cleanup, "value mismatch");
+
+cleanup:
+   pgexporter_history_records_free(out, count);
+   pgexporter_history_shutdown();
+   pgexporter_delete_directory(dir);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_history_columnar_prune_partitions)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record in[2];
+   int count = -1;
+   char dir[MAX_PATH];
+   time_t now = time(NULL);
+
+   pgexporter_snprintf(dir, MAX_PATH, "/tmp/pgexporter-test/history-columnar-%d", (int)getpid());
+   pgexporter_delete_directory(dir);
+   pgexporter_snprintf(config->history_path, MAX_PATH, "%s", dir);
+   config->history_backend = HISTORY_BACKEND_COLUMNAR;
+   config->history_retention = PGEXPORTER_TIME_SEC(3600);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_init(), 0, cleanup, "init failed");
+
+   make_record(&in[0], now - 3 * HISTORY_COLUMNAR_PARTITION_SECONDS, "s", "m", "", 1.0); /* pruned */
+   make_record(&in[1], now, "s", "m", "", 2.0);                                            /* kept   */
+   MCTF_ASSERT_INT_EQ(pgexporter_history_write_batch(in, 2), 0, cleanup, "write failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_prune(), 0, cleanup, "prune failed");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_history_query_range("m", 0, now + 10, NULL, &count), 0,
+                      cleanup, "query failed");
+   MCTF_ASSERT_INT_EQ(count, 1, cleanup, "expected 1 row after prune, got %d", count);
+
+cleanup:
+   pgexporter_history_shutdown();
+   pgexporter_delete_directory(dir);
+   MCTF_FINISH();
+}
@@ -589,6 +589,72 @@ cleanup:
    MCTF_FINISH();
 }
 
+MCTF_TEST(test_http_metrics_scrape_incomplete)
+{
+   struct http* connection = NULL;
+   struct http_request* request = NULL;
+   struct http_response* response = NULL;
+   struct configuration* config;
+   char* body = NULL;
+   int ret;
+
+   pgexporter_test_setup();
+
+   config = (struct configuration*)shmem;
+
+   ret = pgexporter_http_create("localhost", config->metrics, false, &connection);
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to connect to HTTP endpoint localhost:%d", config->metrics);
+
+   /* A budget this small expires during the scrape, so the response is partial */
+   ret = pgexporter_http_request_create(PGEXPORTER_HTTP_GET, "/metrics", &request);
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to create HTTP request");
+   ret = pgexporter_http_request_add_header(request, "X-Prometheus-Scrape-Timeout-Seconds", "0.001");
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to add scrape timeout header");
+
+   ret = pgexporter_http_invoke(connection, request, &response);
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to execute HTTP GET /metrics");
+   MCTF_ASSERT_PTR_NONNULL(response->payload.data, cleanup, "HTTP response body is NULL");
+
+   body = (char*)response->payload.data;
+   MCTF_ASSERT(strstr(body, "pgexporter_state 1") != NULL, cleanup, "Partial scrape is missing pgexporter_state");
+   MCTF_ASSERT(strstr(body, "pgexporter_scrape_incomplete{server=\"primary\"} 1") != NULL, cleanup,
+               "Partial scrape is not reported as incomplete");
+
+   pgexporter_http_response_destroy(response);
+   response = NULL;
+   pgexporter_http_request_destroy(request);
+   request = NULL;
+   pgexporter_http_destroy(connection);
+   connection = NULL;
+
+   /* The flag belongs to the scrape that set it, the next one starts clean */
+   ret = pgexporter_http_create("localhost", config->metrics, false, &connection);
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to connect to HTTP endpoint localhost:%d", config->metrics);
+
+   ret = pgexporter_http_request_create(PGEXPORTER_HTTP_GET, "/metrics", &request);
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to create HTTP request");
+
+   ret = pgexporter_http_invoke(connection, request, &response);
+   MCTF_ASSERT(ret == 0, cleanup, "Failed to execute HTTP GET /metrics");
+   MCTF_ASSERT_PTR_NONNULL(response->payload.data, cleanup, "HTTP response body is NULL");
+
+   body = (char*)response->payload.data;
+   MCTF_ASSERT(strstr(body, "pgexporter_scrape_incomplete{server=\"primary\"} 0") != NULL, cleanup,
+               "Full scrape is still reported as incomplete");
+   MCTF_ASSERT(strstr(body, "pgexporter_postgresql_version") != NULL, cleanup,
+               "Full scrape is missing pgexporter_postgresql_version");
+
+cleanup:
+   if (response)
+      pgexporter_http_response_destroy(response);
+   if (request)
+      pgexporter_http_request_destroy(request);
+   if (connection)
+      pgexporter_http_destroy(connection);
+   pgexporter_test_teardown();
+   MCTF_FINISH();
+}
+
 /* Must run last: shuts down the daemon. Defined last so it registers last and runs last. */
 MCTF_TEST(test_http_shutdown)
 {
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pgexporter.h>
+#include <logging.h>
+#include <shmem.h>
+#include <utils.h>
+
+#include <mctf.h>
+#include <tscommon.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static size_t log_ring_size = 0;
+static int saved_log_type = 0;
+static int saved_log_level = 0;
+static int saved_log_writer_pid = 0;
+
+/* The published lines from the tail of the ring, like the writer would write them */
+static char*
+ring_text(struct log_ring* ring, int* records)
+{
+   char* text = NULL;
+   size_t length = 0;
+   unsigned long head = atomic_load(&ring->head);
+
+   *records = 0;
+
+   for (unsigned long i = atomic_load(&ring->tail); i < head; i++)
+   {
+      struct log_record* record = &ring->records[i % PGEXPORTER_LOGGING_RING_SLOTS];
+      char* t = NULL;
+
+      if (atomic_load(&record->sequence) != i + 1)
+      {
+         break;
+      }
+
+      t = realloc(text, length + record->length + 1);
+      if (t == NULL)
+      {
+         break;
+      }
+      text = t;
+
+      memcpy(text + length, record->data, record->length);
+      length += record->length;
+      text[length] = '\0';
+      (*records)++;
+   }
+
+   return text;
+}
+
+/* Free the slots up to a sequence, like the writer would once they are written */
+static void
+ring_free(struct log_ring* ring, unsigned long until)
+{
+   for (unsigned long i = atomic_load(&ring->tail); i < until; i++)
+   {
+      atomic_store(&ring->records[i % PGEXPORTER_LOGGING_RING_SLOTS].sequence, i + PGEXPORTER_LOGGING_RING_SLOTS);
+   }
+   atomic_store(&ring->tail, until);
+}
+
+MCTF_TEST_SETUP(logging)
+{
+   struct configuration* config = (struct configuration*)shmem;
+
+   pgexporter_log_ring_init(&log_ring_size, &log_ring_shmem);
+
+   /* Queue the lines of this process as if there was a log writer */
+   saved_log_type = config->log_type;
+   saved_log_level = config->log_level;
+   saved_log_writer_pid = atomic_load(&config->log_writer_pid);
+
+   config->log_type = PGEXPORTER_LOGGING_TYPE_FILE;
+   config->log_level = PGEXPORTER_LOGGING_LEVEL_INFO;
+   atomic_store(&config->log_writer_pid, (int)getpid());
+}
+
+MCTF_TEST_TEARDOWN(logging)
+{
+   struct configuration* config = (struct configuration*)shmem;
+
+   config->log_type = saved_log_type;
+   config->log_level = saved_log_level;
+   atomic_store(&config->log_writer_pid, saved_log_writer_pid);
+
+   if (log_ring_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(log_ring_shmem, log_ring_size);
+      log_ring_shmem = NULL;
+   }
+}
+
+MCTF_TEST(test_logging_ring_order)
+{
+   char long_line[3000];
+   char* text = NULL;
+   char* first = NULL;
+   char* second = NULL;
+   char* third = NULL;
+   int records = 0;
+   struct log_ring* ring = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(log_ring_shmem, cleanup, "log ring not initialized");
+   ring = (struct log_ring*)log_ring_shmem;
+
+   memset(long_line, 'x', sizeof(long_line) - 1);
+   long_line[sizeof(long_line) - 1] = '\0';
+
+   pgexporter_log_warn("first");
+   pgexporter_log_warn("%s", long_line);
+   pgexporter_log_warn("last");
+
+   text = ring_text(ring, &records);
+   MCTF_ASSERT_PTR_NONNULL(text, cleanup, "nothing was queued");
+   MCTF_ASSERT_INT_EQ(records, 5, cleanup, "the long line should span three records");
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&ring->dropped), 0, cleanup, "unexpected drop");
+
+   /* The records of the long line are consecutive, so the lines keep their order */
+   first = text;
+   second = strchr(first, '\n');
+   MCTF_ASSERT_PTR_NONNULL(second, cleanup, "missing first line");
+   *second++ = '\0';
+   third = strchr(second, '\n');
+   MCTF_ASSERT_PTR_NONNULL(third, cleanup, "missing second line");
+   *third++ = '\0';
+
+   MCTF_ASSERT(pgexporter_ends_with(first, " first"), cleanup, "unexpected first line: %s", first);
+   MCTF_ASSERT(pgexporter_ends_with(second, long_line), cleanup, "the long line is not intact");
+   MCTF_ASSERT_STR_EQ(strchr(third, '\n'), "\n", cleanup, "expected a single third line");
+   MCTF_ASSERT(!strncmp(third + strlen(third) - strlen(" last\n"), " last\n", strlen(" last\n")), cleanup,
+               "unexpected last line: %s", third);
+
+cleanup:
+   free(text);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_logging_ring_full)
+{
+   char long_line[2000];
+   char* text = NULL;
+   int records = 0;
+   unsigned long head;
+   struct log_ring* ring = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(log_ring_shmem, cleanup, "log ring not initialized");
+   ring = (struct log_ring*)log_ring_shmem;
+
+   memset(long_line, 'y', sizeof(long_line) - 1);
+   long_line[sizeof(long_line) - 1] = '\0';
+
+   for (int i = 0; i < PGEXPORTER_LOGGING_RING_SLOTS; i++)
+   {
+      pgexporter_log_warn("line %d", i);
+   }
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&ring->head), PGEXPORTER_LOGGING_RING_SLOTS, cleanup, "expected a slot per line");
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&ring->dropped), 0, cleanup, "unexpected drop");
+
+   /* A full ring drops lines instead of waiting for the writer */
+   for (int i = 0; i < 10; i++)
+   {
+      pgexporter_log_warn("extra %d", i);
+   }
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&ring->dropped), 10, cleanup, "expected every extra line to be dropped");
+
+   /* A long line needs all of its slots to be free */
+   ring_free(ring, 1);
+   pgexporter_log_warn("%s", long_line);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&ring->dropped), 11, cleanup, "a long line fit in a single slot");
+
+   ring_free(ring, 2);
+   head = atomic_load(&ring->head);
+   pgexporter_log_warn("%s", long_line);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&ring->dropped), 11, cleanup, "the long line was dropped");
+   MCTF_ASSERT_INT_EQ((int)(atomic_load(&ring->head) - head), 2, cleanup, "the long line should take two slots");
+
+   text = ring_text(ring, &records);
+   MCTF_ASSERT_PTR_NONNULL(text, cleanup, "nothing was queued");
+   MCTF_ASSERT_INT_EQ(records, PGEXPORTER_LOGGING_RING_SLOTS, cleanup, "unexpected number of records");
+   MCTF_ASSERT(pgexporter_ends_with(text, "\n") && strstr(text, " line 2\n") != NULL, cleanup, "lost a queued line");
+   MCTF_ASSERT(strstr(text, "extra") == NULL, cleanup, "a dropped line was queued");
+
+cleanup:
+   free(text);
+   MCTF_FINISH();
+}
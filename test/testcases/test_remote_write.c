@@ -0,0 +1,558 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pgexporter.h>
+#include <history.h>
+#include <memory.h>
+#include <remote_write.h>
+#include <shmem.h>
+#include <snappy_compression.h>
+#include <utils.h>
+
+#include <mctf.h>
+#include <tscommon.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Spool directory of the test currently running */
+static char spool[MAX_PATH];
+
+/* Where the receiver stores the last request body */
+static char body_path[MAX_PATH];
+
+static void
+make_record(struct history_record* r, time_t ts, const char* server,
+            const char* metric, const char* labels, double value)
+{
+   memset(r, 0, sizeof(*r));
+   r->ts = ts;
+   pgexporter_snprintf(r->server, MISC_LENGTH, "%s", server);
+   pgexporter_snprintf(r->metric, PROMETHEUS_LENGTH, "%s", metric);
+   r->labels = (char*)labels;
+   r->value = value;
+}
+
+static int
+spool_segments(void)
+{
+   char** files = NULL;
+   int number_of_files = 0;
+   int n = 0;
+
+   if (pgexporter_get_files(spool, &number_of_files, &files))
+   {
+      return 0;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      if (strstr(files[i], ".wal") != NULL)
+      {
+         n++;
+      }
+      free(files[i]);
+   }
+   free(files);
+
+   return n;
+}
+
+/**
+ * A stand-in remote write receiver. Answers the given number of requests
+ * with the status, storing the last body in body_path. The receiver exits
+ * with the number of connections it accepted
+ */
+static pid_t
+start_receiver(int status, int requests, bool keep_alive, int* port)
+{
+   struct sockaddr_in address;
+   socklen_t length = sizeof(address);
+   int fd;
+   int client = -1;
+   int connections = 0;
+   pid_t pid;
+   int one = 1;
+
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0)
+   {
+      return -1;
+   }
+
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   address.sin_port = 0;
+
+   if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 8) != 0 ||
+       getsockname(fd, (struct sockaddr*)&address, &length) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+
+   *port = ntohs(address.sin_port);
+
+   pid = fork();
+   if (pid != 0)
+   {
+      close(fd);
+      return pid;
+   }
+
+   for (int i = 0; i < requests; i++)
+   {
+      char buffer[65536];
+      char response[128];
+      size_t received = 0;
+      size_t content_length = 0;
+      char* end = NULL;
+      char* header = NULL;
+      ssize_t n;
+
+      if (client < 0)
+      {
+         client = accept(fd, NULL, NULL);
+         if (client < 0)
+         {
+            _exit(255);
+         }
+         connections++;
+      }
+
+      while (received < sizeof(buffer) - 1)
+      {
+         n = read(client, buffer + received, sizeof(buffer) - 1 - received);
+         if (n <= 0)
+         {
+            break;
+         }
+         received += (size_t)n;
+         buffer[received] = '\0';
+
+         end = strstr(buffer, "\r\n\r\n");
+         if (end != NULL)
+         {
+            header = strcasestr(buffer, "Content-Length:");
+            content_length = header != NULL ? strtoul(header + 15, NULL, 10) : 0;
+
+            if (received >= (size_t)(end + 4 - buffer) + content_length)
+            {
+               break;
+            }
+         }
+      }
+
+      if (received == 0)
+      {
+         /* The sender closed the connection, the request comes on a new one */
+         close(client);
+         client = -1;
+         i--;
+         continue;
+      }
+
+      if (end != NULL && strstr(buffer, "Content-Encoding: snappy") != NULL)
+      {
+         FILE* file = fopen(body_path, "w");
+
+         if (file != NULL)
+         {
+            fwrite(end + 4, 1, content_length, file);
+            fclose(file);
+         }
+      }
+
+      snprintf(response, sizeof(response), "HTTP/1.1 %d Status\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+               status, keep_alive ? "keep-alive" : "close");
+      if (write(client, response, strlen(response)) < 0)
+      {
+         _exit(255);
+      }
+
+      if (!keep_alive)
+      {
+         close(client);
+         client = -1;
+      }
+   }
+
+   _exit(connections);
+}
+
+static void
+stop_receiver(pid_t pid)
+{
+   int status;
+
+   if (pid > 0)
+   {
+      kill(pid, SIGTERM);
+      waitpid(pid, &status, 0);
+   }
+}
+
+MCTF_TEST_SETUP(remote_write)
+{
+   struct configuration* config;
+
+   pgexporter_test_config_save();
+   pgexporter_memory_init();
+
+   config = (struct configuration*)shmem;
+
+   pgexporter_snprintf(spool, sizeof(spool), "/tmp/pgexporter-test/remote-write-%d", (int)getpid());
+   pgexporter_snprintf(body_path, sizeof(body_path), "/tmp/pgexporter-test/remote-write-%d.body", (int)getpid());
+   pgexporter_delete_directory(spool);
+   unlink(body_path);
+
+   pgexporter_snprintf(config->remote_write_spool, MAX_PATH, "%s", spool);
+   config->remote_write_shards = 1;
+   config->remote_write_spool_size = REMOTE_WRITE_DEFAULT_SPOOL_SIZE;
+   atomic_store(&config->remote_write_samples, 0);
+   atomic_store(&config->remote_write_failures, 0);
+   atomic_store(&config->remote_write_retries, 0);
+   atomic_store(&config->remote_write_dropped, 0);
+}
+
+MCTF_TEST_TEARDOWN(remote_write)
+{
+   pgexporter_delete_directory(spool);
+   unlink(body_path);
+   pgexporter_memory_destroy();
+   pgexporter_test_config_restore();
+}
+
+MCTF_TEST(test_remote_write_snappy_roundtrip)
+{
+   size_t sizes[] = {0, 7, 4096, 200000};
+   unsigned char* input = NULL;
+   void* compressed = NULL;
+   void* output = NULL;
+   size_t compressed_size = 0;
+   size_t output_size = 0;
+
+   input = malloc(200000);
+   MCTF_ASSERT_PTR_NONNULL(input, cleanup, "malloc failed");
+
+   for (size_t i = 0; i < 200000; i++)
+   {
+      /* Repetitive text with some noise so both literals and copies occur */
+      input[i] = (i % 1000) < 900 ? (unsigned char)("pg_stat_database{server=\"primary\"} "[i % 36]) : (unsigned char)(rand() & 0xFF);
+   }
+
+   for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+   {
+      MCTF_ASSERT_INT_EQ(pgexporter_snappy_compress(input, sizes[i], &compressed, &compressed_size), 0, cleanup,
+                         "compress of %zu bytes failed", sizes[i]);
+      MCTF_ASSERT_INT_EQ(pgexporter_snappy_decompress(compressed, compressed_size, &output, &output_size), 0, cleanup,
+                         "decompress of %zu bytes failed", sizes[i]);
+      MCTF_ASSERT(output_size == sizes[i], cleanup, "expected %zu bytes, got %zu", sizes[i], output_size);
+      MCTF_ASSERT(memcmp(input, output, sizes[i]) == 0, cleanup, "roundtrip of %zu bytes differs", sizes[i]);
+
+      if (sizes[i] == 200000)
+      {
+         MCTF_ASSERT(compressed_size < sizes[i] / 4, cleanup, "repetitive input compressed to %zu bytes", compressed_size);
+      }
+
+      free(compressed);
+      free(output);
+      compressed = NULL;
+      output = NULL;
+   }
+
+cleanup:
+   free(input);
+   free(compressed);
+   free(output);
+   MCTF_FINISH();
+}
+
+MCTF_TEST_NEGATIVE(test_remote_write_snappy_corrupt)
+{
+   unsigned char bad[] = {0x10, 0x05, 0x01};
+   void* output = NULL;
+   size_t output_size = 0;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_snappy_decompress(bad, sizeof(bad), &output, &output_size), 1, cleanup,
+                      "truncated input should fail");
+   MCTF_ASSERT_PTR_NULL(output, cleanup, "no output expected");
+
+cleanup:
+   free(output);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_parse_url)
+{
+   char host[MISC_LENGTH];
+   char path[MAX_PATH];
+   int port = 0;
+   bool secure = false;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_parse_url("https://mimir.example.com/api/v1/push", host, sizeof(host), &port, &secure, path, sizeof(path)), 0, cleanup);
+   MCTF_ASSERT_STR_EQ(host, "mimir.example.com", cleanup);
+   MCTF_ASSERT_INT_EQ(port, 443, cleanup);
+   MCTF_ASSERT(secure, cleanup, "https should be secure");
+   MCTF_ASSERT_STR_EQ(path, "/api/v1/push", cleanup);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_parse_url("http://localhost:9090", host, sizeof(host), &port, &secure, path, sizeof(path)), 0, cleanup);
+   MCTF_ASSERT_STR_EQ(host, "localhost", cleanup);
+   MCTF_ASSERT_INT_EQ(port, 9090, cleanup);
+   MCTF_ASSERT(!secure, cleanup, "http should not be secure");
+   MCTF_ASSERT_STR_EQ(path, "/", cleanup);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_parse_url("ftp://localhost/", host, sizeof(host), &port, &secure, path, sizeof(path)), 1, cleanup);
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_parse_url("http://localhost:abc/", host, sizeof(host), &port, &secure, path, sizeof(path)), 1, cleanup);
+
+cleanup:
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_encode_shards)
+{
+   struct history_record records[8];
+   void* buffer = NULL;
+   size_t size = 0;
+   int samples = 0;
+   int total = 0;
+
+   for (int i = 0; i < 8; i++)
+   {
+      char* labels[] = {"database=\"a\"", "database=\"b\"", NULL, "server=\"replica\""};
+
+      make_record(&records[i], 1000 + i, "primary", i % 2 ? "pg_up" : "pg_database_size", labels[i % 4], i);
+   }
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_encode(records, 8, 0, 1, &buffer, &size, &samples), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(samples, 8, cleanup, "all records belong to the only shard");
+   MCTF_ASSERT(size > 0 && ((unsigned char*)buffer)[0] == 0x0A, cleanup, "expected a TimeSeries field");
+   MCTF_ASSERT(memmem(buffer, size, "__name__", 8) != NULL, cleanup, "expected the metric name label");
+   MCTF_ASSERT(memmem(buffer, size, "replica", 7) != NULL, cleanup, "expected the server label of the record");
+   free(buffer);
+   buffer = NULL;
+
+   for (int shard = 0; shard < 4; shard++)
+   {
+      MCTF_ASSERT_INT_EQ(pgexporter_remote_write_encode(records, 8, shard, 4, &buffer, &size, &samples), 0, cleanup);
+      total += samples;
+      free(buffer);
+      buffer = NULL;
+   }
+
+   MCTF_ASSERT_INT_EQ(total, 8, cleanup, "every record belongs to exactly one shard");
+
+cleanup:
+   free(buffer);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_too_many_labels)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record records[2];
+   char labels[2048];
+   size_t length = 0;
+   void* buffer = NULL;
+   size_t size = 0;
+   int samples = 0;
+
+   labels[0] = '\0';
+   for (int i = 0; i < 40; i++)
+   {
+      length += snprintf(labels + length, sizeof(labels) - length, "%slabel%02d=\"%d\"", i > 0 ? "," : "", i, i);
+   }
+
+   make_record(&records[0], 1000, "primary", "pg_wide", labels, 1.0);
+   make_record(&records[1], 1000, "primary", "pg_up", NULL, 1.0);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_encode(records, 2, 0, 1, &buffer, &size, &samples), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(samples, 1, cleanup, "the wide series should be rejected");
+   MCTF_ASSERT(memmem(buffer, size, "pg_wide", 7) == NULL, cleanup, "the wide series should not be truncated");
+   MCTF_ASSERT(memmem(buffer, size, "pg_up", 5) != NULL, cleanup, "the other series should be kept");
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_dropped), 1, cleanup);
+
+cleanup:
+   free(buffer);
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_send)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record records[3];
+   void* request = NULL;
+   size_t request_size = 0;
+   FILE* file = NULL;
+   char data[65536];
+   size_t size = 0;
+   pid_t receiver;
+   int port = 0;
+
+   receiver = start_receiver(204, 1, false, &port);
+   MCTF_ASSERT(receiver > 0, cleanup, "failed to start receiver");
+
+   pgexporter_snprintf(config->remote_write_url, MAX_PATH, "http://127.0.0.1:%d/api/v1/write", port);
+
+   make_record(&records[0], 1000, "primary", "pg_up", NULL, 1.0);
+   make_record(&records[1], 1000, "primary", "pg_database_size", "database=\"postgres\"", 42.0);
+   make_record(&records[2], 1000, "replica", "pg_up", NULL, 0.0);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_spool(records, 3), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(spool_segments(), 1, cleanup, "expected one segment");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_flush(), 0, cleanup, "flush should succeed");
+   MCTF_ASSERT_INT_EQ(spool_segments(), 0, cleanup, "sent segment should be removed");
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_samples), 3, cleanup);
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_failures), 0, cleanup);
+
+   file = fopen(body_path, "r");
+   MCTF_ASSERT_PTR_NONNULL(file, cleanup, "receiver did not store the body");
+   size = fread(data, 1, sizeof(data), file);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_snappy_decompress(data, size, &request, &request_size), 0, cleanup,
+                      "body should be snappy compressed");
+   MCTF_ASSERT(memmem(request, request_size, "pg_database_size", 16) != NULL, cleanup, "missing metric");
+   MCTF_ASSERT(memmem(request, request_size, "postgres", 8) != NULL, cleanup, "missing label");
+
+cleanup:
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+   free(request);
+   stop_receiver(receiver);
+   config->remote_write_url[0] = '\0';
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_reuse_connection)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record record;
+   pid_t receiver;
+   int status = 0;
+   int port = 0;
+
+   receiver = start_receiver(204, 3, true, &port);
+   MCTF_ASSERT(receiver > 0, cleanup, "failed to start receiver");
+
+   pgexporter_snprintf(config->remote_write_url, MAX_PATH, "http://127.0.0.1:%d/api/v1/write", port);
+
+   for (int i = 0; i < 3; i++)
+   {
+      make_record(&record, 1000 + i, "primary", "pg_up", NULL, 1.0);
+      MCTF_ASSERT_INT_EQ(pgexporter_remote_write_spool(&record, 1), 0, cleanup);
+   }
+   MCTF_ASSERT_INT_EQ(spool_segments(), 3, cleanup, "expected a segment per snapshot");
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_flush(), 0, cleanup, "flush should succeed");
+   MCTF_ASSERT_INT_EQ(spool_segments(), 0, cleanup, "sent segments should be removed");
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_samples), 3, cleanup);
+
+   MCTF_ASSERT(waitpid(receiver, &status, 0) == receiver, cleanup, "receiver did not finish");
+   receiver = -1;
+   MCTF_ASSERT(WIFEXITED(status), cleanup, "receiver failed");
+   MCTF_ASSERT_INT_EQ(WEXITSTATUS(status), 1, cleanup, "the segments should share one connection");
+
+cleanup:
+   stop_receiver(receiver);
+   config->remote_write_url[0] = '\0';
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_retry_keeps_spool)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record record;
+   pid_t receiver;
+   int port = 0;
+
+   receiver = start_receiver(503, REMOTE_WRITE_ATTEMPTS, false, &port);
+   MCTF_ASSERT(receiver > 0, cleanup, "failed to start receiver");
+
+   pgexporter_snprintf(config->remote_write_url, MAX_PATH, "http://127.0.0.1:%d/api/v1/write", port);
+   config->remote_write_shards = 2;
+
+   make_record(&record, 1000, "primary", "pg_up", NULL, 1.0);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_spool(&record, 1), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(spool_segments(), 1, cleanup);
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_flush(), 1, cleanup, "flush should fail");
+   MCTF_ASSERT_INT_EQ(spool_segments(), 1, cleanup, "failed segment should stay in the spool");
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_samples), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_failures), 1, cleanup);
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_retries), REMOTE_WRITE_ATTEMPTS - 1, cleanup);
+   MCTF_ASSERT(atomic_load(&config->remote_write_spool_used) > 0, cleanup, "spool size should be tracked");
+
+cleanup:
+   stop_receiver(receiver);
+   config->remote_write_url[0] = '\0';
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_remote_write_spool_bound)
+{
+   struct configuration* config = (struct configuration*)shmem;
+   struct history_record records[4];
+
+   pgexporter_snprintf(config->remote_write_url, MAX_PATH, "http://127.0.0.1:1/api/v1/write");
+
+   for (int i = 0; i < 4; i++)
+   {
+      make_record(&records[i], 1000 + i, "primary", "pg_up", NULL, i);
+   }
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_spool(&records[0], 2), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(spool_segments(), 1, cleanup);
+
+   /* Room for about one segment, so the older one is dropped */
+   config->remote_write_spool_size = (size_t)atomic_load(&config->remote_write_spool_used) + 8;
+
+   MCTF_ASSERT_INT_EQ(pgexporter_remote_write_spool(&records[2], 2), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(spool_segments(), 1, cleanup, "oldest segment should be dropped");
+   MCTF_ASSERT_INT_EQ(atomic_load(&config->remote_write_dropped), 2, cleanup);
+   MCTF_ASSERT(atomic_load(&config->remote_write_spool_used) <= (int64_t)config->remote_write_spool_size, cleanup,
+               "spool exceeds its bound");
+
+cleanup:
+   config->remote_write_url[0] = '\0';
+   MCTF_FINISH();
+}
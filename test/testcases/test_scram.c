@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2026 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pgexporter.h>
+#include <configuration.h>
+#include <security.h>
+#include <shmem.h>
+
+#include <mctf.h>
+#include <tscommon.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t scram_cache_size = 0;
+
+static int
+salted(char* username, char* password, char* salt, int iterations, unsigned char* result)
+{
+   unsigned char* r = NULL;
+   int r_length = 0;
+
+   if (pgexporter_scram_salted_password(0, username, password, salt, strlen(salt), iterations, &r, &r_length) ||
+       r_length != SHA256_DIGEST_LENGTH)
+   {
+      free(r);
+      return 1;
+   }
+
+   memcpy(result, r, SHA256_DIGEST_LENGTH);
+   free(r);
+
+   return 0;
+}
+
+MCTF_TEST_SETUP(scram)
+{
+   pgexporter_scram_cache_init(&scram_cache_size, &scram_cache_shmem);
+}
+
+MCTF_TEST_TEARDOWN(scram)
+{
+   if (scram_cache_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(scram_cache_shmem, scram_cache_size);
+      scram_cache_shmem = NULL;
+   }
+}
+
+MCTF_TEST(test_scram_cache_key)
+{
+   unsigned char first[SHA256_DIGEST_LENGTH];
+   unsigned char again[SHA256_DIGEST_LENGTH];
+   unsigned char other[SHA256_DIGEST_LENGTH];
+   char server[MISC_LENGTH];
+   struct scram_cache* cache = NULL;
+   struct configuration* config = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(scram_cache_shmem, cleanup, "SCRAM cache not initialized");
+   cache = (struct scram_cache*)scram_cache_shmem;
+   config = (struct configuration*)shmem;
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 16, &first[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 1, cleanup, "first login should miss");
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 16, &again[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->hits), 1, cleanup, "second login should hit");
+   MCTF_ASSERT(!memcmp(first, again, SHA256_DIGEST_LENGTH), cleanup, "cached SaltedPassword differs");
+
+   /* Every part of the key is matched */
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "fedcba9876543210", 16, &other[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 2, cleanup, "another salt should miss");
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 17, &other[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 3, cleanup, "another iteration count should miss");
+   MCTF_ASSERT_INT_EQ(salted("other", "secret", "0123456789abcdef", 16, &other[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 4, cleanup, "another user should miss");
+
+   memcpy(server, config->servers[0].name, sizeof(server));
+   snprintf(config->servers[0].name, sizeof(config->servers[0].name), "%s", "scram-other");
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 16, &other[0]), 0, cleanup);
+   memcpy(config->servers[0].name, server, sizeof(server));
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 5, cleanup, "another server should miss");
+
+   /* A changed password must not get the SaltedPassword of the old one */
+   MCTF_ASSERT_INT_EQ(salted("user", "changed", "0123456789abcdef", 16, &other[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 6, cleanup, "changed password should miss");
+   MCTF_ASSERT(memcmp(first, other, SHA256_DIGEST_LENGTH), cleanup, "changed password got the old SaltedPassword");
+
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->hits), 1, cleanup, "unexpected hit");
+
+   /* The password itself is never stored */
+   for (int i = 0; i < SCRAM_CACHE_ENTRIES; i++)
+   {
+      MCTF_ASSERT(memmem(&cache->entries[i], sizeof(struct scram_cache_entry), "secret", strlen("secret")) == NULL,
+                  cleanup, "password found in entry %d", i);
+   }
+
+cleanup:
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_scram_cache_lru)
+{
+   unsigned char result[SHA256_DIGEST_LENGTH];
+   char salt[32];
+   unsigned long misses = 0;
+   struct scram_cache* cache = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(scram_cache_shmem, cleanup, "SCRAM cache not initialized");
+   cache = (struct scram_cache*)scram_cache_shmem;
+
+   for (int i = 0; i < SCRAM_CACHE_ENTRIES; i++)
+   {
+      snprintf(salt, sizeof(salt), "salt-%d", i);
+      MCTF_ASSERT_INT_EQ(salted("user", "secret", salt, 1, &result[0]), 0, cleanup);
+   }
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), SCRAM_CACHE_ENTRIES, cleanup, "expected a miss per salt");
+
+   /* Use the oldest entry, so the second oldest is the least recently used */
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "salt-0", 1, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->hits), 1, cleanup, "salt-0 should hit");
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "salt-new", 1, &result[0]), 0, cleanup);
+   misses = atomic_load(&cache->misses);
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "salt-0", 1, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "salt-new", 1, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "salt-2", 1, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->hits), 4, cleanup, "recently used entries should be kept");
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), (int)misses, cleanup, "unexpected miss");
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "salt-1", 1, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), (int)misses + 1, cleanup, "salt-1 should have been evicted");
+
+cleanup:
+   MCTF_FINISH();
+}
+
+MCTF_TEST(test_scram_cache_reset)
+{
+   unsigned char result[SHA256_DIGEST_LENGTH];
+   struct scram_cache* cache = NULL;
+
+   MCTF_ASSERT_PTR_NONNULL(scram_cache_shmem, cleanup, "SCRAM cache not initialized");
+   cache = (struct scram_cache*)scram_cache_shmem;
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 16, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 16, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->hits), 1, cleanup, "second login should hit");
+
+   pgexporter_scram_cache_reset();
+
+   for (int i = 0; i < SCRAM_CACHE_ENTRIES; i++)
+   {
+      MCTF_ASSERT(!cache->entries[i].in_use, cleanup, "entry %d survived the reset", i);
+   }
+
+   MCTF_ASSERT_INT_EQ(salted("user", "secret", "0123456789abcdef", 16, &result[0]), 0, cleanup);
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->hits), 1, cleanup, "login after a reset should miss");
+   MCTF_ASSERT_INT_EQ((int)atomic_load(&cache->misses), 2, cleanup, "login after a reset should miss");
+
+cleanup:
+   MCTF_FINISH();
+}